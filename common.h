@@ -18,7 +18,6 @@ typedef unsigned long uint32;
 
 #define REPLAY_FILE_MAGIC "MCAP"
 #define REPLAY_FILE_MAGIC_LEN strlen(REPLAY_FILE_MAGIC)
-#define REPLAY_FILE_VER 1
 
 extern const char* replay_host;
 extern const char* replay_user;
@@ -35,12 +34,29 @@ struct Perf_stats
     std::atomic_ullong pkt_mem_in_use;
     std::atomic_ullong pkt_alloced;
     std::atomic_ullong pkt_freed;
+    std::atomic_ullong slab_bytes_reserved; // see Packet_allocator
+    std::atomic_ullong sys_allocs; // packet memory that had to come from the system
+    std::atomic_ullong flows_idle_evicted; // --flow-idle-timeout
+    std::atomic_ullong flows_lru_evicted; // --max-flows
 
-    Perf_stats():pkt_mem_in_use(0), pkt_alloced(0), pkt_freed(0) {}
+    Perf_stats():pkt_mem_in_use(0), pkt_alloced(0), pkt_freed(0), slab_bytes_reserved(0), sys_allocs(0),
+        flows_idle_evicted(0), flows_lru_evicted(0) {}
 };
 
 extern Perf_stats perf_stats;
 
+// spreads the bits of a flow key (ip << 32 | port) so that nearby addresses
+// and ports do not cluster, see get_key()
+inline u_longlong flow_key_hash(u_longlong key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
 class Base_exception: public std::exception
 {
 };
@@ -181,9 +197,13 @@ struct sniff_tcp {
         u_short th_urp;                 /* urgent pointer */
 };
 
+class Tls_keylog;
+
+enum Replay_mode { REPLAY_TIMED, REPLAY_CLOSED, REPLAY_OPEN, REPLAY_RAMP };
+
 struct param_info
 {
-    std::vector<Query_pattern*> query_patterns;
+    Query_pattern_set query_patterns;
     u_int n_slow_queries;
     u_int ethernet_header_size;
     bool do_explain;
@@ -196,23 +216,45 @@ struct param_info
     const char* csv_file;
     const char* table_stats_file;
     bool verbose;
+    u_int n_threads;
+    bool fingerprint;
+    double interval; // --interval rollups, 0 when off
+    const char* interval_file;
+    bool interval_json;
+    u_int n_replay_threads; // event loops the --run connections are spread over
+    double replay_lag_interval; // seconds between schedule lag reports, 0 for none
+    Replay_mode replay_mode; // see Replay_engine
+    u_int replay_concurrency; // queries in flight at most, 0 for no limit
+    double replay_qps; // open mode rate, first ramp step
+    double ramp_step_qps;
+    double ramp_step_secs;
+    double ramp_slo_p99; // seconds
+    u_int replay_clone_factor; // replay connections per captured one
+    double replay_clone_jitter; // seconds, most a clone's start is put off by
+    u_int replay_prewarm; // connections opened before the replay starts
+    const char* diff_csv_file; // --run, the replay vs capture comparison
+    u_int max_buffered_mb; // queued for replay at most, 0 for no limit
+    u_longlong start_time_us, end_time_us; // MCAP input, records outside are skipped
+    u_int n_decode_threads; // MCAP input, 0 for one per core up to 4
+    double flow_idle_timeout; // seconds of packet time a stream may go quiet for, 0 for no limit
+    u_int max_flows; // streams tracked at once, 0 for no limit
+    Tls_keylog* tls_keylog; // --tls-keylog, 0 if not given
 
     param_info():n_slow_queries(0), ethernet_header_size(0), do_explain(0),
         do_analyze(0), do_run(0),report_progress(false),assert_on_query_error(false), pcap_file_size(0),
-        ignore_dup_key_errors(false),csv_file(0),table_stats_file(0),verbose(false)
+        ignore_dup_key_errors(false),csv_file(0),table_stats_file(0),verbose(false),n_threads(1),
+        fingerprint(false),interval(0.0),interval_file(0),interval_json(false),
+        n_replay_threads(4),replay_lag_interval(10.0),
+        replay_mode(REPLAY_TIMED),replay_concurrency(0),replay_qps(0.0),ramp_step_qps(0.0),ramp_step_secs(10.0),
+        ramp_slo_p99(0.0),replay_clone_factor(1),replay_clone_jitter(0.0),
+        replay_prewarm(0),diff_csv_file(0),max_buffered_mb(0),start_time_us(0),end_time_us(~0ULL),
+        n_decode_threads(0),flow_idle_timeout(0.0),max_flows(0),tls_keylog(0)
     {
     }
 
     void add_query_pattern(const char* arg);
-
-    ~param_info()
-    {
-        for (size_t i = 0; i < query_patterns.size(); i++)
-        {
-            delete query_patterns[i];
-        }
-        query_patterns.clear();
-    }
+    // one s/search/replace/ per line, # comments and blank lines skipped
+    void load_query_pattern_file(const char* fname);
 };
 
 #endif
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compressed_stream.h"
+
+#define FRAME_HEADER_LEN 7
+
+Compressed_stream::Compressed_stream(): hdr_len(0), in_left(0), out_left(0), stored(false), failed(false),
+    buf(0), buf_size(0), buf_len(0)
+{
+    memset(&zs, 0, sizeof(zs));
+
+    if (inflateInit(&zs) != Z_OK)
+        throw Oom_exception();
+}
+
+Compressed_stream::~Compressed_stream()
+{
+    inflateEnd(&zs);
+    free(buf);
+}
+
+void Compressed_stream::reserve(size_t n)
+{
+    if (buf_len + n <= buf_size)
+        return;
+
+    size_t size = buf_size ? buf_size : 16384;
+
+    while (size < buf_len + n)
+        size *= 2;
+
+    u_char* p = (u_char*)realloc(buf, size);
+
+    if (!p)
+        throw Oom_exception();
+
+    buf = p;
+    buf_size = size;
+}
+
+bool Compressed_stream::start_frame()
+{
+    in_left = uint3korr(hdr);
+    out_left = uint3korr(hdr + 4);
+    stored = !out_left;
+    hdr_len = 0;
+
+    if (stored)
+        return true;
+
+    // the length is known up front, so is the room the frame needs
+    reserve(out_left);
+    return inflateReset(&zs) == Z_OK;
+}
+
+bool Compressed_stream::inflate_some(const u_char* data, u_int len)
+{
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = len;
+    zs.next_out = buf + buf_len;
+    zs.avail_out = out_left;
+
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    size_t produced = out_left - zs.avail_out;
+    buf_len += produced;
+    out_left -= produced;
+
+    if (ret == Z_STREAM_END)
+        return !out_left && !zs.avail_in; // no more and no less than the header says
+
+    // all the input taken, the rest of the frame is in the next segment
+    return (ret == Z_OK || ret == Z_BUF_ERROR) && !zs.avail_in;
+}
+
+bool Compressed_stream::feed(const u_char* data, u_int len)
+{
+    buf_len = 0;
+
+    if (failed)
+        return true;
+
+    while (len)
+    {
+        if (!in_left)
+        {
+            u_int n = FRAME_HEADER_LEN - hdr_len < len ? FRAME_HEADER_LEN - hdr_len : len;
+            memcpy(hdr + hdr_len, data, n);
+            hdr_len += n;
+            data += n;
+            len -= n;
+
+            if (hdr_len < FRAME_HEADER_LEN)
+                break;
+
+            if (!start_frame())
+                goto err;
+
+            continue;
+        }
+
+        u_int n = in_left < len ? in_left : len;
+
+        if (stored)
+        {
+            reserve(n);
+            memcpy(buf + buf_len, data, n);
+            buf_len += n;
+        }
+        else if (!inflate_some(data, n))
+        {
+            goto err;
+        }
+
+        in_left -= n;
+        data += n;
+        len -= n;
+
+        if (!in_left && out_left)
+            goto err; // the frame is over and came up short
+    }
+
+    return true;
+
+err:
+    failed = true;
+    buf_len = 0;
+    return false;
+}
+
+#ifdef TEST_COMPRESSED_STREAM
+
+#include <stdio.h>
+#include <string>
+
+static int n_failed = 0;
+
+// the frames a server sends for payload, compressed unless stored
+static std::string frames(const std::string& payload, size_t frame_len, bool compressed)
+{
+    std::string out;
+
+    for (size_t off = 0; off < payload.size(); off += frame_len)
+    {
+        std::string raw = payload.substr(off, frame_len);
+        std::string body = raw;
+        u_int raw_len = 0;
+
+        if (compressed)
+        {
+            uLongf comp_len = compressBound(raw.size());
+            body.resize(comp_len);
+            compress2((Bytef*)&body[0], &comp_len, (const Bytef*)raw.data(), raw.size(), Z_DEFAULT_COMPRESSION);
+            body.resize(comp_len);
+            raw_len = raw.size();
+        }
+
+        u_char hdr[FRAME_HEADER_LEN];
+        int3store(hdr, body.size());
+        hdr[3] = (u_char)(off / frame_len);
+        int3store(hdr + 4, raw_len);
+        out.append((const char*)hdr, sizeof(hdr));
+        out.append(body);
+    }
+
+    return out;
+}
+
+// feeds wire in pieces of step bytes, returns what came out
+static bool run(const std::string& wire, size_t step, std::string* out)
+{
+    Compressed_stream z;
+    bool ok = true;
+    out->clear();
+
+    for (size_t off = 0; off < wire.size(); off += step)
+    {
+        size_t n = wire.size() - off < step ? wire.size() - off : step;
+
+        if (!z.feed((const u_char*)wire.data() + off, n))
+            ok = false;
+
+        out->append((const char*)z.data(), z.size());
+    }
+
+    return ok;
+}
+
+static void check(const char* what, bool ok)
+{
+    printf("  %s: %s\n", what, ok ? "PASS" : "FAIL");
+
+    if (!ok)
+        n_failed++;
+}
+
+int main()
+{
+    printf("Test: compressed protocol\n");
+
+    std::string payload;
+
+    for (int i = 0; i < 5000; i++)
+        payload += "\x0c\x00\x00\x00\x03select " + std::to_string(i % 10) + ";";
+
+    static const size_t steps[] = {1, 3, 7, 100, 1460, 1 << 20};
+    bool ok = true;
+
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+    {
+        std::string out;
+        ok = ok && run(frames(payload, 16384, true), steps[i], &out) && out == payload;
+        ok = ok && run(frames(payload, 1000, false), steps[i], &out) && out == payload;
+    }
+
+    check("split frames", ok);
+
+    std::string wire = frames(payload, 16384, true);
+    std::string out;
+    wire[FRAME_HEADER_LEN + 5] ^= 0x55;
+    check("corrupt frame", !run(wire, 1460, &out));
+
+    // a frame that inflates to less than its header says
+    wire = frames(payload.substr(0, 100), 16384, true);
+    wire[4]++;
+    check("short frame", !run(wire, 1460, &out));
+
+    if (n_failed)
+    {
+        printf("%d FAILED\n", n_failed);
+        return 1;
+    }
+
+    printf("ALL PASSED\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef COMPRESSED_STREAM_H
+#define COMPRESSED_STREAM_H
+
+#include <zlib.h>
+
+#include "common.h"
+
+// The compressed protocol (CLIENT_COMPRESS) for one direction of a
+// connection. Every frame is a 7 byte header (3 byte compressed length,
+// 1 byte sequence, 3 byte uncompressed length) and the payload, a zlib
+// stream of its own, or the bytes as they are if the uncompressed length is
+// 0. The MySQL packets inside run across frames as they please.
+//
+// The TCP payload goes in as it comes, frames split anywhere, and is
+// inflated right away with the one z_stream, so nothing waits for a frame
+// to be whole. What comes out lands in a buffer that is kept from one call
+// to the next, it only grows to the largest the frames of a call add up to.
+class Compressed_stream
+{
+protected:
+    z_stream zs;
+    u_char hdr[7];
+    u_int hdr_len; // of the next frame's header, 7 once it is whole
+    u_int in_left; // payload bytes of the current frame still to come
+    u_int out_left; // bytes the current frame still has to inflate to
+    bool stored; // the current frame is not compressed
+    bool failed;
+
+    u_char* buf;
+    size_t buf_size;
+    size_t buf_len;
+
+    void reserve(size_t n);
+    bool start_frame();
+    bool inflate_some(const u_char* data, u_int len);
+
+public:
+    Compressed_stream();
+    ~Compressed_stream();
+
+    // takes the next len bytes of the direction, what they decompress to
+    // is then in data() and size(); false on the call that finds the
+    // stream does not make sense, nothing comes out of it after that
+    bool feed(const u_char* data, u_int len);
+    const u_char* data() const { return buf; }
+    size_t size() const { return buf_len; }
+};
+
+#endif
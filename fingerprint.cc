@@ -0,0 +1,323 @@
+#include <string.h>
+
+#include "fingerprint.h"
+
+static inline bool is_space(u_char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline bool is_digit(u_char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// anything >= 0x80 is taken to be part of a multi-byte identifier
+static inline bool is_ident_char(u_char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || is_digit(c) || c == '_' || c == '$' || c >= 0x80;
+}
+
+static inline u_char to_lower(u_char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+// s[0..len) holds a list of placeholders only
+static bool is_value_list(const char* s, size_t len)
+{
+    bool has_value = false;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (s[i] == '?')
+            has_value = true;
+        else if (s[i] != ',' && s[i] != ' ' && s[i] != '-' && s[i] != '+')
+            return false;
+    }
+
+    return has_value;
+}
+
+static bool is_separator(const char* s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (s[i] != ',' && s[i] != ' ')
+            return false;
+    }
+
+    return true;
+}
+
+// out[0..n) ends with the keyword kw as a whole word
+static bool ends_with_word(const char* out, size_t n, const char* kw)
+{
+    size_t kw_len = strlen(kw);
+
+    if (n < kw_len || memcmp(out + n - kw_len, kw, kw_len))
+        return false;
+
+    return n == kw_len || !is_ident_char(out[n - kw_len - 1]);
+}
+
+u_longlong query_digest(const char* s, size_t len)
+{
+    u_longlong h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (u_char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+u_longlong Query_fingerprint::compute(const char* query, size_t q_len)
+{
+    // (1) -> (?+) is the only rewrite that grows, this is plenty
+    if (buf.size() < q_len * 2 + 16)
+        buf.resize(q_len * 2 + 16);
+
+    char* out = buf.data();
+    size_t n = 0;
+    const u_char* p = (const u_char*)query;
+    const u_char* end = p + q_len;
+    bool pending_space = false;
+    long list_open = -1; // the last '(', its list may still collapse
+    long values_end = -1; // just past the last collapsed VALUES row
+
+    while (p < end)
+    {
+        u_char c = *p;
+
+        if (is_space(c))
+        {
+            pending_space = true;
+            p++;
+            continue;
+        }
+
+        if (c == '/' && p + 1 < end && p[1] == '*')
+        {
+            for (p += 2; p < end && !(*p == '*' && p + 1 < end && p[1] == '/'); p++)
+                ;
+            p = p < end ? p + 2 : end;
+            pending_space = true;
+            continue;
+        }
+
+        if (c == '#' || (c == '-' && p + 1 < end && p[1] == '-' && (p + 2 == end || is_space(p[2]))))
+        {
+            while (p < end && *p != '\n')
+                p++;
+            pending_space = true;
+            continue;
+        }
+
+        if (pending_space && n && out[n - 1] != '(' && out[n - 1] != ',' && c != ')' && c != ',')
+            out[n++] = ' ';
+
+        pending_space = false;
+        bool prev_ident = n && (is_ident_char(out[n - 1]) || out[n - 1] == '`');
+
+        // x'0a', b'01', n'abc'
+        if ((c == 'x' || c == 'X' || c == 'b' || c == 'B' || c == 'n' || c == 'N') && !prev_ident &&
+            p + 1 < end && p[1] == '\'')
+        {
+            c = *++p;
+        }
+
+        if (c == '\'' || c == '"')
+        {
+            for (p++; p < end; p++)
+            {
+                if (*p == '\\' && p + 1 < end)
+                    p++;
+                else if (*p == c)
+                {
+                    if (p + 1 < end && p[1] == c)
+                        p++; // doubled quote
+                    else
+                        break;
+                }
+            }
+
+            p = p < end ? p + 1 : end;
+            out[n++] = '?';
+            continue;
+        }
+
+        if ((is_digit(c) || (c == '.' && p + 1 < end && is_digit(p[1]))) && !prev_ident)
+        {
+            const u_char* start = p;
+
+            if (c == '0' && p + 1 < end && (p[1] == 'x' || p[1] == 'X' || p[1] == 'b' || p[1] == 'B'))
+            {
+                for (p += 2; p < end && is_ident_char(*p); p++)
+                    ;
+            }
+            else
+            {
+                while (p < end && (is_digit(*p) || *p == '.'))
+                    p++;
+
+                if (p < end && (*p == 'e' || *p == 'E'))
+                {
+                    const u_char* exp = p + 1;
+
+                    if (exp < end && (*exp == '+' || *exp == '-'))
+                        exp++;
+
+                    if (exp < end && is_digit(*exp))
+                    {
+                        for (p = exp; p < end && is_digit(*p); p++)
+                            ;
+                    }
+                }
+            }
+
+            // identifiers may start with a digit, 1day is not a number
+            if (p == end || !is_ident_char(*p))
+            {
+                out[n++] = '?';
+                continue;
+            }
+
+            p = start;
+        }
+
+        if (is_ident_char(c))
+        {
+            while (p < end && is_ident_char(*p))
+                out[n++] = to_lower(*p++);
+            continue;
+        }
+
+        if (c == '`')
+        {
+            out[n++] = *p++;
+
+            while (p < end)
+            {
+                out[n++] = *p;
+
+                if (*p++ == '`')
+                {
+                    if (p < end && *p == '`')
+                        out[n++] = *p++;
+                    else
+                        break;
+                }
+            }
+
+            continue;
+        }
+
+        if (c == ')' && list_open >= 0 && is_value_list(out + list_open + 1, n - list_open - 1))
+        {
+            size_t open = list_open;
+            list_open = -1;
+            p++;
+
+            // second and later rows of a multi-row VALUES
+            if (values_end >= 0 && is_separator(out + values_end, open - values_end))
+            {
+                n = values_end;
+                continue;
+            }
+
+            size_t word_end = open && out[open - 1] == ' ' ? open - 1 : open;
+            bool is_values = ends_with_word(out, word_end, "values") || ends_with_word(out, word_end, "value");
+
+            if (is_values || ends_with_word(out, word_end, "in"))
+            {
+                n = word_end;
+                memcpy(out + n, "(?+)", 4);
+                n += 4;
+
+                if (is_values)
+                    values_end = n;
+            }
+            else
+            {
+                out[n++] = ')';
+            }
+
+            continue;
+        }
+
+        if (c == '(')
+            list_open = n;
+        else if (c == ')')
+            list_open = -1;
+
+        out[n++] = *p++;
+    }
+
+    while (n && out[n - 1] == ';')
+        n--;
+
+    out[n] = 0;
+    len = n;
+    return query_digest(out, n);
+}
+
+#ifdef TEST_FINGERPRINT
+
+#include <stdio.h>
+
+struct Fingerprint_test
+{
+    const char* query;
+    const char* expected;
+};
+
+int main()
+{
+    Fingerprint_test tests[] = {
+        {"SELECT 1", "select ?"},
+        {"select  *\n from t1\twhere id = 42", "select * from t1 where id = ?"},
+        {"select * from t1 where name = 'it''s' and x = \"a\\\"b\"", "select * from t1 where name = ? and x = ?"},
+        {"select * from t where id in (1, 2, 3)", "select * from t where id in(?+)"},
+        {"select * from t where id IN ('a','b') and y in (select z from u)",
+            "select * from t where id in(?+) and y in (select z from u)"},
+        {"insert into t (a, b) values (1, 'x'), (2, 'y'),(3,'z')", "insert into t (a,b) values(?+)"},
+        {"select /* app: web01 */ a -- trailing\nfrom t # mysql comment", "select a from t"},
+        {"select t1.c2, 1.5e-3, .5, 0x1F, x'ff', 1day from t1", "select t1.c2,?,?,?,?,1day from t1"},
+        {"select * from `My Table` where `c``1` = -7;", "select * from `My Table` where `c``1` = -?"},
+        {"select f(1, 2)", "select f(?,?)"},
+    };
+
+    Query_fingerprint fp;
+    int n_failed = 0;
+
+    printf("Test: fingerprints\n");
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        fp.compute(tests[i].query, strlen(tests[i].query));
+
+        if (strcmp(fp.text(), tests[i].expected))
+        {
+            printf("  FAIL: %s\n    got:      %s\n    expected: %s\n", tests[i].query, fp.text(), tests[i].expected);
+            n_failed++;
+        }
+    }
+
+    printf("  normalization: %s\n", n_failed ? "FAIL" : "PASS");
+
+    const char* a = "SELECT * FROM t WHERE id IN (1,2)";
+    const char* b = "select *\nfrom t where id in (7, 8, 9, 10)";
+    u_longlong da = fp.compute(a, strlen(a));
+    u_longlong db = fp.compute(b, strlen(b));
+    bool same = da == db && da == query_digest(fp.text(), fp.text_len());
+    printf("  digest: %s\n", same ? "PASS" : "FAIL");
+
+    bool ok = !n_failed && same;
+    printf("%s\n", ok ? "ALL PASSED" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+#endif
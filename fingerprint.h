@@ -0,0 +1,39 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "common.h"
+
+// 64-bit FNV-1a, the key Query_stats files a query pattern under
+u_longlong query_digest(const char* s, size_t len);
+
+// Single pass query normalizer in the spirit of pt-query-digest: comments
+// are dropped, string and numeric literals become ?, IN (...) and multi-row
+// VALUES lists collapse to (?+), whitespace collapses to a single space and
+// everything outside backquotes is lower cased. So
+//
+//   SELECT * FROM t1  WHERE id IN (1, 2, 3) AND name = 'x' /* web01 */
+//
+// comes out as
+//
+//   select * from t1 where id in(?+) and name = ?
+//
+// One instance per thread, the output buffer is reused from query to query.
+class Query_fingerprint
+{
+protected:
+    std::vector<char> buf;
+    size_t len;
+
+public:
+    Query_fingerprint(): len(0) {}
+
+    // returns the digest of the normalized text
+    u_longlong compute(const char* query, size_t q_len);
+    const char* text() const { return buf.data(); }
+    size_t text_len() const { return len; }
+};
+
+#endif
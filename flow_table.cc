@@ -0,0 +1,171 @@
+// Flow_table is a header-only template, this file holds its test and
+// micro-benchmark drivers.
+
+#include "flow_table.h"
+
+#if defined(TEST_FLOW_TABLE) || defined(BENCH_FLOW_TABLE)
+
+#include <stdio.h>
+#include <map>
+#include <chrono>
+
+// client ip << 32 | port, like Mysql_stream_manager::get_key()
+static u_longlong make_key(u_int ip, u_short port)
+{
+    return (((u_longlong)ip) << 32) + port;
+}
+
+// xorshift, deterministic across runs
+static u_longlong rnd_state = 88172645463325252ULL;
+
+static u_longlong rnd()
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+#endif
+
+#ifdef TEST_FLOW_TABLE
+
+int main()
+{
+    Flow_table<long> t(16);
+    std::map<u_longlong, long> ref;
+    int n_failed = 0;
+
+    printf("Test: random insert/erase/find against std::map\n");
+
+    for (int i = 0; i < 200000; i++)
+    {
+        // few hosts, few ports, so the probe runs collide and wrap a lot
+        u_longlong key = make_key(0x0a000000 + rnd() % 8, rnd() % 512);
+
+        switch (rnd() % 3)
+        {
+            case 0:
+                t.insert(key, i);
+                ref[key] = i;
+                break;
+            case 1:
+            {
+                bool erased = t.erase(key);
+                if (erased != (ref.erase(key) == 1))
+                    n_failed++;
+                break;
+            }
+            default:
+            {
+                long* v = t.find(key);
+                std::map<u_longlong, long>::iterator it = ref.find(key);
+                if ((v == NULL) != (it == ref.end()) || (v && *v != it->second))
+                    n_failed++;
+            }
+        }
+    }
+
+    printf("  operations: %s\n", n_failed ? "FAIL" : "PASS");
+    printf("  size: %s\n", t.size() == ref.size() ? "PASS" : "FAIL");
+
+    size_t n_iterated = 0;
+
+    for (Flow_table<long>::iterator it = t.begin(); it != t.end(); it++)
+    {
+        std::map<u_longlong, long>::iterator ref_it = ref.find(it->first);
+        if (ref_it == ref.end() || ref_it->second != it->second)
+            n_failed++;
+        n_iterated++;
+    }
+
+    printf("  iteration: %s\n", !n_failed && n_iterated == ref.size() ? "PASS" : "FAIL");
+
+    t.clear();
+    printf("  clear: %s\n", t.empty() && t.begin() == t.end() ? "PASS" : "FAIL");
+
+    bool ok = !n_failed && n_iterated == ref.size() && t.empty();
+    printf("%s\n", ok ? "ALL PASSED" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+#endif
+
+#ifdef BENCH_FLOW_TABLE
+
+#include <stdlib.h>
+#include <vector>
+
+#define N_LOOKUPS 20000000
+#define N_CHURN 5000000
+
+static double elapsed(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+template <class Table>
+static void bench(const char* name, Table& t, const std::vector<u_longlong>& keys,
+                  void (*insert)(Table&, u_longlong), bool (*lookup)(Table&, u_longlong),
+                  void (*erase)(Table&, u_longlong))
+{
+    for (size_t i = 0; i < keys.size(); i++)
+        insert(t, keys[i]);
+
+    // lookups in packet arrival order: random over the live connections
+    auto start = std::chrono::high_resolution_clock::now();
+    size_t n_found = 0;
+
+    for (int i = 0; i < N_LOOKUPS; i++)
+        n_found += lookup(t, keys[rnd() % keys.size()]);
+
+    double lookup_secs = elapsed(start);
+
+    // churn: one connection closes, a new one opens on the next port
+    std::vector<u_longlong> live(keys);
+    start = std::chrono::high_resolution_clock::now();
+
+    for (int i = 0; i < N_CHURN; i++)
+    {
+        size_t victim = rnd() % live.size();
+        erase(t, live[victim]);
+        live[victim] = make_key(0x0a100000 + (i >> 16), i & 0xffff);
+        insert(t, live[victim]);
+    }
+
+    double churn_secs = elapsed(start);
+
+    printf("%-14s lookup: %6.1f Mops/s  churn: %6.1f Mops/s  (found %zu)\n", name,
+           N_LOOKUPS / lookup_secs / 1e6, N_CHURN / churn_secs / 1e6, n_found);
+}
+
+typedef std::map<u_longlong, void*> Std_map;
+typedef Flow_table<void*> Open_table;
+
+static void map_insert(Std_map& t, u_longlong k) { t[k] = &t; }
+static bool map_lookup(Std_map& t, u_longlong k) { return t.find(k) != t.end(); }
+static void map_erase(Std_map& t, u_longlong k) { t.erase(k); }
+static void table_insert(Open_table& t, u_longlong k) { t.insert(k, &t); }
+static bool table_lookup(Open_table& t, u_longlong k) { return t.find(k) != NULL; }
+static void table_erase(Open_table& t, u_longlong k) { t.erase(k); }
+
+int main(int argc, char** argv)
+{
+    size_t n_flows = argc > 1 ? atoi(argv[1]) : 50000;
+    std::vector<u_longlong> keys;
+
+    // a few hundred app servers with a pool of ephemeral ports each
+    for (size_t i = 0; i < n_flows; i++)
+        keys.push_back(make_key(0x0a000000 + i % 400, 32768 + i / 400));
+
+    printf("%zu concurrent flows, %d lookups, %d close/open pairs\n", n_flows, N_LOOKUPS, N_CHURN);
+
+    Std_map m;
+    bench<Std_map>("std::map", m, keys, map_insert, map_lookup, map_erase);
+
+    Open_table t;
+    bench<Open_table>("Flow_table", t, keys, table_insert, table_lookup, table_erase);
+    return 0;
+}
+
+#endif
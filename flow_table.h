@@ -0,0 +1,187 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <stdlib.h>
+#include <vector>
+
+#include "common.h"
+
+// Open addressing hash table keyed on the 64-bit flow key (see
+// Mysql_stream_manager::get_key()), linear probing over a flat array of
+// slots. Deletion shifts the following entries of the probe run back instead
+// of leaving tombstones, so lookups never wade through dead slots no matter
+// how much connection churn the table has seen.
+//
+// A flow key only has a 16-bit port in its low half, so all ones can never
+// be a real key and marks an empty slot.
+template <class T>
+class Flow_table
+{
+public:
+    static const u_longlong EMPTY_KEY = ~0ULL;
+
+    struct Slot
+    {
+        u_longlong first;
+        T second;
+    };
+
+    // walks the occupied slots, erasing while iterating is not supported
+    class iterator
+    {
+    protected:
+        Slot* cur;
+        Slot* end;
+
+        void skip_empty()
+        {
+            while (cur != end && cur->first == EMPTY_KEY)
+                cur++;
+        }
+
+    public:
+        iterator(Slot* cur, Slot* end): cur(cur), end(end) { skip_empty(); }
+        Slot& operator*() { return *cur; }
+        Slot* operator->() { return cur; }
+        iterator& operator++() { cur++; skip_empty(); return *this; }
+        iterator operator++(int) { iterator tmp = *this; ++*this; return tmp; }
+        bool operator==(const iterator& other) const { return cur == other.cur; }
+        bool operator!=(const iterator& other) const { return cur != other.cur; }
+    };
+
+protected:
+    std::vector<Slot> slots;
+    size_t mask;
+    size_t n_used;
+
+    size_t home(u_longlong key) const { return flow_key_hash(key) & mask; }
+
+    void init_slots(size_t capacity)
+    {
+        Slot empty;
+        empty.first = EMPTY_KEY;
+        empty.second = T();
+        slots.assign(capacity, empty);
+        mask = capacity - 1;
+    }
+
+    // kept at or below 50% full, probe runs stay short even with a weak
+    // spread of keys
+    void grow()
+    {
+        std::vector<Slot> old;
+        old.swap(slots);
+        init_slots(old.size() * 2);
+
+        for (size_t i = 0; i < old.size(); i++)
+        {
+            if (old[i].first != EMPTY_KEY)
+                slots[find_free(old[i].first)] = old[i];
+        }
+    }
+
+    size_t find_free(u_longlong key) const
+    {
+        size_t i = home(key);
+
+        while (slots[i].first != EMPTY_KEY)
+            i = (i + 1) & mask;
+
+        return i;
+    }
+
+    // returns the slot holding key, or the empty slot ending its probe run
+    size_t probe(u_longlong key) const
+    {
+        size_t i = home(key);
+
+        while (slots[i].first != key && slots[i].first != EMPTY_KEY)
+            i = (i + 1) & mask;
+
+        return i;
+    }
+
+public:
+    Flow_table(size_t initial_capacity=1024): n_used(0)
+    {
+        size_t capacity = 16;
+
+        while (capacity < initial_capacity)
+            capacity <<= 1;
+
+        init_slots(capacity);
+    }
+
+    size_t size() const { return n_used; }
+    size_t capacity() const { return slots.size(); }
+    bool empty() const { return n_used == 0; }
+
+    iterator begin() { return iterator(slots.data(), slots.data() + slots.size()); }
+    iterator end() { return iterator(slots.data() + slots.size(), slots.data() + slots.size()); }
+
+    // returns NULL if the key is not in the table
+    T* find(u_longlong key)
+    {
+        Slot& s = slots[probe(key)];
+        return s.first == key ? &s.second : NULL;
+    }
+
+    // replaces the value if the key is already there
+    void insert(u_longlong key, const T& value)
+    {
+        DO_ASSERT(key != EMPTY_KEY);
+        size_t i = probe(key);
+
+        if (slots[i].first == key)
+        {
+            slots[i].second = value;
+            return;
+        }
+
+        if ((n_used + 1) * 2 > slots.size())
+        {
+            grow();
+            i = find_free(key);
+        }
+
+        slots[i].first = key;
+        slots[i].second = value;
+        n_used++;
+    }
+
+    // returns false if the key was not there
+    bool erase(u_longlong key)
+    {
+        size_t i = probe(key);
+
+        if (slots[i].first != key)
+            return false;
+
+        // pull back every later entry of the run that may legally live in
+        // the hole, i.e. whose home is not cyclically within (i, j]
+        for (size_t j = (i + 1) & mask; slots[j].first != EMPTY_KEY; j = (j + 1) & mask)
+        {
+            size_t h = home(slots[j].first);
+            bool stays = i <= j ? (i < h && h <= j) : (i < h || h <= j);
+
+            if (stays)
+                continue;
+
+            slots[i] = slots[j];
+            i = j;
+        }
+
+        slots[i].first = EMPTY_KEY;
+        slots[i].second = T();
+        n_used--;
+        return true;
+    }
+
+    void clear()
+    {
+        init_slots(slots.size());
+        n_used = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,296 @@
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "interval_stats.h"
+
+void Interval_pattern_stats::record_query(double exec_time)
+{
+    if (!n_queries || exec_time < min_exec_time)
+        min_exec_time = exec_time;
+    if (exec_time > max_exec_time)
+        max_exec_time = exec_time;
+
+    n_queries++;
+    total_exec_time += exec_time;
+    exec_hist.record(exec_time);
+}
+
+Interval_window::~Interval_window()
+{
+    for (std::unordered_map<u_longlong, Interval_pattern_stats*>::iterator it = patterns.begin();
+         it != patterns.end(); it++)
+    {
+        delete it->second;
+    }
+}
+
+Interval_stats::Interval_stats(double interval_secs, const char* fname, bool json):
+    interval_us(llround(interval_secs * 1e6)), fp(stdout), json(json), next_to_close(LLONG_MIN), n_late(0)
+{
+    if (interval_us <= 0)
+        throw std::runtime_error("Interval must be positive");
+
+    if (fname && !(fp = fopen(fname, "w")))
+        throw std::runtime_error("Could not open the interval stats file");
+
+    if (!json)
+        fputs("Window Start,Interval,Query Pattern ID,N,QPS,Minimum Execution Time,Maximum Execution Time,"
+              "Average Execution Time,Median Execution Time,95pct Execution Time,99pct Execution Time,"
+              "99.9pct Execution Time,Total Execution Time\n", fp);
+
+    fflush(fp);
+}
+
+Interval_stats::~Interval_stats()
+{
+    flush();
+
+    if (fp != stdout)
+        fclose(fp);
+}
+
+u_int Interval_stats::add_source()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    watermarks.push_back(LLONG_MIN);
+    return watermarks.size() - 1;
+}
+
+long long Interval_stats::window_of(const struct timeval& ts) const
+{
+    return ((long long)ts.tv_sec * 1000000 + ts.tv_usec) / interval_us;
+}
+
+long long Interval_stats::window_of(const struct timeval& ts, double delay) const
+{
+    return ((long long)ts.tv_sec * 1000000 + ts.tv_usec + llround(delay * 1e6)) / interval_us;
+}
+
+void Interval_stats::record_query(long long window, u_longlong digest, const char* key, size_t key_len,
+                                  double exec_time)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (window < next_to_close)
+    {
+        n_late++;
+        return;
+    }
+
+    Interval_window*& w = windows[window];
+
+    if (!w)
+        w = new Interval_window;
+
+    Interval_pattern_stats*& s = w->patterns[digest];
+
+    if (!s)
+        s = new Interval_pattern_stats(key, key_len);
+
+    s->record_query(exec_time);
+}
+
+void Interval_stats::advance(u_int source, long long window)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (window <= watermarks[source])
+        return;
+
+    watermarks[source] = window;
+    close_windows(*std::min_element(watermarks.begin(), watermarks.end()));
+}
+
+void Interval_stats::flush()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    close_windows(LLONG_MAX);
+}
+
+void Interval_stats::close_windows(long long before)
+{
+    if (before <= next_to_close)
+        return;
+
+    while (!windows.empty() && windows.begin()->first < before)
+    {
+        write_window(windows.begin()->first, windows.begin()->second);
+        delete windows.begin()->second;
+        windows.erase(windows.begin());
+    }
+
+    next_to_close = before;
+    fflush(fp);
+}
+
+static bool pattern_key_cmp(const Interval_pattern_stats* s1, const Interval_pattern_stats* s2)
+{
+    return s1->key < s2->key;
+}
+
+void write_csv_string(FILE* fp, const std::string& s)
+{
+    fputc('"', fp);
+
+    for (size_t i = 0; i < s.length(); i++)
+    {
+        if (s[i] == '"')
+            fputc('"', fp);
+        fputc(s[i], fp);
+    }
+
+    fputc('"', fp);
+}
+
+static void write_json_string(FILE* fp, const std::string& s)
+{
+    fputc('"', fp);
+
+    for (size_t i = 0; i < s.length(); i++)
+    {
+        u_char c = s[i];
+
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+
+    fputc('"', fp);
+}
+
+void Interval_stats::write_window(long long n, Interval_window* w)
+{
+    long long start_us = n * interval_us;
+    time_t start_sec = start_us / 1000000;
+    struct tm tm;
+    char start[64];
+    size_t len = strftime(start, sizeof(start), "%Y-%m-%dT%H:%M:%S", gmtime_r(&start_sec, &tm));
+
+    if (start_us % 1000000)
+        len += snprintf(start + len, sizeof(start) - len, ".%06lld", start_us % 1000000);
+
+    snprintf(start + len, sizeof(start) - len, "Z");
+
+    std::vector<Interval_pattern_stats*> sorted;
+
+    for (std::unordered_map<u_longlong, Interval_pattern_stats*>::iterator it = w->patterns.begin();
+         it != w->patterns.end(); it++)
+    {
+        sorted.push_back(it->second);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), pattern_key_cmp);
+    double interval_secs = interval_us / 1e6;
+
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        Interval_pattern_stats* s = sorted[i];
+
+        if (json)
+        {
+            fprintf(fp, "{\"window_start\":\"%s\",\"interval\":%g,\"pattern\":", start, interval_secs);
+            write_json_string(fp, s->key);
+            fprintf(fp, ",\"n\":%llu,\"qps\":%f,\"min\":%f,\"max\":%f,\"avg\":%f,\"p50\":%f,\"p95\":%f,"
+                    "\"p99\":%f,\"p99_9\":%f,\"total\":%f}\n",
+                    s->n_queries, s->n_queries / interval_secs, s->min_exec_time, s->max_exec_time,
+                    s->total_exec_time / s->n_queries, s->exec_hist.percentile(50), s->exec_hist.percentile(95),
+                    s->exec_hist.percentile(99), s->exec_hist.percentile(99.9), s->total_exec_time);
+        }
+        else
+        {
+            fprintf(fp, "%s,%g,", start, interval_secs);
+            write_csv_string(fp, s->key);
+            fprintf(fp, ",%llu,%f,%f,%f,%f,%f,%f,%f,%f,%f\n",
+                    s->n_queries, s->n_queries / interval_secs, s->min_exec_time, s->max_exec_time,
+                    s->total_exec_time / s->n_queries, s->exec_hist.percentile(50), s->exec_hist.percentile(95),
+                    s->exec_hist.percentile(99), s->exec_hist.percentile(99.9), s->total_exec_time);
+        }
+    }
+}
+
+#ifdef TEST_INTERVAL_STATS
+
+#include <string.h>
+
+static struct timeval make_ts(long sec, long usec)
+{
+    struct timeval ts;
+    ts.tv_sec = sec;
+    ts.tv_usec = usec;
+    return ts;
+}
+
+static int count_lines(const char* fname)
+{
+    FILE* fp = fopen(fname, "r");
+    char line[1024];
+    int n = 0;
+
+    while (fgets(line, sizeof(line), fp))
+        n++;
+
+    fclose(fp);
+    return n;
+}
+
+int main()
+{
+    const char* fname = "/tmp/test_interval_stats.csv";
+    int n_failed = 0;
+
+    {
+        Interval_stats stats(60, fname, false);
+        u_int a = stats.add_source();
+        u_int b = stats.add_source();
+        long long t0 = 1700000040; // 22:14:00 UTC, a minute boundary
+
+        stats.advance(a, stats.window_of(make_ts(t0, 0)));
+        stats.record_query(stats.window_of(make_ts(t0 + 1, 0), 0.5), 1, "select ?", 8, 0.5);
+        stats.record_query(stats.window_of(make_ts(t0 + 59, 900000), 0.2), 1, "select ?", 8, 0.2);
+        stats.record_query(stats.window_of(make_ts(t0 + 2, 0)), 2, "say \"hi\"", 8, 0.1);
+
+        // a is a window ahead, b has not moved, nothing may close
+        stats.advance(a, stats.window_of(make_ts(t0 + 61, 0)));
+        bool held = count_lines(fname) == 1;
+        printf("Test: windows wait for the slowest source: %s\n", held ? "PASS" : "FAIL");
+        n_failed += !held;
+
+        stats.advance(b, stats.window_of(make_ts(t0 + 62, 0)));
+        bool closed = count_lines(fname) == 3;
+        printf("Test: first window written once all sources pass it: %s\n", closed ? "PASS" : "FAIL");
+        n_failed += !closed;
+
+        stats.record_query(stats.window_of(make_ts(t0 + 10, 0)), 1, "select ?", 8, 0.1);
+        bool late = stats.get_late() == 1;
+        printf("Test: late query counted: %s\n", late ? "PASS" : "FAIL");
+        n_failed += !late;
+    }
+
+    FILE* fp = fopen(fname, "r");
+    char lines[4][1024];
+    int n = 0;
+
+    while (n < 4 && fgets(lines[n], sizeof(lines[n]), fp))
+        n++;
+
+    fclose(fp);
+
+    bool content = n == 4 &&
+        !strncmp(lines[1], "2023-11-14T22:14:00Z,60,\"say \"\"hi\"\"\",1,", 39) &&
+        !strncmp(lines[2], "2023-11-14T22:14:00Z,60,\"select ?\",1,", 37) &&
+        !strncmp(lines[3], "2023-11-14T22:15:00Z,60,\"select ?\",1,", 37);
+    printf("Test: rows by window then pattern, flushed at the end: %s\n", content ? "PASS" : "FAIL");
+    n_failed += !content;
+
+    remove(fname);
+    printf("%s\n", n_failed ? "FAILED" : "ALL PASSED");
+    return n_failed ? 1 : 0;
+}
+
+#endif
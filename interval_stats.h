@@ -0,0 +1,78 @@
+#ifndef INTERVAL_STATS_H
+#define INTERVAL_STATS_H
+
+#include <stdio.h>
+#include <sys/time.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "latency_histogram.h"
+
+// s as a CSV field: in double quotes, with the quotes inside doubled
+void write_csv_string(FILE* fp, const std::string& s);
+
+struct Interval_pattern_stats
+{
+    std::string key;
+    u_longlong n_queries;
+    double min_exec_time;
+    double max_exec_time;
+    double total_exec_time;
+    Latency_histogram exec_hist;
+
+    Interval_pattern_stats(const char* key, size_t key_len): key(key, key_len), n_queries(0),
+        min_exec_time(0.0), max_exec_time(0.0), total_exec_time(0.0)
+    {
+    }
+
+    void record_query(double exec_time);
+};
+
+struct Interval_window
+{
+    std::unordered_map<u_longlong, Interval_pattern_stats*> patterns; // by query digest
+    ~Interval_window();
+};
+
+// --interval mode: per pattern rollups over fixed windows of packet time,
+// aligned to the epoch so that 60s windows start on the minute. A query is
+// counted in the window its response arrived in. A window is written out
+// and freed as soon as every source (the single stream manager, or each
+// --threads shard) has seen a packet past its end, so memory is bounded by
+// the windows still open, not by the length of the capture.
+class Interval_stats
+{
+protected:
+    std::mutex lock;
+    long long interval_us;
+    FILE* fp;
+    bool json;
+    std::map<long long, Interval_window*> windows; // by window number, start / interval
+    std::vector<long long> watermarks; // per source, the window number it has reached
+    long long next_to_close; // windows below this have been written
+    u_longlong n_late;
+
+    void close_windows(long long before);
+    void write_window(long long n, Interval_window* w);
+
+public:
+    Interval_stats(double interval_secs, const char* fname, bool json);
+    ~Interval_stats();
+
+    // each source must advance() for windows to close
+    u_int add_source();
+    long long window_of(const struct timeval& ts) const;
+    long long window_of(const struct timeval& ts, double delay) const;
+    void record_query(long long window, u_longlong digest, const char* key, size_t key_len, double exec_time);
+    void advance(u_int source, long long window);
+    // writes out whatever is still open
+    void flush();
+    // queries that arrived for a window already written, should stay 0
+    u_longlong get_late() { return n_late; }
+};
+
+#endif
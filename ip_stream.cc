@@ -94,7 +94,10 @@ void IP_stream::append_remaining_packets(u_short ip_id, Mysql_stream* s, struct
 
     while (frag)
     {
-        s->append(ts, (u_char*)frag->data, frag->len, in);
+        const u_char* data = (u_char*)frag->data;
+        u_int len = frag->len;
+        s->decrypt(in, &data, &len);
+        s->append(ts, data, len, in);
         frag = frag->next;
     }
 }
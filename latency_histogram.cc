@@ -0,0 +1,213 @@
+#include <math.h>
+
+#include "latency_histogram.h"
+
+u_int Latency_histogram::default_digits = 2;
+
+Latency_histogram::Latency_histogram(u_int digits): digits(digits), total(0), max_value(0)
+{
+    // 2 * 10^digits sub-buckets per power of two, rounded up
+    u_longlong n = 2;
+
+    for (u_int i = 0; i < digits; i++)
+        n *= 10;
+
+    sub_bucket_bits = 1;
+
+    while ((1ULL << sub_bucket_bits) < n)
+        sub_bucket_bits++;
+
+    sub_bucket_half = 1 << (sub_bucket_bits - 1);
+}
+
+void Latency_histogram::record_value(u_longlong ns, u_longlong n)
+{
+    size_t bucket = 0;
+    size_t sub = ns;
+
+    if (ns >> sub_bucket_bits)
+    {
+        bucket = (63 - __builtin_clzll(ns)) - (sub_bucket_bits - 1);
+        sub = (ns >> bucket) - sub_bucket_half;
+    }
+
+    if (bucket >= buckets.size())
+        buckets.resize(bucket + 1);
+
+    std::vector<u_longlong>& counts = buckets[bucket];
+
+    if (counts.empty())
+        counts.resize(bucket ? sub_bucket_half : sub_bucket_half * 2);
+
+    counts[sub] += n;
+    total += n;
+
+    if (ns > max_value)
+        max_value = ns;
+}
+
+u_longlong Latency_histogram::highest_equivalent(size_t bucket, size_t sub) const
+{
+    if (!bucket)
+        return sub;
+
+    return ((sub + sub_bucket_half + 1) << bucket) - 1;
+}
+
+void Latency_histogram::merge(const Latency_histogram& other)
+{
+    if (other.digits != digits)
+    {
+        // not expected within a run, re-bin at our precision
+        for (size_t b = 0; b < other.buckets.size(); b++)
+        {
+            for (size_t s = 0; s < other.buckets[b].size(); s++)
+            {
+                if (other.buckets[b][s])
+                    record_value(other.highest_equivalent(b, s), other.buckets[b][s]);
+            }
+        }
+
+        return;
+    }
+
+    if (other.buckets.size() > buckets.size())
+        buckets.resize(other.buckets.size());
+
+    for (size_t b = 0; b < other.buckets.size(); b++)
+    {
+        const std::vector<u_longlong>& from = other.buckets[b];
+
+        if (from.empty())
+            continue;
+
+        if (buckets[b].empty())
+            buckets[b].resize(from.size());
+
+        for (size_t s = 0; s < from.size(); s++)
+            buckets[b][s] += from[s];
+    }
+
+    total += other.total;
+
+    if (other.max_value > max_value)
+        max_value = other.max_value;
+}
+
+double Latency_histogram::percentile(double pct) const
+{
+    if (!total)
+        return 0.0;
+
+    u_longlong rank = (u_longlong)ceil(pct / 100.0 * total);
+
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    u_longlong seen = 0;
+
+    for (size_t b = 0; b < buckets.size(); b++)
+    {
+        for (size_t s = 0; s < buckets[b].size(); s++)
+        {
+            seen += buckets[b][s];
+
+            if (seen >= rank)
+            {
+                u_longlong v = highest_equivalent(b, s);
+                return (v < max_value ? v : max_value) / 1e9;
+            }
+        }
+    }
+
+    return max_value / 1e9;
+}
+
+size_t Latency_histogram::mem_usage() const
+{
+    size_t n = sizeof(*this) + buckets.capacity() * sizeof(buckets[0]);
+
+    for (size_t b = 0; b < buckets.size(); b++)
+        n += buckets[b].capacity() * sizeof(u_longlong);
+
+    return n;
+}
+
+#ifdef TEST_LATENCY_HISTOGRAM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+static double exact_percentile(std::vector<double>& v, double pct)
+{
+    size_t rank = (size_t)ceil(pct / 100.0 * v.size());
+
+    if (rank < 1)
+        rank = 1;
+
+    return v[rank - 1];
+}
+
+int main()
+{
+    const double pcts[] = {50, 95, 99, 99.9, 100};
+    int n_failed = 0;
+
+    srand(1);
+
+    for (u_int digits = 1; digits <= 3; digits++)
+    {
+        Latency_histogram all(digits), part1(digits), part2(digits);
+        std::vector<double> values;
+        double max_err = 1.0;
+
+        for (u_int i = 0; i < digits; i++)
+            max_err /= 10;
+
+        // log-uniform between 1us and 10s, like a mix of point selects and
+        // reports
+        for (int i = 0; i < 200000; i++)
+        {
+            double v = 1e-6 * pow(10.0, 7.0 * rand() / RAND_MAX);
+            values.push_back(v);
+            all.record(v);
+            (i % 3 ? part1 : part2).record(v);
+        }
+
+        std::sort(values.begin(), values.end());
+        part1.merge(part2);
+
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+        {
+            double exact = exact_percentile(values, pcts[i]);
+            double approx = all.percentile(pcts[i]);
+            double err = fabs(approx - exact) / exact;
+
+            if (err > max_err || part1.percentile(pcts[i]) != approx)
+            {
+                printf("  digits %u p%g: exact %.9f histogram %.9f merged %.9f\n", digits, pcts[i], exact, approx,
+                       part1.percentile(pcts[i]));
+                n_failed++;
+            }
+        }
+
+        printf("  digits %u: %zu bytes for %llu values\n", digits, all.mem_usage(), all.count());
+    }
+
+    printf("Test: percentiles within precision, merge: %s\n", n_failed ? "FAIL" : "PASS");
+
+    Latency_histogram small;
+    small.record(0.000039);
+    small.record(0.000445);
+    bool exact_ok = small.percentile(100) == 0.000445 && small.percentile(0) == small.percentile(50);
+    printf("Test: max is exact: %s\n", exact_ok ? "PASS" : "FAIL");
+
+    bool ok = !n_failed && exact_ok;
+    printf("%s\n", ok ? "ALL PASSED" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <vector>
+
+#include "common.h"
+
+// Log-linear histogram of latencies in the style of HdrHistogram. Values are
+// kept in nanoseconds; each power of two range is split into the same number
+// of linear sub-buckets, enough to hold digits significant decimal digits,
+// so any percentile is within 10^-digits of the true value relative to it.
+// Values below the sub-bucket count are exact.
+//
+// Memory does not depend on the number of values recorded, only on the spread
+// of magnitudes seen: a power of two range takes 10^digits * 8 bytes or so and
+// is allocated the first time a value lands in it. Two histograms with the
+// same digits merge by adding counts.
+class Latency_histogram
+{
+protected:
+    u_int digits;
+    u_int sub_bucket_bits;
+    u_int sub_bucket_half;
+    // [0] covers 0 .. 2^bits - 1, [m] covers 2^(bits - 1 + m) .. 2^(bits + m) - 1
+    // in steps of 2^m
+    std::vector<std::vector<u_longlong> > buckets;
+    u_longlong total;
+    u_longlong max_value;
+
+    void record_value(u_longlong ns, u_longlong n);
+    u_longlong highest_equivalent(size_t bucket, size_t sub) const;
+
+public:
+    // from --histogram-digits
+    static u_int default_digits;
+
+    Latency_histogram(u_int digits = default_digits);
+
+    void record(double secs) { record_value(secs > 0 ? (u_longlong)(secs * 1e9 + 0.5) : 0, 1); }
+    void merge(const Latency_histogram& other);
+    // pct in 0..100, returns seconds, 0 if nothing was recorded
+    double percentile(double pct) const;
+    u_longlong count() const { return total; }
+    size_t mem_usage() const;
+};
+
+#endif
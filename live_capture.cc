@@ -0,0 +1,219 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "live_capture.h"
+
+#define LIVE_BLOCK_SIZE (1 << 20)
+#define LIVE_FRAME_SIZE 2048
+#define LIVE_BLOCK_RETIRE_MS 60
+
+static std::string errno_msg(const char* what)
+{
+    return std::string(what) + ": " + strerror(errno);
+}
+
+Live_capture::Live_capture(const char* iface, u_short port, size_t ring_bytes):
+    fd(-1), ring(0), ring_size(0), cur_block(0), ifindex(0), is_loopback(false), is_ethernet(false),
+    n_received(0), n_dropped(0), n_freeze_q_cnt(0)
+{
+    memset(&req, 0, sizeof(req));
+
+    try
+    {
+        open_socket(iface);
+        attach_port_filter(port);
+        setup_ring(ring_bytes);
+    }
+    catch (...)
+    {
+        if (ring)
+            munmap(ring, ring_size);
+        if (fd >= 0)
+            close(fd);
+        throw;
+    }
+}
+
+Live_capture::~Live_capture()
+{
+    if (ring)
+        munmap(ring, ring_size);
+
+    if (fd >= 0)
+        close(fd);
+}
+
+void Live_capture::open_socket(const char* iface)
+{
+    // protocol 0 - nothing is queued until we bind, so the ring only ever
+    // sees packets that went through the filter
+    if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+        throw Live_capture_exception(errno_msg("Could not open packet socket (are you root?)"));
+
+    if (!(ifindex = if_nametoindex(iface)))
+        throw Live_capture_exception(errno_msg((std::string("Unknown interface ") + iface).c_str()));
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface, sizeof(ifr.ifr_name) - 1);
+
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
+        throw Live_capture_exception(errno_msg("Could not get the interface hardware type"));
+
+    is_loopback = ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK;
+    is_ethernet = is_loopback || ifr.ifr_hwaddr.sa_family == ARPHRD_ETHER;
+}
+
+// Equivalent of "tcp port <port> or ip[6:2] & 0x1fff != 0" so we do not copy
+// unrelated traffic into the ring. Non-first IP fragments carry no TCP header
+// and are passed through for process_pkt() to reassemble.
+void Live_capture::attach_port_filter(u_short port)
+{
+    if (!is_ethernet)
+        return; // no Ethernet framing, the filter offsets would be wrong
+
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 10),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 8),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 5, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 14),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 2, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0x40000),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+        throw Live_capture_exception(errno_msg("Could not attach the port filter"));
+}
+
+void Live_capture::setup_ring(size_t ring_bytes)
+{
+    int ver = TPACKET_V3;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+        throw Live_capture_exception(errno_msg("TPACKET_V3 is not supported"));
+
+    req.tp_block_size = LIVE_BLOCK_SIZE;
+    req.tp_block_nr = ring_bytes / LIVE_BLOCK_SIZE;
+
+    if (req.tp_block_nr < 2)
+        req.tp_block_nr = 2;
+
+    req.tp_frame_size = LIVE_FRAME_SIZE;
+    req.tp_frame_nr = (LIVE_BLOCK_SIZE / LIVE_FRAME_SIZE) * req.tp_block_nr;
+    // hand back partially filled blocks so a quiet link does not stall us
+    req.tp_retire_blk_tov = LIVE_BLOCK_RETIRE_MS;
+    req.tp_feature_req_word = 0;
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+        throw Live_capture_exception(errno_msg("Could not set up the PACKET_RX_RING"));
+
+    ring_size = (size_t)req.tp_block_size * req.tp_block_nr;
+    ring = (u_char*)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (ring == MAP_FAILED)
+    {
+        ring = 0;
+        throw Live_capture_exception(errno_msg("Could not mmap the packet ring"));
+    }
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+
+    if (bind(fd, (struct sockaddr*)&sll, sizeof(sll)) < 0)
+        throw Live_capture_exception(errno_msg("Could not bind to the interface"));
+}
+
+void Live_capture::walk_block(struct tpacket_block_desc* bd, Live_capture_handler handler, void* arg)
+{
+    u_int n_pkts = bd->hdr.bh1.num_pkts;
+    struct tpacket3_hdr* ph = (struct tpacket3_hdr*)((u_char*)bd + bd->hdr.bh1.offset_to_first_pkt);
+
+    for (u_int i = 0; i < n_pkts; i++)
+    {
+        const struct sockaddr_ll* sll = (const struct sockaddr_ll*)((u_char*)ph +
+            TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+        // on loopback every packet shows up twice, once on the way out and
+        // once on the way in
+        if (!(is_loopback && sll->sll_pkttype == PACKET_OUTGOING))
+        {
+            struct pcap_pkthdr header;
+            header.ts.tv_sec = ph->tp_sec;
+            header.ts.tv_usec = ph->tp_nsec / 1000;
+            header.caplen = ph->tp_snaplen;
+            header.len = ph->tp_len;
+            handler(arg, &header, (const u_char*)ph + ph->tp_mac);
+        }
+
+        ph = (struct tpacket3_hdr*)((u_char*)ph + ph->tp_next_offset);
+    }
+}
+
+u_int Live_capture::dispatch(int timeout_ms, Live_capture_handler handler, void* arg)
+{
+    struct tpacket_block_desc* bd = (struct tpacket_block_desc*)(ring +
+        (size_t)cur_block * req.tp_block_size);
+
+    if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+    {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN | POLLERR;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, timeout_ms) < 0)
+        {
+            if (errno == EINTR)
+                return 0;
+
+            throw Live_capture_exception(errno_msg("poll() on the packet socket failed"));
+        }
+
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+            return 0;
+    }
+
+    u_int n_pkts = bd->hdr.bh1.num_pkts;
+    walk_block(bd, handler, arg);
+    __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    cur_block = (cur_block + 1) % req.tp_block_nr;
+    return n_pkts;
+}
+
+void Live_capture::update_stats()
+{
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    // the kernel resets the counters on every read
+    if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+        throw Live_capture_exception(errno_msg("Could not read the packet socket statistics"));
+
+    n_received += st.tp_packets;
+    n_dropped += st.tp_drops;
+    n_freeze_q_cnt += st.tp_freeze_q_cnt;
+}
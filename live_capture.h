@@ -0,0 +1,61 @@
+#ifndef LIVE_CAPTURE_H
+#define LIVE_CAPTURE_H
+
+#include <pcap.h>
+#include <stdexcept>
+#include <string>
+#include <linux/if_packet.h>
+
+#include "common.h"
+
+class Live_capture_exception: public std::runtime_error
+{
+public:
+    Live_capture_exception(const std::string& msg): std::runtime_error(msg)
+    {
+    }
+};
+
+// called for every captured packet, the data points straight into the ring
+// and is only valid until the handler returns
+typedef void (*Live_capture_handler)(void* arg, const struct pcap_pkthdr* header, const u_char* packet);
+
+// Reads packets from a PACKET_MMAP ring (TPACKET_V3) on a network interface.
+// The kernel fills whole blocks of packets, we walk them in place and hand
+// the block back once all packets in it have been processed.
+class Live_capture
+{
+protected:
+    int fd;
+    u_char* ring;
+    size_t ring_size;
+    struct tpacket_req3 req;
+    u_int cur_block;
+    int ifindex;
+    bool is_loopback;
+    bool is_ethernet;
+    u_longlong n_received;
+    u_longlong n_dropped;
+    u_longlong n_freeze_q_cnt;
+
+    void open_socket(const char* iface);
+    void attach_port_filter(u_short port);
+    void setup_ring(size_t ring_bytes);
+    void walk_block(struct tpacket_block_desc* bd, Live_capture_handler handler, void* arg);
+
+public:
+    Live_capture(const char* iface, u_short port, size_t ring_bytes);
+    ~Live_capture();
+
+    // waits up to timeout_ms for a filled block and runs handler on every
+    // packet in it, returns the number of packets processed
+    u_int dispatch(int timeout_ms, Live_capture_handler handler, void* arg);
+
+    // refresh the cumulative counters from the kernel
+    void update_stats();
+    u_longlong get_received() { return n_received; }
+    u_longlong get_dropped() { return n_dropped; }
+    u_longlong get_freeze_q_cnt() { return n_freeze_q_cnt; }
+};
+
+#endif
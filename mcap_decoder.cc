@@ -0,0 +1,148 @@
+#include "mcap_decoder.h"
+
+// blocks decoded ahead of the consumer per worker
+#define BLOCKS_AHEAD 2
+
+Mcap_decoder::Mcap_decoder(const Mcap_reader* reader, u_int n_threads):
+    reader(reader), blocks(reader->blocks_in_range()), next_claim(0), next_out(0), stopping(false)
+{
+    if (!n_threads)
+        n_threads = 1;
+
+    slots.resize(n_threads * BLOCKS_AHEAD, NULL);
+
+    for (u_int i = 0; i < n_threads; i++)
+        workers.push_back(new std::thread(&Mcap_decoder::run, this));
+}
+
+static void free_block(Mcap_decoded_block* b)
+{
+    for (size_t i = 0; i < b->pkts.size(); i++)
+        delete b->pkts[i];
+
+    delete b;
+}
+
+Mcap_decoder::~Mcap_decoder()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    taken.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i]->join();
+        delete workers[i];
+    }
+
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        if (slots[i])
+            free_block(slots[i]);
+    }
+}
+
+Mcap_decoded_block* Mcap_decoder::decode(const Mcap_block_info& block, std::vector<u_char>* raw,
+                                         std::vector<u_char>* comp)
+{
+    Mcap_decoded_block* b = new Mcap_decoded_block();
+    Mcap_block_cursor cursor;
+    Mcap_record rec;
+
+    try
+    {
+        reader->read_block(block, raw, comp);
+        b->comp_bytes = comp->size();
+        b->raw_bytes = raw->size();
+        cursor.reset(raw->data(), raw->size());
+
+        while (cursor.next(&rec))
+        {
+            if (!reader->in_time_range(rec))
+                continue;
+
+            Mysql_packet* pkt = new Mysql_packet(); // throws on OOM
+            b->pkts.push_back(pkt);
+            pkt->replay_copy(rec);
+            b->keys.push_back(rec.key);
+        }
+    }
+    catch (...)
+    {
+        free_block(b);
+        throw;
+    }
+
+    return b;
+}
+
+void Mcap_decoder::run()
+{
+    std::vector<u_char> raw, comp;
+    std::unique_lock<std::mutex> guard(lock);
+
+    for (;;)
+    {
+        while (!stopping && next_claim < blocks.size() && next_claim >= next_out + slots.size())
+            taken.wait(guard);
+
+        if (stopping || next_claim == blocks.size())
+            return;
+
+        size_t i = next_claim++;
+        guard.unlock();
+        Mcap_decoded_block* b = NULL;
+        std::exception_ptr e;
+
+        try
+        {
+            b = decode(blocks[i], &raw, &comp);
+        }
+        catch (...)
+        {
+            e = std::current_exception();
+        }
+
+        guard.lock();
+
+        if (e)
+        {
+            if (!error)
+                error = e;
+
+            stopping = true;
+            decoded.notify_all();
+            taken.notify_all();
+            return;
+        }
+
+        slots[i % slots.size()] = b;
+        decoded.notify_all();
+    }
+}
+
+Mcap_decoded_block* Mcap_decoder::next()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    if (next_out == blocks.size())
+        return NULL;
+
+    Mcap_decoded_block** slot = &slots[next_out % slots.size()];
+
+    while (!*slot && !error)
+        decoded.wait(guard);
+
+    if (error)
+        std::rethrow_exception(error);
+
+    Mcap_decoded_block* b = *slot;
+    *slot = NULL;
+    next_out++;
+    guard.unlock();
+    taken.notify_all();
+    return b;
+}
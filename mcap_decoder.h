@@ -0,0 +1,58 @@
+#ifndef MCAP_DECODER_H
+#define MCAP_DECODER_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "common.h"
+#include "mcap_file.h"
+#include "mysql_packet.h"
+
+// The packets of one block, ready for Mysql_stream_manager::find_or_make_stream()
+struct Mcap_decoded_block
+{
+    std::vector<u_longlong> keys;
+    std::vector<Mysql_packet*> pkts; // taken over by whoever consumes the block
+    u_longlong comp_bytes, raw_bytes;
+
+    Mcap_decoded_block(): comp_bytes(0), raw_bytes(0) {}
+};
+
+// Decompresses and decodes the blocks of an indexed MCAP file that fall in
+// the reader's time range on n_threads worker threads, and hands them out in
+// file order. Workers run at most a few blocks ahead of the consumer, so
+// memory stays bounded whatever the file size.
+class Mcap_decoder
+{
+protected:
+    const Mcap_reader* reader;
+    std::vector<Mcap_block_info> blocks;
+    std::vector<std::thread*> workers;
+    std::mutex lock;
+    std::condition_variable decoded; // a slot got filled
+    std::condition_variable taken; // a slot got emptied
+    // block i goes in slots[i % slots.size()]
+    std::vector<Mcap_decoded_block*> slots;
+    size_t next_claim; // next block for a worker to take up
+    size_t next_out; // next block for the consumer
+    bool stopping;
+    std::exception_ptr error; // the first thing a worker threw
+
+    void run();
+    Mcap_decoded_block* decode(const Mcap_block_info& block, std::vector<u_char>* raw, std::vector<u_char>* comp);
+
+public:
+    Mcap_decoder(const Mcap_reader* reader, u_int n_threads);
+    // stops the workers and frees whatever was not handed out
+    ~Mcap_decoder();
+
+    u_int get_n_blocks() const { return blocks.size(); }
+    // the next block in file order, NULL after the last; the caller deletes
+    // it. Rethrows what a worker threw.
+    Mcap_decoded_block* next();
+};
+
+#endif
@@ -0,0 +1,883 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "mcap_file.h"
+
+#define FILE_HEADER_LEN 6 // REPLAY_FILE_MAGIC and the version
+#define V1_RECORD_HEADER_LEN (8 + 1 + 16 + 4) // key, in, ts, len
+#define CHUNK_HEADER_LEN (1 + 4 + 4 + 4) // type, raw len, compressed len, records
+#define TRAILER_LEN (8 + 4) // index offset, REPLAY_FILE_MAGIC
+#define INDEX_BLOCK_LEN (8 + 8 + 8 + 4)
+#define INDEX_CONN_LEN (8 + 4 + 4)
+
+#define CHUNK_BLOCK 'B'
+#define CHUNK_INDEX 'I'
+
+#define V1_READ_SIZE (1024 * 1024)
+
+// the most a block decodes to: the writer closes it at BLOCK_SIZE, after the
+// record that takes it there, a MySQL packet of up to 16M and its varints
+#define MAX_BLOCK_RAW_LEN (Mcap_writer::BLOCK_SIZE + 0xffffff + 3 * 10)
+// deflate makes no more than this many bytes out of one
+#define ZLIB_MAX_RATIO 1032
+
+static void put_varint(std::vector<u_char>* out, u_longlong v)
+{
+    while (v >= 0x80)
+    {
+        out->push_back((u_char)(v | 0x80));
+        v >>= 7;
+    }
+
+    out->push_back((u_char)v);
+}
+
+// false if the value runs past end
+static bool get_varint(const u_char** p, const u_char* end, u_longlong* v)
+{
+    u_longlong r = 0;
+
+    for (u_int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        u_char b = *(*p)++;
+        r |= (u_longlong)(b & 0x7f) << shift;
+
+        if (!(b & 0x80))
+        {
+            *v = r;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// small deltas either way make small varints
+static u_longlong zigzag(long long v)
+{
+    return ((u_longlong)v << 1) ^ (u_longlong)(v >> 63);
+}
+
+static long long unzigzag(u_longlong v)
+{
+    return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static void put_u4(std::vector<u_char>* out, u_int v)
+{
+    u_char b[4];
+    int4store(b, v);
+    out->insert(out->end(), b, b + sizeof(b));
+}
+
+static void put_u8(std::vector<u_char>* out, u_longlong v)
+{
+    u_char b[8];
+    int8store(b, v);
+    out->insert(out->end(), b, b + sizeof(b));
+}
+
+static u_longlong ts_to_us(const struct timeval& ts)
+{
+    return (u_longlong)ts.tv_sec * 1000000 + ts.tv_usec;
+}
+
+static struct timeval us_to_ts(u_longlong us)
+{
+    struct timeval ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_usec = us % 1000000;
+    return ts;
+}
+
+bool mcap_parse_time(const char* s, u_longlong* us)
+{
+    struct tm tm;
+    const char* rest;
+    char* end;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_isdst = -1;
+
+    if ((rest = strptime(s, "%Y-%m-%d %H:%M:%S", &tm)))
+    {
+        time_t secs = mktime(&tm);
+        double frac = 0.0;
+
+        if (*rest == '.')
+        {
+            frac = strtod(rest, &end);
+            rest = end;
+        }
+
+        if (secs == (time_t)-1 || *rest)
+            return false;
+
+        *us = (u_longlong)secs * 1000000 + (u_longlong)(frac * 1e6 + 0.5);
+        return true;
+    }
+
+    double secs = strtod(s, &end);
+
+    if (end == s || *end || secs < 0)
+        return false;
+
+    *us = (u_longlong)(secs * 1e6 + 0.5);
+    return true;
+}
+
+// returns true on error
+static bool write_all(int fd, const u_char* p, size_t n)
+{
+    while (n)
+    {
+        ssize_t done = ::write(fd, p, n);
+
+        if (done <= 0)
+            return true;
+
+        p += done;
+        n -= done;
+    }
+
+    return false;
+}
+
+// false if the file ends first
+static bool pread_all(int fd, u_char* p, size_t n, u_longlong offset)
+{
+    while (n)
+    {
+        ssize_t done = pread(fd, p, n, offset);
+
+        if (done < 0)
+            throw std::runtime_error(std::string("Error reading the replay file: ") + strerror(errno));
+
+        if (!done)
+            return false;
+
+        p += done;
+        n -= done;
+        offset += done;
+    }
+
+    return true;
+}
+
+Mcap_writer::~Mcap_writer()
+{
+    if (fd >= 0)
+        close();
+}
+
+bool Mcap_writer::open(const char* fname)
+{
+    if ((fd = ::open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0660)) < 0)
+        return true;
+
+    u_char hdr[FILE_HEADER_LEN];
+    memcpy(hdr, REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LEN);
+    int2store(hdr + REPLAY_FILE_MAGIC_LEN, MCAP_VERSION_2);
+    file_pos = sizeof(hdr);
+    return write_all(fd, hdr, sizeof(hdr));
+}
+
+bool Mcap_writer::write(const Mcap_record& rec)
+{
+    u_longlong ts_us = ts_to_us(rec.ts);
+
+    if (!n_records)
+    {
+        block.offset = file_pos;
+        block.first_ts_us = block.last_ts_us = ts_us;
+        prev_key = prev_ts_us = 0;
+    }
+
+    put_varint(&raw, zigzag(rec.key - prev_key));
+    put_varint(&raw, zigzag(ts_us - prev_ts_us));
+    put_varint(&raw, ((u_longlong)rec.len << 1) | (rec.in ? 1 : 0));
+    raw.insert(raw.end(), rec.data, rec.data + rec.len);
+    prev_key = rec.key;
+    prev_ts_us = ts_us;
+    n_records++;
+
+    if (ts_us < block.first_ts_us)
+        block.first_ts_us = ts_us;
+
+    if (ts_us > block.last_ts_us)
+        block.last_ts_us = ts_us;
+
+    u_int block_no = blocks.size();
+    std::unordered_map<u_longlong, Mcap_conn_info>::iterator it = conns.find(rec.key);
+
+    if (it == conns.end())
+    {
+        Mcap_conn_info& c = conns[rec.key];
+        c.key = rec.key;
+        c.first_block = c.last_block = block_no;
+    }
+    else
+    {
+        it->second.last_block = block_no;
+    }
+
+    return raw.size() >= BLOCK_SIZE ? flush_block() : false;
+}
+
+bool Mcap_writer::write_chunk(u_char type, u_int n)
+{
+    // fast over small, the writer runs inline with the capture
+    uLongf comp_len = compressBound(raw.size());
+    comp.resize(CHUNK_HEADER_LEN + comp_len);
+
+    if (compress2(&comp[CHUNK_HEADER_LEN], &comp_len, raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK)
+        return true;
+
+    comp[0] = type;
+    int4store(&comp[1], raw.size());
+    int4store(&comp[5], comp_len);
+    int4store(&comp[9], n);
+    file_pos += CHUNK_HEADER_LEN + comp_len;
+    return write_all(fd, comp.data(), CHUNK_HEADER_LEN + comp_len);
+}
+
+bool Mcap_writer::flush_block()
+{
+    if (!n_records)
+        return false;
+
+    block.n_records = n_records;
+
+    if (write_chunk(CHUNK_BLOCK, n_records))
+        return true;
+
+    blocks.push_back(block);
+    raw.clear();
+    n_records = 0;
+    return false;
+}
+
+static bool conn_cmp(const Mcap_conn_info& c1, const Mcap_conn_info& c2)
+{
+    return c1.first_block < c2.first_block || (c1.first_block == c2.first_block && c1.key < c2.key);
+}
+
+bool Mcap_writer::close()
+{
+    if (fd < 0)
+        return false;
+
+    bool err = flush_block();
+
+    if (!err)
+    {
+        u_longlong index_offset = file_pos;
+        std::vector<Mcap_conn_info> sorted;
+        raw.clear();
+        put_u4(&raw, blocks.size());
+
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            put_u8(&raw, blocks[i].offset);
+            put_u8(&raw, blocks[i].first_ts_us);
+            put_u8(&raw, blocks[i].last_ts_us);
+            put_u4(&raw, blocks[i].n_records);
+        }
+
+        for (std::unordered_map<u_longlong, Mcap_conn_info>::iterator it = conns.begin(); it != conns.end(); it++)
+            sorted.push_back(it->second);
+
+        std::sort(sorted.begin(), sorted.end(), conn_cmp);
+        put_u4(&raw, sorted.size());
+
+        for (size_t i = 0; i < sorted.size(); i++)
+        {
+            put_u8(&raw, sorted[i].key);
+            put_u4(&raw, sorted[i].first_block);
+            put_u4(&raw, sorted[i].last_block);
+        }
+
+        err = write_chunk(CHUNK_INDEX, 0);
+
+        if (!err)
+        {
+            u_char trailer[TRAILER_LEN];
+            int8store(trailer, index_offset);
+            memcpy(trailer + 8, REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LEN);
+            err = write_all(fd, trailer, sizeof(trailer));
+        }
+    }
+
+    if (::close(fd))
+        err = true;
+
+    fd = -1;
+    return err;
+}
+
+Mcap_reader::Mcap_reader(): fd(-1), version(0), file_size(0), data_end(0), buf_pos(0), buf_len(0), buf_file_pos(0),
+    next_chunk(0), next_block(0), start_us(0), end_us(~0ULL), bytes_read(0), bytes_decoded(0)
+{
+}
+
+Mcap_reader::~Mcap_reader()
+{
+    if (fd >= 0)
+        ::close(fd);
+}
+
+void Mcap_reader::open(const char* fname)
+{
+    struct stat st;
+    u_char hdr[FILE_HEADER_LEN];
+
+    if ((fd = ::open(fname, O_RDONLY)) < 0 || fstat(fd, &st))
+        throw std::runtime_error("Error opening replay file for reading");
+
+    file_size = st.st_size;
+
+    if (!pread_all(fd, hdr, REPLAY_FILE_MAGIC_LEN, 0))
+        throw std::runtime_error("Failed to read the magic number in the replay file");
+
+    if (memcmp(hdr, REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LEN) != 0)
+        throw std::runtime_error("Bad magic number in the replay file");
+
+    if (!pread_all(fd, hdr + REPLAY_FILE_MAGIC_LEN, 2, REPLAY_FILE_MAGIC_LEN))
+        throw std::runtime_error("Failed to read the replay file format version number");
+
+    version = hdr[REPLAY_FILE_MAGIC_LEN] | hdr[REPLAY_FILE_MAGIC_LEN + 1] << 8;
+    next_chunk = buf_file_pos = FILE_HEADER_LEN;
+    data_end = file_size;
+
+    if (version == MCAP_VERSION_2)
+        load_index();
+    else if (version != MCAP_VERSION_1)
+        throw std::runtime_error("Unsupported replay file format version");
+}
+
+bool Mcap_reader::read_chunk(u_longlong offset, u_char* type, u_int* n_records, std::vector<u_char>* out,
+                             std::vector<u_char>* comp_buf, u_longlong* chunk_end) const
+{
+    u_char hdr[CHUNK_HEADER_LEN];
+
+    if (offset + CHUNK_HEADER_LEN > file_size || !pread_all(fd, hdr, sizeof(hdr), offset))
+        return false;
+
+    *type = hdr[0];
+    u_int raw_len = uint4korr(hdr + 1);
+    u_int comp_len = uint4korr(hdr + 5);
+    *n_records = uint4korr(hdr + 9);
+
+    // the lengths are checked before anything is allocated for them
+    if ((*type == CHUNK_BLOCK && raw_len > MAX_BLOCK_RAW_LEN) || raw_len / ZLIB_MAX_RATIO > comp_len ||
+        comp_len > compressBound(raw_len))
+        throw std::runtime_error("Corrupt block in the replay file");
+
+    if (offset + CHUNK_HEADER_LEN + comp_len > file_size)
+        return false;
+
+    comp_buf->resize(comp_len);
+
+    if (!pread_all(fd, comp_buf->data(), comp_len, offset + CHUNK_HEADER_LEN))
+        return false;
+
+    uLongf out_len = raw_len;
+    out->resize(raw_len);
+
+    if (uncompress(out->data(), &out_len, comp_buf->data(), comp_len) != Z_OK || out_len != raw_len)
+        throw std::runtime_error("Corrupt block in the replay file");
+
+    *chunk_end = offset + CHUNK_HEADER_LEN + comp_len;
+    return true;
+}
+
+void Mcap_reader::load_index()
+{
+    u_char trailer[TRAILER_LEN];
+
+    if (file_size < FILE_HEADER_LEN + TRAILER_LEN ||
+        !pread_all(fd, trailer, sizeof(trailer), file_size - TRAILER_LEN) ||
+        memcmp(trailer + 8, REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LEN))
+    {
+        return; // not written to the end, read front to back
+    }
+
+    u_longlong index_offset = uint8korr(trailer);
+    u_longlong index_end;
+    std::vector<u_char> index;
+    u_char type;
+    u_int n;
+
+    if (index_offset < FILE_HEADER_LEN || !read_chunk(index_offset, &type, &n, &index, &comp, &index_end) ||
+        type != CHUNK_INDEX)
+        throw std::runtime_error("Bad index in the replay file");
+
+    const u_char* p = index.data();
+    const u_char* end = p + index.size();
+
+    if (end - p < 4)
+        throw std::runtime_error("Bad index in the replay file");
+
+    u_int n_blocks = uint4korr(p);
+    p += 4;
+
+    if ((size_t)(end - p) < (size_t)n_blocks * INDEX_BLOCK_LEN + 4)
+        throw std::runtime_error("Bad index in the replay file");
+
+    for (u_int i = 0; i < n_blocks; i++, p += INDEX_BLOCK_LEN)
+    {
+        Mcap_block_info b;
+        b.offset = uint8korr(p);
+        b.first_ts_us = uint8korr(p + 8);
+        b.last_ts_us = uint8korr(p + 16);
+        b.n_records = uint4korr(p + 24);
+        blocks.push_back(b);
+    }
+
+    u_int n_conns = uint4korr(p);
+    p += 4;
+
+    if ((size_t)(end - p) < (size_t)n_conns * INDEX_CONN_LEN)
+        throw std::runtime_error("Bad index in the replay file");
+
+    for (u_int i = 0; i < n_conns; i++, p += INDEX_CONN_LEN)
+    {
+        Mcap_conn_info c;
+        c.key = uint8korr(p);
+        c.first_block = uint4korr(p + 8);
+        c.last_block = uint4korr(p + 12);
+        conns.push_back(c);
+    }
+
+    data_end = index_offset;
+    next_chunk = FILE_HEADER_LEN;
+}
+
+bool Mcap_reader::fill(size_t n)
+{
+    if (buf_len - buf_pos >= n)
+        return true;
+
+    memmove(buf.data(), buf.data() + buf_pos, buf_len - buf_pos);
+    buf_file_pos += buf_pos;
+    buf_len -= buf_pos;
+    buf_pos = 0;
+
+    if (buf.size() < std::max(n, (size_t)V1_READ_SIZE))
+        buf.resize(std::max(n, (size_t)V1_READ_SIZE));
+
+    while (buf_len < n)
+    {
+        ssize_t done = pread(fd, buf.data() + buf_len, buf.size() - buf_len, buf_file_pos + buf_len);
+
+        if (done < 0)
+            throw std::runtime_error(std::string("Error reading the replay file: ") + strerror(errno));
+
+        if (!done)
+            return false;
+
+        buf_len += done;
+    }
+
+    return true;
+}
+
+bool Mcap_reader::next_v1(Mcap_record* rec)
+{
+    if (!fill(V1_RECORD_HEADER_LEN))
+        return false;
+
+    const u_char* p = buf.data() + buf_pos;
+    rec->key = uint8korr(p);
+    rec->in = p[8];
+    rec->ts.tv_sec = uint8korr(p + 9);
+    rec->ts.tv_usec = uint8korr(p + 17);
+    rec->len = uint4korr(p + 25);
+
+    if (!fill(V1_RECORD_HEADER_LEN + rec->len))
+        return false; // truncated
+
+    rec->data = buf.data() + buf_pos + V1_RECORD_HEADER_LEN;
+    buf_pos += V1_RECORD_HEADER_LEN + rec->len;
+    bytes_read += V1_RECORD_HEADER_LEN + rec->len;
+    bytes_decoded += V1_RECORD_HEADER_LEN + rec->len;
+    return true;
+}
+
+void Mcap_reader::set_time_range(u_longlong start_us, u_longlong end_us)
+{
+    this->start_us = start_us;
+    this->end_us = end_us;
+}
+
+bool Mcap_reader::in_time_range(const Mcap_record& rec) const
+{
+    u_longlong ts_us = ts_to_us(rec.ts);
+    return ts_us >= start_us && ts_us <= end_us;
+}
+
+std::vector<Mcap_block_info> Mcap_reader::blocks_in_range() const
+{
+    std::vector<Mcap_block_info> res;
+
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (blocks[i].last_ts_us >= start_us && blocks[i].first_ts_us <= end_us)
+            res.push_back(blocks[i]);
+    }
+
+    return res;
+}
+
+void Mcap_reader::read_block(const Mcap_block_info& block, std::vector<u_char>* raw, std::vector<u_char>* comp) const
+{
+    u_longlong chunk_end;
+    u_char type;
+    u_int n;
+
+    if (!read_chunk(block.offset, &type, &n, raw, comp, &chunk_end) || type != CHUNK_BLOCK ||
+        n != block.n_records)
+        throw std::runtime_error("Bad block in the replay file");
+}
+
+bool Mcap_reader::load_block()
+{
+    if (!blocks.empty())
+    {
+        // the index says which blocks to read, skip the rest
+        while (next_block < blocks.size() &&
+               (blocks[next_block].last_ts_us < start_us || blocks[next_block].first_ts_us > end_us))
+            next_block++;
+
+        if (next_block == blocks.size())
+            return false;
+
+        read_block(blocks[next_block++], &raw, &comp);
+    }
+    else
+    {
+        u_char type;
+        u_int n;
+
+        if (next_chunk >= data_end || !read_chunk(next_chunk, &type, &n, &raw, &comp, &next_chunk) ||
+            type != CHUNK_BLOCK)
+            return false;
+    }
+
+    bytes_read += comp.size() + CHUNK_HEADER_LEN;
+    bytes_decoded += raw.size();
+    cursor.reset(raw.data(), raw.size());
+    return true;
+}
+
+bool Mcap_block_cursor::next(Mcap_record* rec)
+{
+    if (p >= end)
+        return false;
+
+    u_longlong key_delta, ts_delta, len_in;
+
+    if (!get_varint(&p, end, &key_delta) || !get_varint(&p, end, &ts_delta) || !get_varint(&p, end, &len_in) ||
+        (u_longlong)(end - p) < (len_in >> 1))
+    {
+        throw std::runtime_error("Corrupt record in the replay file");
+    }
+
+    prev_key += unzigzag(key_delta);
+    prev_ts_us += unzigzag(ts_delta);
+    rec->key = prev_key;
+    rec->ts = us_to_ts(prev_ts_us);
+    rec->in = len_in & 1;
+    rec->len = len_in >> 1;
+    rec->data = p;
+    p += rec->len;
+    return true;
+}
+
+bool Mcap_reader::next_v2(Mcap_record* rec)
+{
+    while (!cursor.next(rec))
+    {
+        if (!load_block())
+            return false;
+    }
+
+    return true;
+}
+
+bool Mcap_reader::next(Mcap_record* rec)
+{
+    do
+    {
+        if (!(version == MCAP_VERSION_1 ? next_v1(rec) : next_v2(rec)))
+            return false;
+    } while (!in_time_range(*rec));
+
+    return true;
+}
+
+#ifdef TEST_MCAP_FILE
+
+#include <stdio.h>
+
+// xorshift, deterministic across runs
+static u_longlong rnd_state = 88172645463325252ULL;
+
+static u_longlong rnd()
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+struct Test_record
+{
+    u_longlong key;
+    bool in;
+    u_longlong ts_us;
+    std::string data;
+};
+
+static std::vector<Test_record> make_records(size_t n)
+{
+    std::vector<Test_record> recs;
+    u_longlong ts_us = 1700000000ULL * 1000000;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        Test_record r;
+        // a few hundred connections, time mostly going forward
+        r.key = ((0x0a000000ULL + rnd() % 4) << 32) + 30000 + rnd() % 300;
+        r.in = rnd() & 1;
+        ts_us += rnd() % 10 ? rnd() % 2000 : -(rnd() % 50);
+        r.ts_us = ts_us;
+        // mostly small packets, now and then a big one, some end markers
+        size_t len = rnd() % 20 ? rnd() % 200 : (rnd() % 3 ? rnd() % 100000 : 0);
+        for (size_t j = 0; j < len; j++)
+            r.data.push_back("select * from t where id = "[j % 28] + (j / 28) % 3);
+        recs.push_back(r);
+    }
+
+    return recs;
+}
+
+static Mcap_record to_mcap(const Test_record& r)
+{
+    Mcap_record m;
+    m.key = r.key;
+    m.in = r.in;
+    m.ts = us_to_ts(r.ts_us);
+    m.data = (const u_char*)r.data.data();
+    m.len = r.data.size();
+    return m;
+}
+
+static void write_v1(const char* fname, const std::vector<Test_record>& recs)
+{
+    FILE* fp = fopen(fname, "w");
+    u_char hdr[V1_RECORD_HEADER_LEN];
+    fwrite(REPLAY_FILE_MAGIC, 1, REPLAY_FILE_MAGIC_LEN, fp);
+    int2store(hdr, MCAP_VERSION_1);
+    fwrite(hdr, 1, 2, fp);
+
+    for (size_t i = 0; i < recs.size(); i++)
+    {
+        int8store(hdr, recs[i].key);
+        hdr[8] = recs[i].in;
+        int8store(hdr + 9, recs[i].ts_us / 1000000);
+        int8store(hdr + 17, recs[i].ts_us % 1000000);
+        int4store(hdr + 25, recs[i].data.size());
+        fwrite(hdr, 1, sizeof(hdr), fp);
+        fwrite(recs[i].data.data(), 1, recs[i].data.size(), fp);
+    }
+
+    fclose(fp);
+}
+
+// how many records read back equal to what was written, -1 if more came
+static long read_back(const char* fname, const std::vector<Test_record>& recs, Mcap_reader* r)
+{
+    Mcap_record m;
+    size_t n = 0;
+    r->open(fname);
+
+    while (r->next(&m))
+    {
+        if (n >= recs.size())
+            return -1;
+
+        const Test_record& t = recs[n];
+
+        if (m.key != t.key || m.in != t.in || ts_to_us(m.ts) != t.ts_us || m.len != t.data.size() ||
+            memcmp(m.data, t.data.data(), m.len))
+            break;
+
+        n++;
+    }
+
+    return n;
+}
+
+int main()
+{
+    int n_failed = 0;
+    const char* fname = "/tmp/test_mcap_file.mcap";
+    std::vector<Test_record> recs = make_records(50000);
+
+    {
+        write_v1(fname, recs);
+        Mcap_reader r;
+        long n = read_back(fname, recs, &r);
+        bool ok = n == (long)recs.size() && r.get_version() == MCAP_VERSION_1;
+        printf("Test: version 1 read back %ld of %zu: %s\n", n, recs.size(), ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+    }
+
+    struct stat v1_st;
+    stat(fname, &v1_st);
+
+    {
+        Mcap_writer w;
+        bool err = w.open(fname);
+
+        for (size_t i = 0; i < recs.size() && !err; i++)
+            err = w.write(to_mcap(recs[i]));
+
+        err |= w.close();
+        Mcap_reader r;
+        long n = read_back(fname, recs, &r);
+        struct stat st;
+        stat(fname, &st);
+
+        // the index has every block and every connection in the blocks it says
+        const std::vector<Mcap_block_info>& blocks = r.get_blocks();
+        u_longlong n_indexed = 0;
+        bool index_ok = !blocks.empty();
+
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            n_indexed += blocks[i].n_records;
+            index_ok &= blocks[i].first_ts_us <= blocks[i].last_ts_us;
+        }
+
+        index_ok &= n_indexed == recs.size();
+        std::unordered_map<u_longlong, Mcap_conn_info> conns;
+
+        for (size_t i = 0; i < r.get_conns().size(); i++)
+            conns[r.get_conns()[i].key] = r.get_conns()[i];
+
+        u_int block = 0;
+        u_longlong in_block = 0;
+
+        for (size_t i = 0; i < recs.size() && index_ok; i++)
+        {
+            while (in_block == blocks[block].n_records)
+            {
+                block++;
+                in_block = 0;
+            }
+
+            in_block++;
+            std::unordered_map<u_longlong, Mcap_conn_info>::iterator it = conns.find(recs[i].key);
+            index_ok &= it != conns.end() && it->second.first_block <= block && block <= it->second.last_block &&
+                        blocks[block].first_ts_us <= recs[i].ts_us && recs[i].ts_us <= blocks[block].last_ts_us;
+        }
+
+        bool ok = !err && n == (long)recs.size() && r.get_version() == MCAP_VERSION_2 && index_ok;
+        printf("Test: version 2 read back %ld of %zu in %zu blocks, %lld vs %lld bytes, index %s: %s\n", n,
+               recs.size(), blocks.size(), (long long)st.st_size, (long long)v1_st.st_size, index_ok ? "ok" : "bad",
+               ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+
+        // a time range in the middle reads only the blocks it needs and gets
+        // exactly the records in it, in file order
+        u_longlong from = recs[recs.size() / 3].ts_us, to = recs[recs.size() / 2].ts_us;
+        std::vector<Test_record> in_range;
+
+        for (size_t i = 0; i < recs.size(); i++)
+        {
+            if (recs[i].ts_us >= from && recs[i].ts_us <= to)
+                in_range.push_back(recs[i]);
+        }
+
+        Mcap_reader ranged;
+        ranged.set_time_range(from, to);
+        n = read_back(fname, in_range, &ranged);
+        ok = n == (long)in_range.size() && ranged.get_bytes_read() * 3 < (u_longlong)st.st_size;
+        printf("Test: time range read back %ld of %zu, %llu of %lld bytes read: %s\n", n, in_range.size(),
+               ranged.get_bytes_read(), (long long)st.st_size, ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+
+        // blocks decoded on their own make up the same records
+        std::vector<u_char> raw, comp;
+        Mcap_block_cursor cursor;
+        Mcap_record m;
+        size_t n_same = 0;
+
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            r.read_block(blocks[i], &raw, &comp);
+            cursor.reset(raw.data(), raw.size());
+
+            while (cursor.next(&m) && n_same < recs.size() && m.key == recs[n_same].key &&
+                   ts_to_us(m.ts) == recs[n_same].ts_us && m.len == recs[n_same].data.size())
+                n_same++;
+        }
+
+        ok = n_same == recs.size();
+        printf("Test: %zu blocks decoded one by one: %s\n", blocks.size(), ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+
+        // cut in the middle of the last block, the ones before it still read
+        if (truncate(fname, blocks.back().offset + 100))
+            perror("truncate");
+
+        Mcap_reader cut;
+        n = read_back(fname, recs, &cut);
+        ok = n == (long)(recs.size() - blocks.back().n_records) && cut.get_blocks().empty();
+        printf("Test: truncated version 2 reads its whole blocks: %s\n", ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+
+        // a block header with lengths no writer makes is not taken for the
+        // end of the file, nor read into a buffer that big
+        static const u_int bad_lens[][2] = {{0xfffffff0, 0x1000}, {0x1000, 0xfffffff0}, {MAX_BLOCK_RAW_LEN + 1, 0x100000}};
+
+        for (size_t i = 0; i < sizeof(bad_lens) / sizeof(bad_lens[0]); i++)
+        {
+            u_char lens[8];
+            int4store(lens, bad_lens[i][0]);
+            int4store(lens + 4, bad_lens[i][1]);
+            int fd = ::open(fname, O_WRONLY);
+            ok = pwrite(fd, lens, sizeof(lens), blocks[0].offset + 1) == sizeof(lens);
+            close(fd);
+
+            try
+            {
+                Mcap_reader bad;
+                read_back(fname, recs, &bad);
+                ok = false;
+            }
+            catch (const std::runtime_error&)
+            {
+            }
+
+            printf("Test: block header lengths %u, %u rejected: %s\n", bad_lens[i][0], bad_lens[i][1],
+                   ok ? "PASS" : "FAIL");
+            n_failed += !ok;
+        }
+    }
+
+    unlink(fname);
+    printf("%s\n", n_failed ? "FAILED" : "ALL PASSED");
+    return n_failed ? 1 : 0;
+}
+
+#endif
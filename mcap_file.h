@@ -0,0 +1,185 @@
+#ifndef MCAP_FILE_H
+#define MCAP_FILE_H
+
+#include <sys/time.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// MCAP, the --record-for-replay format: the MySQL packets of a capture, each
+// with the connection it belongs to, its direction and timestamp, and a
+// zero length packet marking the end of a connection. Every file starts with
+// REPLAY_FILE_MAGIC and a 2 byte version.
+//
+// Version 1 is a flat run of records, each a 29 byte header (8 byte key, 1
+// byte direction, 8 byte seconds, 8 byte microseconds, 4 byte length) and
+// the packet.
+//
+// Version 2 packs the records into chunks that decode on their own:
+//   chunk    1 byte type ('B' records, 'I' index), 4 byte raw length,
+//            4 byte compressed length, 4 byte record count, zlib data
+//   record   varints: zigzag key delta, zigzag microsecond timestamp
+//            delta (both from the previous record in the chunk, 0 at its
+//            start), length << 1 | in; then the packet
+//   index    4 byte block count, per block its file offset, first and last
+//            timestamp and record count (8, 8, 8, 4 bytes); 4 byte
+//            connection count, per connection its key and first and last
+//            block (8, 4, 4 bytes)
+//   trailer  8 byte offset of the index chunk, REPLAY_FILE_MAGIC
+// All fixed size integers are little endian. A file cut short, say by a
+// crash while recording, has no trailer and is read front to back up to
+// the last whole block.
+
+#define MCAP_VERSION_1 1
+#define MCAP_VERSION_2 2
+
+// parses YYYY-MM-DD HH:MM:SS[.ffffff] in local time or seconds since the
+// epoch into microseconds, the timestamps records carry; false if s is
+// neither
+bool mcap_parse_time(const char* s, u_longlong* us);
+
+struct Mcap_record
+{
+    u_longlong key; // Mysql_stream_manager::get_key() of the connection
+    bool in; // client to server
+    struct timeval ts;
+    const u_char* data; // owned by the reader, valid until its next call
+    u_int len; // 0 marks the end of the connection
+};
+
+struct Mcap_block_info
+{
+    u_longlong offset; // of the chunk header
+    u_longlong first_ts_us, last_ts_us; // earliest and latest record
+    u_int n_records;
+};
+
+struct Mcap_conn_info
+{
+    u_longlong key;
+    u_int first_block, last_block; // it may skip some in between
+};
+
+// Writes version 2, a block at a time. Returns true on error, like the
+// rest of the replay file code.
+class Mcap_writer
+{
+protected:
+    int fd;
+    u_longlong file_pos;
+    std::vector<u_char> raw; // the block being filled
+    std::vector<u_char> comp;
+    u_int n_records;
+    u_longlong prev_key, prev_ts_us;
+    Mcap_block_info block; // the one being filled
+    std::vector<Mcap_block_info> blocks;
+    std::unordered_map<u_longlong, Mcap_conn_info> conns;
+
+    bool write_chunk(u_char type, u_int n);
+    bool flush_block();
+
+public:
+    // raw bytes a block is closed at, one bigger record gets a block of its own
+    static const u_int BLOCK_SIZE = 256 * 1024;
+
+    Mcap_writer(): fd(-1), file_pos(0), n_records(0), prev_key(0), prev_ts_us(0) {}
+    // closes the file if close() was not called, errors go unreported
+    ~Mcap_writer();
+
+    // creates or truncates fname and writes the file header
+    bool open(const char* fname);
+    bool write(const Mcap_record& rec);
+    // writes out the last block, the index and the trailer
+    bool close();
+};
+
+// Walks the records of a decompressed version 2 block.
+class Mcap_block_cursor
+{
+protected:
+    const u_char* p;
+    const u_char* end;
+    u_longlong prev_key, prev_ts_us;
+
+public:
+    Mcap_block_cursor(): p(0), end(0), prev_key(0), prev_ts_us(0) {}
+
+    void reset(const u_char* data, size_t len)
+    {
+        p = data;
+        end = data + len;
+        prev_key = prev_ts_us = 0;
+    }
+
+    // false at the end of the block, throws std::runtime_error on a record
+    // that runs past it; rec->data points into the block
+    bool next(Mcap_record* rec);
+};
+
+// Reads either version. Throws std::runtime_error on a file it cannot
+// make sense of; a truncated last record or block just ends the file.
+class Mcap_reader
+{
+protected:
+    int fd;
+    u_int version;
+    u_longlong file_size;
+    u_longlong data_end; // where the index chunk starts, file_size without one
+    std::vector<Mcap_block_info> blocks;
+    std::vector<Mcap_conn_info> conns;
+
+    // version 1 reads through buf
+    std::vector<u_char> buf;
+    size_t buf_pos, buf_len;
+    u_longlong buf_file_pos; // of buf[0]
+
+    // version 2 decodes a block at a time into raw
+    std::vector<u_char> raw;
+    std::vector<u_char> comp;
+    Mcap_block_cursor cursor;
+    u_longlong next_chunk; // file offset of the next chunk header, no index
+    size_t next_block; // in blocks, with an index
+
+    // set_time_range()
+    u_longlong start_us, end_us;
+    u_longlong bytes_read, bytes_decoded;
+
+    bool fill(size_t n);
+    bool next_v1(Mcap_record* rec);
+    bool next_v2(Mcap_record* rec);
+    bool load_block();
+    void load_index();
+    // reads the chunk at offset into out and sets *chunk_end past it, false
+    // if the file ends first; safe to call from several threads at once
+    bool read_chunk(u_longlong offset, u_char* type, u_int* n_records, std::vector<u_char>* out,
+                    std::vector<u_char>* comp_buf, u_longlong* chunk_end) const;
+
+public:
+    Mcap_reader();
+    ~Mcap_reader();
+
+    // checks the header and, for version 2, loads the index if there is one
+    void open(const char* fname);
+    u_int get_version() const { return version; }
+    // version 2 files written to the end, empty otherwise
+    const std::vector<Mcap_block_info>& get_blocks() const { return blocks; }
+    const std::vector<Mcap_conn_info>& get_conns() const { return conns; }
+    // next() skips records outside [start_us, end_us] and, with an index,
+    // the blocks that have none without reading them
+    void set_time_range(u_longlong start_us, u_longlong end_us);
+    bool in_time_range(const Mcap_record& rec) const;
+    // the blocks of the index that may hold records in the time range
+    std::vector<Mcap_block_info> blocks_in_range() const;
+    // decompresses a block listed in the index into raw, comp is scratch
+    // space; safe to call from several threads, throws on a bad block
+    void read_block(const Mcap_block_info& block, std::vector<u_char>* raw, std::vector<u_char>* comp) const;
+    // false at the end of the file
+    bool next(Mcap_record* rec);
+    // what next() went through so far, compressed and not
+    u_longlong get_bytes_read() const { return bytes_read; }
+    u_longlong get_bytes_decoded() const { return bytes_decoded; }
+};
+
+#endif
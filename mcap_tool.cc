@@ -0,0 +1,525 @@
+// mysqlpcap-mcap: works on MCAP recordings without replaying them. Every
+// command streams its inputs a block at a time, merged by timestamp, so it
+// runs at the speed of the disk and zlib in memory that does not grow with
+// the size of the files.
+//
+//   mysqlpcap-mcap stats [filters] FILE...
+//   mysqlpcap-mcap slice|filter|merge -o OUT [filters] FILE...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+#include "common.h"
+#include "mcap_file.h"
+#include "fingerprint.h"
+
+static const char* command_names[] =
+{
+    "sleep", "quit", "init_db", "query", "field_list", "create_db", "drop_db", "refresh", "shutdown",
+    "statistics", "process_info", "connect", "process_kill", "debug", "ping", "time", "delayed_insert",
+    "change_user", "binlog_dump", "table_dump", "connect_out", "register_slave", "stmt_prepare",
+    "stmt_execute", "stmt_send_long_data", "stmt_close", "stmt_reset", "set_option", "stmt_fetch", "daemon",
+    "binlog_dump_gtid", "reset_connection"
+};
+
+#define N_COMMAND_NAMES (sizeof(command_names) / sizeof(command_names[0]))
+#define COM_QUERY 3
+
+static void die(const char* msg, ...)
+{
+    va_list ap;
+    va_start(ap, msg);
+    fprintf(stderr, "Error: ");
+    vfprintf(stderr, msg, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(1);
+}
+
+static void print_usage(const char* prog_name)
+{
+    fprintf(stderr,
+            "Usage: %s COMMAND [options] FILE...\n\n"
+            "Commands:\n"
+            "  stats                    Print a summary of the records that pass the filters.\n"
+            "  slice, filter, merge     Write the records that pass the filters to -o, as MCAP version 2.\n"
+            "                           Several input files are merged by timestamp; connections are told\n"
+            "                           apart by client address and port only, so the files should not\n"
+            "                           share any.\n\n"
+            "Options:\n"
+            "  -o, --output FILE        Where slice, filter and merge write to.\n"
+            "      --start-time TIME    Skip records before TIME, YYYY-MM-DD HH:MM:SS[.ffffff] local time or\n"
+            "                           seconds since the epoch.\n"
+            "      --end-time TIME      Skip records after TIME.\n"
+            "      --client IP[:PORT]   Keep only the connections of this client, may be given several times.\n"
+            "      --command NAME,...   Keep only these commands and their responses, e.g. query,stmt_execute.\n"
+            "      --pattern REGEX      Keep only the queries whose fingerprint matches REGEX, and their\n"
+            "                           responses.\n"
+            "      --top N              Query patterns stats lists, by count (default 20).\n"
+            "  -H, --help               Print this help message and exit.\n",
+            prog_name);
+}
+
+// the records to keep; the client filter goes by connection, the command and
+// pattern ones by command, a kept command keeps the responses to it
+struct Mcap_filter
+{
+    u_longlong start_us, end_us;
+    std::vector<std::pair<u_int, u_int> > clients; // ip and port as in a key, port 0 for any
+    bool by_command;
+    bool commands[256];
+    pcre2_code* pattern;
+    pcre2_match_data* match_data;
+    Query_fingerprint fingerprint;
+    std::unordered_map<u_longlong, bool> keeping; // per open connection, is its current command kept
+
+    Mcap_filter(): start_us(0), end_us(~0ULL), by_command(false), pattern(NULL), match_data(NULL)
+    {
+        memset(commands, 0, sizeof(commands));
+    }
+
+    ~Mcap_filter()
+    {
+        if (match_data)
+            pcre2_match_data_free(match_data);
+
+        if (pattern)
+            pcre2_code_free(pattern);
+    }
+
+    void add_client(const char* arg)
+    {
+        std::string ip(arg);
+        u_int port = 0;
+        size_t colon = ip.find(':');
+        struct in_addr addr;
+
+        if (colon != std::string::npos)
+        {
+            port = htons(atoi(ip.c_str() + colon + 1));
+            ip.resize(colon);
+        }
+
+        if (!inet_aton(ip.c_str(), &addr))
+            die("--client must be IP or IP:PORT, not %s", arg);
+
+        clients.push_back(std::make_pair((u_int)addr.s_addr, port));
+    }
+
+    void add_commands(const char* arg)
+    {
+        std::string list(arg);
+        size_t pos = 0;
+        by_command = true;
+
+        while (pos <= list.size())
+        {
+            size_t comma = list.find(',', pos);
+            std::string name = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+            size_t i = 0;
+
+            while (i < N_COMMAND_NAMES && name != command_names[i])
+                i++;
+
+            if (i == N_COMMAND_NAMES)
+                die("--command: unknown command %s", name.c_str());
+
+            commands[i] = true;
+
+            if (comma == std::string::npos)
+                break;
+
+            pos = comma + 1;
+        }
+    }
+
+    void set_pattern(const char* regex)
+    {
+        PCRE2_SIZE erroroffset;
+        int errornumber;
+
+        if (!(pattern = pcre2_compile((PCRE2_SPTR)regex, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS | PCRE2_DOTALL,
+                                      &errornumber, &erroroffset, NULL)))
+            die("--pattern: invalid regular expression at offset %zu: %s", (size_t)erroroffset, regex);
+
+        pcre2_jit_compile(pattern, PCRE2_JIT_COMPLETE);
+        match_data = pcre2_match_data_create_from_pattern(pattern, NULL);
+    }
+
+    bool client_kept(u_longlong key) const
+    {
+        if (clients.empty())
+            return true;
+
+        u_int ip = key >> 32;
+        u_int port = key & 0xffffffff;
+
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            if (clients[i].first == ip && (!clients[i].second || clients[i].second == port))
+                return true;
+        }
+
+        return false;
+    }
+
+    bool command_kept(const Mcap_record& rec)
+    {
+        if (by_command && !commands[rec.data[0]])
+            return false;
+
+        if (!pattern)
+            return true;
+
+        if (rec.data[0] != COM_QUERY)
+            return false;
+
+        fingerprint.compute((const char*)rec.data + 1, rec.len - 1);
+        return pcre2_match(pattern, (PCRE2_SPTR)fingerprint.text(), fingerprint.text_len(), 0, 0, match_data,
+                           NULL) >= 0;
+    }
+
+    bool keep(const Mcap_record& rec)
+    {
+        u_longlong ts_us = (u_longlong)rec.ts.tv_sec * 1000000 + rec.ts.tv_usec;
+
+        if (ts_us < start_us || ts_us > end_us || !client_kept(rec.key))
+            return false;
+
+        if (!by_command && !pattern)
+            return true;
+
+        if (!rec.len)
+        {
+            keeping.erase(rec.key);
+            return true; // the end of the connection, harmless if none of it was kept
+        }
+
+        if (rec.in)
+            return keeping[rec.key] = command_kept(rec);
+
+        std::unordered_map<u_longlong, bool>::iterator it = keeping.find(rec.key);
+        return it != keeping.end() && it->second;
+    }
+};
+
+struct Pattern_count
+{
+    std::string text;
+    u_longlong n;
+    u_longlong bytes;
+
+    Pattern_count(): n(0), bytes(0) {}
+};
+
+static bool pattern_count_cmp(const Pattern_count* p1, const Pattern_count* p2)
+{
+    return p1->n > p2->n;
+}
+
+struct Mcap_stats
+{
+    u_longlong n_records, n_in, n_bytes, n_conns, n_ends;
+    u_longlong first_us, last_us;
+    u_longlong n_commands[256];
+    std::unordered_map<u_longlong, bool> open; // connections seen and not ended yet
+    std::unordered_map<u_longlong, Pattern_count> patterns;
+    Query_fingerprint fingerprint;
+
+    Mcap_stats(): n_records(0), n_in(0), n_bytes(0), n_conns(0), n_ends(0), first_us(~0ULL), last_us(0)
+    {
+        memset(n_commands, 0, sizeof(n_commands));
+    }
+
+    void record(const Mcap_record& rec)
+    {
+        u_longlong ts_us = (u_longlong)rec.ts.tv_sec * 1000000 + rec.ts.tv_usec;
+        n_records++;
+        n_bytes += rec.len;
+        first_us = std::min(first_us, ts_us);
+        last_us = std::max(last_us, ts_us);
+
+        if (!rec.len)
+        {
+            n_ends++;
+            open.erase(rec.key);
+            return;
+        }
+
+        if (open.insert(std::make_pair(rec.key, true)).second)
+            n_conns++;
+
+        if (!rec.in)
+            return;
+
+        n_in++;
+        n_commands[rec.data[0]]++;
+
+        if (rec.data[0] != COM_QUERY)
+            return;
+
+        u_longlong digest = fingerprint.compute((const char*)rec.data + 1, rec.len - 1);
+        Pattern_count& p = patterns[digest];
+
+        if (!p.n)
+            p.text.assign(fingerprint.text(), fingerprint.text_len());
+
+        p.n++;
+        p.bytes += rec.len;
+    }
+
+    static void print_time(const char* label, u_longlong us)
+    {
+        time_t secs = us / 1000000;
+        struct tm tm;
+        char buf[64];
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime_r(&secs, &tm));
+        printf("%s%s.%06llu\n", label, buf, us % 1000000);
+    }
+
+    void print(u_int top)
+    {
+        printf("Records: %llu, %llu from clients, %llu from the server\n", n_records, n_in,
+               n_records - n_in - n_ends);
+        printf("Packet bytes: %llu\n", n_bytes);
+        printf("Connections: %llu, %llu ended\n", n_conns, n_ends);
+
+        if (n_records)
+        {
+            print_time("First: ", first_us);
+            print_time("Last:  ", last_us);
+            printf("Span: %.6fs\n", (last_us - first_us) / 1e6);
+        }
+
+        printf("Commands:\n");
+
+        for (u_int i = 0; i < 256; i++)
+        {
+            if (!n_commands[i])
+                continue;
+
+            if (i < N_COMMAND_NAMES)
+                printf("  %-20s %llu\n", command_names[i], n_commands[i]);
+            else
+                printf("  0x%02x %15s %llu\n", i, "", n_commands[i]);
+        }
+
+        std::vector<Pattern_count*> sorted;
+
+        for (std::unordered_map<u_longlong, Pattern_count>::iterator it = patterns.begin(); it != patterns.end(); it++)
+            sorted.push_back(&it->second);
+
+        std::sort(sorted.begin(), sorted.end(), pattern_count_cmp);
+        printf("Query patterns: %zu, top %zu by count:\n", sorted.size(), std::min(sorted.size(), (size_t)top));
+
+        for (size_t i = 0; i < sorted.size() && i < top; i++)
+            printf("  %10llu %12llu  %.200s\n", sorted[i]->n, sorted[i]->bytes, sorted[i]->text.c_str());
+    }
+};
+
+// one input file and the record it is at
+struct Mcap_input
+{
+    Mcap_reader reader;
+    Mcap_record rec;
+    size_t file_no;
+    u_longlong ts_us;
+
+    bool advance()
+    {
+        if (!reader.next(&rec))
+            return false;
+
+        ts_us = (u_longlong)rec.ts.tv_sec * 1000000 + rec.ts.tv_usec;
+        return true;
+    }
+};
+
+// earliest on top, the first file on the command line wins ties
+struct Mcap_input_cmp
+{
+    bool operator()(const Mcap_input* i1, const Mcap_input* i2) const
+    {
+        return i1->ts_us > i2->ts_us || (i1->ts_us == i2->ts_us && i1->file_no > i2->file_no);
+    }
+};
+
+enum { START_TIME = 256, END_TIME, CLIENT, COMMAND, PATTERN, TOP };
+
+static struct option long_options[] =
+{
+    {"output", required_argument, 0, 'o'},
+    {"start-time", required_argument, 0, START_TIME},
+    {"end-time", required_argument, 0, END_TIME},
+    {"client", required_argument, 0, CLIENT},
+    {"command", required_argument, 0, COMMAND},
+    {"pattern", required_argument, 0, PATTERN},
+    {"top", required_argument, 0, TOP},
+    {"help", no_argument, 0, 'H'},
+    {0, 0, 0, 0}
+};
+
+static u_longlong parse_time_us(const char* opt, const char* arg)
+{
+    u_longlong us;
+
+    if (!mcap_parse_time(arg, &us))
+        die("%s must be YYYY-MM-DD HH:MM:SS[.ffffff] or seconds since the epoch", opt);
+
+    return us;
+}
+
+int main(int argc, char** argv)
+{
+    Mcap_filter filter;
+    const char* out_file = NULL;
+    u_int top = 20;
+    int c;
+
+    if (argc < 2 || !strcmp(argv[1], "-H") || !strcmp(argv[1], "--help"))
+    {
+        print_usage(argv[0]);
+        return argc < 2;
+    }
+
+    const char* command = argv[1];
+    bool write = strcmp(command, "slice") == 0 || strcmp(command, "filter") == 0 || strcmp(command, "merge") == 0;
+
+    if (!write && strcmp(command, "stats"))
+        die("Unknown command %s, see --help", command);
+
+    optind = 2;
+
+    while ((c = getopt_long(argc, argv, "o:H", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'o':
+            out_file = optarg;
+            break;
+        case START_TIME:
+            filter.start_us = parse_time_us("--start-time", optarg);
+            break;
+        case END_TIME:
+            filter.end_us = parse_time_us("--end-time", optarg);
+            break;
+        case CLIENT:
+            filter.add_client(optarg);
+            break;
+        case COMMAND:
+            filter.add_commands(optarg);
+            break;
+        case PATTERN:
+            filter.set_pattern(optarg);
+            break;
+        case TOP:
+            top = atoi(optarg);
+            break;
+        case 'H':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            die("Invalid option, see --help");
+        }
+    }
+
+    if (optind == argc)
+        die("No input files");
+
+    if (write && !out_file)
+        die("%s needs -o", command);
+
+    if (!write && out_file)
+        die("stats does not write, drop -o");
+
+    if (filter.end_us <= filter.start_us)
+        die("--end-time must be after --start-time");
+
+    std::vector<Mcap_input*> inputs;
+    std::priority_queue<Mcap_input*, std::vector<Mcap_input*>, Mcap_input_cmp> heap;
+    Mcap_writer writer;
+    Mcap_stats stats;
+    u_longlong n_read = 0, n_kept = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    try
+    {
+        for (int i = optind; i < argc; i++)
+        {
+            Mcap_input* in = new Mcap_input();
+            inputs.push_back(in);
+            in->file_no = inputs.size() - 1;
+            in->reader.open(argv[i]);
+            // blocks outside the time range are skipped by the index
+            in->reader.set_time_range(filter.start_us, filter.end_us);
+
+            if (in->advance())
+                heap.push(in);
+        }
+
+        if (write && writer.open(out_file))
+            die("Error opening %s for writing", out_file);
+
+        while (!heap.empty())
+        {
+            Mcap_input* in = heap.top();
+            heap.pop();
+            n_read++;
+
+            if (filter.keep(in->rec))
+            {
+                n_kept++;
+
+                if (!write)
+                    stats.record(in->rec);
+                else if (writer.write(in->rec))
+                    die("Error writing to %s", out_file);
+            }
+
+            if (in->advance())
+                heap.push(in);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        die("%s", e.what());
+    }
+
+    if (write && writer.close())
+        die("Error writing to %s", out_file);
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    u_longlong bytes_read = 0, bytes_decoded = 0;
+
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        bytes_read += inputs[i]->reader.get_bytes_read();
+        bytes_decoded += inputs[i]->reader.get_bytes_decoded();
+        delete inputs[i];
+    }
+
+    if (!write)
+    {
+        stats.print(top);
+        fflush(stdout);
+    }
+
+    fprintf(stderr, "%s: kept %llu of %llu records from %zu file%s, %.1f MB read, %.1f MB decoded in %.2fs, %.1f MB/s\n",
+            command, n_kept, n_read, inputs.size(), inputs.size() > 1 ? "s" : "", bytes_read / (1024.0 * 1024.0),
+            bytes_decoded / (1024.0 * 1024.0), secs, secs > 0 ? bytes_decoded / (1024.0 * 1024.0) / secs : 0.0);
+    return 0;
+}
@@ -7,13 +7,15 @@
 
 #include "common.h"
 #include "mysql_packet.h"
+#include "packet_alloc.h"
+#include "mcap_file.h"
 
 void Mysql_packet::cleanup()
 {
   if (!data)
     return;
 
-  delete[] data;
+  Packet_allocator::free(data, len);
   data = 0;
   perf_stats.pkt_mem_in_use.fetch_sub(len);
   perf_stats.pkt_freed.fetch_add(1);
@@ -22,78 +24,55 @@ void Mysql_packet::cleanup()
 void Mysql_packet::init()
 {
   DEBUG_MSG("packet len is %d", len);
-  data = new u_char[len]; // throws on OOM
+  data = (u_char*)Packet_allocator::alloc(len); // throws on OOM
   perf_stats.pkt_mem_in_use.fetch_add(len);
   perf_stats.pkt_alloced.fetch_add(1);
 }
 
-#define PACKET_HEADER_SIZE (8+1+16+4) // key + in + ts + data_len
-
 // returns false on success
-bool Mysql_packet::replay_write(int fd, u_longlong key)
+bool Mysql_packet::replay_write(Mcap_writer* w, u_longlong key)
 {
-  char buf[PACKET_HEADER_SIZE];
-  char* p = buf;
-  int8store(p, key);
-
-  p += 8;
-  *p++ = in ? 1 : 0;
-  int8store(p, ts.tv_sec);
-  p += 8;
-  int8store(p, ts.tv_usec);
-  p += 8;
-  int4store(p, len);
-  if (write(fd, buf, sizeof(buf)) != sizeof(buf))
-    return true;
-
-  if (!len)
-    return false; // End of stream
-
-  if (write(fd, data, len) != len)
-    return true;
-
-  return false;
+  Mcap_record rec;
+  rec.key = key;
+  rec.in = in;
+  rec.ts = ts;
+  rec.data = data;
+  rec.len = len; // 0 marks the end of stream
+  return w->write(rec);
 }
 
-bool Mysql_packet::replay_read(int fd, u_longlong* key)
+bool Mysql_packet::replay_read(Mcap_reader* r, u_longlong* key)
 {
-  char buf[PACKET_HEADER_SIZE];
-  char* p = buf;
+  Mcap_record rec;
 
-  if (read(fd, buf, sizeof(buf)) != sizeof(buf))
+  if (!r->next(&rec))
   {
     data = 0;
     len = 0;
     return true;
   }
 
-  *key = uint8korr(p);
-  p += 8;
-  in = *p++;
-  ts.tv_sec = uint8korr(p);
-  p += 8;
-  ts.tv_usec = uint8korr(p);
-  p += 8;
-  len = uint4korr(p);
+  *key = rec.key;
+  replay_copy(rec);
+  return false;
+}
+
+void Mysql_packet::replay_copy(const Mcap_record& rec)
+{
+  in = rec.in;
+  ts = rec.ts;
+  len = rec.len;
 
   if (!len)
   {
-    return false; // end of stream
+    data = 0;
+    return; // end of stream
   }
 
-  data = new u_char[len]; // throws on OOM
+  data = (u_char*)Packet_allocator::alloc(len); // throws on OOM
   perf_stats.pkt_mem_in_use.fetch_add(len);
   perf_stats.pkt_alloced.fetch_add(1);
-
-  if (read(fd, data, len) != len)
-  {
-    delete[] data;
-    data = 0;
-    len = 0;
-    return true;
-  }
-
-  return false;
+  memcpy(data, rec.data, len);
 }
 
 void Mysql_packet::append(const u_char* append_data, u_int* try_append_len)
@@ -139,8 +118,7 @@ bool Mysql_packet::is_query()
   return data[0] == 0x3 && in;
 }
 
-bool Mysql_packet::is_eof()
+bool Mysql_packet::is_stmt_command()
 {
-  return data[0] == 0xfe && !in;
+  return in && data[0] >= COM_STMT_PREPARE && data[0] <= COM_STMT_RESET;
 }
-
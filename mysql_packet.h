@@ -5,6 +5,12 @@
 #include <chrono>
 #include <stdlib.h>
 
+#include "packet_alloc.h"
+
+class Mcap_writer;
+class Mcap_reader;
+struct Mcap_record;
+
 class Mysql_packet
 {
 protected:
@@ -47,15 +53,23 @@ public:
         prev(0), skip(false) { init(); }
     Mysql_packet():ref_count(0),data(0),len(0),cur_len(0),next(0),prev(0) {}
     ~Mysql_packet() { cleanup();}
+
+    // packets are created and freed at wire rate, keep them off the heap
+    static void* operator new(size_t size) { return Packet_allocator::alloc(size); }
+    static void operator delete(void* p, size_t size) { Packet_allocator::free(p, size); }
+
     void append(const u_char* append_data, u_int* try_append_len);
     bool is_complete() { return len == cur_len;}
     void print();
     double ts_diff(Mysql_packet* other);
     bool is_query();
-    bool is_eof();
+    // COM_STMT_PREPARE to COM_STMT_RESET, see Mysql_stream::handle_stmt_command()
+    bool is_stmt_command();
 
-    bool replay_write(int fd, u_longlong key);
-    bool replay_read(int fd, u_longlong* key);
+    bool replay_write(Mcap_writer* w, u_longlong key);
+    bool replay_read(Mcap_reader* r, u_longlong* key);
+    // takes a copy of the record's packet, thread safe
+    void replay_copy(const Mcap_record& rec);
 };
 
 class Mysql_query_packet: public Mysql_packet
@@ -0,0 +1,280 @@
+#include "mysql_response.h"
+#include "prepared_stmt.h"
+
+// the status flags and warning count of the EOF or OK packet that ends a
+// result, false if the packet is too short to have them
+static bool read_status(const u_char* data, u_int len, u_int* status, u_int* warnings)
+{
+    const u_char* p = data + 1;
+    const u_char* end = data + len;
+    u_longlong skip;
+
+    if (data[0] == 0xfe && len <= 5)
+    {
+        // EOF: the warning count, then the status
+        if (len < 5)
+            return false;
+
+        *warnings = p[0] | (p[1] << 8);
+        *status = p[2] | (p[3] << 8);
+        return true;
+    }
+
+    // OK: affected rows and insert id, then the status and the warning count
+    if (!read_lenenc(&p, end, &skip) || !read_lenenc(&p, end, &skip) || end - p < 4)
+        return false;
+
+    *status = p[0] | (p[1] << 8);
+    *warnings = p[2] | (p[3] << 8);
+    return true;
+}
+
+bool Mysql_response_decoder::end_result(const u_char* data, u_int len)
+{
+    u_int status, warnings;
+
+    if (!read_status(data, len, &status, &warnings))
+        return true;
+
+    resp.status_flags |= status;
+    resp.warnings += warnings;
+    return !(status & SERVER_MORE_RESULTS_EXIST);
+}
+
+void Mysql_response_decoder::start(u_char cmd)
+{
+    this->cmd = cmd;
+    resp = Mysql_response();
+    state = START;
+    continued = false;
+    prepare_ok = false;
+}
+
+bool Mysql_response_decoder::feed(const u_char* data, u_int len, double elapsed)
+{
+    if (!resp.bytes)
+        resp.ttfb = elapsed;
+
+    resp.bytes += len + 4;
+    resp.ttlb = elapsed;
+
+    bool was_continued = continued;
+    continued = len == PACKET_OVERFLOW_LEN;
+
+    if (was_continued || !len)
+        return false;
+
+    u_char type = data[0];
+    bool is_err = type == 0xff;
+    // EOF, or with CLIENT_DEPRECATE_EOF the OK that ends the rows, which
+    // with session state tracking can run to any length; a row starting with
+    // 0xfe has an 8 byte length after it, its value alone is 2^24 bytes or
+    // more and its first packet a full one
+    bool is_end = type == 0xfe && len < PACKET_OVERFLOW_LEN;
+
+    switch (state)
+    {
+    case START:
+        if (is_err)
+            return true;
+
+        // the parameter and column definitions that follow are of no interest
+        if (type == 0x00 && cmd == COM_STMT_PREPARE && len >= 12)
+        {
+            prepare_ok = true;
+            prepare_ok_id = uint4korr(data + 1);
+            prepare_ok_params = data[7] | (data[8] << 8);
+            return true;
+        }
+
+        if (type == 0x00 || is_end)
+            return end_result(data, len);
+
+        if (type == 0xfb)
+            return false; // LOCAL INFILE, the OK comes after the client sent the file
+
+        {
+            const u_char* p = data;
+
+            if (!read_lenenc(&p, data + len, &cols_left) || !cols_left)
+                return true; // not a result set, nothing more to wait for
+        }
+
+        state = COLUMNS;
+        return false;
+
+    case COLUMNS:
+        if (is_err)
+            return true;
+
+        if (!--cols_left)
+            state = COLUMNS_END;
+
+        return false;
+
+    case COLUMNS_END:
+        state = ROWS;
+
+        // an EOF is 5 bytes, the OK that ends the rows at least 7
+        if (is_end && len <= 5)
+            return false;
+
+        // CLIENT_DEPRECATE_EOF, no EOF after the columns
+        // fall through
+
+    case ROWS:
+        if (is_err)
+            return true;
+
+        if (is_end)
+        {
+            if (end_result(data, len))
+                return true;
+
+            state = START;
+            return false;
+        }
+
+        resp.rows++;
+        return false;
+    }
+
+    return true;
+}
+
+#ifdef TEST_MYSQL_RESPONSE
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+static int n_failed = 0;
+
+static std::string pkt(const char* s, size_t len)
+{
+    return std::string(s, len);
+}
+
+#define PKT(s) pkt(s, sizeof(s) - 1)
+
+static const std::string OK = PKT("\x00\x00\x00\x02\x00\x00\x00");
+static const std::string ERR = PKT("\xff\x15\x04#28000Access denied");
+static const std::string COLS_2 = PKT("\x02");
+static const std::string COL = PKT("\x03" "def\x04test\x01t\x01t\x01" "a\x01" "a\x0c\x21\x00\x0b\x00\x00\x00\xfd\x00\x00\x00\x00\x00");
+static const std::string ROW = PKT("\x01" "a\x01" "b");
+// one warning, SERVER_STATUS_AUTOCOMMIT
+static const std::string END_EOF = PKT("\xfe\x01\x00\x02\x00");
+// CLIENT_DEPRECATE_EOF
+static const std::string END_OK = PKT("\xfe\x00\x00\x02\x00\x01\x00");
+
+// feeds the packets one after the other, returns how many it took for the
+// decoder to see the end, 0 if it did not
+static size_t run(Mysql_response_decoder* d, u_char cmd, const std::vector<std::string>& pkts)
+{
+    d->start(cmd);
+
+    for (size_t i = 0; i < pkts.size(); i++)
+    {
+        if (d->feed((const u_char*)pkts[i].data(), pkts[i].size(), i + 1))
+            return i + 1;
+    }
+
+    return 0;
+}
+
+static void check(const char* what, bool ok)
+{
+    printf("  %s: %s\n", what, ok ? "PASS" : "FAIL");
+
+    if (!ok)
+        n_failed++;
+}
+
+int main()
+{
+    printf("Test: response decoder\n");
+
+    Mysql_response_decoder d;
+    std::vector<std::string> pkts;
+
+    pkts = {OK};
+    check("OK", run(&d, COM_QUERY, pkts) == 1 && d.resp.rows == 0 && d.resp.status_flags == 2 &&
+        d.resp.bytes == OK.size() + 4 && d.resp.ttfb == 1 && d.resp.ttlb == 1);
+
+    pkts = {ERR};
+    check("ERR", run(&d, COM_QUERY, pkts) == 1);
+
+    pkts = {COLS_2, COL, ERR};
+    check("ERR in the columns", run(&d, COM_QUERY, pkts) == 3);
+
+    pkts = {COLS_2, COL, COL, END_EOF, ROW, ROW, ERR};
+    check("ERR in the rows", run(&d, COM_QUERY, pkts) == 7 && d.resp.rows == 2);
+
+    pkts = {COLS_2, COL, COL, END_EOF, ROW, ROW, ROW, END_EOF};
+    check("EOF result set", run(&d, COM_QUERY, pkts) == 8 && d.resp.rows == 3 && d.resp.warnings == 1 &&
+        d.resp.status_flags == 2 && d.resp.ttfb == 1 && d.resp.ttlb == 8);
+
+    pkts = {COLS_2, COL, COL, END_EOF, END_EOF};
+    check("empty EOF result set", run(&d, COM_QUERY, pkts) == 5 && d.resp.rows == 0 && d.resp.warnings == 1);
+
+    pkts = {COLS_2, COL, COL, ROW, ROW, END_OK};
+    check("DEPRECATE_EOF result set", run(&d, COM_QUERY, pkts) == 6 && d.resp.rows == 2 && d.resp.warnings == 1);
+
+    pkts = {COLS_2, COL, COL, END_OK};
+    check("empty DEPRECATE_EOF result set", run(&d, COM_QUERY, pkts) == 4 && d.resp.rows == 0);
+
+    // SERVER_SESSION_STATE_CHANGED, an info string and a system variable
+    std::string state_ok = PKT("\xfe\x00\x00\x02\x40\x00\x00\x00\x1e\x00\x1c\x1a" "character_set_results\x04utf8");
+    pkts = {COLS_2, COL, COL, ROW, state_ok};
+    check("session state OK", run(&d, COM_QUERY, pkts) == 5 && d.resp.rows == 1 && d.resp.status_flags == 0x4002);
+
+    // a CALL: a result set and the OK of the procedure, then a result set
+    // ended by an OK that with DEPRECATE_EOF looks like an EOF
+    std::string more_eof = PKT("\xfe\x00\x00\x0a\x00");
+    std::string more_ok = PKT("\x00\x00\x00\x0a\x00\x00\x00");
+    std::string more_end_ok = PKT("\xfe\x00\x00\x0a\x00\x00\x00");
+    pkts = {COLS_2, COL, COL, END_EOF, ROW, more_eof, COLS_2, COL, COL, END_EOF, ROW, ROW, more_eof, OK};
+    check("more results, EOF", run(&d, COM_QUERY, pkts) == 14 && d.resp.rows == 3 && d.resp.status_flags == 0x0a);
+
+    pkts = {more_ok, COLS_2, COL, COL, ROW, more_end_ok, COLS_2, COL, COL, END_OK};
+    check("more results, DEPRECATE_EOF", run(&d, COM_QUERY, pkts) == 10 && d.resp.rows == 1);
+
+    pkts = {PKT("\xfb/tmp/data.csv"), OK};
+    check("LOCAL INFILE", run(&d, COM_QUERY, pkts) == 2);
+
+    pkts = {PKT("\xfb/tmp/data.csv"), ERR};
+    check("LOCAL INFILE refused", run(&d, COM_QUERY, pkts) == 2);
+
+    // a row of one value of 2^24 bytes: the first packet starts like an
+    // EOF, the one that carries on with it could too
+    std::string big(PACKET_OVERFLOW_LEN, 'x');
+    big[0] = '\xfe';
+    big[1] = '\x00';
+    big[2] = '\x00';
+    big[3] = '\x00';
+    big[4] = '\x01';
+    std::string big_rest = PKT("\xfe\x00\x00\x02\x00\x00\x00\x00\x00");
+    pkts = {PKT("\x01"), COL, END_EOF, big, big_rest, ROW, END_EOF};
+    check("16M row", run(&d, COM_QUERY, pkts) == 7 && d.resp.rows == 2 &&
+        d.resp.bytes == 4 * 7 + 1 + COL.size() + 2 * END_EOF.size() + big.size() + big_rest.size() + ROW.size());
+
+    pkts = {PKT("\x01"), COL, big, big_rest, END_OK};
+    check("16M row, DEPRECATE_EOF", run(&d, COM_QUERY, pkts) == 5 && d.resp.rows == 1);
+
+    // id 7, 2 columns, 3 parameters
+    pkts = {PKT("\x00\x07\x00\x00\x00\x02\x00\x03\x00\x00\x00\x00")};
+    check("prepare OK", run(&d, COM_STMT_PREPARE, pkts) == 1 && d.prepare_ok && d.prepare_ok_id == 7 &&
+        d.prepare_ok_params == 3);
+    check("start forgets", run(&d, COM_QUERY, {OK}) == 1 && !d.prepare_ok && d.resp.bytes == OK.size() + 4);
+
+    if (n_failed)
+    {
+        printf("%d FAILED\n", n_failed);
+        return 1;
+    }
+
+    printf("ALL PASSED\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef MYSQL_RESPONSE_H
+#define MYSQL_RESPONSE_H
+
+#include "common.h"
+
+// the payload length of a packet that another one carries on
+#define PACKET_OVERFLOW_LEN 0xffffff
+
+// what the server sent back for a query, see Mysql_response_decoder
+struct Mysql_response
+{
+    u_longlong rows; // over all the result sets
+    u_longlong bytes; // packet headers included
+    double ttfb, ttlb; // seconds from the query to the first and last response packet
+    u_int status_flags; // SERVER_QUERY_NO_INDEX_USED and the like, of all the OK and EOF packets
+    u_int warnings;
+
+    Mysql_response(): rows(0), bytes(0), ttfb(0.0), ttlb(0.0), status_flags(0), warnings(0) {}
+};
+
+// Follows the server packets that answer one command far enough to tell
+// which one is the last: an OK or ERR, or result sets of column
+// definitions and rows, ended by an EOF or with CLIENT_DEPRECATE_EOF an OK,
+// as many as SERVER_MORE_RESULTS_EXIST chains. Rows are counted, not read.
+class Mysql_response_decoder
+{
+protected:
+    enum State
+    {
+        START, // the first packet of a result: OK, ERR or the column count
+        COLUMNS, // column definitions
+        COLUMNS_END, // the EOF after the columns, or with CLIENT_DEPRECATE_EOF the first row
+        ROWS
+    };
+    State state;
+    u_char cmd;
+    u_longlong cols_left;
+    bool continued; // the last packet was a full 16M one, the next one carries on with it
+
+    // folds the status of the OK or EOF packet that ends a result into resp,
+    // returns true if no other result follows
+    bool end_result(const u_char* data, u_int len);
+
+public:
+    Mysql_response resp;
+    // the COM_STMT_PREPARE got its OK
+    bool prepare_ok;
+    u_int prepare_ok_id;
+    u_int prepare_ok_params;
+
+    Mysql_response_decoder(): state(START), cmd(0), cols_left(0), continued(false),
+        prepare_ok(false), prepare_ok_id(0), prepare_ok_params(0) {}
+
+    // forgets the last response, the next one answers cmd
+    void start(u_char cmd);
+    // takes the payload of the next server packet, which came elapsed
+    // seconds after the command; returns true once it is the last one of
+    // the response
+    bool feed(const u_char* data, u_int len, double elapsed);
+};
+
+#endif
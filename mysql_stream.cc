@@ -4,6 +4,7 @@
 #include "common.h"
 #include "mysql_stream.h"
 #include "mysql_stream_manager.h"
+#include "replay_engine.h"
 
 void setup_for_ssl(MYSQL* con, const char* ssl_ca, const char* ssl_cert, const char* ssl_key)
 {
@@ -30,95 +31,27 @@ void setup_for_ssl(MYSQL* con, const char* ssl_ca, const char* ssl_cert, const c
 
 void Mysql_stream::start_replay()
 {
-  th = new std::thread(&Mysql_stream::run_replay, this);
+  for (u_int i = 0; i < sm->info->replay_clone_factor; i++)
+    replay.push_back(sm->replay_engine->open_session(i));
 }
 
 void Mysql_stream::end_replay()
 {
-  if (!th)
-    return;
+  for (size_t i = 0; i < replay.size(); i++)
+    replay[i]->close();
 
-  lock.lock();
-  eof_lock.lock();
-  reached_eof = 1;
-  eof_cond.notify_one();
-  eof_lock.unlock();
-  lock.unlock();
-  th->join();
-  delete th;
-  th = 0;
+  replay.clear();
 }
 
 void Mysql_stream::register_replay_packet(Mysql_packet* pkt)
 {
-  if (!sm->in_replay_write)
+  if (!sm->mcap_writer)
     return;
 
-  if (pkt->replay_write(sm->replay_fd, get_key(pkt)))
+  if (pkt->replay_write(sm->mcap_writer, get_key()))
     throw std::runtime_error("Error writing to replay file");
 }
 
-u_longlong Mysql_stream::get_key(Mysql_packet* pkt)
-{
-  return pkt->in ? Mysql_stream_manager::get_key(dst_ip, dst_port) :
-            Mysql_stream_manager::get_key(src_ip, src_port);
-}
-
-void Mysql_stream::run_replay()
-{
-
-  lock.lock();
-  Mysql_packet* p = first;
-  lock.unlock();
-
-  if (!p)
-  {
-    db_close();
-    return;
-  }
-
-  for (;;)
-  {
-    Mysql_packet* tmp;
-    if (p->is_query())
-      db_query((Mysql_query_packet*)p);
-
-    lock.lock();
-
-    if (p->next)
-    {
-      tmp = p;
-      p = p->next;
-      consider_unlink_pkt(tmp, true);
-      lock.unlock();
-      continue;
-    }
-
-    lock.unlock();
-
-    std::unique_lock<std::mutex> lk(eof_lock);
-
-    while (!p->next && !reached_eof)
-    {
-      eof_cond.wait(lk);
-    }
-
-    if (reached_eof)
-    {
-      db_close();
-      return;
-    }
-
-    tmp = p;
-    p = p->next;
-    eof_lock.unlock();
-    lock.lock();
-    consider_unlink_pkt(tmp, true);
-    lock.unlock();
-    eof_lock.lock();
-  }
-}
-
 void Mysql_stream::unlink_pkt(Mysql_packet* pkt)
 {
   
@@ -143,150 +76,79 @@ void Mysql_stream::unlink_pkt(Mysql_packet* pkt)
   }
 }
 
-bool Mysql_stream::db_connect()
+void Mysql_stream::queue_replay_query(Mysql_query_packet* query_pkt, Mysql_packet* end_pkt)
 {
-  if (!(con = mysql_init(NULL)))
-  {
-    fprintf(stderr, "Error initializing stream replay connection\n");
-    return false;
-  }
-
-  try
-  {
-    setup_for_ssl(con, replay_ssl_ca, replay_ssl_cert, replay_ssl_key);
-  }
-  catch (std::runtime_error e)
-  {
-    fprintf(stderr, "Error initializing SSL: %s\n", e.what());
-    return false;
-  }
-
-  if (!mysql_real_connect(con, replay_host, replay_user, replay_pw, replay_db,
-      replay_port, NULL, 0))
-  {
-    fprintf(stderr, "Error connecting for replay: %s", mysql_error(con));
-    mysql_close(con);
-    con = 0;
-    return false;
-  }
-
-  return true;
-}
-
-void Mysql_stream::db_close()
-{
-  if (con)
-  {
-    mysql_close(con);
-    con = 0;
-  }
-}
-
-#define PACKET_OVERFLOW_LEN 0xffffff
+  if (sm->replay_engine->stopped())
+    return;
 
-bool Mysql_stream::db_query(Mysql_query_packet* query_pkt)
-{
-  MYSQL_RES* res = 0;
-  MYSQL_ROW row = 0;
-  bool ret = false;
-  const char* query = query_pkt->query();
   u_int q_len = query_pkt->query_len();
-  Mysql_packet* cur_pkt = query_pkt;
-  auto query_scheduled_ts = sm->get_scheduled_ts(query_pkt);
-  auto start = std::chrono::high_resolution_clock::now();
 
-  if (query_scheduled_ts != INVALID_TIME)
+  for (Mysql_packet* p = query_pkt; p != end_pkt; )
   {
-    auto now = std::chrono::high_resolution_clock::now();
-
-    if (now < query_scheduled_ts)
-    {
-      auto delay = query_scheduled_ts - now;
-      std::this_thread::sleep_for(delay);
-    }
+    p = p->next;
+    q_len += p->len;
   }
 
-  while (cur_pkt->len == PACKET_OVERFLOW_LEN)
-  {
-    std::unique_lock<std::mutex> lk(eof_lock);
-    while (!cur_pkt->next && !reached_eof)
-      eof_cond.wait(lk);
-
-    cur_pkt = cur_pkt->next;
-
-    if (!cur_pkt)
-      goto err;
-
-    q_len += cur_pkt->len;
-  }
+  // one copy, shared by all the clones
+  Replay_query* q = sm->replay_engine->new_query(q_len, replay.size());
+  char* dst = q->text();
+  memcpy(dst, query_pkt->query(), query_pkt->query_len());
+  dst += query_pkt->query_len();
 
-  if (cur_pkt != query_pkt)
+  for (Mysql_packet* p = query_pkt; p != end_pkt; )
   {
-    query = new char[q_len];
-    char* p = (char*)query;
-    cur_pkt = query_pkt;
-    memcpy(p, query_pkt->query(), query_pkt->query_len());
-    p += query_pkt->query_len();
-
-    while (cur_pkt->len == PACKET_OVERFLOW_LEN)
-    {
-      memcpy(p, cur_pkt->data, cur_pkt->len);
-      p += cur_pkt->len;
-      cur_pkt = cur_pkt->next;
-      assert(cur_pkt);
-    }
+    p = p->next;
+    memcpy(dst, p->data, p->len);
+    dst += p->len;
   }
 
-  cur_pkt = query_pkt;
-
-  if (!db_ensure_connected())
-    return false;
-
-  start = std::chrono::high_resolution_clock::now();
-
-  if (mysql_real_query(con, query, q_len))
-  {
-    fprintf(stderr, "Error running query: %.*s : %s\n", q_len, query, mysql_error(con));
-
-    if (sm->info->ignore_dup_key_errors && mysql_errno(con) == ER_DUP_ENTRY)
-        goto err;
+  for (size_t i = 0; i < replay.size(); i++)
+    replay[i]->push(q, sm->replay_engine->schedule(sm, query_pkt, replay[i]));
+}
 
-    if (sm->info->assert_on_query_error)
-      assert(false);
-    goto err;
-  }
+void Mysql_stream::queue_replay_stmt(u_char cmd, u_int stmt_id, const u_char* data, u_int len, Mysql_packet* pkt)
+{
+  if (sm->replay_engine->stopped())
+    return;
 
-  if ((res = mysql_use_result(con))) // otherwise the query does not have a result set, e.g update
-  {
-    while ((row = mysql_fetch_row(res)))
-    {
-    }
-  }
+  Replay_query* q = sm->replay_engine->new_query(len, replay.size());
+  q->cmd = cmd;
+  q->stmt_id = stmt_id;
+  memcpy(q->text(), data, len);
 
-  ret = true;
-err:
-  if (res)
-    mysql_free_result(res);
+  // only the executes keep to the schedule, the rest run as soon as the
+  // session gets to them
+  for (size_t i = 0; i < replay.size(); i++)
+    replay[i]->push(q, cmd == COM_STMT_EXECUTE ? sm->replay_engine->schedule(sm, pkt, replay[i]) : INVALID_TIME);
+}
 
-  auto end = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed = end - start;
-  char lookup_key[1024];
-  size_t lookup_key_len = sizeof(lookup_key) - 1;
-  sm->get_query_key(lookup_key, &lookup_key_len, query, q_len);
-  lookup_key[lookup_key_len] = 0;
-  sm->q_stats.record_query(lookup_key, elapsed.count());
+void Mysql_stream::decrypt(bool in, const u_char** data, u_int* len)
+{
+  if (!tls)
+    return;
 
-  if (query != query_pkt->query())
-    delete[] query;
+  if (!tls->feed(in, *data, *len))
+    fprintf(stderr, "Error decrypting stream %llu: %s, the rest of it is skipped\n", key, tls->error());
 
-  return ret;
+  *data = tls->data();
+  *len = tls->size();
 }
 
-
 bool Mysql_stream::append(struct timeval ts, const u_char* data, u_int len, bool in)
 {
-  std::lock_guard<std::mutex> guard(lock);
   bool created_new_packet = false;
+  Compressed_stream* z = in ? compressed_in : compressed_out;
+
+  // the packets inside the frames are put together like any others
+  if (z)
+  {
+    if (!z->feed(data, len))
+      fprintf(stderr, "Error decompressing %s data of stream %llu, the rest of it is skipped\n",
+              in ? "client" : "server", key);
+
+    data = z->data();
+    len = z->size();
+  }
 
   while (len)
   {
@@ -320,17 +182,13 @@ void Mysql_stream::cleanup()
 
   while (pkt)
   {
-    //printf("in=%d eof=%d cmd=%d len=%d\n", pkt->in, pkt->is_eof(), pkt->data[0], pkt->len);
+    //printf("in=%d eof=%d cmd=%d len=%d\n", pkt->in, pkt->data[0] == 0xfe, pkt->data[0], pkt->len);
     Mysql_packet* tmp = pkt->next;
     unlink_pkt(pkt);
     pkt = tmp;
   }
 
-  if (con)
-  {
-    mysql_close(con);
-    con = 0;
-  }
+  end_replay();
 }
 
 int Mysql_stream::create_new_packet(struct timeval ts, const u_char** data, u_int* len, bool in)
@@ -368,37 +226,21 @@ int Mysql_stream::create_new_packet(struct timeval ts, const u_char** data, u_in
   return 0;
 }
 
-void Mysql_stream::consider_unlink_pkt(Mysql_packet* pkt, bool in_replay)
-{
-  if (!sm->info->do_run)
-  {
-    unlink_pkt(pkt);
-    return;
-  }
-    
-  if (in_replay)
-  {
-    if (pkt->ref_count == 1)
-     unlink_pkt(pkt);
-  }
-}
-
 void Mysql_stream::register_stream_end(struct timeval ts)
 {
-  if (sm->replay_fd == -1)
+  if (!sm->mcap_writer)
     return;
 
   Mysql_packet p;
   p.ts = ts;
   p.len = 0;
   p.in = true;
-  if (p.replay_write(sm->replay_fd, get_key(&p)))
+  if (p.replay_write(sm->mcap_writer, get_key()))
     throw std::runtime_error("Failed to write stream end");
 }
 
 void Mysql_stream::append_packet(Mysql_packet* pkt)
 {
-  std::lock_guard<std::mutex> guard(lock);
   pkt->mark_ref();
 
   if (!first)
@@ -415,31 +257,177 @@ void Mysql_stream::append_packet(Mysql_packet* pkt)
   handle_packet_complete();
 }
 
+bool Mysql_stream::decode_response(Mysql_packet* pkt)
+{
+  return response.feed(pkt->data, pkt->len, last_query->ts_diff(pkt));
+}
+
+void Mysql_stream::start_command()
+{
+  last_query = (Mysql_query_packet*)last;
+  response.start(last_query->data[0]);
+  exec_stmt = 0;
+}
+
+void Mysql_stream::handle_stmt_command()
+{
+  Mysql_packet* pkt = last;
+  register_replay_packet(pkt);
+
+  if (pkt->data[0] == COM_STMT_PREPARE)
+  {
+    start_command(); // queued for the replay once the OK tells the id
+    return;
+  }
+
+  if (pkt->len < 5)
+  {
+    unlink_pkt(pkt);
+    return;
+  }
+
+  u_int stmt_id = uint4korr(pkt->data + 1);
+  std::unordered_map<u_int, Prepared_stmt>::iterator it = stmts.find(stmt_id);
+  Prepared_stmt* stmt = it == stmts.end() ? 0 : &it->second;
+
+  switch (pkt->data[0])
+  {
+  case COM_STMT_EXECUTE:
+    start_command();
+
+    if (!stmt || pkt->len == PACKET_OVERFLOW_LEN || !stmt->parse_execute(pkt->data + 1, pkt->len - 1, &exec_params))
+      return;
+
+    exec_stmt = stmt;
+
+    if (!replay.empty())
+    {
+      std::vector<u_char> buf;
+      stmt_encode_params(exec_params, &buf);
+      queue_replay_stmt(COM_STMT_EXECUTE, stmt_id, buf.data(), buf.size(), pkt);
+    }
+    return;
+  case COM_STMT_RESET:
+    start_command();
+
+    if (stmt)
+      stmt->reset_long_data();
+    return;
+  case COM_STMT_SEND_LONG_DATA:
+    if (stmt)
+      stmt->add_long_data(pkt->data + 5, pkt->len - 5);
+    break;
+  case COM_STMT_CLOSE:
+    if (stmt)
+    {
+      if (!replay.empty())
+        queue_replay_stmt(COM_STMT_CLOSE, stmt_id, 0, 0, pkt);
+
+      stmts.erase(it);
+    }
+    break;
+  }
+
+  // no response to these
+  unlink_pkt(pkt);
+}
+
+void Mysql_stream::register_execute()
+{
+  std::string sql;
+  stmt_interpolate(exec_stmt->text, exec_params, &sql);
+
+  Mysql_query_packet* q = (Mysql_query_packet*)new Mysql_packet(last_query->ts, sql.size() + 1, true);
+  q->data[0] = COM_QUERY;
+  memcpy(q->data + 1, sql.data(), sql.size());
+  q->cur_len = q->len;
+  q->exec_time = last_query->exec_time;
+  q->mark_ref();
+  sm->register_query(this, q, exec_stmt->text.data(), exec_stmt->text.size());
+
+  if (q->unmark_ref())
+    delete q;
+}
+
+void Mysql_stream::end_command()
+{
+  switch (last_query->data[0])
+  {
+  case COM_QUERY:
+    sm->register_query(this, last_query);
+    break;
+  case COM_STMT_PREPARE:
+    if (response.prepare_ok)
+    {
+      Prepared_stmt& stmt = stmts[response.prepare_ok_id];
+      stmt = Prepared_stmt();
+      stmt.text.assign((char*)last_query->data + 1, last_query->len - 1);
+      stmt.n_params = response.prepare_ok_params;
+
+      if (!replay.empty())
+        queue_replay_stmt(COM_STMT_PREPARE, response.prepare_ok_id, last_query->data + 1, last_query->len - 1, last_query);
+    }
+    break;
+  case COM_STMT_EXECUTE:
+    if (exec_stmt)
+    {
+      register_execute();
+      exec_stmt->reset_long_data();
+    }
+    break;
+  }
+
+  exec_stmt = 0;
+  response.prepare_ok = false;
+}
+
 void Mysql_stream::handle_packet_complete()
 {
-  eof_lock.lock();
-  eof_cond.notify_one();
-  eof_lock.unlock();
   //last->print();
   if (last->is_query())
   {
-    last_query = (Mysql_query_packet*)last;
+    start_command();
     register_replay_packet(last);
+
+    if (!replay.empty() && last->len != PACKET_OVERFLOW_LEN)
+      queue_replay_query(last_query, last);
+    return;
+  }
+
+  // prepared statements, unless a piece of a command too long for one packet
+  if (last->is_stmt_command() && !(last->prev && last->prev->in && last->prev->len == PACKET_OVERFLOW_LEN))
+  {
+    handle_stmt_command();
     return;
   }
 
+  // the last piece of a query too long for one packet
+  if (!replay.empty() && last_query && last_query->is_query() && last->in && last->len != PACKET_OVERFLOW_LEN &&
+      last->prev && last->prev->in && last->prev->len == PACKET_OVERFLOW_LEN)
+  {
+    queue_replay_query(last_query, last);
+    return;
+  }
+
+  // server packets are not kept, only the one that ends the response goes
+  // to the replay file; read back, that one is all there is and it ends
+  // the response just the same
+  if (!last->in && (!last_query || !decode_response(last)))
+  {
+    unlink_pkt(last);
+    return;
+  }
 
-  if (last_query && last->is_eof())
+  if (last_query && !last->in)
   {
     assert(last->next == 0);
     assert(last_query->next);
     register_replay_packet(last);
-    last_query->exec_time = last_query->ts_diff(last);
+    last_query->exec_time = response.resp.ttlb;
     //printf("Query: %.*s\n exec_time=%.6f s\n", last_query->query_len(), last_query->query(), last_query->exec_time);
     Mysql_packet* next_p = last_query->next;
-    sm->register_query(this, last_query);
-    
-    consider_unlink_pkt(last_query);
+    end_command();
+    unlink_pkt(last_query);
 
     for (Mysql_packet* p = next_p; p; )
     {
@@ -448,21 +436,10 @@ void Mysql_stream::handle_packet_complete()
         register_replay_packet(p);
 
       Mysql_packet* tmp = p->next;
-      
-      if (p != last)
-        unlink_pkt(p);
-      else
-        consider_unlink_pkt(p);
+      unlink_pkt(p);
       p = tmp;
     }
 
     last_query = 0;
-    return;
-  }
-
-  if (!last->in && !last->is_eof())
-  {
-    unlink_pkt(last);
   }
 }
-
@@ -2,21 +2,25 @@
 #define MYSQL_STREAM_H
 
 #include <pcap.h>
+#include <vector>
+#include <unordered_map>
 #include <mysql.h>
 #include <mysqld_error.h>
 #include "mysql_packet.h"
 #include "common.h"
-
-#include <thread>
-#include <mutex>
-#include <condition_variable>
+#include "compressed_stream.h"
+#include "tls_decrypt.h"
+#include "prepared_stmt.h"
+#include "mysql_response.h"
 
 class Mysql_stream_manager;
+class Replay_session;
 void setup_for_ssl(MYSQL* con, const char* ssl_ca, const char* ssl_cert, const char* ssl_key);
 
 class Mysql_stream
 {
 public:
+    u_longlong key; // the client end, what Mysql_stream_manager::lookup files it under
     u_short src_port;
     u_int src_ip;
     u_int dst_ip;
@@ -28,53 +32,100 @@ public:
     u_int cur_pkt_hdr_len;
 
     Mysql_stream_manager* sm;
-    MYSQL* con;
-    std::thread* th;
-    std::mutex lock;
-    std::mutex eof_lock;
-    std::condition_variable eof_cond;
-    bool reached_eof;
+    std::vector<Replay_session*> replay; // --run, a session per clone, empty otherwise
     u_int last_tcp_seq;
     bool last_tcp_seq_inited;
+    // --flow-idle-timeout and --max-flows, see Mysql_stream_manager::touch_flow()
+    u_longlong flow_id;
+    u_longlong last_seen_ms; // packet time
+    Mysql_stream* lru_prev;
+    Mysql_stream* lru_next;
+
+    Mysql_response_decoder response; // to last_query
+
+    // prepared statements by id, and what the COM_STMT_EXECUTE in last_query
+    // runs, 0 if it is not one or refers to a statement prepared before the
+    // capture started
+    std::unordered_map<u_int, Prepared_stmt> stmts;
+    Prepared_stmt* exec_stmt;
+    std::vector<Stmt_param> exec_params;
 
-    Mysql_stream(Mysql_stream_manager* sm, u_int src_ip, u_short src_port, u_int dst_ip, u_short dst_port):
-        sm(sm),src_port(src_port),src_ip(src_ip),dst_ip(dst_ip),
-        dst_port(dst_port),first(0),last(0),last_query(0),cur_pkt_hdr_len(0),con(0),th(0),reached_eof(0),
-        last_tcp_seq(0),last_tcp_seq_inited(false)
+    // CLIENT_COMPRESS: the handshake asked for it, and once the first command
+    // came, the frames of each direction; 0 while the stream is plain
+    bool compress_negotiated;
+    Compressed_stream* compressed_in;
+    Compressed_stream* compressed_out;
+
+    // CLIENT_SSL with --tls-keylog: the records of both directions from the
+    // SSLRequest on; 0 for a plain stream
+    Tls_session* tls;
+
+    Mysql_stream(Mysql_stream_manager* sm, u_longlong key, u_int src_ip, u_short src_port, u_int dst_ip,
+                 u_short dst_port):
+        key(key),sm(sm),src_port(src_port),src_ip(src_ip),dst_ip(dst_ip),
+        dst_port(dst_port),first(0),last(0),last_query(0),cur_pkt_hdr_len(0),
+        last_tcp_seq(0),last_tcp_seq_inited(false),flow_id(0),last_seen_ms(0),lru_prev(0),lru_next(0),
+        exec_stmt(0),compress_negotiated(false),compressed_in(0),compressed_out(0),
+        tls(0)
     {
     }
 
     ~Mysql_stream()
     {
         cleanup();
+        delete compressed_in;
+        delete compressed_out;
+        delete tls;
     }
 
-    bool db_ensure_connected()
+    bool is_compressed() { return compressed_in != 0; }
+    // from here on both directions come in compressed frames
+    void start_compression()
     {
-      if (!con)
-        return db_connect();
-      return true;
+        compressed_in = new Compressed_stream();
+        compressed_out = new Compressed_stream();
     }
 
+    // the client asked for TLS, what follows are its records
+    void start_tls(Tls_keylog* keys) { tls = new Tls_session(keys); }
+    // replaces data and len with the plaintext the TCP payload completes, if
+    // the stream is TLS; nothing comes out of the handshake
+    void decrypt(bool in, const u_char** data, u_int* len);
+
     u_int get_cur_pkt_len() { return pkt_hdr[0] + (((u_int)pkt_hdr[1]) << 8) + (((u_int)pkt_hdr[2]) << 16);}
 
     // returns true if the tcp packet that was appended contained the MySQL packet
-    // entirely
+    // entirely; data is what came over TCP, compressed or not
     bool append(struct timeval ts, const u_char* data, u_int len, bool in);
     void cleanup();
     int create_new_packet(struct timeval ts, const u_char** data, u_int* len, bool in);
     void handle_packet_complete();
+    // last is the start of a command that gets a response
+    void start_command();
+    // COM_STMT_*: keeps stmts up to date and queues the replay
+    void handle_stmt_command();
+    // the response to last_query is complete, records it
+    void end_command();
+    // records the COM_STMT_EXECUTE in last_query as the query it ran, with
+    // the parameters filled in, under the text of the statement
+    void register_execute();
+    // feeds a server packet to the response decoder, returns true once it is
+    // the last one of the response to last_query
+    bool decode_response(Mysql_packet* pkt);
     void start_replay();
+    // hands the stream over to the replay engine, returns right away
     void end_replay();
-    void run_replay();
+    // queues the query that starts at query_pkt and ends with end_pkt,
+    // the same packet unless the query did not fit in one
+    void queue_replay_query(Mysql_query_packet* query_pkt, Mysql_packet* end_pkt);
+    // queues a prepared statement command, data is what it carries after
+    // the statement id, see Replay_query
+    void queue_replay_stmt(u_char cmd, u_int stmt_id, const u_char* data, u_int len, Mysql_packet* pkt);
     void unlink_pkt(Mysql_packet* pkt);
-    void consider_unlink_pkt(Mysql_packet* pkt, bool in_replay=false);
     void register_replay_packet(Mysql_packet* pkt);
 
-    bool db_connect();
-    void db_close();
-    bool db_query(Mysql_query_packet* query_pkt);
-    u_longlong get_key(Mysql_packet* pkt);
+    // the client address and port, see Mysql_stream_manager::get_key()
+    u_longlong get_key() { return key; }
     void register_stream_end(struct timeval ts);
     void append_packet(Mysql_packet* pkt);
 
@@ -9,6 +9,8 @@
 
 #include "common.h"
 #include "mysql_stream_manager.h"
+#include "mcap_decoder.h"
+#include "replay_engine.h"
 
 void Mysql_stream_manager::cleanup()
 {
@@ -24,6 +26,12 @@ void Mysql_stream_manager::cleanup()
         table_stats_fp = NULL;
     }
 
+    if (diff_fp)
+    {
+        fclose(diff_fp);
+        diff_fp = NULL;
+    }
+
     for (std::multiset<Mysql_query_packet*, Mysql_query_packet_time_cmp>::iterator it = slow_queries.begin();
          it != slow_queries.end(); it++)
     {
@@ -34,12 +42,21 @@ void Mysql_stream_manager::cleanup()
 
     slow_queries.clear();
 
-    for (std::map<u_longlong, Mysql_stream*>::iterator it = lookup.begin(); it != lookup.end(); it++)
+    for (Flow_table<Mysql_stream*>::iterator it = lookup.begin(); it != lookup.end(); it++)
     {
         delete (*it).second;
     }
 
     lookup.clear();
+    lru_head = lru_tail = NULL;
+
+    if (!is_shard)
+    {
+        delete interval_stats; // writes out the open windows
+        interval_stats = NULL;
+        delete replay_engine; // waits for the sessions still replaying
+        replay_engine = NULL;
+    }
 
     if (explain_con)
     {
@@ -47,16 +64,27 @@ void Mysql_stream_manager::cleanup()
         explain_con = 0;
     }
 
-    if (replay_fd >= 0)
+    if (mcap_writer)
     {
-      close(replay_fd);
-      replay_fd = -1;
+      // the index goes at the end, a file that does not get it still reads
+      if (mcap_writer->close())
+        fprintf(stderr, "Error finishing the replay file\n");
+
+      delete mcap_writer;
+      mcap_writer = NULL;
     }
 }
 
 void Mysql_stream_manager::init_replay()
 {
+    // the engine warms up its connections first, t=0 comes after that
+    if (info->do_run && !replay_engine)
+        replay_engine = new Replay_engine(this, info->n_replay_threads);
+
     replay_start_ts = std::chrono::high_resolution_clock::now();
+
+    if (replay_engine)
+        replay_engine->start(replay_start_ts);
 }
 
 u_longlong Mysql_stream_manager::get_ellapsed_us()
@@ -198,11 +226,31 @@ static bool could_be_query(const u_char* data, u_int len)
     );
 }
 
+// the first packet of a COM_STMT_PREPARE to COM_STMT_RESET, sequence 0
+static bool could_be_stmt_command(const u_char* data, u_int len)
+{
+    return len > 4 && data[3] == 0 && data[4] >= COM_STMT_PREPARE && data[4] <= COM_STMT_RESET;
+}
+
+// the capabilities of the client's reply to the server greeting, sequence 1,
+// or 2 when it comes after the SSLRequest; false for any other packet
+static bool client_caps(const u_char* data, u_int len, u_char seq, u_int* caps)
+{
+    if (len < 4 + 32 || data[3] != seq)
+        return false;
+
+    *caps = uint4korr(data + 4);
+    return *caps & CLIENT_PROTOCOL_41;
+}
+
 bool Mysql_stream_manager::process_pkt(const struct pcap_pkthdr* header, const u_char* packet)
 {
     int tcp_header_len;
     const struct sniff_tcp* tcp_header;
 
+    if (interval_stats)
+        advance_clock(header->ts);
+
     const struct sniff_ip* ip_header = get_ip_header(info, packet);
     if (header->caplen < (char*)ip_header + sizeof(*ip_header) - (char*)packet ||
         ip_header->ip_p != 6 /* tcp */)
@@ -264,36 +312,47 @@ bool Mysql_stream_manager::process_pkt(const struct pcap_pkthdr* header, const u
 
 
     Mysql_stream *s;
-    std::map<u_longlong, Mysql_stream*>::iterator it;
+    Mysql_stream** sp;
+    u_longlong now_ms = (u_longlong)header->ts.tv_sec * 1000 + header->ts.tv_usec / 1000;
 
-    if ((it = lookup.find(key)) == lookup.end())
+    if (info->flow_idle_timeout > 0)
+        evict_idle_flows(header->ts);
+
+    if (!(sp = lookup.find(key)))
     {
         if (!(tcp_header->th_flags & TH_SYN) && !in && !could_be_query(data, len))
             return false; // igore streams if we join in the middle of a conversation
-        s = new Mysql_stream(this, ip_header->ip_src.s_addr, tcp_header->th_sport,
+
+        if (max_flows && lookup.size() >= max_flows)
+            evict_lru_flow(header->ts);
+
+        s = new Mysql_stream(this, key, ip_header->ip_src.s_addr, tcp_header->th_sport,
                              ip_header->ip_dst.s_addr, tcp_header->th_dport);
-        lookup[key] = s;
+        lookup.insert(key, s);
+        s->flow_id = ++next_flow_id;
+
+        if (info->flow_idle_timeout > 0)
+        {
+            Flow_timer t = {key, s->flow_id};
+            idle_timers.add(now_ms + (u_longlong)(info->flow_idle_timeout * 1000), t);
+        }
 
-        if (info->do_run)
+        if (replay_engine)
             s->start_replay();
     }
     else
     {
-        s = it->second;
-        // TODO: this throttles the benchmark, figure out how to make it better
+        s = *sp;
+
         if (tcp_header->th_flags & (TH_RST | TH_FIN))
         {
-            s->register_stream_end(header->ts);
-
-            if (info->do_run)
-                s->end_replay();
-
-            lookup.erase(it);
-            delete s;
+            end_stream(key, s, header->ts);
             return true;
         }
     }
 
+    touch_flow(s, now_ms);
+
     if (!len)
         return true;
 
@@ -310,8 +369,31 @@ bool Mysql_stream_manager::process_pkt(const struct pcap_pkthdr* header, const u
     if (!s->register_tcp_seq(tcp_header->th_seq))
         return false;
 
-    if (in && (s->starting_packet() &&  !could_be_query(data, len))) // crude hack to filter out client authentication packets
+    // from here on a TLS stream is what its records decrypt to
+    s->decrypt(in, &data, &len);
+
+    // the first command after a handshake that asked for compression, a
+    // frame with sequence 0, the authentication packets carry on from 1
+    if (in && s->compress_negotiated && !s->is_compressed() && len > 4 && data[3] == 0)
+        s->start_compression();
+
+    if (in && len && !s->is_compressed() && (s->starting_packet() &&  !could_be_query(data, len) &&
+               !could_be_stmt_command(data, len))) // crude hack to filter out client authentication packets
+    {
+        u_int caps;
+
+        // with CLIENT_SSL and no TLS yet it is only the SSLRequest, the
+        // real reply comes in the first records
+        if (client_caps(data, len, s->tls ? 2 : 1, &caps))
+        {
+            if (!(caps & CLIENT_SSL) || s->tls)
+                s->compress_negotiated = caps & CLIENT_COMPRESS;
+            else if (info->tls_keylog)
+                s->start_tls(info->tls_keylog);
+        }
+
         return false;
+    }
 
     s->append(header->ts, data, len, in);
 
@@ -323,6 +405,64 @@ bool Mysql_stream_manager::process_pkt(const struct pcap_pkthdr* header, const u
     return true; // for now
 }
 
+bool Mysql_stream_manager::get_flow_info(const struct pcap_pkthdr* header, const u_char* packet, Flow_info* fi)
+{
+    const struct sniff_ip* ip_header = get_ip_header(info, packet);
+    if (header->caplen < (char*)ip_header + sizeof(*ip_header) - (char*)packet ||
+        ip_header->ip_p != 6 /* tcp */)
+            return false;
+
+    u_short ip_header_len = ((*(char*)ip_header) & 0x0F) * 4;
+    fi->ip_id = ip_header->ip_id;
+    fi->is_fragment = ip_header->ip_off & IP_MF; // same test as process_pkt()
+    fi->has_key = false;
+
+    // only the first fragment carries the TCP header
+    if ((ntohs(ip_header->ip_off) & IP_OFFMASK) ||
+        header->caplen < info->ethernet_header_size + ip_header_len + sizeof(struct sniff_tcp))
+        return true;
+
+    const struct sniff_tcp* tcp_header = (const struct sniff_tcp*)((const u_char*)ip_header + ip_header_len);
+
+    // fragments are queued before the port is looked at
+    if (ntohs(tcp_header->th_sport) != _mysql_port && ntohs(tcp_header->th_dport) != _mysql_port)
+        return fi->is_fragment;
+
+    bool in = (ntohl(ip_header->ip_dst.s_addr) == ntohl(mysql_ip) &&
+        ntohs(tcp_header->th_dport) == _mysql_port);
+
+    fi->key = in ? get_key(ip_header->ip_src.s_addr, tcp_header->th_sport) :
+        get_key(ip_header->ip_dst.s_addr, tcp_header->th_dport);
+    fi->has_key = true;
+    return true;
+}
+
+void Mysql_stream_manager::merge_stats(Mysql_stream_manager& shard)
+{
+    q_stats.merge(shard.q_stats);
+    orig_stats.merge(shard.orig_stats);
+    table_stats.merge(shard.table_stats);
+
+    for (std::multiset<Mysql_query_packet*, Mysql_query_packet_time_cmp>::iterator it = shard.slow_queries.begin();
+         it != shard.slow_queries.end(); it++)
+    {
+        slow_queries.insert(*it);
+    }
+
+    shard.slow_queries.clear();
+
+    while (slow_queries.size() > info->n_slow_queries)
+    {
+        std::multiset<Mysql_query_packet*>::iterator it = --slow_queries.end();
+        Mysql_query_packet* p = *it;
+        slow_queries.erase(it);
+
+        // the stream is gone by now, we may be holding the last reference
+        if (p->unmark_ref())
+            delete p;
+    }
+}
+
 std::chrono::time_point<std::chrono::high_resolution_clock> Mysql_stream_manager::get_scheduled_ts(Mysql_packet* p)
 {
     if (replay_speed == 0.0)
@@ -334,28 +474,94 @@ std::chrono::time_point<std::chrono::high_resolution_clock> Mysql_stream_manager
 }
 
 // returns false on success, true on error
-bool Mysql_stream_manager::write_to_replay_file(const char* data, size_t len)
+bool Mysql_stream_manager::init_replay_file(const char* fname)
 {
-  return write(replay_fd, data, len) != len;
+  mcap_writer = new Mcap_writer();
+  return mcap_writer->open(fname);
 }
 
+void Mysql_stream_manager::end_stream(u_longlong key, Mysql_stream* s, struct timeval ts)
+{
+    s->register_stream_end(ts);
+    s->end_replay(); // the engine drains it on its own
+    lru_unlink(s);
+    lookup.erase(key);
+    delete s;
+}
 
-bool Mysql_stream_manager::init_replay_file(const char* fname)
+void Mysql_stream_manager::lru_unlink(Mysql_stream* s)
 {
-  if ((replay_fd = open(fname, O_WRONLY|O_CREAT, 0660)) < 0)
-    return true;
+    if (!max_flows)
+        return;
 
-  in_replay_write = true;
+    if (s->lru_prev)
+        s->lru_prev->lru_next = s->lru_next;
+    else if (lru_head == s)
+        lru_head = s->lru_next;
 
-  char ver_buf[2];
-  int2store(ver_buf, REPLAY_FILE_VER);
+    if (s->lru_next)
+        s->lru_next->lru_prev = s->lru_prev;
+    else if (lru_tail == s)
+        lru_tail = s->lru_prev;
 
-  if (write_to_replay_file(REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LEN) ||
-      write_to_replay_file(ver_buf, sizeof(ver_buf))
-  )
-    return true;
+    s->lru_prev = s->lru_next = NULL;
+}
 
-  return false;
+void Mysql_stream_manager::touch_flow(Mysql_stream* s, u_longlong now_ms)
+{
+    s->last_seen_ms = now_ms;
+
+    if (!max_flows || lru_head == s)
+        return;
+
+    lru_unlink(s);
+    s->lru_next = lru_head;
+
+    if (lru_head)
+        lru_head->lru_prev = s;
+
+    lru_head = s;
+
+    if (!lru_tail)
+        lru_tail = s;
+}
+
+void Mysql_stream_manager::evict_idle_flows(const struct timeval& ts)
+{
+    u_longlong now_ms = (u_longlong)ts.tv_sec * 1000 + ts.tv_usec / 1000;
+    u_longlong timeout_ms = (u_longlong)(info->flow_idle_timeout * 1000);
+    expired_timers.clear();
+    idle_timers.advance(now_ms, &expired_timers);
+
+    for (size_t i = 0; i < expired_timers.size(); i++)
+    {
+        const Flow_timer& t = expired_timers[i];
+        Mysql_stream** sp = lookup.find(t.key);
+
+        // ended, or ended and the key taken up by a new stream with a timer of its own
+        if (!sp || (*sp)->flow_id != t.flow_id)
+            continue;
+
+        if ((*sp)->last_seen_ms + timeout_ms > now_ms)
+        {
+            idle_timers.add((*sp)->last_seen_ms + timeout_ms, t);
+            continue;
+        }
+
+        end_stream(t.key, *sp, ts);
+        perf_stats.flows_idle_evicted.fetch_add(1);
+    }
+}
+
+void Mysql_stream_manager::evict_lru_flow(const struct timeval& ts)
+{
+    Mysql_stream* s = lru_tail;
+
+    if (!s)
+        return;
+
+    end_stream(s->key, s, ts);
+    perf_stats.flows_lru_evicted.fetch_add(1);
 }
 
 Mysql_stream* Mysql_stream_manager::find_or_make_stream(u_longlong key, Mysql_packet* pkt)
@@ -364,29 +570,28 @@ Mysql_stream* Mysql_stream_manager::find_or_make_stream(u_longlong key, Mysql_pa
   u_int src_port = key & ((1LL << 32) - 1);
 
   Mysql_stream* s;
-  std::map<u_longlong, Mysql_stream*>::iterator it;
+  Mysql_stream** sp;
 
-  if ((it = lookup.find(key)) == lookup.end())
+  if (!(sp = lookup.find(key)))
   {
     if (pkt->len == 0)
       return NULL; // found end of stream on an inactive  stream
 
-    s = new Mysql_stream(this, src_ip, src_port,
+    s = new Mysql_stream(this, key, src_ip, src_port,
                           mysql_ip, _mysql_port);
-    lookup[key] = s;
+    lookup.insert(key, s);
 
-    if (info->do_run)
+    if (replay_engine)
         s->start_replay();
   }
   else
   {
-    s = it->second;
-    // TODO: this throttles the benchmark, figure out how to make it better
+    s = *sp;
+
     if (pkt->len == 0)
     {
-        if (info->do_run)
-            s->end_replay();
-        lookup.erase(it);
+        s->end_replay();
+        lookup.erase(key);
         delete s;
         return NULL;
     }
@@ -395,45 +600,82 @@ Mysql_stream* Mysql_stream_manager::find_or_make_stream(u_longlong key, Mysql_pa
   return s;
 }
 
+void Mysql_stream_manager::process_replay_packet(u_longlong key, Mysql_packet* pkt)
+{
+  throttle_replay();
+  Mysql_stream* s = find_or_make_stream(key, pkt);
+
+  if (!s)
+  {
+    delete pkt;
+    return;
+  }
+
+  s->append_packet(pkt);
+}
+
 void Mysql_stream_manager::process_replay_file(const char* fname)
 {
-  if ((replay_fd = open(fname, O_RDONLY)) < 0)
-    throw std::runtime_error("Error opening replay file for reading");
+  Mcap_reader reader;
+  reader.open(fname); // throws on a file it cannot read
+  reader.set_time_range(info->start_time_us, info->end_time_us);
+  Time_Point start = Clock::now();
+  u_longlong comp_bytes = 0, raw_bytes = 0;
+  u_int n_threads = info->n_decode_threads;
 
-  char magic[REPLAY_FILE_MAGIC_LEN];
+  if (!n_threads)
+    n_threads = std::max(1U, std::min(4U, std::thread::hardware_concurrency()));
 
-  if (read(replay_fd, magic, REPLAY_FILE_MAGIC_LEN) != REPLAY_FILE_MAGIC_LEN)
-    throw std::runtime_error("Failed to read the magic number in the replay file");
+  if (!reader.get_blocks().empty())
+  {
+    // indexed, the blocks in the time range are decoded ahead on the side
+    Mcap_decoder decoder(&reader, n_threads);
+    Mcap_decoded_block* b;
 
-  if (memcmp(magic, REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LEN) != 0)
-    throw std::runtime_error("Bad magic number in the replay file");
+    while ((b = decoder.next()))
+    {
+      for (size_t i = 0; i < b->pkts.size(); i++)
+        process_replay_packet(b->keys[i], b->pkts[i]);
 
-  char ver_buf[2];
+      comp_bytes += b->comp_bytes;
+      raw_bytes += b->raw_bytes;
+      delete b;
+    }
 
-  if (read(replay_fd, ver_buf, sizeof(ver_buf)) != sizeof(ver_buf))
-    throw std::runtime_error("Failed to read the replay file format version number");
+    print_decode_stats(start, comp_bytes, raw_bytes, decoder.get_n_blocks(), reader.get_blocks().size(), n_threads);
+    return;
+  }
 
   while (1)
   {
     Mysql_packet* pkt = new Mysql_packet(); // throws on OOM
     u_longlong key;
 
-    if (pkt->replay_read(replay_fd, &key))
+    if (pkt->replay_read(&reader, &key))
     {
       delete pkt;
-      return; // EOF or truncated file
+      break; // EOF or truncated file
     }
 
-    Mysql_stream* s = find_or_make_stream(key, pkt);
+    process_replay_packet(key, pkt);
+  }
 
-    if (!s)
-    {
-      delete pkt;
-      continue;
-    }
+  print_decode_stats(start, reader.get_bytes_read(), reader.get_bytes_decoded(), 0, 0, 1);
+}
 
-    s->append_packet(pkt);
-  }
+void Mysql_stream_manager::print_decode_stats(Time_Point start, u_longlong comp_bytes, u_longlong raw_bytes,
+                                              u_int n_blocks, u_int n_indexed, u_int n_threads)
+{
+  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+  double mb = raw_bytes / (1024.0 * 1024.0);
+
+  fprintf(stderr, "Replay file decode: %.1f MB from %.1f MB read in %.2fs, %.1f MB/s", mb,
+          comp_bytes / (1024.0 * 1024.0), secs, secs > 0 ? mb / secs : 0.0);
+
+  if (n_indexed)
+    fprintf(stderr, ", %u of %u blocks on %u thread%s\n", n_blocks, n_indexed, n_threads, n_threads > 1 ? "s" : "");
+  else
+    fprintf(stderr, ", read front to back, no index\n");
 }
 
 u_longlong Mysql_stream_manager::get_packet_ellapsed_us(Mysql_packet* p)
@@ -446,7 +688,8 @@ u_longlong Mysql_stream_manager::get_packet_ellapsed_us(Mysql_packet* p)
     return d_s * 1000000 + d_us;
 }
 
-void Mysql_stream_manager::register_query(Mysql_stream* s, Mysql_query_packet* query)
+void Mysql_stream_manager::register_query(Mysql_stream* s, Mysql_query_packet* query, const char* key_text,
+                                          size_t key_text_len)
 {
     query->mark_ref();
     // TODO: if we are doing a replay, we should fill up the slow query list based on replay, not the original
@@ -457,20 +700,30 @@ void Mysql_stream_manager::register_query(Mysql_stream* s, Mysql_query_packet* q
         std::multiset<Mysql_query_packet*>::iterator it = --slow_queries.end();
         Mysql_query_packet* p = *it;
         slow_queries.erase(it);
-        s->consider_unlink_pkt(p);
+        s->unlink_pkt(p);
     }
 
-    if (!info->do_run)
-    {
-        char lookup_key[1024];
-        size_t lookup_key_len = sizeof(lookup_key) - 1;
-        get_query_key(lookup_key, &lookup_key_len, query->query(), query->query_len());
-        lookup_key[lookup_key_len] = 0;
-        q_stats.record_query(lookup_key, query->exec_time);
+    char key_buf[1024];
+    size_t key_len = sizeof(key_buf) - 1;
+    const char* key;
+    u_longlong digest = key_text ? get_query_key(key_buf, &key_len, &key, key_text, key_text_len) :
+        get_query_key(key_buf, &key_len, &key, query->query(), query->query_len());
 
-        if (table_stats_fp)
-            table_stats.update_from_query(query->query(), query->query_len(), query->exec_time);
+    // the replay fills q_stats, the capture is kept to compare it with
+    if (info->do_run)
+    {
+        orig_stats.record_query(digest, key, key_len, query->exec_time, &s->response.resp);
+        return;
     }
+
+    q_stats.record_query(digest, key, key_len, query->exec_time, &s->response.resp);
+
+    if (interval_stats)
+        interval_stats->record_query(interval_stats->window_of(query->ts, query->exec_time), digest, key, key_len,
+                                     query->exec_time);
+
+    if (info->table_stats_file)
+        table_stats.update_from_query(query->query(), query->query_len(), query->exec_time, s->response.resp.status_flags);
 }
 
 void Mysql_stream_manager::print_slow_queries()
@@ -495,30 +748,33 @@ void Mysql_stream_manager::print_slow_queries()
     }
 }
 
-void Mysql_stream_manager::get_query_key(char* key_buf, size_t* key_buf_len, const char* query, size_t q_len)
+u_longlong Mysql_stream_manager::get_query_key(char* key_buf, size_t* key_len, const char** key,
+                                               const char* query, size_t q_len)
 {
-    for (size_t i = 0; i < info->query_patterns.size(); i++)
+    if (info->query_patterns.apply(query, q_len, key_buf, key_len))
     {
-        const char* key = info->query_patterns[i]->apply(query, q_len, key_buf, key_buf_len);
-        if (key)
-        {
-            key_buf[*key_buf_len] = 0;
-            return;
-        }
+        *key = key_buf;
+        return query_digest(key_buf, *key_len);
     }
 
-    *key_buf_len = 0;
-    *key_buf = 0;
+    if (info->fingerprint)
+    {
+        static thread_local Query_fingerprint fingerprint;
+        u_longlong digest = fingerprint.compute(query, q_len);
+        *key = fingerprint.text();
+        *key_len = fingerprint.text_len();
+        return digest;
+    }
+
+    *key = "";
+    *key_len = 0;
+    return query_digest("", 0);
 }
 
-void Query_stats::finalize()
+static bool pattern_key_cmp(const Query_pattern_stats* s1, const Query_pattern_stats* s2)
 {
-    for (std::map<std::string, Query_pattern_stats*>::iterator it = lookup.begin();
-            it != lookup.end(); it++)
-    {
-        it->second->finalize();
-    }
- }
+    return s1->key < s2->key;
+}
 
 void Query_stats::print(FILE* csv_fp)
 {
@@ -526,28 +782,148 @@ void Query_stats::print(FILE* csv_fp)
 
     if (csv_fp)
         fputs("Query Pattern ID, N, Minimum execution time, Maximum Execution Time, Average Execution Time,"
-        "Median Execution Time, 95pct Execution Time,Total Execution Time\n", csv_fp);
+        "Median Execution Time, 95pct Execution Time,Total Execution Time,99pct Execution Time,"
+        "99.9pct Execution Time,Rows Returned,Average Rows,Maximum Rows,Bytes Returned,Average Bytes,"
+        "Maximum Bytes,Average Time To First Byte,95pct Time To First Byte,No Index Used,No Good Index Used,"
+        "Flagged Slow,Warnings\n", csv_fp);
+
+    std::vector<Query_pattern_stats*> sorted;
 
-    for (std::map<std::string, Query_pattern_stats*>::iterator it = lookup.begin();
+    for (std::unordered_map<u_longlong, Query_pattern_stats*>::iterator it = lookup.begin();
             it != lookup.end(); it++)
     {
-        Query_pattern_stats* s = it->second;
-        std::cout << "Query Pattern ID: " << it->first << " N: " << s->n_queries << " min: "
+        sorted.push_back(it->second);
+    }
+
+    std::sort(sorted.begin(), sorted.end(), pattern_key_cmp);
+
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        Query_pattern_stats* s = sorted[i];
+        std::cout << "Query Pattern ID: " << s->key << " N: " << s->n_queries << " min: "
             << s->min_exec_time << "s max: " << s->max_exec_time << "s" <<
-            " avg: " << s->total_exec_time / s->n_queries << "s total time " << s->total_exec_time << "s" << std::endl;
+            " avg: " << s->total_exec_time / s->n_queries << "s p50: " << s->get_pct_exec_time(50) <<
+            "s p95: " << s->get_pct_exec_time(95) << "s p99: " << s->get_pct_exec_time(99) <<
+            "s p99.9: " << s->get_pct_exec_time(99.9) << "s total time " << s->total_exec_time << "s";
+
+        size_t n_resp = std::max(s->n_responses, (size_t)1);
+
+        if (s->n_responses)
+            std::cout << " rows avg: " << (double)s->total_rows / n_resp << " max: " << s->max_rows <<
+                " bytes avg: " << (double)s->total_bytes / n_resp << " max: " << s->max_bytes <<
+                " ttfb avg: " << s->total_ttfb / n_resp << "s p95: " << s->ttfb_hist.percentile(95) << "s";
+
+        if (s->n_no_index || s->n_no_good_index || s->n_slow || s->total_warnings)
+            std::cout << " no index: " << s->n_no_index << " no good index: " << s->n_no_good_index <<
+                " slow: " << s->n_slow << " warnings: " << s->total_warnings;
+
+        std::cout << std::endl;
 
-        // TODO: escape quotes
         if (csv_fp)
-            fprintf(csv_fp, "\"%s\",%lu,%f,%f,%f,%f,%f,%f\n", it->first.c_str(), s->n_queries, s->min_exec_time,
+        {
+            write_csv_string(csv_fp, s->key);
+            fprintf(csv_fp, ",%lu,%f,%f,%f,%f,%f,%f,%f,%f,%llu,%f,%llu,%llu,%f,%llu,%f,%f,%zu,%zu,%zu,%llu\n",
+                    s->n_queries, s->min_exec_time,
                     s->max_exec_time,
-                    s->total_exec_time / s->n_queries, s->get_median_exec_time(),
+                    s->total_exec_time / s->n_queries, s->get_pct_exec_time(50),
                     s->get_pct_exec_time(95),
-                    s->total_exec_time);
+                    s->total_exec_time, s->get_pct_exec_time(99), s->get_pct_exec_time(99.9),
+                    s->total_rows, (double)s->total_rows / n_resp, s->max_rows,
+                    s->total_bytes, (double)s->total_bytes / n_resp, s->max_bytes,
+                    s->total_ttfb / n_resp, s->ttfb_hist.percentile(95),
+                    s->n_no_index, s->n_no_good_index, s->n_slow, s->total_warnings);
+        }
     }
+}
 
+struct Pattern_diff
+{
+    Query_pattern_stats* orig;
+    Query_pattern_stats* replay;
+    double regression; // seconds the captured queries would lose at the replay's average
+};
+
+static bool regression_cmp(const Pattern_diff& d1, const Pattern_diff& d2)
+{
+    return d1.regression > d2.regression;
 }
 
-void Query_pattern_stats::record_query(double exec_time)
+void Query_stats::print_diff(Query_stats& orig, FILE* csv_fp)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::lock_guard<std::mutex> orig_guard(orig.lock);
+    std::vector<Pattern_diff> diffs;
+    size_t n_unmatched = 0;
+
+    // weighing the change in average time by the captured count ranks a
+    // common query slowing down a little above a rare one slowing down a
+    // lot, and does not depend on how many times the replay ran a pattern
+    for (std::unordered_map<u_longlong, Query_pattern_stats*>::iterator it = lookup.begin();
+         it != lookup.end(); it++)
+    {
+        std::unordered_map<u_longlong, Query_pattern_stats*>::iterator orig_it = orig.lookup.find(it->first);
+
+        if (orig_it == orig.lookup.end())
+        {
+            n_unmatched++;
+            continue;
+        }
+
+        Pattern_diff d;
+        d.orig = orig_it->second;
+        d.replay = it->second;
+        d.regression = (d.replay->total_exec_time / d.replay->n_queries -
+                        d.orig->total_exec_time / d.orig->n_queries) * d.orig->n_queries;
+        diffs.push_back(d);
+    }
+
+    if (diffs.empty())
+        return;
+
+    std::sort(diffs.begin(), diffs.end(), regression_cmp);
+    printf("Replay vs capture, worst regression first:\n");
+
+    if (csv_fp)
+        fputs("Query Pattern ID,Captured N,Replayed N,Captured Median,Replayed Median,Median Delta,"
+              "Captured 95pct,Replayed 95pct,95pct Delta,Captured 99pct,Replayed 99pct,99pct Delta,"
+              "Captured Total,Replayed Total,Total Delta,Regression\n", csv_fp);
+
+    static const double pcts[] = {50, 95, 99};
+
+    for (size_t i = 0; i < diffs.size(); i++)
+    {
+        Query_pattern_stats* o = diffs[i].orig;
+        Query_pattern_stats* r = diffs[i].replay;
+        printf("Query Pattern ID: %s N: %zu/%zu", o->key.c_str(), o->n_queries, r->n_queries);
+
+        if (csv_fp)
+        {
+            write_csv_string(csv_fp, o->key);
+            fprintf(csv_fp, ",%zu,%zu", o->n_queries, r->n_queries);
+        }
+
+        for (size_t j = 0; j < sizeof(pcts) / sizeof(pcts[0]); j++)
+        {
+            double before = o->get_pct_exec_time(pcts[j]), after = r->get_pct_exec_time(pcts[j]);
+            printf(" p%g: %gs -> %gs (%+gs)", pcts[j], before, after, after - before);
+
+            if (csv_fp)
+                fprintf(csv_fp, ",%f,%f,%f", before, after, after - before);
+        }
+
+        printf(" total: %gs -> %gs (%+gs) regression: %+gs\n", o->total_exec_time, r->total_exec_time,
+               r->total_exec_time - o->total_exec_time, diffs[i].regression);
+
+        if (csv_fp)
+            fprintf(csv_fp, ",%f,%f,%f,%f\n", o->total_exec_time, r->total_exec_time,
+                    r->total_exec_time - o->total_exec_time, diffs[i].regression);
+    }
+
+    if (n_unmatched)
+        printf("%zu replayed patterns have no captured timings\n", n_unmatched);
+}
+
+void Query_pattern_stats::record_query(double exec_time, const Mysql_response* resp)
 {
     n_queries++;
     total_exec_time += exec_time;
@@ -556,31 +932,79 @@ void Query_pattern_stats::record_query(double exec_time)
     if (exec_time > max_exec_time)
         max_exec_time = exec_time;
 
-    exec_times.push_back(exec_time);
+    exec_hist.record(exec_time);
+
+    if (!resp)
+        return;
+
+    n_responses++;
+    total_rows += resp->rows;
+    total_bytes += resp->bytes;
+    total_ttfb += resp->ttfb;
+    if (resp->rows > max_rows)
+        max_rows = resp->rows;
+    if (resp->bytes > max_bytes)
+        max_bytes = resp->bytes;
+
+    ttfb_hist.record(resp->ttfb);
+
+    if (resp->status_flags & SERVER_QUERY_NO_INDEX_USED)
+        n_no_index++;
+    if (resp->status_flags & SERVER_QUERY_NO_GOOD_INDEX_USED)
+        n_no_good_index++;
+    if (resp->status_flags & SERVER_QUERY_WAS_SLOW)
+        n_slow++;
+
+    total_warnings += resp->warnings;
 }
 
-void Query_pattern_stats::finalize()
+void Query_pattern_stats::merge(const Query_pattern_stats& other)
 {
-    std::sort(exec_times.begin(), exec_times.end());
+    n_queries += other.n_queries;
+    total_exec_time += other.total_exec_time;
+    if (other.min_exec_time < min_exec_time)
+        min_exec_time = other.min_exec_time;
+    if (other.max_exec_time > max_exec_time)
+        max_exec_time = other.max_exec_time;
+
+    exec_hist.merge(other.exec_hist);
+
+    n_responses += other.n_responses;
+    total_rows += other.total_rows;
+    total_bytes += other.total_bytes;
+    total_ttfb += other.total_ttfb;
+    if (other.max_rows > max_rows)
+        max_rows = other.max_rows;
+    if (other.max_bytes > max_bytes)
+        max_bytes = other.max_bytes;
+
+    ttfb_hist.merge(other.ttfb_hist);
+
+    n_no_index += other.n_no_index;
+    n_no_good_index += other.n_no_good_index;
+    n_slow += other.n_slow;
+    total_warnings += other.total_warnings;
 }
 
 Query_stats::~Query_stats()
 {
-    for (std::map<std::string, Query_pattern_stats*>::iterator it = lookup.begin();
+    for (std::unordered_map<u_longlong, Query_pattern_stats*>::iterator it = lookup.begin();
          it != lookup.end(); it++)
     {
         delete it->second;
     }
 }
 
-void Query_stats::record_query(const char* lookup_key, double exec_time)
+void Query_stats::record_query(u_longlong digest, const char* key, size_t key_len, double exec_time,
+                               const Mysql_response* resp)
 {
     std::lock_guard<std::mutex> guard(lock);
-    std::map<std::string, Query_pattern_stats*>::iterator it;
+    std::unordered_map<u_longlong, Query_pattern_stats*>::iterator it;
     Query_pattern_stats* s;
-    if ((it = lookup.find(lookup_key)) == lookup.end())
+    if ((it = lookup.find(digest)) == lookup.end())
     {
-        s = lookup[lookup_key] = new Query_pattern_stats();
+        s = lookup[digest] = new Query_pattern_stats();
+        s->key.assign(key, key_len);
     }
     else
     {
@@ -589,11 +1013,38 @@ void Query_stats::record_query(const char* lookup_key, double exec_time)
 
     n_queries++;
     total_exec_time += exec_time;
-    s->record_query(exec_time);
+    s->record_query(exec_time, resp);
+}
+
+void Query_stats::merge(Query_stats& other)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::lock_guard<std::mutex> other_guard(other.lock);
+
+    for (std::unordered_map<u_longlong, Query_pattern_stats*>::iterator it = other.lookup.begin();
+         it != other.lookup.end(); it++)
+    {
+        std::unordered_map<u_longlong, Query_pattern_stats*>::iterator my_it = lookup.find(it->first);
+
+        if (my_it == lookup.end())
+            lookup[it->first] = new Query_pattern_stats(*it->second);
+        else
+            my_it->second->merge(*it->second);
+    }
+
+    n_queries += other.n_queries;
+    total_exec_time += other.total_exec_time;
 }
 
 void Mysql_stream_manager::init()
 {
+    // the --threads workers split the cap, none of them sees the others' streams
+    if (info->max_flows)
+        max_flows = is_shard ? std::max(1U, info->max_flows / info->n_threads) : info->max_flows;
+
+    if (is_shard)
+        return;
+
     if (info->csv_file)
     {
         csv_fp = fopen(info->csv_file, "w");
@@ -607,20 +1058,54 @@ void Mysql_stream_manager::init()
         if (!table_stats_fp)
             throw std::runtime_error("Could not open the table stats file");
     }
+
+    if (info->diff_csv_file)
+    {
+        diff_fp = fopen(info->diff_csv_file, "w");
+        if (!diff_fp)
+            throw std::runtime_error("Could not open the diff csv file");
+    }
+
+    if (info->interval > 0)
+    {
+        interval_stats = new Interval_stats(info->interval, info->interval_file, info->interval_json);
+
+        // with --threads the shards are the sources, see Mysql_shard_pool
+        if (info->n_threads <= 1)
+            interval_source = interval_stats->add_source();
+    }
+}
+
+void Mysql_stream_manager::advance_clock(const struct timeval& ts)
+{
+    long long window = interval_stats->window_of(ts);
+
+    if (window != cur_window && interval_source >= 0)
+    {
+        interval_stats->advance(interval_source, window);
+        cur_window = window;
+    }
 }
 
 void Mysql_stream_manager::finish_replay()
 {
-    for (std::map<u_longlong, Mysql_stream*>::iterator it = lookup.begin(); it != lookup.end(); it++)
+    for (Flow_table<Mysql_stream*>::iterator it = lookup.begin(); it != lookup.end(); it++)
     {
         Mysql_stream* s = it->second;
         s->end_replay();
     }
+
+    // the shards share the primary's engine, it waits for theirs too
+    if (replay_engine && !is_shard)
+    {
+        replay_engine->finish();
+        replay_engine->print_replay_stats(stdout);
+        q_stats.print_diff(orig_stats, diff_fp);
+    }
 }
 
 void Mysql_stream_manager::print_query_stats()
 {
-    q_stats.finalize();
     q_stats.print(csv_fp);
 }
 
@@ -691,7 +1176,51 @@ void param_info::add_query_pattern(const char* arg)
     parse_re_part(replace, &arg, arg_end);
 
     Query_pattern* qp = new Query_pattern(search, replace);
-    query_patterns.push_back(qp);
+    query_patterns.add(qp);
     //printf("search: %s replace: %s\n", search, replace);
 }
 
+void param_info::load_query_pattern_file(const char* fname)
+{
+    FILE* fp = fopen(fname, "r");
+
+    if (!fp)
+        throw std::runtime_error(std::string("Could not open query pattern file ") + fname);
+
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    u_int line_no = 0;
+
+    while ((len = getline(&line, &line_size, fp)) >= 0)
+    {
+        line_no++;
+
+        while (len && isspace((u_char)line[len - 1]))
+            line[--len] = 0;
+
+        const char* p = line;
+
+        while (isspace((u_char)*p))
+            p++;
+
+        if (!*p || *p == '#')
+            continue;
+
+        try
+        {
+            add_query_pattern(p);
+        }
+        catch (const Query_pattern_exception& e)
+        {
+            free(line);
+            fclose(fp);
+            std::string msg = std::string(fname) + ":" + std::to_string(line_no) + ": " + e.what();
+            throw Query_pattern_exception(msg.c_str());
+        }
+    }
+
+    free(line);
+    fclose(fp);
+}
+
@@ -3,6 +3,7 @@
 
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <pcap.h>
 #include <mysql.h>
 
@@ -11,6 +12,13 @@
 #include "query_pattern.h"
 #include "ip_stream.h"
 #include "table_stats.h"
+#include "flow_table.h"
+#include "fingerprint.h"
+#include "latency_histogram.h"
+#include "interval_stats.h"
+#include "replay_engine.h"
+#include "mcap_file.h"
+#include "timer_wheel.h"
 #include <vector>
 #include <float.h>
 #include <chrono>
@@ -18,47 +26,36 @@
 
 struct Query_pattern_stats
 {
+    std::string key; // the pattern text, stored once per digest
     double min_exec_time;
     double max_exec_time;
     double total_exec_time;
     size_t n_queries;
-    std::vector<double> exec_times;
-
-    Query_pattern_stats():min_exec_time(DBL_MAX),max_exec_time(0.0),total_exec_time(0.0),n_queries(0)
+    Latency_histogram exec_hist;
+    // the responses decoded off the wire, the replay does not fill these in
+    size_t n_responses;
+    u_longlong total_rows, max_rows;
+    u_longlong total_bytes, max_bytes;
+    double total_ttfb;
+    Latency_histogram ttfb_hist;
+    // queries the server flagged in the status of its OK or EOF
+    size_t n_no_index, n_no_good_index, n_slow;
+    u_longlong total_warnings;
+
+    Query_pattern_stats():min_exec_time(DBL_MAX),max_exec_time(0.0),total_exec_time(0.0),n_queries(0),
+        n_responses(0),total_rows(0),max_rows(0),total_bytes(0),max_bytes(0),total_ttfb(0.0),
+        n_no_index(0),n_no_good_index(0),n_slow(0),total_warnings(0)
     {
     }
 
-    void record_query(double exec_time);
-    void finalize();
-    double get_median_exec_time()
-    {
-        if (exec_times.size() == 0)
-            return 0.0;
-
-        if (exec_times.size() % 2)
-            return exec_times[exec_times.size() / 2];
-
-        int pos = exec_times.size() / 2;
-
-        return (exec_times[pos] + exec_times[pos - 1])/2.0;
-    }
-
-    double get_pct_exec_time(int pct)
-    {
-        int pos = exec_times.size() * pct / 100 - 1;
-
-        if (pos <= 0)
-            pos = 0;
-        if (pos >= exec_times.size())
-            pos = exec_times.size() - 1;
-
-        return exec_times[pos];
-    }
+    void record_query(double exec_time, const Mysql_response* resp);
+    void merge(const Query_pattern_stats& other);
+    double get_pct_exec_time(double pct) { return exec_hist.percentile(pct); }
 };
 
 struct Query_stats
 {
-    std::map<std::string, Query_pattern_stats*> lookup;
+    std::unordered_map<u_longlong, Query_pattern_stats*> lookup;
     std::mutex lock;
     double total_exec_time;
     size_t n_queries;
@@ -67,9 +64,24 @@ struct Query_stats
     }
 
     ~Query_stats();
-    void record_query(const char* lookup_key, double exec_time);
+    // resp is NULL when only the time is known
+    void record_query(u_longlong digest, const char* key, size_t key_len, double exec_time,
+                      const Mysql_response* resp = NULL);
+    void merge(Query_stats& other);
     void print(FILE* csv_fp);
-    void finalize();
+    // compares these, the replay, to the captured timings of the same
+    // patterns, the worst regression first
+    void print_diff(Query_stats& orig, FILE* csv_fp);
+};
+
+// where process_pkt() is going to file a packet, worked out without
+// touching any stream state
+struct Flow_info
+{
+    u_longlong key;
+    bool has_key; // false for IP fragments that do not carry the TCP header
+    bool is_fragment; // will be queued for IP reassembly
+    u_short ip_id;
 };
 
 class Mysql_stream_manager
@@ -77,24 +89,51 @@ class Mysql_stream_manager
 public:
     u_int mysql_ip;
     u_int _mysql_port;
-    std::map<u_longlong, Mysql_stream*> lookup;
+    Flow_table<Mysql_stream*> lookup;
     std::multiset<Mysql_query_packet*, Mysql_query_packet_time_cmp> slow_queries;
     param_info* info;
     MYSQL* explain_con;
     Query_stats q_stats;
+    Query_stats orig_stats; // --run, the captured timings, q_stats has the replay
     Table_stats table_stats;
     std::chrono::time_point<std::chrono::high_resolution_clock> replay_start_ts;
     struct timeval first_packet_ts;
     bool first_packet_ts_inited;
-    int replay_fd;
-    bool in_replay_write;
+    Mcap_writer* mcap_writer; // --record-for-replay
     IP_stream ip_stream;
     FILE* csv_fp;
     FILE* table_stats_fp;
-
-    Mysql_stream_manager(u_int mysql_ip, u_int _mysql_port, param_info* info) : mysql_ip(mysql_ip), _mysql_port(_mysql_port),
+    FILE* diff_fp;
+    bool is_shard; // one of several --threads workers, the results go elsewhere
+    Interval_stats* interval_stats; // shared with the shards, owned by the primary
+    int interval_source; // -1 if this manager does not see packets
+    long long cur_window;
+    Replay_engine* replay_engine; // --run, shared with the shards, owned by the primary
+
+    // --flow-idle-timeout: a timer per stream at last seen + timeout, in
+    // packet time milliseconds. Packets do not move the timer, a timer that
+    // finds its stream seen since is set again for the new deadline.
+    struct Flow_timer
+    {
+        u_longlong key;
+        u_longlong flow_id; // the stream the timer was set for, the key may have been reused
+    };
+
+    Timer_wheel<Flow_timer> idle_timers;
+    std::vector<Flow_timer> expired_timers;
+    u_longlong next_flow_id;
+    // --max-flows: streams by last packet, most recent first
+    Mysql_stream* lru_head;
+    Mysql_stream* lru_tail;
+    size_t max_flows; // this manager's share of --max-flows, 0 for no limit
+
+    Mysql_stream_manager(u_int mysql_ip, u_int _mysql_port, param_info* info, bool is_shard=false) :
+        mysql_ip(mysql_ip), _mysql_port(_mysql_port),
         info(info), explain_con(NULL), first_packet_ts_inited(false),
-        replay_fd(-1),in_replay_write(false),csv_fp(NULL),table_stats_fp(NULL) { init();}
+        mcap_writer(NULL),csv_fp(NULL),table_stats_fp(NULL),diff_fp(NULL),
+        is_shard(is_shard),
+        interval_stats(NULL), interval_source(-1), cur_window(0), replay_engine(NULL),
+        next_flow_id(0), lru_head(NULL), lru_tail(NULL), max_flows(0) { init();}
     ~Mysql_stream_manager() { cleanup();}
 
     void init();
@@ -105,21 +144,52 @@ public:
     }
 
     Mysql_stream* find_or_make_stream(u_longlong key, Mysql_packet* pkt);
+    // FIN, RST or eviction: writes the end to the replay file, hands the
+    // stream to the replay engine and drops it
+    void end_stream(u_longlong key, Mysql_stream* s, struct timeval ts);
+    // a packet on s at packet time now_ms
+    void touch_flow(Mysql_stream* s, u_longlong now_ms);
+    void lru_unlink(Mysql_stream* s);
+    // ends the streams that went quiet for --flow-idle-timeout by packet time ts
+    void evict_idle_flows(const struct timeval& ts);
+    // makes room for a new stream under --max-flows
+    void evict_lru_flow(const struct timeval& ts);
 
     // returns true if the packet is essential for replay,
     // false if it can be dropped when writing out the replay file
     bool process_pkt(const struct pcap_pkthdr* header, const u_char* packet);
-    void register_query(Mysql_stream* s, Mysql_query_packet* query);
+    // returns false if process_pkt() would ignore the packet outright
+    bool get_flow_info(const struct pcap_pkthdr* header, const u_char* packet, Flow_info* fi);
+    // moves the --interval clock to packet time ts
+    void advance_clock(const struct timeval& ts);
+    // folds the results of a --threads worker into this one
+    void merge_stats(Mysql_stream_manager& shard);
+    // key_text, if given, is what the stats go under instead of the query,
+    // the prepared text of a COM_STMT_EXECUTE
+    void register_query(Mysql_stream* s, Mysql_query_packet* query, const char* key_text = NULL,
+                        size_t key_text_len = 0);
     void explain_query(Mysql_query_packet* query, bool analyze);
     void print_slow_queries();
     bool connect_for_explain();
     void cleanup();
-    void get_query_key(char* key_buf, size_t* key_buf_len, const char* query, size_t q_len);
+    // returns the digest of the pattern key, *key points to its text, either
+    // in key_buf or in a per-thread fingerprint buffer, valid until the next
+    // call; the replay loops call this concurrently
+    u_longlong get_query_key(char* key_buf, size_t* key_len, const char** key, const char* query, size_t q_len);
     void init_replay();
+    // the reader calls this for every packet, see Replay_engine::throttle()
+    void throttle_replay()
+    {
+        if (replay_engine)
+            replay_engine->throttle();
+    }
     void finish_replay();
     bool init_replay_file(const char* fname);
+    // MCAP input, decoded on info->n_decode_threads if the file has an index
     void process_replay_file(const char* fname);
-    bool write_to_replay_file(const char* data, size_t len);
+    void process_replay_packet(u_longlong key, Mysql_packet* pkt);
+    void print_decode_stats(Time_Point start, u_longlong comp_bytes, u_longlong raw_bytes, u_int n_blocks,
+                            u_int n_indexed, u_int n_threads);
     u_longlong get_ellapsed_us();
     u_longlong get_packet_ellapsed_us(Mysql_packet* p);
     std::chrono::time_point<std::chrono::high_resolution_clock> get_scheduled_ts(Mysql_packet* p);
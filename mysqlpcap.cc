@@ -12,7 +12,9 @@
 
 #include <sys/types.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <iostream>
 #include <iomanip>
 
@@ -20,6 +22,11 @@
 #include "version.h"
 #include "mysql_stream_manager.h"
 #include "pcap_detect.h"
+#include "live_capture.h"
+#include "pcap_reader.h"
+#include "shard_pool.h"
+#include "mcap_file.h"
+#include "tls_decrypt.h"
 
 enum {
   REPLAY_HOST=230,
@@ -36,7 +43,36 @@ enum {
   ASSERT_ON_QUERY_ERROR,
   IGNORE_DUP_KEY_ERRORS,
   CSV,
-  TABLE_STATS
+  TABLE_STATS,
+  LIVE,
+  LIVE_RING_MB,
+  USE_LIBPCAP,
+  THREADS,
+  FINGERPRINT,
+  QUERY_PATTERN_FILE,
+  HISTOGRAM_DIGITS,
+  INTERVAL,
+  INTERVAL_FILE,
+  INTERVAL_FORMAT,
+  REPLAY_THREADS,
+  REPLAY_LAG_INTERVAL,
+  REPLAY_MODE,
+  REPLAY_CONCURRENCY,
+  REPLAY_QPS,
+  RAMP_STEP_QPS,
+  RAMP_STEP_SECS,
+  RAMP_SLO_P99,
+  REPLAY_CLONE_FACTOR,
+  REPLAY_CLONE_JITTER,
+  REPLAY_PREWARM,
+  DIFF_CSV,
+  MAX_BUFFERED_MB,
+  START_TIME,
+  END_TIME,
+  DECODE_THREADS,
+  FLOW_IDLE_TIMEOUT,
+  MAX_FLOWS,
+  TLS_KEYLOG
 };
 
 const char* replay_host = 0;
@@ -47,10 +83,16 @@ const char* replay_ssl_cert = 0;
 const char* replay_ssl_ca = 0;
 const char* replay_ssl_key = 0;
 const char* record_for_replay_file = 0;
+const char* live_iface = 0;
 
 uint replay_port = 3306;
 uint _mysql_port = 3306;
 double replay_speed = 1.0;
+size_t live_ring_mb = 64;
+bool use_libpcap = false;
+
+static volatile sig_atomic_t stop_capture = 0;
+static Mysql_shard_pool* shard_pool = 0;
 
 Perf_stats perf_stats;
 
@@ -81,6 +123,35 @@ static struct option long_options[] =
   {"ignore-dup-key-errors", no_argument, 0, IGNORE_DUP_KEY_ERRORS},
   {"csv", required_argument, 0, CSV},
   {"table-stats", required_argument, 0, TABLE_STATS},
+  {"live", required_argument, 0, LIVE},
+  {"live-ring-mb", required_argument, 0, LIVE_RING_MB},
+  {"use-libpcap", no_argument, 0, USE_LIBPCAP},
+  {"threads", required_argument, 0, THREADS},
+  {"fingerprint", no_argument, 0, FINGERPRINT},
+  {"query-pattern-file", required_argument, 0, QUERY_PATTERN_FILE},
+  {"histogram-digits", required_argument, 0, HISTOGRAM_DIGITS},
+  {"interval", required_argument, 0, INTERVAL},
+  {"interval-file", required_argument, 0, INTERVAL_FILE},
+  {"interval-format", required_argument, 0, INTERVAL_FORMAT},
+  {"replay-threads", required_argument, 0, REPLAY_THREADS},
+  {"replay-lag-interval", required_argument, 0, REPLAY_LAG_INTERVAL},
+  {"replay-mode", required_argument, 0, REPLAY_MODE},
+  {"replay-concurrency", required_argument, 0, REPLAY_CONCURRENCY},
+  {"replay-qps", required_argument, 0, REPLAY_QPS},
+  {"ramp-step-qps", required_argument, 0, RAMP_STEP_QPS},
+  {"ramp-step-secs", required_argument, 0, RAMP_STEP_SECS},
+  {"ramp-slo-p99", required_argument, 0, RAMP_SLO_P99},
+  {"replay-clone-factor", required_argument, 0, REPLAY_CLONE_FACTOR},
+  {"replay-clone-jitter", required_argument, 0, REPLAY_CLONE_JITTER},
+  {"replay-prewarm", required_argument, 0, REPLAY_PREWARM},
+  {"diff-csv", required_argument, 0, DIFF_CSV},
+  {"max-buffered-mb", required_argument, 0, MAX_BUFFERED_MB},
+  {"start-time", required_argument, 0, START_TIME},
+  {"end-time", required_argument, 0, END_TIME},
+  {"decode-threads", required_argument, 0, DECODE_THREADS},
+  {"flow-idle-timeout", required_argument, 0, FLOW_IDLE_TIMEOUT},
+  {"max-flows", required_argument, 0, MAX_FLOWS},
+  {"tls-keylog", required_argument, 0, TLS_KEYLOG},
   {"version", no_argument, 0, 'v'},
   {"verbose", no_argument, 0, 'V'},
   {"help", no_argument, 0, 'H'},
@@ -102,6 +173,16 @@ void die(const char* msg, ...)
   exit(1);
 }
 
+static u_longlong parse_time_us(const char* opt, const char* arg)
+{
+  u_longlong us;
+
+  if (!mcap_parse_time(arg, &us))
+    die("%s must be YYYY-MM-DD HH:MM:SS[.ffffff] or seconds since the epoch", opt);
+
+  return us;
+}
+
 void print_version()
 {
      std::cerr << "mysqlpcap version " << MYSQLPCAP_VERSION << "\n";
@@ -140,6 +221,35 @@ void print_usage(const char* prog_name)
         "[REPLAY] Ignore duplicate key errors during replay.",
         "Output analysis results to a CSV file at the specified path.",
         "Output table usage statistics (selects, updates, deletes) to the specified file.",
+        "Capture live from the given network interface instead of reading a file, stop with Ctrl-C.",
+        "[LIVE] Size of the kernel packet ring in MB (default 64).",
+        "Read the input file through libpcap instead of the built-in mmap reader.",
+        "Analyze pcap or live input on N worker threads, sharded by connection (default 1).",
+        "Group queries by their normalized text, literals and IN lists stripped, when no regex matches.",
+        "Read query grouping regexes from a file, one s/search/replace/ per line, in command line order with -q.",
+        "Significant digits kept by the per pattern latency percentiles, 1-4 (default 2), each costs ~10x memory.",
+        "Also report per pattern stats for every window of N seconds of packet time, written as each window closes.",
+        "[INTERVAL] Write the windows to this file instead of stdout.",
+        "[INTERVAL] csv (default) or json, one object per line.",
+        "[REPLAY] Event loop threads the replayed connections are multiplexed over (default 4).",
+        "[REPLAY] Report how far behind schedule queries start every N seconds (default 10, 0 for only at the end).",
+        "[REPLAY] timed (default, capture timing scaled by --replay-speed), closed, open or ramp.",
+        "[REPLAY] At most N queries in flight at once, any mode (closed mode default 16).",
+        "[REPLAY] open: queries per second to send regardless of capture timing, ramp: the first step's rate.",
+        "[RAMP] Rate added at every step (default the --replay-qps rate).",
+        "[RAMP] Seconds each step lasts (default 10).",
+        "[RAMP] Stop after the first step whose p99 query time goes over this many seconds.",
+        "[REPLAY] Replay every captured connection over N connections of its own (default 1).",
+        "[REPLAY] timed: start each extra clone up to this many seconds after the original, at random.",
+        "[REPLAY] Open N connections before the replay starts, for the connections replayed to reuse.",
+        "[REPLAY] Also write the per pattern replay vs capture comparison to a CSV file at this path.",
+        "[REPLAY] Pause reading while queries waiting to be replayed take more than N MB (--live drops packets meanwhile).",
+        "[MCAP] Skip packets before this time, YYYY-MM-DD HH:MM:SS[.ffffff] local time or seconds since the epoch.",
+        "[MCAP] Skip packets after this time, same format as --start-time.",
+        "[MCAP] Threads decoding an indexed MCAP file (default one per core, up to 4).",
+        "End connections quiet for this many seconds of packet time, for captures that miss the FIN (default never).",
+        "Track at most N connections at once, ending the least recently active one to make room (default no limit).",
+        "Decrypt TLS connections with the secrets of this NSS key log (SSLKEYLOGFILE), TLS 1.2 and 1.3 AEAD suites.",
         "Print verision and exit",
         "Print this help message and exit"
     };
@@ -302,6 +412,122 @@ void parse_args(int argc, char** argv)
       case TABLE_STATS:
         info.table_stats_file = optarg;
         break;
+      case LIVE:
+        live_iface = optarg;
+        break;
+      case LIVE_RING_MB:
+        live_ring_mb = atoi(optarg);
+        break;
+      case USE_LIBPCAP:
+        use_libpcap = true;
+        break;
+      case THREADS:
+        info.n_threads = atoi(optarg);
+        if (!info.n_threads)
+          info.n_threads = 1;
+        break;
+      case FINGERPRINT:
+        info.fingerprint = true;
+        break;
+      case QUERY_PATTERN_FILE:
+        info.load_query_pattern_file(optarg);
+        break;
+      case HISTOGRAM_DIGITS:
+        Latency_histogram::default_digits = atoi(optarg);
+        if (Latency_histogram::default_digits < 1 || Latency_histogram::default_digits > 4)
+          die("--histogram-digits must be between 1 and 4");
+        break;
+      case INTERVAL:
+        info.interval = atof(optarg);
+        if (info.interval <= 0)
+          die("--interval must be a positive number of seconds");
+        break;
+      case INTERVAL_FILE:
+        info.interval_file = optarg;
+        break;
+      case INTERVAL_FORMAT:
+        if (!strcmp(optarg, "json"))
+          info.interval_json = true;
+        else if (strcmp(optarg, "csv"))
+          die("--interval-format must be csv or json");
+        break;
+      case REPLAY_THREADS:
+        info.n_replay_threads = atoi(optarg);
+        if (!info.n_replay_threads)
+          info.n_replay_threads = 1;
+        break;
+      case REPLAY_LAG_INTERVAL:
+        info.replay_lag_interval = atof(optarg);
+        break;
+      case REPLAY_MODE:
+        if (!strcmp(optarg, "timed"))
+          info.replay_mode = REPLAY_TIMED;
+        else if (!strcmp(optarg, "closed"))
+          info.replay_mode = REPLAY_CLOSED;
+        else if (!strcmp(optarg, "open"))
+          info.replay_mode = REPLAY_OPEN;
+        else if (!strcmp(optarg, "ramp"))
+          info.replay_mode = REPLAY_RAMP;
+        else
+          die("--replay-mode must be timed, closed, open or ramp");
+        break;
+      case REPLAY_CONCURRENCY:
+        info.replay_concurrency = atoi(optarg);
+        break;
+      case REPLAY_QPS:
+        info.replay_qps = atof(optarg);
+        break;
+      case RAMP_STEP_QPS:
+        info.ramp_step_qps = atof(optarg);
+        break;
+      case RAMP_STEP_SECS:
+        info.ramp_step_secs = atof(optarg);
+        break;
+      case RAMP_SLO_P99:
+        info.ramp_slo_p99 = atof(optarg);
+        break;
+      case REPLAY_CLONE_FACTOR:
+        info.replay_clone_factor = atoi(optarg);
+        if (!info.replay_clone_factor)
+          die("--replay-clone-factor must be at least 1");
+        break;
+      case REPLAY_CLONE_JITTER:
+        info.replay_clone_jitter = atof(optarg);
+        break;
+      case REPLAY_PREWARM:
+        info.replay_prewarm = atoi(optarg);
+        break;
+      case DIFF_CSV:
+        info.diff_csv_file = optarg;
+        break;
+      case MAX_BUFFERED_MB:
+        info.max_buffered_mb = atoi(optarg);
+        break;
+      case START_TIME:
+        info.start_time_us = parse_time_us("--start-time", optarg);
+        break;
+      case END_TIME:
+        info.end_time_us = parse_time_us("--end-time", optarg);
+        break;
+      case DECODE_THREADS:
+        info.n_decode_threads = atoi(optarg);
+        break;
+      case FLOW_IDLE_TIMEOUT:
+        info.flow_idle_timeout = atof(optarg);
+        break;
+      case MAX_FLOWS:
+        info.max_flows = atoi(optarg);
+        break;
+      case TLS_KEYLOG:
+      {
+        static Tls_keylog keylog;
+
+        if (!keylog.open(optarg))
+          die("Cannot read the TLS key log %s", optarg);
+
+        info.tls_keylog = &keylog;
+        break;
+      }
       case 'v':
         print_version();
         exit(0);
@@ -314,8 +540,40 @@ void parse_args(int argc, char** argv)
 
   }
 
-  if (!fname)
-    die("Missing file name, specify with -i argument");
+  if (!fname && !live_iface)
+    die("Missing file name, specify with -i argument, or capture with --live");
+
+  if (fname && live_iface)
+    die("-i and --live are mutually exclusive");
+
+  if (info.n_threads > 1 && record_for_replay_file)
+    die("--record-for-replay cannot be combined with --threads");
+
+  if (info.end_time_us <= info.start_time_us)
+    die("--end-time must be after --start-time");
+
+  if (live_iface && (info.start_time_us || info.end_time_us != ~0ULL))
+    die("--start-time and --end-time only apply to MCAP input");
+
+  if (info.replay_mode == REPLAY_CLOSED && !info.replay_concurrency)
+    info.replay_concurrency = 16;
+
+  if ((info.replay_mode == REPLAY_OPEN || info.replay_mode == REPLAY_RAMP) && info.replay_qps <= 0)
+    die("--replay-mode open and ramp need a positive --replay-qps");
+
+  if (info.replay_mode == REPLAY_RAMP)
+  {
+    if (info.ramp_slo_p99 <= 0)
+      die("--replay-mode ramp needs --ramp-slo-p99");
+
+    if (info.ramp_step_secs <= 0)
+      die("--ramp-step-secs must be positive");
+
+    if (info.ramp_step_qps <= 0)
+      info.ramp_step_qps = info.replay_qps;
+  }
+
+  info.query_patterns.build();
 }
 
 void progress(const char* msg, ...)
@@ -324,21 +582,134 @@ void progress(const char* msg, ...)
   va_start(ap, msg);
   vfprintf(stderr, msg, ap);
   fputc('\n', stderr);
-  fprintf(stderr, "pkt_mem_in_use %llu pkt_alloced %llu pkt_freed %llu\n",
+  fprintf(stderr, "pkt_mem_in_use %llu pkt_alloced %llu pkt_freed %llu slab_bytes_reserved %llu sys_allocs %llu\n",
           perf_stats.pkt_mem_in_use.load(), perf_stats.pkt_alloced.load(),
-          perf_stats.pkt_freed.load());
+          perf_stats.pkt_freed.load(), perf_stats.slab_bytes_reserved.load(),
+          perf_stats.sys_allocs.load());
+
+  if (info.flow_idle_timeout > 0 || info.max_flows)
+    fprintf(stderr, "flows_idle_evicted %llu flows_lru_evicted %llu\n", perf_stats.flows_idle_evicted.load(),
+            perf_stats.flows_lru_evicted.load());
   va_end(ap);
 }
 
+static void start_shards(Mysql_stream_manager& sm)
+{
+  if (info.n_threads > 1)
+    shard_pool = new Mysql_shard_pool(&sm, info.n_threads);
+}
+
+static void process_packet(Mysql_stream_manager& sm, const struct pcap_pkthdr* header, const u_char* packet)
+{
+  sm.throttle_replay();
+
+  if (shard_pool)
+    shard_pool->dispatch(header, packet);
+  else
+    sm.process_pkt(header, packet);
+}
+
+static void report_results(Mysql_stream_manager& sm)
+{
+  if (shard_pool)
+    shard_pool->finish();
+
+  if (sm.interval_stats)
+  {
+    sm.interval_stats->flush();
+
+    if (sm.interval_stats->get_late())
+      fprintf(stderr, "Warning: %llu queries arrived after their --interval window was written\n",
+              sm.interval_stats->get_late());
+  }
+
+  sm.print_slow_queries();
+
+  if (info.do_run)
+    sm.finish_replay();
+
+  sm.print_query_stats();
+
+  if (info.table_stats_file)
+      sm.print_table_stats();
+
+  delete shard_pool;
+  shard_pool = 0;
+}
+
 #define PCAP_DIE(msg) die("pcap error: %s: %s", msg, error_buffer)
 
-void process_pcap_file(const char* fname)
+static void handle_file_packet(Mysql_stream_manager& sm, const struct pcap_pkthdr* header,
+                               const u_char* packet, off_t cur_pos, uint* last_pct)
+{
+  if (!info.ethernet_header_size)
+  {
+      info.ethernet_header_size = detect_eth_header_size((void*)header, packet);
+
+      if (!info.ethernet_header_size)
+          die("Could not detect ethernet header size, set manually with -e option");
+  }
+
+  if (info.report_progress)
+  {
+    uint pct = cur_pos * 100 / info.pcap_file_size;
+    if (pct > *last_pct)
+    {
+      progress("Completed: %u%%", pct);
+      *last_pct = pct;
+    }
+  }
+
+  try
+  {
+    process_packet(sm, header, packet);
+  }
+  catch (std::exception e)
+  {
+    die("Exception: %s", e.what());
+  }
+}
+
+// returns false if the file is in a format the mmap reader does not handle
+static bool read_pcap_file_mmap(const char* fname, Mysql_stream_manager& sm)
+{
+  Pcap_file_reader* reader;
+  uint last_pct = 0;
+
+  try
+  {
+    reader = new Pcap_file_reader(fname);
+  }
+  catch (const Pcap_reader_exception& e)
+  {
+    if (info.verbose)
+      fprintf(stderr, "Falling back to libpcap: %s\n", e.what());
+    return false;
+  }
+
+  try
+  {
+    struct pcap_pkthdr header;
+    const u_char* packet;
+
+    // packet points straight into the mapping, process_pkt() copies what it keeps
+    while (reader->next(&header, &packet))
+      handle_file_packet(sm, &header, packet, reader->get_pos(), &last_pct);
+  }
+  catch (const Pcap_reader_exception& e)
+  {
+    die("Error reading %s: %s", fname, e.what());
+  }
+
+  delete reader;
+  return true;
+}
+
+static void read_pcap_file_libpcap(const char* fname, Mysql_stream_manager& sm)
 {
   char error_buffer[PCAP_ERRBUF_SIZE];
   pcap_t *ph = pcap_open_offline(fname, error_buffer);
   int fd;
-  pcap_dumper_t *pd = 0;
-  unsigned long long n_packets = 0;
   uint last_pct = 0;
 
   if (!ph)
@@ -347,6 +718,22 @@ void process_pcap_file(const char* fname)
   if ((fd = pcap_get_selectable_fd(ph)) == -1)
     PCAP_DIE("Not able to get fd from the PCAP handle");
 
+  while (1)
+  {
+    struct pcap_pkthdr header;
+    const u_char *packet =  pcap_next(ph, &header);
+
+    if (!packet)
+      break;
+
+    handle_file_packet(sm, &header, packet, info.report_progress ? lseek(fd, 0, SEEK_CUR) : 0, &last_pct);
+  }
+
+  pcap_close(ph);
+}
+
+void process_pcap_file(const char* fname)
+{
   // no filter, does not work if the packets have vlan ID in the ethernet header
   Mysql_stream_manager sm(mysql_ip.s_addr, _mysql_port, &info);
   sm.init_replay();
@@ -354,60 +741,96 @@ void process_pcap_file(const char* fname)
   if (record_for_replay_file && sm.init_replay_file(record_for_replay_file))
     die("Could not open record for replay file");
 
-  while (1)
+  start_shards(sm);
+
+  if (use_libpcap || !read_pcap_file_mmap(fname, sm))
+    read_pcap_file_libpcap(fname, sm);
+
+  report_results(sm);
+}
+
+static void stop_capture_handler(int)
+{
+  stop_capture = 1;
+}
+
+static void handle_live_packet(void* arg, const struct pcap_pkthdr* header, const u_char* packet)
+{
+  Mysql_stream_manager* sm = (Mysql_stream_manager*)arg;
+
+  // unlike a file we can afford to wait for a packet we recognize
+  if (!info.ethernet_header_size &&
+      !(info.ethernet_header_size = detect_eth_header_size((void*)header, packet)))
+    return;
+
+  try
   {
-    struct pcap_pkthdr header;
-    const u_char *packet =  pcap_next(ph, &header);
+    process_packet(*sm, header, packet);
+  }
+  catch (const std::exception& e)
+  {
+    die("Exception: %s", e.what());
+  }
+}
 
-    if (!packet)
-      break;
+#define LIVE_POLL_TIMEOUT_MS 100
 
-    if (!info.ethernet_header_size)
-    {
-        info.ethernet_header_size = detect_eth_header_size(&header, packet);
+void process_live_capture(const char* iface)
+{
+  Mysql_stream_manager sm(mysql_ip.s_addr, _mysql_port, &info);
+  sm.init_replay();
 
-        if (!info.ethernet_header_size)
-            die("Could not detect ethernet header size, set manually with -e option");
-    }
+  if (record_for_replay_file && sm.init_replay_file(record_for_replay_file))
+    die("Could not open record for replay file");
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_capture_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  start_shards(sm);
 
-    if (info.report_progress)
+  try
+  {
+    Live_capture lc(iface, _mysql_port, live_ring_mb << 20);
+    time_t last_report = time(NULL);
+    std::chrono::steady_clock::time_point last_flush = std::chrono::steady_clock::now();
+
+    while (!stop_capture)
     {
-      off_t cur_pos = lseek(fd, 0, SEEK_CUR);
-      uint pct = cur_pos * 100 / info.pcap_file_size;
-      if (pct > last_pct)
+      u_int n_pkts = lc.dispatch(LIVE_POLL_TIMEOUT_MS, handle_live_packet, &sm);
+
+      // --threads: a batch is otherwise only sent once it is full, on a
+      // quiet link the shards would sit on the last packets
+      if (shard_pool)
       {
-        progress("Completed: %u%%", pct);
-        last_pct = pct;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        if (!n_pkts || now - last_flush >= std::chrono::milliseconds(LIVE_POLL_TIMEOUT_MS))
+        {
+          shard_pool->flush();
+          last_flush = now;
+        }
       }
-    }
 
-    try
-    {
-      if (sm.process_pkt(&header, packet) && pd)
+      if (info.report_progress && time(NULL) != last_report)
       {
-        pcap_dump((unsigned char*)pd, &header, (unsigned char*)packet);
+        lc.update_stats();
+        progress("Captured: %llu packets, kernel drops: %llu", lc.get_received(), lc.get_dropped());
+        last_report = time(NULL);
       }
     }
-    catch (std::exception e)
-    {
-      die("Exception: %s", e.what());
-    }
-  }
-
-  pcap_close(ph);
-
-  if (pd)
-    pcap_dump_close(pd);
-
-  sm.print_slow_queries();
 
-  if (info.do_run)
-    sm.finish_replay();
-
-  sm.print_query_stats();
+    lc.update_stats();
+    fprintf(stderr, "Kernel received %llu packets, dropped %llu, ring freezes %llu\n",
+            lc.get_received(), lc.get_dropped(), lc.get_freeze_q_cnt());
+  }
+  catch (const Live_capture_exception& e)
+  {
+    die("Live capture: %s", e.what());
+  }
 
-  if (info.table_stats_file)
-      sm.print_table_stats();
+  report_results(sm);
 }
 
 void init_file_size(const char* fname)
@@ -458,6 +881,9 @@ void process_file(const char* fname)
     return;
   }
 
+  if (info.start_time_us || info.end_time_us != ~0ULL)
+    die("--start-time and --end-time only apply to MCAP input");
+
   process_pcap_file(fname);
 }
 
@@ -467,14 +893,20 @@ int main(int argc, char** argv)
   try
   {
     parse_args(argc, argv);
-    init_file_size(fname);
+
+    if (fname)
+      init_file_size(fname);
   }
-  catch (std::exception e)
+  catch (const std::exception& e)
   {
     die("Error parsing arguments: %s\n", e.what());
   }
 
-  process_file(fname);
+  if (live_iface)
+    process_live_capture(live_iface);
+  else
+    process_file(fname);
+
   progress("Finished");
   return 0;
 }
@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <new>
+#include <mutex>
+
+#include "common.h"
+#include "packet_alloc.h"
+
+#define MIN_CLASS_SHIFT 5
+#define MAX_CLASS_SHIFT 16
+#define N_SIZE_CLASSES (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+#define SLAB_SIZE (64 * 1024)
+#define MIN_CHUNKS_PER_SLAB 16
+// bytes of free chunks a thread may sit on per class before spilling
+#define THREAD_CACHE_BYTES (256 * 1024)
+#define MIN_THREAD_CACHE_CHUNKS 8
+
+bool Packet_allocator::enabled = true;
+
+struct Free_chunk
+{
+    Free_chunk* next;
+};
+
+struct Depot_list
+{
+    std::mutex lock;
+    Free_chunk* head;
+    size_t count;
+
+    Depot_list(): head(0), count(0) {}
+};
+
+static Depot_list depot[N_SIZE_CLASSES];
+
+static inline int size_class(size_t size)
+{
+    if (size <= (1 << MIN_CLASS_SHIFT))
+        return 0;
+
+    return (64 - __builtin_clzll(size - 1)) - MIN_CLASS_SHIFT;
+}
+
+static inline size_t class_size(int c)
+{
+    return (size_t)1 << (c + MIN_CLASS_SHIFT);
+}
+
+static inline u_int cache_limit(int c)
+{
+    u_int n = THREAD_CACHE_BYTES / class_size(c);
+    return n < MIN_THREAD_CACHE_CHUNKS ? MIN_THREAD_CACHE_CHUNKS : n;
+}
+
+struct Thread_cache
+{
+    Free_chunk* head[N_SIZE_CLASSES];
+    u_int count[N_SIZE_CLASSES];
+
+    Thread_cache()
+    {
+        for (int c = 0; c < N_SIZE_CLASSES; c++)
+        {
+            head[c] = 0;
+            count[c] = 0;
+        }
+    }
+
+    // replay threads come and go with their connections, whatever they
+    // cached goes back to the depot
+    ~Thread_cache()
+    {
+        for (int c = 0; c < N_SIZE_CLASSES; c++)
+            spill(c, count[c]);
+    }
+
+    void spill(int c, u_int n)
+    {
+        if (!n)
+            return;
+
+        Free_chunk* first = head[c];
+        Free_chunk* last = first;
+
+        for (u_int i = 1; i < n; i++)
+            last = last->next;
+
+        head[c] = last->next;
+        count[c] -= n;
+
+        std::lock_guard<std::mutex> guard(depot[c].lock);
+        last->next = depot[c].head;
+        depot[c].head = first;
+        depot[c].count += n;
+    }
+
+    void refill(int c);
+};
+
+static thread_local Thread_cache thread_cache;
+
+void Thread_cache::refill(int c)
+{
+    u_int want = cache_limit(c) / 2;
+
+    {
+        std::lock_guard<std::mutex> guard(depot[c].lock);
+
+        while (depot[c].head && count[c] < want)
+        {
+            Free_chunk* chunk = depot[c].head;
+            depot[c].head = chunk->next;
+            depot[c].count--;
+            chunk->next = head[c];
+            head[c] = chunk;
+            count[c]++;
+        }
+    }
+
+    if (head[c])
+        return;
+
+    // depot is dry too, carve a new slab
+    size_t chunk_size = class_size(c);
+    size_t slab_size = chunk_size * MIN_CHUNKS_PER_SLAB > SLAB_SIZE ? chunk_size * MIN_CHUNKS_PER_SLAB : SLAB_SIZE;
+    char* slab = (char*)malloc(slab_size);
+
+    if (!slab)
+        throw std::bad_alloc();
+
+    perf_stats.sys_allocs.fetch_add(1);
+    perf_stats.slab_bytes_reserved.fetch_add(slab_size);
+
+    for (size_t off = 0; off + chunk_size <= slab_size; off += chunk_size)
+    {
+        Free_chunk* chunk = (Free_chunk*)(slab + off);
+        chunk->next = head[c];
+        head[c] = chunk;
+        count[c]++;
+    }
+}
+
+void* Packet_allocator::alloc(size_t size)
+{
+    int c = size_class(size);
+
+    if (!enabled || c >= N_SIZE_CLASSES)
+    {
+        perf_stats.sys_allocs.fetch_add(1);
+        return new char[size]; // throws on OOM
+    }
+
+    Thread_cache& tc = thread_cache;
+
+    if (!tc.head[c])
+        tc.refill(c);
+
+    Free_chunk* chunk = tc.head[c];
+    tc.head[c] = chunk->next;
+    tc.count[c]--;
+    return chunk;
+}
+
+void Packet_allocator::free(void* p, size_t size)
+{
+    int c = size_class(size);
+
+    if (!enabled || c >= N_SIZE_CLASSES)
+    {
+        delete[] (char*)p;
+        return;
+    }
+
+    Thread_cache& tc = thread_cache;
+    Free_chunk* chunk = (Free_chunk*)p;
+    chunk->next = tc.head[c];
+    tc.head[c] = chunk;
+
+    if (++tc.count[c] > cache_limit(c))
+        tc.spill(c, tc.count[c] / 2);
+}
+
+#if defined(TEST_PACKET_ALLOC) || defined(BENCH_PACKET_ALLOC)
+Perf_stats perf_stats;
+#endif
+
+#ifdef TEST_PACKET_ALLOC
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// every thread allocates, fills and frees chunks of all sizes, and hands
+// half of them over to be freed by another thread, like the reader does
+// with the replay threads
+static void worker(int id, std::vector<std::pair<u_char*, size_t> >* out, int* n_failed)
+{
+    std::vector<std::pair<u_char*, size_t> > mine;
+
+    for (int round = 0; round < 20; round++)
+    {
+        for (size_t size = 1; size < 200000; size = size * 3 + round)
+        {
+            u_char* p = (u_char*)Packet_allocator::alloc(size);
+            memset(p, id, size);
+            mine.push_back(std::make_pair(p, size));
+        }
+
+        for (size_t i = 0; i < mine.size(); i++)
+        {
+            for (size_t j = 0; j < mine[i].second; j++)
+            {
+                if (mine[i].first[j] != (u_char)id)
+                {
+                    (*n_failed)++;
+                    break;
+                }
+            }
+
+            if (i % 2)
+                out->push_back(mine[i]);
+            else
+                Packet_allocator::free(mine[i].first, mine[i].second);
+        }
+
+        mine.clear();
+    }
+}
+
+int main()
+{
+    const int n_threads = 4;
+    std::vector<std::pair<u_char*, size_t> > handoff[n_threads];
+    int n_failed[n_threads] = {0};
+    std::vector<std::thread> threads;
+
+    printf("Test: concurrent alloc/fill/free with cross-thread frees\n");
+
+    for (int i = 0; i < n_threads; i++)
+        threads.push_back(std::thread(worker, i + 1, &handoff[i], &n_failed[i]));
+
+    for (int i = 0; i < n_threads; i++)
+        threads[i].join();
+
+    // free everything that was handed over on a different thread
+    std::thread freer([&]() {
+        for (int i = 0; i < n_threads; i++)
+            for (size_t j = 0; j < handoff[i].size(); j++)
+                Packet_allocator::free(handoff[i][j].first, handoff[i][j].second);
+    });
+    freer.join();
+
+    int total_failed = 0;
+    for (int i = 0; i < n_threads; i++)
+        total_failed += n_failed[i];
+
+    printf("  no overlapping chunks: %s\n", total_failed ? "FAIL" : "PASS");
+
+    // everything is back in the depot now, reallocating must not carve
+    unsigned long long before = perf_stats.sys_allocs.load();
+    void* p = Packet_allocator::alloc(100);
+    bool reused = perf_stats.sys_allocs.load() == before;
+    Packet_allocator::free(p, 100);
+    printf("  depot reuse: %s\n", reused ? "PASS" : "FAIL");
+
+    bool ok = !total_failed && reused;
+    printf("%s\n", ok ? "ALL PASSED" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+#endif
+
+#ifdef BENCH_PACKET_ALLOC
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include "mysql_packet.h"
+
+#define N_QUERIES 2000000
+#define RESULT_PACKETS 4
+
+// counts every trip to the system allocator, whichever path takes it
+static std::atomic_ullong n_mallocs(0);
+
+void* operator new(size_t size)
+{
+    n_mallocs++;
+    void* p = malloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    ::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    ::free(p);
+}
+
+// the packet life cycle of one query: the query, a few result packets and
+// an EOF are created by the reader, the result packets freed as they are
+// skipped, the query and EOF later on by another thread (replay)
+static double run(bool slab, unsigned long long* mallocs)
+{
+    Packet_allocator::enabled = slab;
+    std::vector<Mysql_packet*> handoff;
+    struct timeval ts = {0, 0};
+    unsigned long long start_mallocs = n_mallocs.load();
+    auto start = std::chrono::high_resolution_clock::now();
+
+    handoff.reserve(2 * 1024);
+
+    for (int q = 0; q < N_QUERIES; q += 1024)
+    {
+        for (int i = 0; i < 1024; i++)
+        {
+            Mysql_packet* query = new Mysql_packet(ts, 40 + i % 200, true);
+            handoff.push_back(query);
+
+            for (int r = 0; r < RESULT_PACKETS; r++)
+                delete new Mysql_packet(ts, 20 + r * 30, false);
+
+            handoff.push_back(new Mysql_packet(ts, 7, false));
+        }
+
+        std::thread replay([&]() {
+            for (size_t i = 0; i < handoff.size(); i++)
+                delete handoff[i];
+        });
+        replay.join();
+        handoff.clear();
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    // thread objects themselves allocate, count only the packet traffic
+    *mallocs = n_mallocs.load() - start_mallocs;
+    return secs;
+}
+
+int main()
+{
+    unsigned long long mallocs_plain, mallocs_slab;
+    double plain = run(false, &mallocs_plain);
+    double slab = run(true, &mallocs_slab);
+
+    printf("%d queries, %d packets each\n", N_QUERIES, RESULT_PACKETS + 2);
+    printf("new/delete  %6.2f system allocations/query  %6.1f ns/query\n",
+           (double)mallocs_plain / N_QUERIES, plain * 1e9 / N_QUERIES);
+    printf("slab        %6.2f system allocations/query  %6.1f ns/query\n",
+           (double)mallocs_slab / N_QUERIES, slab * 1e9 / N_QUERIES);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef PACKET_ALLOC_H
+#define PACKET_ALLOC_H
+
+#include <stddef.h>
+
+// Slab allocator for Mysql_packet objects and their payloads. Requests are
+// rounded up to a power of two size class between 32 bytes and 64K, larger
+// ones go straight to the system allocator. Every thread keeps a small free
+// list per class so the common alloc/free pair never takes a lock; lists
+// that grow too long spill in batches into a shared depot, which is also
+// where threads refill from. Memory freed by the replay threads therefore
+// finds its way back to the reader.
+//
+// Slabs are never handed back to the system, the footprint is bounded by the
+// peak number of packets in flight, see Perf_stats::slab_bytes_reserved.
+class Packet_allocator
+{
+public:
+    // throws std::bad_alloc on OOM, like new
+    static void* alloc(size_t size);
+    // size must be the one passed to alloc()
+    static void free(void* p, size_t size);
+
+    // false makes alloc()/free() plain new[]/delete[], for comparisons
+    static bool enabled;
+};
+
+#endif
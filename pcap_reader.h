@@ -0,0 +1,69 @@
+#ifndef PCAP_READER_H
+#define PCAP_READER_H
+
+#include <pcap.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+class Pcap_reader_exception: public std::runtime_error
+{
+public:
+    Pcap_reader_exception(const std::string& msg): std::runtime_error(msg)
+    {
+    }
+};
+
+// Reads pcap and pcapng files through a read-only mapping of the whole file.
+// Packet pointers returned by next() point into the mapping and stay valid
+// for the lifetime of the reader, nothing is copied.
+class Pcap_file_reader
+{
+protected:
+    int fd;
+    const u_char* map;
+    size_t map_size;
+    size_t pos;
+    size_t released_pos; // everything before this has been madvise()'d away
+    bool is_pcapng;
+    bool swapped;
+    uint64_t ts_units; // classic pcap: ticks per second, 10^6 or 10^9
+
+    struct Interface
+    {
+        uint64_t ts_units;
+        u_int snaplen;
+    };
+
+    std::vector<Interface> interfaces; // pcapng, reset on every section
+
+    // records are in the byte order of the machine that wrote the file
+    u_int get16(const u_char* p) { uint16_t v; memcpy(&v, p, sizeof(v)); return swapped ? __builtin_bswap16(v) : v; }
+    u_int get32(const u_char* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return swapped ? __builtin_bswap32(v) : v; }
+    void set_ts(struct pcap_pkthdr* header, uint64_t ts, uint64_t units);
+    void release_consumed();
+    void parse_file_header();
+    void parse_section_header(const u_char* body, u_int body_len);
+    void parse_interface(const u_char* body, u_int body_len);
+    bool next_classic(struct pcap_pkthdr* header, const u_char** packet);
+    bool next_pcapng(struct pcap_pkthdr* header, const u_char** packet);
+
+public:
+    // throws Pcap_reader_exception if the file cannot be mapped or is not
+    // in a format we understand, the caller can then fall back to libpcap
+    Pcap_file_reader(const char* fname);
+    ~Pcap_file_reader();
+
+    // returns false at the end of the file or on a truncated record
+    bool next(struct pcap_pkthdr* header, const u_char** packet)
+    {
+        return is_pcapng ? next_pcapng(header, packet) : next_classic(header, packet);
+    }
+
+    size_t get_pos() { return pos; }
+    size_t get_size() { return map_size; }
+};
+
+#endif
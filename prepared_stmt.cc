@@ -0,0 +1,539 @@
+#include <ctype.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "prepared_stmt.h"
+
+bool read_lenenc(const u_char** p, const u_char* end, u_longlong* v)
+{
+    if (*p >= end)
+        return false;
+
+    u_int n;
+
+    switch (**p)
+    {
+    case 0xfc: n = 2; break;
+    case 0xfd: n = 3; break;
+    case 0xfe: n = 8; break;
+    case 0xfb: case 0xff: return false; // NULL and ERR, not numbers
+    default:
+        *v = *(*p)++;
+        return true;
+    }
+
+    if (end - *p < (long)n + 1)
+        return false;
+
+    *v = 0;
+
+    for (u_int i = n; i; i--)
+        *v = (*v << 8) | (*p)[i];
+
+    *p += n + 1;
+    return true;
+}
+
+void Prepared_stmt::add_long_data(const u_char* data, u_int len)
+{
+    if (len < 2)
+        return;
+
+    u_int i = data[0] | (data[1] << 8);
+
+    if (i >= n_params)
+        return;
+
+    if (long_data.size() < n_params)
+    {
+        long_data.resize(n_params);
+        has_long_data.resize(n_params);
+    }
+
+    long_data[i].append((const char*)data + 2, len - 2);
+    has_long_data[i] = true;
+}
+
+void Prepared_stmt::reset_long_data()
+{
+    long_data.clear();
+    has_long_data.clear();
+}
+
+// bytes the value of a type takes, 0 if it carries its own length
+static u_int fixed_size(u_char type)
+{
+    switch (type)
+    {
+    case MYSQL_TYPE_TINY: return 1;
+    case MYSQL_TYPE_SHORT: case MYSQL_TYPE_YEAR: return 2;
+    case MYSQL_TYPE_LONG: case MYSQL_TYPE_INT24: case MYSQL_TYPE_FLOAT: return 4;
+    case MYSQL_TYPE_LONGLONG: case MYSQL_TYPE_DOUBLE: return 8;
+    default: return 0;
+    }
+}
+
+bool stmt_is_temporal(u_char type)
+{
+    return type == MYSQL_TYPE_DATE || type == MYSQL_TYPE_DATETIME || type == MYSQL_TYPE_TIMESTAMP ||
+        type == MYSQL_TYPE_TIME;
+}
+
+bool Prepared_stmt::parse_execute(const u_char* data, u_int len, std::vector<Stmt_param>* params)
+{
+    const u_char* p = data + 9; // statement id, flags, iteration count
+    const u_char* end = data + len;
+    params->clear();
+
+    if (len < 9)
+        return false;
+
+    if (!n_params)
+        return true;
+
+    const u_char* nulls = p;
+    p += (n_params + 7) / 8;
+
+    if (p >= end)
+        return false;
+
+    if (*p++) // new parameters bound, the types follow
+    {
+        if ((u_int)(end - p) < n_params * 2)
+            return false;
+
+        types.assign(p, p + n_params * 2);
+        p += n_params * 2;
+    }
+
+    if (types.size() != n_params * 2)
+        return false; // the types went before the capture started
+
+    for (u_int i = 0; i < n_params; i++)
+    {
+        Stmt_param param;
+        param.type = types[i * 2];
+        param.is_unsigned = types[i * 2 + 1] & 0x80;
+        param.is_null = nulls[i / 8] & (1 << (i % 8));
+        param.value = p;
+        param.len = 0;
+
+        if (i < has_long_data.size() && has_long_data[i])
+        {
+            param.is_null = false;
+            param.value = (const u_char*)long_data[i].data();
+            param.len = long_data[i].size();
+        }
+        else if (param.is_null || param.type == MYSQL_TYPE_NULL)
+        {
+            param.is_null = true;
+        }
+        else if ((param.len = fixed_size(param.type)))
+        {
+            if ((u_int)(end - p) < param.len)
+                return false;
+
+            p += param.len;
+        }
+        else if (stmt_is_temporal(param.type))
+        {
+            if (p >= end || (u_int)(end - p) < 1U + *p)
+                return false;
+
+            param.len = *p;
+            param.value = p + 1;
+            p += param.len + 1;
+        }
+        else
+        {
+            u_longlong n;
+
+            if (!read_lenenc(&p, end, &n) || (u_longlong)(end - p) < n)
+                return false;
+
+            param.value = p;
+            param.len = n;
+            p += n;
+        }
+
+        params->push_back(param);
+    }
+
+    return true;
+}
+
+void stmt_encode_params(const std::vector<Stmt_param>& params, std::vector<u_char>* out)
+{
+    out->clear();
+
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        const Stmt_param& p = params[i];
+        u_char hdr[6];
+        hdr[0] = p.type;
+        hdr[1] = (p.is_unsigned ? 0x80 : 0) | (p.is_null ? 0x01 : 0);
+        int4store(hdr + 2, p.is_null ? 0 : p.len);
+        out->insert(out->end(), hdr, hdr + sizeof(hdr));
+
+        if (!p.is_null)
+            out->insert(out->end(), p.value, p.value + p.len);
+    }
+}
+
+bool stmt_decode_params(const u_char* data, u_int len, std::vector<Stmt_param>* params)
+{
+    const u_char* p = data;
+    const u_char* end = data + len;
+    params->clear();
+
+    while (p < end)
+    {
+        if (end - p < 6)
+            return false;
+
+        Stmt_param param;
+        param.type = p[0];
+        param.is_unsigned = p[1] & 0x80;
+        param.is_null = p[1] & 0x01;
+        param.len = uint4korr(p + 2);
+        param.value = p + 6;
+        p += 6;
+
+        if ((u_int)(end - p) < param.len)
+            return false;
+
+        p += param.len;
+        params->push_back(param);
+    }
+
+    return true;
+}
+
+static u_int get_uint2(const u_char* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+void stmt_temporal_text(const Stmt_param& p, std::string* out)
+{
+    const u_char* v = p.value;
+    char buf[64];
+    int n = 0;
+
+    if (p.type == MYSQL_TYPE_TIME)
+    {
+        // sign, days, hours, minutes, seconds, microseconds
+        if (p.len < 8)
+        {
+            out->append("00:00:00");
+            return;
+        }
+
+        n = snprintf(buf, sizeof(buf), "%s%02u:%02u:%02u", v[0] ? "-" : "", (u_int)uint4korr(v + 1) * 24 + v[5],
+                     v[6], v[7]);
+
+        if (p.len >= 12)
+            n += snprintf(buf + n, sizeof(buf) - n, ".%06u", (u_int)uint4korr(v + 8));
+
+        out->append(buf, n);
+        return;
+    }
+
+    // year, month, day, hours, minutes, seconds, microseconds
+    if (p.len < 4)
+    {
+        out->append(p.type == MYSQL_TYPE_DATE ? "0000-00-00" : "0000-00-00 00:00:00");
+        return;
+    }
+
+    n = snprintf(buf, sizeof(buf), "%04u-%02u-%02u", get_uint2(v), v[2], v[3]);
+
+    if (p.type != MYSQL_TYPE_DATE)
+    {
+        if (p.len >= 7)
+            n += snprintf(buf + n, sizeof(buf) - n, " %02u:%02u:%02u", v[4], v[5], v[6]);
+        else
+            n += snprintf(buf + n, sizeof(buf) - n, " 00:00:00");
+
+        if (p.len >= 11)
+            n += snprintf(buf + n, sizeof(buf) - n, ".%06u", (u_int)uint4korr(v + 7));
+    }
+
+    out->append(buf, n);
+}
+
+// DECIMAL comes as a string, it can go in unquoted if it looks like a number
+static bool is_number_text(const u_char* s, u_int len)
+{
+    if (!len)
+        return false;
+
+    for (u_int i = 0; i < len; i++)
+    {
+        if (!isdigit(s[i]) && !(s[i] && strchr("+-.eE", s[i])))
+            return false;
+    }
+
+    return true;
+}
+
+void stmt_param_literal(const Stmt_param& p, std::string* out)
+{
+    const u_char* v = p.value;
+    char buf[64];
+    int n = 0;
+
+    if (p.is_null)
+    {
+        out->append("NULL");
+        return;
+    }
+
+    switch (p.type)
+    {
+    case MYSQL_TYPE_TINY:
+        n = p.is_unsigned ? snprintf(buf, sizeof(buf), "%u", v[0]) : snprintf(buf, sizeof(buf), "%d", (signed char)v[0]);
+        break;
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        n = p.is_unsigned ? snprintf(buf, sizeof(buf), "%u", get_uint2(v)) :
+            snprintf(buf, sizeof(buf), "%d", (short)get_uint2(v));
+        break;
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+        n = p.is_unsigned ? snprintf(buf, sizeof(buf), "%u", (u_int)uint4korr(v)) :
+            snprintf(buf, sizeof(buf), "%d", (int)uint4korr(v));
+        break;
+    case MYSQL_TYPE_LONGLONG:
+        n = p.is_unsigned ? snprintf(buf, sizeof(buf), "%llu", (u_longlong)uint8korr(v)) :
+            snprintf(buf, sizeof(buf), "%lld", (long long)uint8korr(v));
+        break;
+    case MYSQL_TYPE_FLOAT:
+    {
+        float f;
+        memcpy(&f, v, sizeof(f));
+        n = snprintf(buf, sizeof(buf), "%.9g", f);
+        break;
+    }
+    case MYSQL_TYPE_DOUBLE:
+    {
+        double d;
+        memcpy(&d, v, sizeof(d));
+        n = snprintf(buf, sizeof(buf), "%.17g", d);
+        break;
+    }
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_TIME:
+        out->push_back('\'');
+        stmt_temporal_text(p, out);
+        out->push_back('\'');
+        return;
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+        if (is_number_text(v, p.len))
+        {
+            out->append((const char*)v, p.len);
+            return;
+        }
+        // fall through
+    default:
+        out->push_back('\'');
+
+        for (u_int i = 0; i < p.len; i++)
+        {
+            switch (v[i])
+            {
+            case 0: out->append("\\0"); break;
+            case '\'': out->append("\\'"); break;
+            case '\\': out->append("\\\\"); break;
+            case '\n': out->append("\\n"); break;
+            case '\r': out->append("\\r"); break;
+            case 0x1a: out->append("\\Z"); break;
+            default: out->push_back(v[i]);
+            }
+        }
+
+        out->push_back('\'');
+        return;
+    }
+
+    out->append(buf, n);
+}
+
+void stmt_interpolate(const std::string& text, const std::vector<Stmt_param>& params, std::string* out)
+{
+    size_t next_param = 0;
+    size_t len = text.size();
+    const char* s = text.data();
+    out->clear();
+    out->reserve(len + params.size() * 8);
+
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = s[i];
+
+        if (c == '\'' || c == '"' || c == '`')
+        {
+            // copied through to the closing quote, a doubled quote closes
+            // and opens again
+            size_t start = i++;
+
+            while (i < len && s[i] != c)
+            {
+                if (s[i] == '\\' && c != '`')
+                    i++;
+
+                i++;
+            }
+
+            out->append(s + start, (i < len ? i + 1 : len) - start);
+            continue;
+        }
+
+        if (c == '#' || (c == '-' && i + 2 < len && s[i + 1] == '-' && isspace(s[i + 2])) ||
+            (c == '/' && i + 1 < len && s[i + 1] == '*'))
+        {
+            const char* end_mark = c == '/' ? "*/" : "\n";
+            const char* end = strstr(s + i, end_mark); // std::string is NUL terminated
+            size_t stop = end ? (end - s) + strlen(end_mark) : len;
+            out->append(s + i, stop - i);
+            i = stop - 1;
+            continue;
+        }
+
+        if (c == '?' && next_param < params.size())
+        {
+            stmt_param_literal(params[next_param++], out);
+            continue;
+        }
+
+        out->push_back(c);
+    }
+}
+
+#ifdef TEST_PREPARED_STMT
+
+static int n_failed = 0;
+
+static void check(const char* what, const std::string& got, const char* expected)
+{
+    if (got != expected)
+    {
+        printf("  FAIL: %s\n    got:      %s\n    expected: %s\n", what, got.c_str(), expected);
+        n_failed++;
+    }
+}
+
+// a COM_STMT_EXECUTE past the command byte
+static std::string execute_packet(u_int n_params, const u_char* nulls, bool bound, const u_char* types,
+                                  const std::string& values)
+{
+    std::string pkt("\x01\x00\x00\x00\x00\x01\x00\x00\x00", 9);
+    pkt.append((const char*)nulls, (n_params + 7) / 8);
+    pkt.push_back(bound ? 1 : 0);
+
+    if (bound)
+        pkt.append((const char*)types, n_params * 2);
+
+    pkt.append(values);
+    return pkt;
+}
+
+int main()
+{
+    printf("Test: prepared statements\n");
+
+    Prepared_stmt stmt;
+    stmt.text = "select * from t where a = ? and b = ? and c = '?' and d in (?, ?) -- ?\n and e = ? /* ? */ and f = ?";
+    stmt.n_params = 6;
+
+    const u_char types[] = {
+        MYSQL_TYPE_LONG, 0, MYSQL_TYPE_VAR_STRING, 0, MYSQL_TYPE_LONGLONG, 0x80,
+        MYSQL_TYPE_DOUBLE, 0, MYSQL_TYPE_DATETIME, 0, MYSQL_TYPE_TINY, 0
+    };
+    const u_char nulls[] = {0x00};
+    std::string values;
+    values.append("\xfe\xff\xff\xff", 4); // -2
+    values.append("\x04it's", 5);
+    values.append("\xff\xff\xff\xff\xff\xff\xff\xff", 8); // 2^64 - 1
+    double d = 1.5;
+    values.append((const char*)&d, 8);
+    values.append("\x0b\xe8\x07\x02\x1d\x17\x3b\x3a\x40\xe2\x01\x00", 12); // 2024-02-29 23:59:58.123456
+    values.append("\x80", 1);
+
+    std::string pkt = execute_packet(6, nulls, true, types, values);
+    std::vector<Stmt_param> params;
+    bool parsed = stmt.parse_execute((const u_char*)pkt.data(), pkt.size(), &params) && params.size() == 6;
+    printf("  parse: %s\n", parsed ? "PASS" : "FAIL");
+
+    std::string sql;
+    stmt_interpolate(stmt.text, params, &sql);
+    check("interpolate", sql, "select * from t where a = -2 and b = 'it\\'s' and c = '?' and d in "
+          "(18446744073709551615, 1.5) -- ?\n and e = '2024-02-29 23:59:58.123456' /* ? */ and f = -128");
+
+    // the types stay from the last execute, NULL takes no value
+    const u_char nulls2[] = {0x02 | 0x10};
+    std::string values2;
+    values2.append("\x07\x00\x00\x00", 4);
+    values2.append("\xff\xff\xff\xff\xff\xff\xff\xff", 8);
+    values2.append((const char*)&d, 8);
+    values2.append("\x01", 1);
+    pkt = execute_packet(6, nulls2, false, NULL, values2);
+    bool parsed2 = stmt.parse_execute((const u_char*)pkt.data(), pkt.size(), &params) && params.size() == 6 &&
+        params[1].is_null && params[4].is_null;
+    stmt_interpolate(stmt.text, params, &sql);
+    check("reused types", sql, "select * from t where a = 7 and b = NULL and c = '?' and d in "
+          "(18446744073709551615, 1.5) -- ?\n and e = NULL /* ? */ and f = 1");
+
+    // long data replaces the value in the packet
+    const u_char ld[] = {1, 0, 'a', 'b'};
+    stmt.add_long_data(ld, sizeof(ld));
+    stmt.add_long_data(ld, sizeof(ld));
+    std::string values3;
+    values3.append("\x07\x00\x00\x00", 4);
+    values3.append("\x01\x00\x00\x00\x00\x00\x00\x00", 8);
+    values3.append((const char*)&d, 8);
+    values3.append("\x04\xe8\x07\x01\x02", 5);
+    values3.append("\x01", 1);
+    pkt = execute_packet(6, nulls, false, NULL, values3);
+    bool parsed3 = stmt.parse_execute((const u_char*)pkt.data(), pkt.size(), &params);
+    stmt_interpolate(stmt.text, params, &sql);
+    check("long data", sql, "select * from t where a = 7 and b = 'abab' and c = '?' and d in "
+          "(1, 1.5) -- ?\n and e = '2024-01-02 00:00:00' /* ? */ and f = 1");
+
+    // a truncated packet
+    pkt.resize(pkt.size() - 3);
+    bool truncated = !stmt.parse_execute((const u_char*)pkt.data(), pkt.size(), &params);
+    printf("  malformed: %s\n", parsed2 && parsed3 && truncated ? "PASS" : "FAIL");
+
+    // the replay encoding round trips
+    pkt = execute_packet(6, nulls, true, types, values);
+    stmt.reset_long_data();
+    stmt.parse_execute((const u_char*)pkt.data(), pkt.size(), &params);
+    std::vector<u_char> enc;
+    std::vector<Stmt_param> dec;
+    stmt_encode_params(params, &enc);
+    std::string sql2;
+    bool decoded = stmt_decode_params(enc.data(), enc.size(), &dec) && dec.size() == params.size();
+    stmt_interpolate(stmt.text, params, &sql);
+    stmt_interpolate(stmt.text, dec, &sql2);
+    printf("  encoding: %s\n", decoded && sql == sql2 ? "PASS" : "FAIL");
+
+    // TIME with days and a sign
+    Stmt_param t;
+    t.type = MYSQL_TYPE_TIME;
+    t.is_null = t.is_unsigned = false;
+    t.value = (const u_char*)"\x01\x02\x00\x00\x00\x03\x04\x05";
+    t.len = 8;
+    sql.clear();
+    stmt_temporal_text(t, &sql);
+    check("time", sql, "-51:04:05");
+
+    bool ok = parsed && !n_failed && parsed2 && parsed3 && truncated && decoded;
+    printf("%s\n", ok ? "ALL PASSED" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+#endif
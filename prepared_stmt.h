@@ -0,0 +1,65 @@
+#ifndef PREPARED_STMT_H
+#define PREPARED_STMT_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// moves *p past a length encoded integer, false if it runs past end
+bool read_lenenc(const u_char** p, const u_char* end, u_longlong* v);
+
+// One parameter of a COM_STMT_EXECUTE, as the binary protocol has it.
+struct Stmt_param
+{
+    u_char type; // enum_field_types
+    bool is_unsigned;
+    bool is_null;
+    // numbers in their fixed size, little endian; for strings and temporals
+    // the bytes after the length
+    const u_char* value;
+    u_int len;
+};
+
+// A statement prepared on a captured connection, what it takes to make sense
+// of the COM_STMT_EXECUTEs that refer to it.
+struct Prepared_stmt
+{
+    std::string text;
+    u_int n_params;
+    std::vector<u_char> types; // 2 bytes a parameter, from the last execute that sent them
+    // COM_STMT_SEND_LONG_DATA since the last execute, by parameter; the
+    // execute leaves those parameters out
+    std::vector<std::string> long_data;
+    std::vector<bool> has_long_data;
+
+    Prepared_stmt(): n_params(0) {}
+
+    // the COM_STMT_SEND_LONG_DATA payload after the statement id
+    void add_long_data(const u_char* data, u_int len);
+    // after every execute and on COM_STMT_RESET
+    void reset_long_data();
+    // decodes the parameters of a COM_STMT_EXECUTE, data past the command
+    // byte, and keeps the types if the execute sent them. The values point
+    // into data and long_data. False if the packet does not add up.
+    bool parse_execute(const u_char* data, u_int len, std::vector<Stmt_param>* params);
+};
+
+// The parameters in a form that stands on its own, for the replay: per
+// parameter the type, flags (0x80 unsigned, 0x01 NULL) and length (1, 1 and
+// 4 bytes), then the value. Decoded values point into data.
+void stmt_encode_params(const std::vector<Stmt_param>& params, std::vector<u_char>* out);
+bool stmt_decode_params(const u_char* data, u_int len, std::vector<Stmt_param>* params);
+
+// DATE, DATETIME, TIMESTAMP or TIME
+bool stmt_is_temporal(u_char type);
+// appends the value of a DATE, DATETIME, TIMESTAMP or TIME parameter the
+// way the server prints it, without quotes
+void stmt_temporal_text(const Stmt_param& p, std::string* out);
+// appends p as an SQL literal
+void stmt_param_literal(const Stmt_param& p, std::string* out);
+// text with its ? placeholders, those outside quotes and comments, replaced
+// by the parameters in order
+void stmt_interpolate(const std::string& text, const std::vector<Stmt_param>& params, std::string* out);
+
+#endif
@@ -2,12 +2,185 @@
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+// ovector pairs the shared match data needs, the most capture groups any
+// pattern has plus the whole match
+static uint32_t max_capture_pairs = 1;
+
+// per thread, reused from query to query so that apply() does not allocate
+struct Match_scratch
+{
+  std::vector<char> subject;
+  pcre2_match_data* match_data;
+  uint32_t n_pairs;
+
+  Match_scratch(): match_data(0), n_pairs(0) {}
+  ~Match_scratch() { pcre2_match_data_free(match_data); }
+
+  pcre2_match_data* get_match_data()
+  {
+    if (n_pairs < max_capture_pairs)
+    {
+      pcre2_match_data_free(match_data);
+
+      if (!(match_data = pcre2_match_data_create(max_capture_pairs, NULL)))
+        throw std::bad_alloc();
+
+      n_pairs = max_capture_pairs;
+    }
+
+    return match_data;
+  }
+};
+
+static thread_local Match_scratch scratch;
+
+// re[i] is '[', returns the index past the closing ']'
+static size_t skip_class(const char* re, size_t len, size_t i)
+{
+  i++;
+
+  if (i < len && re[i] == '^')
+    i++;
+  if (i < len && re[i] == ']')
+    i++; // a leading ] is literal
+
+  while (i < len && re[i] != ']')
+  {
+    if (re[i] == '\\')
+      i += 2;
+    else if (re[i] == '[' && i + 1 < len && re[i + 1] == ':')
+    {
+      const char* end = strstr(re + i + 2, ":]");
+      i = end ? end - re + 2 : len;
+    }
+    else
+      i++;
+  }
+
+  return i < len ? i + 1 : len;
+}
+
+// re[i] is '(', returns the index past the matching ')'
+static size_t skip_group(const char* re, size_t len, size_t i)
+{
+  int depth = 0;
+
+  while (i < len)
+  {
+    switch (re[i])
+    {
+      case '\\':
+        i += 2;
+        continue;
+      case '[':
+        i = skip_class(re, len, i);
+        continue;
+      case '(':
+        depth++;
+        break;
+      case ')':
+        if (!--depth)
+          return i + 1;
+        break;
+    }
+
+    i++;
+  }
+
+  return len;
+}
+
+// The longest run of plain characters every match of re must contain, or
+// empty if there is none or the regex uses something we would rather not
+// second guess (top level alternation, inline options, lookarounds). Getting
+// this wrong would silently drop matches, when in doubt a run is cut short.
+static std::string required_literal(const char* re)
+{
+  std::string best, cur;
+  size_t len = strlen(re);
+
+  for (size_t i = 0; i < len;)
+  {
+    bool is_literal = false;
+    char lit = re[i];
+    size_t next = i + 1;
+
+    switch (re[i])
+    {
+      case '|':
+        return std::string(); // groups are skipped whole, this is top level
+      case '\\':
+        // \d, \b, \1, \x41, \Q... end the run, \. \/ etc are literal
+        if (i + 1 < len && !isalnum((unsigned char)re[i + 1]))
+        {
+          is_literal = true;
+          lit = re[i + 1];
+        }
+        next = i + 2;
+        break;
+      case '[':
+        next = skip_class(re, len, i);
+        break;
+      case '(':
+        if (i + 2 < len && re[i + 1] == '?' && re[i + 2] != ':')
+          return std::string();
+        next = skip_group(re, len, i);
+        break;
+      case '.': case '^': case '$': case ')': case '*': case '+': case '?': case '{':
+        break;
+      default:
+        is_literal = true;
+    }
+
+    // a quantifier on what we just passed
+    size_t q = next;
+    bool optional = false;
+    bool repeated = false;
+
+    if (q < len && (re[q] == '?' || re[q] == '*'))
+    {
+      optional = true;
+      q++;
+    }
+    else if (q < len && re[q] == '+')
+    {
+      repeated = true;
+      q++;
+    }
+    else if (q < len && re[q] == '{')
+    {
+      const char* end = strchr(re + q, '}');
+      optional = true; // {0,n} or not a quantifier at all, either way
+      q = end ? end - re + 1 : q + 1;
+    }
+
+    if (q != next && q < len && (re[q] == '?' || re[q] == '+'))
+      q++; // lazy, possessive
+
+    if (is_literal && !optional)
+      cur += lit;
+
+    if (!is_literal || optional || repeated)
+    {
+      if (cur.length() > best.length())
+        best = cur;
+      cur.clear();
+    }
+
+    i = q;
+  }
+
+  return cur.length() > best.length() ? cur : best;
+}
 
 Query_pattern::Query_pattern(const char* search, const char* replace):replace_str(replace)
 {
   PCRE2_SIZE erroroffset;
-  PCRE2_SIZE *ovector;
   int errornumber;
 
   if (!(re = pcre2_compile((PCRE2_SPTR) search, PCRE2_ZERO_TERMINATED | PCRE2_DOTALL,
@@ -20,28 +193,33 @@ Query_pattern::Query_pattern(const char* search, const char* replace):replace_st
   }
 
   pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+
+  uint32_t capture_count = 0;
+  pcre2_pattern_info(re, PCRE2_INFO_CAPTURECOUNT, &capture_count);
+
+  if (capture_count + 1 > max_capture_pairs)
+    max_capture_pairs = capture_count + 1;
+
+  literal = required_literal(search);
 }
 
 const char* Query_pattern::apply(const char* subject, size_t subject_len, char* output_buf, size_t* out_len)
 {
-  struct strbuf {
-    char* ptr;
-    strbuf(const char* s, size_t len) {
-      ptr = new char[len]; // throws on error
-      for (size_t i = 0; i < len; i++)
-      {
-        if (s[i] == '\r' || s[i] == '\n')
-          ptr[i] = ' ';
-        else
-          ptr[i] = s[i];
-      }
-    }
+  if (scratch.subject.size() < subject_len)
+    scratch.subject.resize(subject_len);
+
+  char* subject_buf = scratch.subject.data();
 
-    ~strbuf() { delete ptr;}
-  } subject_buf(subject, subject_len);
+  for (size_t i = 0; i < subject_len; i++)
+  {
+    if (subject[i] == '\r' || subject[i] == '\n')
+      subject_buf[i] = ' ';
+    else
+      subject_buf[i] = subject[i];
+  }
 
-  int rc =  pcre2_substitute(re, (PCRE2_SPTR)subject_buf.ptr, subject_len, 0,
-                             PCRE2_SUBSTITUTE_GLOBAL | PCRE2_SUBSTITUTE_EXTENDED, 0, 0,
+  int rc =  pcre2_substitute(re, (PCRE2_SPTR)subject_buf, subject_len, 0,
+                             PCRE2_SUBSTITUTE_GLOBAL | PCRE2_SUBSTITUTE_EXTENDED, scratch.get_match_data(), 0,
                              (PCRE2_SPTR)replace_str.c_str(),
                              replace_str.length(), (PCRE2_UCHAR*)output_buf, out_len);
 
@@ -74,6 +252,192 @@ Query_pattern::~Query_pattern()
   pcre2_code_free(re);
 }
 
+Query_pattern_set::~Query_pattern_set()
+{
+  for (size_t i = 0; i < patterns.size(); i++)
+    delete patterns[i];
+}
+
+void Query_pattern_set::add(Query_pattern* qp)
+{
+  patterns.push_back(qp);
+  built = false;
+}
+
+void Query_pattern_set::build()
+{
+  // every byte some literal uses gets a class of its own, the rest share 0
+  memset(byte_class, 0, sizeof(byte_class));
+  n_classes = 1;
+  always.clear();
+
+  for (size_t i = 0; i < patterns.size(); i++)
+  {
+    const std::string& lit = patterns[i]->get_literal();
+
+    if (lit.empty())
+      always.push_back(i);
+
+    for (size_t j = 0; j < lit.length(); j++)
+    {
+      u_char c = lit[j];
+
+      if (!byte_class[c])
+        byte_class[c] = n_classes++;
+    }
+  }
+
+  // the trie of the literals, -1 for a missing edge
+  delta.assign(n_classes, -1);
+  matches.assign(1, std::vector<size_t>());
+
+  for (size_t i = 0; i < patterns.size(); i++)
+  {
+    const std::string& lit = patterns[i]->get_literal();
+
+    if (lit.empty())
+      continue;
+
+    size_t state = 0;
+
+    for (size_t j = 0; j < lit.length(); j++)
+    {
+      size_t edge = state * n_classes + byte_class[(u_char)lit[j]];
+
+      if (delta[edge] < 0)
+      {
+        delta[edge] = matches.size();
+        matches.push_back(std::vector<size_t>());
+        delta.resize(delta.size() + n_classes, -1);
+      }
+
+      state = delta[edge];
+    }
+
+    matches[state].push_back(i);
+  }
+
+  // breadth first, so the fail state of every node is done before the node,
+  // turns the trie into a DFA and links each state to the next one down
+  // its fail chain that completes a literal
+  size_t n_states = matches.size();
+  std::vector<int> fail(n_states, 0);
+  std::vector<int> queue;
+  out_link.assign(n_states, 0);
+
+  for (size_t c = 0; c < n_classes; c++)
+  {
+    if (delta[c] < 0)
+      delta[c] = 0;
+    else
+      queue.push_back(delta[c]);
+  }
+
+  for (size_t head = 0; head < queue.size(); head++)
+  {
+    int s = queue[head];
+
+    for (size_t c = 0; c < n_classes; c++)
+    {
+      int& t = delta[s * n_classes + c];
+      int fail_next = delta[fail[s] * n_classes + c];
+
+      if (t < 0)
+      {
+        t = fail_next;
+        continue;
+      }
+
+      fail[t] = fail_next;
+      out_link[t] = matches[fail_next].empty() ? out_link[fail_next] : fail_next;
+      queue.push_back(t);
+    }
+  }
+
+  built = true;
+}
+
+void Query_pattern_set::find_candidates(const char* subject, size_t subject_len,
+                                        std::vector<size_t>* candidates) const
+{
+  // seen[i] == epoch means rule i is already a candidate for this subject
+  static thread_local std::vector<unsigned int> seen;
+  static thread_local unsigned int epoch;
+
+  candidates->clear();
+
+  if (matches.size() <= 1)
+    return;
+
+  if (seen.size() < patterns.size())
+    seen.resize(patterns.size(), 0);
+
+  if (!++epoch)
+  {
+    std::fill(seen.begin(), seen.end(), 0);
+    epoch = 1;
+  }
+
+  int state = 0;
+
+  for (size_t i = 0; i < subject_len; i++)
+  {
+    u_char c = subject[i];
+
+    if (c == '\r' || c == '\n')
+      c = ' '; // as Query_pattern::apply() sees it
+
+    state = delta[state * n_classes + byte_class[c]];
+
+    // the root never completes a literal, 0 ends the chain
+    for (int s = matches[state].empty() ? out_link[state] : state; s; s = out_link[s])
+    {
+      for (size_t j = 0; j < matches[s].size(); j++)
+      {
+        size_t p = matches[s][j];
+
+        if (seen[p] != epoch)
+        {
+          seen[p] = epoch;
+          candidates->push_back(p);
+        }
+      }
+    }
+  }
+
+  std::sort(candidates->begin(), candidates->end());
+}
+
+const char* Query_pattern_set::apply(const char* subject, size_t subject_len, char* output_buf,
+                                     size_t* out_len) const
+{
+  static thread_local std::vector<size_t> candidates;
+  size_t out_size = *out_len;
+
+  assert(built || patterns.empty());
+  find_candidates(subject, subject_len, &candidates);
+
+  // both lists are sorted, walk them together to keep the rule order
+  size_t a = 0, c = 0;
+
+  while (a < always.size() || c < candidates.size())
+  {
+    size_t i;
+
+    if (c == candidates.size() || (a < always.size() && always[a] < candidates[c]))
+      i = always[a++];
+    else
+      i = candidates[c++];
+
+    *out_len = out_size;
+
+    if (patterns[i]->apply(subject, subject_len, output_buf, out_len))
+      return output_buf;
+  }
+
+  return NULL;
+}
+
 #ifdef TEST_QUERY_PATTERN
 
 struct Query_pattern_test
@@ -116,6 +480,170 @@ int main(int argc, char** argv)
       std::cerr << "Exception: " << e.what() << std::endl;
     }
   }
+
+  struct { const char* re; const char* literal; } literal_tests[] = {
+      {".*hash:\\s*(\\d+).*", "hash:"},
+      {".*\\bfrom orders\\b.*", "from orders"},
+      {"^select .* from t1 where id = \\d+$", " from t1 where id = "},
+      {"abc?de+f{2}", "ab"},
+      {"insert into (t1|t2) values", "insert into "},
+      {"x\\.y[.a-z]+z", "x.y"},
+      {"foo|bar", ""},
+      {"(?i)select", ""},
+  };
+  int n_failed = 0;
+
+  for (size_t i = 0; i < sizeof(literal_tests) / sizeof(literal_tests[0]); i++)
+  {
+    std::string lit = required_literal(literal_tests[i].re);
+
+    if (lit != literal_tests[i].literal)
+    {
+      printf("required_literal(%s): got '%s' expected '%s'\n", literal_tests[i].re, lit.c_str(),
+             literal_tests[i].literal);
+      n_failed++;
+    }
+  }
+
+  printf("required literals: %s\n", n_failed ? "FAIL" : "PASS");
+
+  // the set must pick the same rule as trying them one by one
+  const char* rules[][2] = {
+      {".*from orders where.*", "orders by filter"},
+      {".*from orders.*", "orders"},
+      {"^update (\\w+).*", "update $1"},
+      {".*from customers.*", "customers"},
+      {".*hash: (\\d+).*", "hash $1"},
+  };
+  const char* queries[] = {
+      "select * from orders where id = 1",
+      "select * from orders",
+      "select *\nfrom\norders",
+      "select * from\norders where x",
+      "update customers set a = 1",
+      "select * from customers /* hash: 7 */",
+      "select /* hash: 7 */ 1",
+      "select 1",
+  };
+  Query_pattern_set set;
+  std::vector<Query_pattern*> seq;
+
+  for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++)
+  {
+    set.add(new Query_pattern(rules[i][0], rules[i][1]));
+    seq.push_back(new Query_pattern(rules[i][0], rules[i][1]));
+  }
+
+  set.build();
+  int n_set_failed = 0;
+
+  for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++)
+  {
+    char set_buf[1024], seq_buf[1024];
+    size_t set_len = sizeof(set_buf), seq_len = sizeof(seq_buf);
+    const char* set_res = set.apply(queries[i], strlen(queries[i]), set_buf, &set_len);
+    const char* seq_res = NULL;
+
+    for (size_t j = 0; j < seq.size() && !seq_res; j++)
+    {
+      seq_len = sizeof(seq_buf);
+      seq_res = seq[j]->apply(queries[i], strlen(queries[i]), seq_buf, &seq_len);
+    }
+
+    if (!set_res != !seq_res || (set_res && std::string(set_res, set_len) != std::string(seq_res, seq_len)))
+    {
+      printf("set mismatch for %s\n", queries[i]);
+      n_set_failed++;
+    }
+  }
+
+  for (size_t i = 0; i < seq.size(); i++)
+    delete seq[i];
+
+  printf("pattern set: %s\n", n_set_failed ? "FAIL" : "PASS");
+  return n_failed || n_set_failed;
+}
+
+#endif
+
+#ifdef BENCH_QUERY_PATTERN
+
+#include <stdlib.h>
+#include <chrono>
+
+#define N_QUERIES 20000
+
+// n rules grouping by table, plus a catch-all by statement type, the way a
+// rules file generated from the schema looks
+static void bench(size_t n_rules)
+{
+  Query_pattern_set set;
+  std::vector<Query_pattern*> seq;
+  std::vector<std::string> queries;
+  char re[256], repl[256];
+
+  for (size_t i = 0; i < n_rules; i++)
+  {
+    snprintf(re, sizeof(re), ".*\\bfrom tbl_%zu\\b.*", i);
+    snprintf(repl, sizeof(repl), "tbl_%zu", i);
+    set.add(new Query_pattern(re, repl));
+    seq.push_back(new Query_pattern(re, repl));
+  }
+
+  set.add(new Query_pattern("^\\s*(\\w+).*", "other $1"));
+  seq.push_back(new Query_pattern("^\\s*(\\w+).*", "other $1"));
+  set.build();
+
+  // a third of the traffic goes to tables no rule knows about
+  for (size_t i = 0; i < 1000; i++)
+  {
+    char q[256];
+    snprintf(q, sizeof(q), "select id, name, created from tbl_%zu where id = %zu and status = 'active'",
+             (size_t)rand() % (n_rules + n_rules / 2), i);
+    queries.push_back(q);
+  }
+
+  char out[1024];
+  size_t out_len;
+  auto start = std::chrono::high_resolution_clock::now();
+
+  for (int i = 0; i < N_QUERIES; i++)
+  {
+    const std::string& q = queries[i % queries.size()];
+
+    for (size_t j = 0; j < seq.size(); j++)
+    {
+      out_len = sizeof(out);
+      if (seq[j]->apply(q.data(), q.length(), out, &out_len))
+        break;
+    }
+  }
+
+  double seq_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+  start = std::chrono::high_resolution_clock::now();
+
+  for (int i = 0; i < N_QUERIES; i++)
+  {
+    const std::string& q = queries[i % queries.size()];
+    out_len = sizeof(out);
+    set.apply(q.data(), q.length(), out, &out_len);
+  }
+
+  double set_secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+  printf("%5zu rules  one by one: %10.0f queries/s  pattern set: %10.0f queries/s\n", n_rules + 1,
+         N_QUERIES / seq_secs, N_QUERIES / set_secs);
+
+  for (size_t i = 0; i < seq.size(); i++)
+    delete seq[i];
+}
+
+int main()
+{
+  bench(10);
+  bench(200);
+  bench(2000);
+  return 0;
 }
 
 #endif
@@ -3,6 +3,8 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
+#include <sys/types.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
@@ -20,13 +22,51 @@ class Query_pattern
 protected:
   pcre2_code* re;
   std::string replace_str;
+  std::string literal; // appears in every subject the regex matches, may be empty
 
 public:
   Query_pattern(const char* search, const char* replace);
   ~Query_pattern();
 
   const char* apply(const char* subject, size_t subject_len, char* output_buf, size_t* out_len);
+  const std::string& get_literal() const { return literal; }
+};
+
+// The --query-pattern-regex rules, tried in order, the first one that
+// matches wins. Most rules carry a literal any match must contain, e.g.
+// "from orders" in .*\bfrom orders\b.*; one Aho-Corasick pass over the query
+// finds the rules whose literal is present and only those get to run their
+// regex, the rest are skipped without touching PCRE2.
+class Query_pattern_set
+{
+protected:
+  std::vector<Query_pattern*> patterns;
+  std::vector<size_t> always; // rules without a literal, always candidates
+
+  // the automaton, over byte classes rather than bytes to keep it small
+  u_char byte_class[256];
+  size_t n_classes;
+  std::vector<int> delta; // n_states * n_classes
+  std::vector<int> out_link; // next state on the fail chain with matches
+  std::vector<std::vector<size_t> > matches; // rules whose literal ends here
+  bool built;
+
+  void find_candidates(const char* subject, size_t subject_len, std::vector<size_t>* candidates) const;
+
+public:
+  Query_pattern_set(): n_classes(0), built(false) {}
+  ~Query_pattern_set();
+
+  // takes ownership
+  void add(Query_pattern* qp);
+  // must be called after the last add() and before apply()
+  void build();
+  size_t size() const { return patterns.size(); }
+  Query_pattern* operator[](size_t i) const { return patterns[i]; }
 
+  // like Query_pattern::apply() for the first rule that matches, safe to
+  // call from several threads at once
+  const char* apply(const char* subject, size_t subject_len, char* output_buf, size_t* out_len) const;
 };
 
 #endif
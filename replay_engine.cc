@@ -0,0 +1,1475 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <mysqld_error.h>
+#include <stdexcept>
+
+#include "replay_engine.h"
+#include "packet_alloc.h"
+#include "mysql_stream.h"
+#include "mysql_stream_manager.h"
+
+// epoll_event.data.u64 for the loop's own descriptors, sessions start above
+#define WAKE_ID 0
+#define TIMER_ID 1
+#define FIRST_SESSION_ID 2
+
+#define MAX_EVENTS 64
+
+// timer wheel resolution, about what a timerfd wakeup can do anyway
+#define TIMER_TICK_NS 10000
+// the timerfd is armed at most this far out, the wheel is looked at again then
+#define MAX_TIMER_WAIT_TICKS (3600ULL * 1000000000 / TIMER_TICK_NS)
+
+void Replay_lag_stats::record(Time_Point scheduled, Time_Point start)
+{
+    std::chrono::duration<double> lag = start - scheduled;
+    hist.record(lag.count() > 0 ? lag.count() : 0);
+
+    if (first_start == INVALID_TIME || start < first_start)
+    {
+        first_start = start;
+        first_scheduled = scheduled;
+    }
+
+    if (last_start == INVALID_TIME || start > last_start)
+    {
+        last_start = start;
+        last_scheduled = scheduled;
+    }
+}
+
+void Replay_lag_stats::merge(const Replay_lag_stats& other)
+{
+    hist.merge(other.hist);
+
+    if (other.first_start != INVALID_TIME && (first_start == INVALID_TIME || other.first_start < first_start))
+    {
+        first_start = other.first_start;
+        first_scheduled = other.first_scheduled;
+    }
+
+    if (other.last_start != INVALID_TIME && (last_start == INVALID_TIME || other.last_start > last_start))
+    {
+        last_start = other.last_start;
+        last_scheduled = other.last_scheduled;
+    }
+}
+
+double Replay_lag_stats::achieved_speed() const
+{
+    if (first_start == INVALID_TIME || last_start <= first_start)
+        return 0.0;
+
+    // the schedule is already divided by --replay-speed
+    std::chrono::duration<double> scheduled = last_scheduled - first_scheduled;
+    std::chrono::duration<double> actual = last_start - first_start;
+    return replay_speed * scheduled.count() / actual.count();
+}
+
+void Replay_lag_stats::print(FILE* fp, const char* label) const
+{
+    fprintf(fp, "%s N: %llu p50: %gs p95: %gs p99: %gs p99.9: %gs max: %gs", label, hist.count(),
+            hist.percentile(50), hist.percentile(95), hist.percentile(99), hist.percentile(99.9),
+            hist.percentile(100));
+
+    if (achieved_speed() > 0)
+        fprintf(fp, " achieved speed: %.2fx of %gx", achieved_speed(), replay_speed);
+
+    fputc('\n', fp);
+}
+
+Replay_query* Replay_query::create(u_int len, u_int n_refs)
+{
+    Replay_query* q = new (Packet_allocator::alloc(sizeof(Replay_query) + len)) Replay_query;
+    q->n_refs = n_refs;
+    q->len = len;
+    q->cmd = COM_QUERY;
+    q->stmt_id = 0;
+    return q;
+}
+
+size_t Replay_query::release(Replay_query* q)
+{
+    if (--q->n_refs)
+        return 0;
+
+    size_t size = sizeof(Replay_query) + q->len;
+    q->~Replay_query();
+    Packet_allocator::free(q, size);
+    return size;
+}
+
+void Replay_exec_stats::record(Time_Point start, Time_Point end)
+{
+    std::chrono::duration<double> exec_time = end - start;
+    exec_hist.record(exec_time.count());
+    n_queries++;
+
+    if (first_start == INVALID_TIME || start < first_start)
+        first_start = start;
+
+    if (last_end == INVALID_TIME || end > last_end)
+        last_end = end;
+}
+
+void Replay_exec_stats::merge(const Replay_exec_stats& other)
+{
+    exec_hist.merge(other.exec_hist);
+    n_queries += other.n_queries;
+
+    if (other.first_start != INVALID_TIME && (first_start == INVALID_TIME || other.first_start < first_start))
+        first_start = other.first_start;
+
+    if (other.last_end != INVALID_TIME && (last_end == INVALID_TIME || other.last_end > last_end))
+        last_end = other.last_end;
+}
+
+void Replay_exec_stats::print(FILE* fp) const
+{
+    std::chrono::duration<double> span = last_end - first_start;
+    fprintf(fp, "achieved QPS: %g N: %llu p50: %gs p95: %gs p99: %gs max: %gs",
+            n_queries && span.count() > 0 ? n_queries / span.count() : 0.0, n_queries,
+            exec_hist.percentile(50), exec_hist.percentile(95), exec_hist.percentile(99), exec_hist.percentile(100));
+}
+
+Replay_session::Replay_session(Replay_loop* loop, u_longlong id, u_int clone, Clock::duration offset): loop(loop),
+    id(id), clone(clone), offset(offset), state(IDLE), con(0), fd(-1), timer_gen(0),
+    has_slot(false), warm_up(false), needs_reset(false), cur(0), res(0), connect_ret(0), query_err(0), row(0), cur_stmt(0),
+    closing_stmt(0), stmt_ret(0)
+{
+}
+
+Replay_session::~Replay_session()
+{
+    close_connection();
+
+    // with the connection gone this only frees the handles
+    for (Stmt_map::iterator it = stmts.begin(); it != stmts.end(); it++)
+        mysql_stmt_close(it->second.stmt);
+
+    if (cur)
+        loop->engine->release_query(cur);
+
+    Replay_item item;
+
+    while (queue.pop(&item))
+        loop->engine->release_query(item.query);
+}
+
+void Replay_session::push(Replay_query* q, Time_Point scheduled_ts)
+{
+    Replay_item item;
+    item.query = q;
+    item.scheduled_ts = scheduled_ts;
+
+    if (queue.push(item))
+        loop->wake(this);
+}
+
+void Replay_session::close()
+{
+    Replay_loop* l = loop; // once closed the session may be gone any moment
+
+    if (queue.close())
+        l->wake(this);
+}
+
+Replay_query* Replay_session::pop(Time_Point* scheduled_ts, bool* done)
+{
+    Replay_item item;
+    *done = false;
+
+    for (;;)
+    {
+        // checked first, whatever was pushed before close() is there to pop
+        bool closed = queue.closed();
+
+        if (queue.pop(&item))
+        {
+            *scheduled_ts = item.scheduled_ts;
+            return item.query;
+        }
+
+        if (closed)
+        {
+            *done = true;
+            return 0;
+        }
+
+        if (queue.park())
+            return 0;
+    }
+}
+
+bool Replay_session::init_connection()
+{
+    if (!(con = mysql_init(NULL)))
+    {
+        fprintf(stderr, "Error initializing stream replay connection\n");
+        return false;
+    }
+
+    try
+    {
+        setup_for_ssl(con, replay_ssl_ca, replay_ssl_cert, replay_ssl_key);
+    }
+    catch (const std::runtime_error& e)
+    {
+        fprintf(stderr, "Error initializing SSL: %s\n", e.what());
+        mysql_close(con);
+        con = 0;
+        return false;
+    }
+
+    if (mysql_options(con, MYSQL_OPT_NONBLOCK, 0))
+    {
+        fprintf(stderr, "Error enabling non-blocking mode: %s\n", mysql_error(con));
+        mysql_close(con);
+        con = 0;
+        return false;
+    }
+
+    return true;
+}
+
+void Replay_session::close_connection()
+{
+    if (!con)
+        return;
+
+    loop->unwatch(this);
+    mysql_close(con);
+    con = 0;
+}
+
+void Replay_session::drop_query()
+{
+    if (cur)
+        loop->engine->release_query(cur);
+
+    cur = 0;
+
+    if (has_slot)
+    {
+        has_slot = false;
+        loop->engine->release_slot();
+    }
+}
+
+void Replay_session::finish_query()
+{
+    Time_Point end = Clock::now();
+    std::chrono::duration<double> elapsed = end - start;
+
+    if (cur->cmd == COM_STMT_EXECUTE)
+        loop->engine->record_query(cur_stmt->text.data(), cur_stmt->text.size(), elapsed.count());
+    else
+        loop->engine->record_query(cur->text(), cur->len, elapsed.count());
+
+    // at a fixed rate a query is late from the moment it was due, counting
+    // from the actual start would hide the queueing behind a slow server
+    if (loop->engine->fixed_rate())
+        loop->record_exec(clone, cur_ts, end);
+    else
+        loop->record_exec(clone, start, end);
+
+    drop_query();
+}
+
+bool Replay_session::bind_params()
+{
+    MYSQL_STMT* stmt = cur_stmt->stmt;
+
+    if (!stmt_decode_params((const u_char*)cur->text(), cur->len, &params) ||
+        params.size() != mysql_stmt_param_count(stmt))
+        return false;
+
+    if (params.empty())
+        return true;
+
+    size_t n = params.size();
+    binds.assign(n, MYSQL_BIND());
+    bind_lens.resize(n);
+    bind_nulls.resize(n);
+    bind_values.resize(n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const Stmt_param& p = params[i];
+        MYSQL_BIND& b = binds[i];
+        std::string& value = bind_values[i];
+        bool as_text = !p.is_null && stmt_is_temporal(p.type);
+
+        // copied so that the numbers are aligned; the temporals go as text,
+        // the library would want them as MYSQL_TIME
+        value.clear();
+
+        if (as_text)
+            stmt_temporal_text(p, &value);
+        else if (!p.is_null)
+            value.assign((const char*)p.value, p.len);
+
+        bind_lens[i] = value.size();
+        bind_nulls[i] = p.is_null;
+        b.buffer_type = as_text ? MYSQL_TYPE_STRING : (enum enum_field_types)p.type;
+        b.buffer = &value[0];
+        b.buffer_length = value.size();
+        b.length = &bind_lens[i];
+        b.is_null = &bind_nulls[i];
+        b.is_unsigned = p.is_unsigned;
+    }
+
+    return !mysql_stmt_bind_param(stmt, binds.data());
+}
+
+int Replay_session::close_stmt(Stmt_map::iterator it)
+{
+    closing_stmt = it->second.stmt;
+    stmts.erase(it);
+    state = STMT_CLOSING;
+    return mysql_stmt_close_start(&stmt_ret, closing_stmt);
+}
+
+bool Replay_session::start_stmt_command(int* status)
+{
+    Stmt_map::iterator it = stmts.find(cur->stmt_id);
+
+    switch (cur->cmd)
+    {
+    case COM_STMT_PREPARE:
+        // an id the capture reuses without closing it first is prepared
+        // over the old statement
+        cur_stmt = &stmts[cur->stmt_id];
+
+        if (!cur_stmt->stmt && !(cur_stmt->stmt = mysql_stmt_init(con)))
+        {
+            fprintf(stderr, "Error initializing statement: %s\n", mysql_error(con));
+            stmts.erase(cur->stmt_id);
+            break;
+        }
+
+        cur_stmt->text.assign(cur->text(), cur->len);
+        state = PREPARING;
+        *status = mysql_stmt_prepare_start(&query_err, cur_stmt->stmt, cur->text(), cur->len);
+        return true;
+    case COM_STMT_EXECUTE:
+        if (it == stmts.end())
+            break; // the prepare failed
+
+        cur_stmt = &it->second;
+
+        if (!bind_params())
+        {
+            fprintf(stderr, "Error binding parameters: %s\n", cur_stmt->text.c_str());
+            break;
+        }
+
+        state = EXECUTING;
+        *status = mysql_stmt_execute_start(&query_err, cur_stmt->stmt);
+        return true;
+    case COM_STMT_CLOSE:
+        if (it == stmts.end())
+            break;
+
+        *status = close_stmt(it);
+        return true;
+    }
+
+    drop_query();
+    state = IDLE;
+    return false;
+}
+
+int Replay_session::cont(int ready)
+{
+    switch (state)
+    {
+    case CONNECTING:
+        return mysql_real_connect_cont(&connect_ret, con, ready);
+    case QUERYING:
+        return mysql_real_query_cont(&query_err, con, ready);
+    case FETCHING:
+        return mysql_fetch_row_cont(&row, res, ready);
+    case FREEING:
+        return mysql_free_result_cont(res, ready);
+    case PREPARING:
+        return mysql_stmt_prepare_cont(&query_err, cur_stmt->stmt, ready);
+    case EXECUTING:
+        return mysql_stmt_execute_cont(&query_err, cur_stmt->stmt, ready);
+    case STORING:
+        return mysql_stmt_store_result_cont(&query_err, cur_stmt->stmt, ready);
+    case STMT_FREEING:
+        return mysql_stmt_free_result_cont(&stmt_ret, cur_stmt->stmt, ready);
+    case STMT_CLOSING:
+        return mysql_stmt_close_cont(&stmt_ret, closing_stmt, ready);
+    case RESETTING:
+        return mysql_change_user_cont(&stmt_ret, con, ready);
+    default:
+        return 0;
+    }
+}
+
+bool Replay_session::run(int ready)
+{
+    param_info* info = loop->engine->sm->info;
+    int status = 0;
+
+    if (ready)
+    {
+        // a stale event for an operation that has already completed
+        if (state == IDLE || state == SCHEDULED || state == WAITING_SLOT)
+            return true;
+
+        timer_gen++; // the wait is over, whichever of I/O or timeout ended it
+
+        if ((status = cont(ready)))
+        {
+            loop->watch(this, status);
+            return true;
+        }
+    }
+
+    // here the operation the state stands for, if any, has completed
+    for (;;)
+    {
+        switch (state)
+        {
+        case IDLE:
+        {
+            bool done;
+
+            if (!(cur = pop(&cur_ts, &done)))
+            {
+                if (!done)
+                    return true;
+
+                if (warm_up)
+                {
+                    warm_up = false;
+                    state = SCHEDULED;
+                    continue;
+                }
+
+                // the pool's next user is not to find them prepared
+                if (con && !stmts.empty())
+                {
+                    status = close_stmt(stmts.begin());
+                    break;
+                }
+
+                // a client side error leaves the connection in doubt
+                if (con && mysql_errno(con) < 2000)
+                {
+                    // nor is it to find the transaction, the variables or
+                    // the database the capture left behind
+                    if (needs_reset)
+                    {
+                        state = RESETTING;
+                        status = mysql_change_user_start(&stmt_ret, con, replay_user, replay_pw, replay_db);
+                        break;
+                    }
+
+                    loop->unwatch(this);
+                    loop->return_connection(con);
+                    con = 0;
+                }
+
+                close_connection();
+                return false;
+            }
+
+            if (loop->engine->stopped())
+            {
+                drop_query();
+                continue;
+            }
+
+            state = SCHEDULED;
+
+            if (cur_ts != INVALID_TIME && Clock::now() < cur_ts)
+            {
+                loop->add_timer(this, cur_ts, 0);
+                return true;
+            }
+
+            continue;
+        }
+        case SCHEDULED:
+            if (!cur) // warming up
+            {
+                if (con) // connected, off to the pool
+                {
+                    state = IDLE;
+                    continue;
+                }
+            }
+            else
+            {
+                if (!has_slot && loop->engine->n_slots)
+                {
+                    if (!loop->engine->acquire_slot(this))
+                    {
+                        state = WAITING_SLOT;
+                        return true;
+                    }
+
+                    has_slot = true;
+                }
+
+                if (!con)
+                    con = loop->take_connection();
+            }
+
+            if (!con)
+            {
+                if (!init_connection())
+                {
+                    drop_query();
+                    state = IDLE;
+                    continue;
+                }
+
+                state = CONNECTING;
+                connect_start = Clock::now();
+                status = mysql_real_connect_start(&connect_ret, con, replay_host, replay_user, replay_pw,
+                                                  replay_db, replay_port, NULL, 0);
+                break;
+            }
+
+            start = Clock::now();
+            needs_reset = true;
+
+            if (cur_ts != INVALID_TIME)
+                loop->record_lag(cur_ts, start);
+
+            if (cur->cmd != COM_QUERY)
+            {
+                if (!start_stmt_command(&status))
+                    continue;
+
+                break;
+            }
+
+            state = QUERYING;
+            status = mysql_real_query_start(&query_err, con, cur->text(), cur->len);
+            break;
+        case CONNECTING:
+            if (!connect_ret)
+            {
+                fprintf(stderr, "Error connecting for replay: %s\n", mysql_error(con));
+                close_connection();
+                drop_query();
+                state = IDLE;
+                continue;
+            }
+
+            loop->record_connect(connect_start, Clock::now());
+            state = SCHEDULED;
+            continue;
+        case WAITING_SLOT:
+            // woken up by release_slot(), which handed the slot over
+            has_slot = true;
+            state = SCHEDULED;
+            continue;
+        case QUERYING:
+            if (query_err)
+            {
+                fprintf(stderr, "Error running query: %.*s : %s\n", cur->len, cur->text(), mysql_error(con));
+
+                if (info->assert_on_query_error &&
+                    !(info->ignore_dup_key_errors && mysql_errno(con) == ER_DUP_ENTRY))
+                    assert(false);
+
+                finish_query();
+                state = IDLE;
+                continue;
+            }
+
+            if (!(res = mysql_use_result(con))) // no result set, e.g. update
+            {
+                finish_query();
+                state = IDLE;
+                continue;
+            }
+
+            state = FETCHING;
+            status = mysql_fetch_row_start(&row, res);
+            break;
+        case FETCHING:
+            if (row)
+            {
+                status = mysql_fetch_row_start(&row, res);
+                break;
+            }
+
+            state = FREEING;
+            status = mysql_free_result_start(res);
+            break;
+        case FREEING:
+            res = 0;
+            finish_query();
+            state = IDLE;
+            continue;
+        case PREPARING:
+            if (query_err)
+            {
+                fprintf(stderr, "Error preparing statement: %.*s : %s\n", cur->len, cur->text(),
+                        mysql_stmt_error(cur_stmt->stmt));
+                // nothing was prepared, closing it does not go to the server
+                mysql_stmt_close(cur_stmt->stmt);
+                stmts.erase(cur->stmt_id);
+            }
+
+            drop_query(); // only the executes count
+            state = IDLE;
+            continue;
+        case EXECUTING:
+            if (query_err)
+            {
+                fprintf(stderr, "Error executing statement: %s : %s\n", cur_stmt->text.c_str(),
+                        mysql_stmt_error(cur_stmt->stmt));
+
+                if (info->assert_on_query_error &&
+                    !(info->ignore_dup_key_errors && mysql_stmt_errno(cur_stmt->stmt) == ER_DUP_ENTRY))
+                    assert(false);
+
+                finish_query();
+                state = IDLE;
+                continue;
+            }
+
+            if (!mysql_stmt_field_count(cur_stmt->stmt))
+            {
+                finish_query();
+                state = IDLE;
+                continue;
+            }
+
+            state = STORING;
+            status = mysql_stmt_store_result_start(&query_err, cur_stmt->stmt);
+            break;
+        case STORING:
+            state = STMT_FREEING;
+            status = mysql_stmt_free_result_start(&stmt_ret, cur_stmt->stmt);
+            break;
+        case STMT_FREEING:
+            finish_query();
+            state = IDLE;
+            continue;
+        case STMT_CLOSING:
+            closing_stmt = 0;
+            drop_query(); // a close from the capture, or none at the end
+            state = IDLE;
+            continue;
+        case RESETTING:
+            if (stmt_ret)
+            {
+                fprintf(stderr, "Error resetting a replay connection, closing it: %s\n", mysql_error(con));
+                close_connection();
+            }
+
+            needs_reset = false;
+            state = IDLE;
+            continue;
+        }
+
+        if (status)
+        {
+            loop->watch(this, status);
+            return true;
+        }
+    }
+}
+
+Replay_loop::Replay_loop(Replay_engine* engine): engine(engine), epoll_fd(-1), wake_fd(-1), timer_fd(-1), th(0),
+    stop(false), wheel_base(Clock::now()), armed_ts(INVALID_TIME), n_reused(0)
+{
+    struct epoll_event ev;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    {
+        throw std::runtime_error(std::string("Could not set up the replay event loop: ") + strerror(errno));
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = WAKE_ID;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev))
+        throw std::runtime_error(std::string("epoll_ctl failed: ") + strerror(errno));
+
+    ev.data.u64 = TIMER_ID;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev))
+        throw std::runtime_error(std::string("epoll_ctl failed: ") + strerror(errno));
+
+    th = new std::thread(&Replay_loop::run, this);
+}
+
+Replay_loop::~Replay_loop()
+{
+    shutdown();
+
+    for (std::unordered_map<u_longlong, Replay_session*>::iterator it = sessions.begin();
+         it != sessions.end(); it++)
+    {
+        delete it->second;
+    }
+
+    if (timer_fd >= 0)
+        ::close(timer_fd);
+    if (wake_fd >= 0)
+        ::close(wake_fd);
+    if (epoll_fd >= 0)
+        ::close(epoll_fd);
+}
+
+void Replay_loop::shutdown()
+{
+    if (!th)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+
+    u_longlong one = 1;
+
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+        perror("eventfd write");
+
+    th->join();
+    delete th;
+    th = 0;
+}
+
+void Replay_loop::wake(Replay_session* s)
+{
+    bool was_empty;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        was_empty = inbox.empty();
+        inbox.push_back(s);
+    }
+
+    u_longlong one = 1;
+
+    if (was_empty && write(wake_fd, &one, sizeof(one)) != sizeof(one))
+        perror("eventfd write");
+}
+
+void Replay_loop::watch(Replay_session* s, int status)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // one shot, every wait re-arms with what the library asks for this time
+    ev.events = EPOLLONESHOT;
+    ev.data.u64 = s->id;
+
+    if (status & MYSQL_WAIT_READ)
+        ev.events |= EPOLLIN;
+    if (status & MYSQL_WAIT_WRITE)
+        ev.events |= EPOLLOUT;
+    if (status & MYSQL_WAIT_EXCEPT)
+        ev.events |= EPOLLPRI;
+
+    if (s->fd < 0)
+    {
+        s->fd = mysql_get_socket(s->con);
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd, &ev))
+            perror("epoll_ctl");
+    }
+    else if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev))
+    {
+        perror("epoll_ctl");
+    }
+
+    s->timer_gen++;
+
+    if (status & MYSQL_WAIT_TIMEOUT)
+        add_timer(s, Clock::now() + std::chrono::milliseconds(mysql_get_timeout_value_ms(s->con)),
+                  MYSQL_WAIT_TIMEOUT);
+}
+
+void Replay_loop::unwatch(Replay_session* s)
+{
+    if (s->fd < 0)
+        return;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+    s->fd = -1;
+}
+
+u_longlong Replay_loop::to_tick(Time_Point ts) const
+{
+    if (ts <= wheel_base)
+        return 0;
+
+    // rounded up, a timer must not fire early
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(ts - wheel_base).count();
+    return (ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+}
+
+void Replay_loop::add_timer(Replay_session* s, Time_Point ts, int ready)
+{
+    Timer t;
+    t.session_id = s->id;
+    t.gen = s->timer_gen;
+    t.ready = ready;
+    timers.add(to_tick(ts), t);
+}
+
+void Replay_loop::arm_timer()
+{
+    u_longlong tick;
+    Time_Point next = INVALID_TIME;
+
+    if (timers.next_expiry(&tick))
+    {
+        u_longlong max_tick = to_tick(Clock::now()) + MAX_TIMER_WAIT_TICKS;
+
+        // clamped before the multiplication can overflow
+        if (tick > max_tick)
+            tick = max_tick;
+
+        next = wheel_base + std::chrono::nanoseconds(tick * TIMER_TICK_NS);
+    }
+
+    if (next == armed_ts)
+        return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+
+    if (next != INVALID_TIME)
+    {
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next - Clock::now()).count();
+
+        if (ns <= 0)
+            ns = 1; // 0 would disarm
+
+        its.it_value.tv_sec = ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+    }
+
+    if (timerfd_settime(timer_fd, 0, &its, NULL))
+        perror("timerfd_settime");
+
+    armed_ts = next;
+}
+
+void Replay_loop::fire_timers()
+{
+    u_longlong n;
+
+    if (read(timer_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        perror("timerfd read");
+
+    armed_ts = INVALID_TIME;
+    long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - wheel_base).count();
+    expired.clear();
+    timers.advance(ns / TIMER_TICK_NS, &expired);
+
+    for (size_t i = 0; i < expired.size(); i++)
+    {
+        const Timer& t = expired[i];
+        std::unordered_map<u_longlong, Replay_session*>::iterator it = sessions.find(t.session_id);
+
+        if (it != sessions.end() && it->second->timer_gen == t.gen)
+            resume(it->second, t.ready);
+    }
+}
+
+void Replay_loop::record_exec(u_int clone, Time_Point start, Time_Point end)
+{
+    u_int step = engine->step_of(start);
+    std::lock_guard<std::mutex> guard(stats_lock);
+
+    if (step >= steps.size())
+        steps.resize(step + 1);
+
+    if (clone >= clones.size())
+        clones.resize(clone + 1);
+
+    steps[step].record(start, end);
+    clones[clone].record(start, end);
+}
+
+void Replay_loop::record_connect(Time_Point start, Time_Point end)
+{
+    std::chrono::duration<double> connect_time = end - start;
+    std::lock_guard<std::mutex> guard(stats_lock);
+    connect_hist.record(connect_time.count());
+}
+
+MYSQL* Replay_loop::take_connection()
+{
+    if (idle_cons.empty())
+        return 0;
+
+    MYSQL* con = idle_cons.back();
+    idle_cons.pop_back();
+    std::lock_guard<std::mutex> guard(stats_lock);
+    n_reused++;
+    return con;
+}
+
+void Replay_loop::return_connection(MYSQL* con)
+{
+    idle_cons.push_back(con);
+}
+
+void Replay_loop::record_lag(Time_Point scheduled, Time_Point start)
+{
+    std::lock_guard<std::mutex> guard(stats_lock);
+    lag_total.record(scheduled, start);
+    lag_window.record(scheduled, start);
+}
+
+void Replay_loop::drain_inbox()
+{
+    std::vector<Replay_session*> ready;
+    u_longlong n;
+
+    if (read(wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ready.swap(inbox);
+    }
+
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        sessions[ready[i]->id] = ready[i];
+        resume(ready[i], 0);
+    }
+}
+
+void Replay_loop::resume(Replay_session* s, int ready)
+{
+    if (s->run(ready))
+        return;
+
+    sessions.erase(s->id);
+    delete s;
+    engine->session_done();
+}
+
+void Replay_loop::run()
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    mysql_thread_init();
+
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            if (stop)
+                break;
+        }
+
+        arm_timer();
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+        if (n < 0)
+        {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            u_longlong id = events[i].data.u64;
+
+            if (id == WAKE_ID)
+            {
+                drain_inbox();
+                continue;
+            }
+
+            if (id == TIMER_ID)
+            {
+                fire_timers();
+                continue;
+            }
+
+            // the session may have finished earlier in this batch
+            std::unordered_map<u_longlong, Replay_session*>::iterator it = sessions.find(id);
+
+            if (it == sessions.end())
+                continue;
+
+            int ready = 0;
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                ready |= MYSQL_WAIT_READ;
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                ready |= MYSQL_WAIT_WRITE;
+            if (events[i].events & EPOLLPRI)
+                ready |= MYSQL_WAIT_EXCEPT;
+
+            resume(it->second, ready);
+        }
+    }
+
+    for (size_t i = 0; i < idle_cons.size(); i++)
+        mysql_close(idle_cons[i]);
+
+    idle_cons.clear();
+    mysql_thread_end();
+}
+
+Replay_engine::Replay_engine(Mysql_stream_manager* sm, u_int n_loops): sm(sm), mode(sm->info->replay_mode),
+    next_loop(0), next_id(FIRST_SESSION_ID), n_sessions(0), stopping(false), reporter(0), ramp_monitor(0),
+    start_ts(INVALID_TIME), n_scheduled(0), ramp_over(false), broken_step(-1),
+    n_slots(sm->info->replay_concurrency), n_in_flight(0),
+    max_buffered((size_t)sm->info->max_buffered_mb << 20), resume_buffered(max_buffered / 4 * 3), buffered(0),
+    reader_stalled(false), n_stalls(0), stall_secs(0.0)
+{
+    for (u_int i = 0; i < n_loops; i++)
+        loops.push_back(new Replay_loop(this));
+
+    if (sm->info->replay_prewarm)
+        warm_up(sm->info->replay_prewarm);
+}
+
+void Replay_engine::warm_up(u_int n_cons)
+{
+    Time_Point begin = Clock::now();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        n_sessions += n_cons;
+    }
+
+    // a session with nothing to replay connects and hands the connection to
+    // its loop's pool, the loops do theirs in parallel
+    for (u_int i = 0; i < n_cons; i++)
+    {
+        Replay_session* s = new Replay_session(loops[next_loop++ % loops.size()], next_id++, 0,
+                                               Clock::duration::zero());
+        s->warm_up = true;
+
+        if (s->queue.close())
+            s->loop->wake(s);
+    }
+
+    std::unique_lock<std::mutex> lk(lock);
+
+    while (n_sessions)
+        all_done.wait(lk);
+
+    std::chrono::duration<double> took = Clock::now() - begin;
+    size_t n_warm = 0;
+
+    // the loops are idle, nothing else touches the pools yet
+    for (size_t i = 0; i < loops.size(); i++)
+        n_warm += loops[i]->idle_cons.size();
+
+    fprintf(stderr, "Replay warm-up: %zu of %u connections in %gs\n", n_warm, n_cons, took.count());
+}
+
+void Replay_engine::start(Time_Point start_ts)
+{
+    this->start_ts = start_ts;
+
+    if (sm->info->replay_lag_interval > 0)
+        reporter = new std::thread(&Replay_engine::run_reporter, this, sm->info->replay_lag_interval);
+
+    if (mode == REPLAY_RAMP)
+        ramp_monitor = new std::thread(&Replay_engine::run_ramp_monitor, this);
+}
+
+Time_Point Replay_engine::schedule(Mysql_stream_manager* sm, Mysql_packet* query_pkt, Replay_session* s)
+{
+    const param_info* info = sm->info;
+
+    switch (mode)
+    {
+    case REPLAY_TIMED:
+    {
+        Time_Point ts = sm->get_scheduled_ts(query_pkt);
+        return ts == INVALID_TIME ? ts : ts + s->offset;
+    }
+    case REPLAY_CLOSED:
+        return INVALID_TIME;
+    default:
+        break;
+    }
+
+    u_longlong n = n_scheduled++;
+    double offset;
+
+    if (mode == REPLAY_OPEN)
+    {
+        offset = n / info->replay_qps;
+    }
+    else
+    {
+        // find the step the n-th query falls in, each step sends qps * secs
+        u_int step = 0;
+        double before = 0;
+
+        while (n >= before + step_target_qps(step) * info->ramp_step_secs)
+            before += step_target_qps(step++) * info->ramp_step_secs;
+
+        offset = step * info->ramp_step_secs + (n - before) / step_target_qps(step);
+    }
+
+    return start_ts + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(offset));
+}
+
+Replay_query* Replay_engine::new_query(u_int len, u_int n_refs)
+{
+    Replay_query* q = Replay_query::create(len, n_refs);
+    buffered += sizeof(Replay_query) + len;
+    return q;
+}
+
+void Replay_engine::release_query(Replay_query* q)
+{
+    size_t size = Replay_query::release(q);
+
+    if (!size)
+        return;
+
+    // the reader sets reader_stalled before it looks at buffered, so either
+    // it sees this release or this sees it stalled
+    if ((buffered -= size) <= resume_buffered && reader_stalled)
+    {
+        std::lock_guard<std::mutex> guard(budget_lock);
+        budget_freed.notify_all();
+    }
+}
+
+void Replay_engine::stall_reader()
+{
+    Time_Point begin = Clock::now();
+
+    {
+        std::unique_lock<std::mutex> lk(budget_lock);
+        reader_stalled = true;
+
+        // down to three quarters, so that the reader does not stop and go on
+        // every other query
+        while (buffered > resume_buffered)
+            budget_freed.wait(lk);
+
+        reader_stalled = false;
+    }
+
+    std::chrono::duration<double> stalled = Clock::now() - begin;
+    n_stalls++;
+    stall_secs += stalled.count();
+}
+
+double Replay_engine::step_target_qps(u_int step) const
+{
+    return sm->info->replay_qps + step * sm->info->ramp_step_qps;
+}
+
+u_int Replay_engine::step_of(Time_Point start) const
+{
+    if (mode != REPLAY_RAMP || start <= start_ts)
+        return 0;
+
+    std::chrono::duration<double> offset = start - start_ts;
+    return (u_int)(offset.count() / sm->info->ramp_step_secs);
+}
+
+bool Replay_engine::acquire_slot(Replay_session* s)
+{
+    std::lock_guard<std::mutex> guard(slot_lock);
+
+    if (n_in_flight < n_slots)
+    {
+        n_in_flight++;
+        return true;
+    }
+
+    slot_waiters.push_back(s);
+    return false;
+}
+
+void Replay_engine::release_slot()
+{
+    Replay_session* next = 0;
+
+    {
+        std::lock_guard<std::mutex> guard(slot_lock);
+
+        if (slot_waiters.empty())
+        {
+            n_in_flight--;
+            return;
+        }
+
+        // the slot goes straight to the longest waiting session
+        next = slot_waiters.front();
+        slot_waiters.pop_front();
+    }
+
+    next->loop->wake(next);
+}
+
+Replay_exec_stats Replay_engine::merged(std::vector<Replay_exec_stats> Replay_loop::*which, u_int i)
+{
+    Replay_exec_stats merged;
+
+    for (size_t j = 0; j < loops.size(); j++)
+    {
+        std::lock_guard<std::mutex> guard(loops[j]->stats_lock);
+        const std::vector<Replay_exec_stats>& stats = loops[j]->*which;
+
+        if (i < stats.size())
+            merged.merge(stats[i]);
+    }
+
+    return merged;
+}
+
+void Replay_engine::run_ramp_monitor()
+{
+    double step_secs = sm->info->ramp_step_secs;
+    std::unique_lock<std::mutex> lk(lock);
+
+    for (u_int step = 0; !stopping; step++)
+    {
+        // a step is judged once the next one is over too, so that its slow
+        // queries have had the time to finish and count
+        Time_Point judge_ts = start_ts +
+            std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((step + 2) * step_secs));
+
+        while (!stopping && Clock::now() < judge_ts)
+            reporter_wakeup.wait_until(lk, judge_ts);
+
+        if (stopping)
+            break;
+
+        lk.unlock();
+        Replay_exec_stats stats = merged(&Replay_loop::steps, step);
+        lk.lock();
+
+        if (stats.n_queries && stats.exec_hist.percentile(99) > sm->info->ramp_slo_p99)
+        {
+            fprintf(stderr, "Ramp step %u at %g QPS broke the p99 SLO: %gs, stopping\n", step,
+                    step_target_qps(step), stats.exec_hist.percentile(99));
+            broken_step = step;
+            ramp_over = true;
+            break;
+        }
+    }
+}
+
+Replay_engine::~Replay_engine()
+{
+    finish();
+
+    for (size_t i = 0; i < loops.size(); i++)
+        delete loops[i];
+}
+
+Replay_session* Replay_engine::open_session(u_int clone)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        n_sessions++;
+    }
+
+    Replay_loop* loop = loops[next_loop++ % loops.size()];
+    u_longlong id = next_id++;
+    Clock::duration offset = Clock::duration::zero();
+
+    // the original keeps its timing, the clones spread out after it; a hash
+    // of the id is as good as a random number here and needs no lock
+    if (clone && sm->info->replay_clone_jitter > 0)
+    {
+        u_longlong h = id * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 31;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 29;
+        double frac = (h >> 11) / (double)(1ULL << 53);
+        offset = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(frac * sm->info->replay_clone_jitter));
+    }
+
+    return new Replay_session(loop, id, clone, offset);
+}
+
+void Replay_engine::session_done()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (!--n_sessions)
+        all_done.notify_all();
+}
+
+void Replay_engine::record_query(const char* text, size_t len, double exec_time)
+{
+    char key_buf[1024];
+    size_t key_len = sizeof(key_buf) - 1;
+    const char* key;
+    u_longlong digest = sm->get_query_key(key_buf, &key_len, &key, text, len);
+    sm->q_stats.record_query(digest, key, key_len, exec_time);
+}
+
+void Replay_engine::report_lag_window()
+{
+    Replay_lag_stats window;
+
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        std::lock_guard<std::mutex> guard(loops[i]->stats_lock);
+        window.merge(loops[i]->lag_window);
+        loops[i]->lag_window = Replay_lag_stats();
+    }
+
+    if (window.hist.count())
+        window.print(stderr, "Replay lag:");
+}
+
+void Replay_engine::run_reporter(double interval)
+{
+    std::unique_lock<std::mutex> lk(lock);
+    std::chrono::duration<double> period(interval);
+
+    while (!stopping)
+    {
+        reporter_wakeup.wait_for(lk, period);
+
+        if (stopping)
+            break;
+
+        lk.unlock();
+        report_lag_window();
+        lk.lock();
+    }
+}
+
+void Replay_engine::print_connect_stats(FILE* fp)
+{
+    Latency_histogram hist;
+    u_longlong n_reused = 0;
+
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        std::lock_guard<std::mutex> guard(loops[i]->stats_lock);
+        hist.merge(loops[i]->connect_hist);
+        n_reused += loops[i]->n_reused;
+    }
+
+    if (!hist.count() && !n_reused)
+        return;
+
+    fprintf(fp, "Replay connect N: %llu p50: %gs p95: %gs p99: %gs max: %gs reused: %llu\n", hist.count(),
+            hist.percentile(50), hist.percentile(95), hist.percentile(99), hist.percentile(100), n_reused);
+}
+
+void Replay_engine::print_replay_stats(FILE* fp)
+{
+    Replay_lag_stats total;
+    size_t n_steps = 0, n_clones = 0;
+
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        std::lock_guard<std::mutex> guard(loops[i]->stats_lock);
+        total.merge(loops[i]->lag_total);
+
+        if (loops[i]->steps.size() > n_steps)
+            n_steps = loops[i]->steps.size();
+
+        if (loops[i]->clones.size() > n_clones)
+            n_clones = loops[i]->clones.size();
+    }
+
+    if (total.hist.count())
+        total.print(fp, "Replay schedule lag");
+
+    print_connect_stats(fp);
+
+    if (n_stalls)
+    {
+        std::chrono::duration<double> replay_secs = Clock::now() - start_ts;
+        fprintf(fp, "Replay reader stalls: %llu for %gs, %.1f%% of the replay, on --max-buffered-mb %u\n", n_stalls,
+                stall_secs, replay_secs.count() > 0 ? 100.0 * stall_secs / replay_secs.count() : 0.0,
+                sm->info->max_buffered_mb);
+    }
+
+    for (u_int step = 0; step < n_steps; step++)
+    {
+        Replay_exec_stats stats = merged(&Replay_loop::steps, step);
+
+        if (!stats.n_queries)
+            continue;
+
+        fprintf(fp, "Replay step %u target QPS: ", step);
+
+        if (fixed_rate())
+            fprintf(fp, "%g", step_target_qps(step));
+        else if (mode == REPLAY_CLOSED)
+            fprintf(fp, "max");
+        else
+            fprintf(fp, "capture");
+
+        if (n_slots)
+            fprintf(fp, " concurrency: %u", n_slots);
+
+        fputc(' ', fp);
+        stats.print(fp);
+        fprintf(fp, "%s\n", (long long)step == broken_step ? " SLO broken" : "");
+    }
+
+    // clone group 0 is the captured connections as they were
+    for (u_int clone = 0; n_clones > 1 && clone < n_clones; clone++)
+    {
+        Replay_exec_stats stats = merged(&Replay_loop::clones, clone);
+        fprintf(fp, "Replay clone group %u ", clone);
+        stats.print(fp);
+        fputc('\n', fp);
+    }
+}
+
+void Replay_engine::finish()
+{
+    {
+        std::unique_lock<std::mutex> lk(lock);
+
+        while (n_sessions)
+            all_done.wait(lk);
+
+        stopping = true;
+    }
+
+    reporter_wakeup.notify_all();
+
+    if (ramp_monitor)
+    {
+        ramp_monitor->join();
+        delete ramp_monitor;
+        ramp_monitor = 0;
+    }
+
+    if (reporter)
+    {
+        reporter->join();
+        delete reporter;
+        reporter = 0;
+        report_lag_window(); // the last, partial one
+    }
+
+    for (size_t i = 0; i < loops.size(); i++)
+        loops[i]->shutdown();
+}
@@ -0,0 +1,364 @@
+#ifndef REPLAY_ENGINE_H
+#define REPLAY_ENGINE_H
+
+#include <mysql.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+#include "latency_histogram.h"
+#include "prepared_stmt.h"
+#include "spsc_queue.h"
+#include "timer_wheel.h"
+
+class Mysql_packet;
+class Mysql_stream_manager;
+class Replay_engine;
+class Replay_loop;
+
+// A query on its way from the capture to the replay sessions. The text is
+// copied out of the packets so they can be freed as soon as the capture is
+// done with them, the replay may be running well behind. With
+// --replay-clone-factor every clone of the connection queues the same copy.
+// Prepared statements go as their own commands: a COM_STMT_PREPARE carries
+// the statement text, a COM_STMT_EXECUTE the parameters as
+// stmt_encode_params() has them and a COM_STMT_CLOSE nothing, all under the
+// statement id of the capture.
+struct Replay_query
+{
+    std::atomic<u_int> n_refs; // clones that have yet to run it
+    u_int len;
+    u_char cmd; // COM_QUERY or COM_STMT_*
+    u_int stmt_id;
+
+    char* text() { return (char*)(this + 1); }
+
+    // one allocation from Packet_allocator, header and text together, see
+    // Replay_engine::new_query()
+    static Replay_query* create(u_int len, u_int n_refs);
+    // the last clone to let go of q frees it, returns the bytes freed if any
+    static size_t release(Replay_query* q);
+};
+
+// A query queued on one session, with when that session is to start it.
+struct Replay_item
+{
+    Replay_query* query;
+    Time_Point scheduled_ts; // INVALID_TIME to run as soon as possible
+};
+
+// How far behind schedule queries started: lag is the actual start minus
+// get_scheduled_ts(), and the achieved speed compares the stretch of the
+// schedule covered to the wall time it took, so a --replay-speed 4 run that
+// keeps up shows 4x.
+struct Replay_lag_stats
+{
+    Latency_histogram hist;
+    Time_Point first_scheduled, first_start; // INVALID_TIME before the first query
+    Time_Point last_scheduled, last_start;
+
+    Replay_lag_stats(): first_scheduled(INVALID_TIME), first_start(INVALID_TIME),
+        last_scheduled(INVALID_TIME), last_start(INVALID_TIME)
+    {
+    }
+
+    void record(Time_Point scheduled, Time_Point start);
+    void merge(const Replay_lag_stats& other);
+    // 0 if the queries seen do not span any time
+    double achieved_speed() const;
+    void print(FILE* fp, const char* label) const;
+};
+
+// How many queries ran and how long they took to complete, for one
+// --replay-mode step (the whole replay unless ramping) or one clone group.
+// See Replay_engine::fixed_rate() for what start means.
+struct Replay_exec_stats
+{
+    u_longlong n_queries;
+    Latency_histogram exec_hist;
+    Time_Point first_start; // INVALID_TIME before the first query
+    Time_Point last_end;
+
+    Replay_exec_stats(): n_queries(0), first_start(INVALID_TIME), last_end(INVALID_TIME) {}
+
+    void record(Time_Point start, Time_Point end);
+    void merge(const Replay_exec_stats& other);
+    // the achieved QPS and the percentiles, no newline
+    void print(FILE* fp) const;
+};
+
+// One captured connection replayed over one server connection. The capture
+// side only ever calls push() and close(), everything else runs on the loop
+// the session was assigned to, one step of the MariaDB non-blocking API at a
+// time: start an operation, and if it would block, go back to epoll until
+// the socket (or the timeout the library asked for) is ready. The server
+// connection comes from the loop's pool if it has an idle one and goes back
+// to it when the session is done, so captured connections that do not
+// overlap in time share server connections. Before it goes back it is reset
+// with COM_CHANGE_USER, which rolls back what the capture left open and
+// clears its temporary tables, variables and default database; one the
+// reset fails on is closed instead.
+class Replay_session
+{
+    friend class Replay_loop;
+    friend class Replay_engine;
+
+protected:
+    enum State { IDLE, SCHEDULED, WAITING_SLOT, CONNECTING, QUERYING, FETCHING, FREEING, PREPARING, EXECUTING,
+                 STORING, STMT_FREEING, STMT_CLOSING, RESETTING };
+
+    // a statement prepared on con, with the text its stats go under
+    struct Replay_stmt
+    {
+        MYSQL_STMT* stmt;
+        std::string text;
+
+        Replay_stmt(): stmt(0) {}
+    };
+
+    Replay_loop* loop;
+    u_longlong id;
+    u_int clone; // 0 for the captured connection itself
+    Clock::duration offset; // --replay-clone-jitter, added to timed schedules
+
+    // the capture thread pushes, the loop pops; while the loop has queries
+    // to run the capture side never has to wake it
+    Spsc_queue<Replay_item> queue;
+
+    // only touched on the loop
+    State state;
+    MYSQL* con;
+    int fd; // registered with epoll, -1 if not
+    u_int timer_gen; // timers armed before the last wait are stale
+    bool has_slot; // counts against --replay-concurrency
+    bool warm_up; // only connects, for the pool
+    bool needs_reset; // con ran something of the capture's
+    Replay_query* cur;
+    Time_Point cur_ts; // when cur was scheduled
+    MYSQL_RES* res;
+    MYSQL* connect_ret;
+    int query_err;
+    MYSQL_ROW row;
+    Time_Point start;
+    Time_Point connect_start;
+    // by the statement id of the capture, closed before con goes back to the
+    // pool
+    typedef std::unordered_map<u_int, Replay_stmt> Stmt_map;
+    Stmt_map stmts;
+    Replay_stmt* cur_stmt; // the one cur runs on
+    MYSQL_STMT* closing_stmt;
+    my_bool stmt_ret;
+    // the parameters of the execute in flight
+    std::vector<Stmt_param> params;
+    std::vector<MYSQL_BIND> binds;
+    std::vector<unsigned long> bind_lens;
+    std::vector<my_bool> bind_nulls;
+    std::vector<std::string> bind_values;
+
+    Replay_session(Replay_loop* loop, u_longlong id, u_int clone, Clock::duration offset);
+    ~Replay_session();
+
+    // returns false once the session is done and can be deleted, ready is
+    // the MYSQL_WAIT_* set the pending operation was waiting for
+    bool run(int ready);
+    int cont(int ready);
+    Replay_query* pop(Time_Point* scheduled_ts, bool* done);
+    bool init_connection();
+    void close_connection();
+    void finish_query();
+    void drop_query();
+    // starts cur, a prepared statement command; false if there is nothing to
+    // wait for, cur is then done with and the state IDLE
+    bool start_stmt_command(int* status);
+    // binds the parameters of the execute in cur to cur_stmt
+    bool bind_params();
+    // starts closing the statement, which is then gone from stmts
+    int close_stmt(Stmt_map::iterator it);
+
+public:
+    void push(Replay_query* q, Time_Point scheduled_ts);
+    // no more queries are coming, the session must not be touched after this
+    void close();
+};
+
+// An event loop thread, it owns the sessions assigned to it and multiplexes
+// them over one epoll set. Queries scheduled in the future and the library's
+// I/O timeouts wait on a timer wheel, with a timerfd armed for the earliest
+// tick it has work at.
+class Replay_loop
+{
+    friend class Replay_session;
+    friend class Replay_engine;
+
+protected:
+    struct Timer
+    {
+        u_longlong session_id;
+        u_int gen;
+        int ready; // passed to Replay_session::run(), 0 for a scheduled query
+    };
+
+    Replay_engine* engine;
+    int epoll_fd;
+    int wake_fd; // eventfd, the capture side has handed over work
+    int timer_fd;
+    std::thread* th;
+
+    std::mutex lock;
+    std::vector<Replay_session*> inbox; // parked sessions with new work
+    bool stop;
+
+    std::unordered_map<u_longlong, Replay_session*> sessions;
+    Time_Point wheel_base; // tick 0
+    Timer_wheel<Timer> timers;
+    std::vector<Timer> expired;
+    Time_Point armed_ts; // what timer_fd is set to, INVALID_TIME if disarmed
+    std::vector<MYSQL*> idle_cons; // connected, not used by any session
+
+    // taken by the loop once per query and by the reporters
+    std::mutex stats_lock;
+    Replay_lag_stats lag_total;
+    Replay_lag_stats lag_window; // since the last --replay-lag-interval report
+    std::vector<Replay_exec_stats> steps;
+    std::vector<Replay_exec_stats> clones; // by clone index
+    Latency_histogram connect_hist;
+    u_longlong n_reused; // sessions that got a connection from the pool
+
+    void run();
+    void resume(Replay_session* s, int ready);
+    void add_timer(Replay_session* s, Time_Point ts, int ready);
+    void arm_timer();
+    void fire_timers();
+    void drain_inbox();
+    void watch(Replay_session* s, int status);
+    void unwatch(Replay_session* s);
+    void record_lag(Time_Point scheduled, Time_Point start);
+    void record_exec(u_int clone, Time_Point start, Time_Point end);
+    void record_connect(Time_Point start, Time_Point end);
+    MYSQL* take_connection();
+    void return_connection(MYSQL* con);
+    u_longlong to_tick(Time_Point ts) const;
+
+public:
+    Replay_loop(Replay_engine* engine);
+    ~Replay_loop();
+
+    // capture side, s has work and is not on the loop right now
+    void wake(Replay_session* s);
+    void shutdown();
+};
+
+// --run: replays every captured connection on its own server connection,
+// with all of them multiplexed over a few event loop threads instead of a
+// thread per connection. When a query may start depends on --replay-mode:
+//   timed   no earlier than Mysql_stream_manager::get_scheduled_ts()
+//   closed  as soon as one of --replay-concurrency slots is free
+//   open    at --replay-qps, query n at n / qps, regardless of capture timing
+//   ramp    like open, the rate going up by --ramp-step-qps every
+//           --ramp-step-secs until a step's p99 breaks --ramp-slo-p99
+// Queries of one connection always run one at a time in capture order, so
+// in open and ramp modes a connection that is still busy makes its next
+// query late, which shows up as schedule lag and in the step latencies.
+// --replay-clone-factor N replays each captured connection N times over, on
+// sessions of their own, clone k of every connection making up clone group k.
+// --replay-prewarm N connections are opened before the replay starts, so
+// that connecting does not eat into the schedule; the connect times are
+// reported on their own either way. With --max-buffered-mb the reader is
+// held up while the queries waiting to be replayed take more than that.
+class Replay_engine
+{
+    friend class Replay_loop;
+    friend class Replay_session;
+
+protected:
+    Mysql_stream_manager* sm; // the stats go to the primary manager
+    Replay_mode mode;
+    std::vector<Replay_loop*> loops;
+    std::atomic<u_int> next_loop;
+    std::atomic<u_longlong> next_id;
+
+    std::mutex lock;
+    std::condition_variable all_done;
+    u_longlong n_sessions; // opened and not finished yet
+    bool stopping;
+    std::condition_variable reporter_wakeup;
+    std::thread* reporter; // prints the lag every --replay-lag-interval
+    std::thread* ramp_monitor;
+
+    Time_Point start_ts; // the primary's replay_start_ts, set by start()
+    std::atomic<u_longlong> n_scheduled; // open and ramp, queries handed out so far
+    std::atomic<bool> ramp_over;
+    long long broken_step; // the ramp step that broke the SLO, -1 if none
+
+    // --replay-concurrency
+    u_int n_slots; // 0 for no limit
+    std::mutex slot_lock;
+    u_int n_in_flight;
+    std::deque<Replay_session*> slot_waiters;
+
+    // --max-buffered-mb
+    size_t max_buffered; // bytes, 0 for no limit
+    size_t resume_buffered; // a stalled reader goes on once down to this
+    std::atomic<size_t> buffered; // queries created and not released yet
+    std::atomic<bool> reader_stalled;
+    std::mutex budget_lock;
+    std::condition_variable budget_freed;
+    u_longlong n_stalls;
+    double stall_secs;
+
+    void session_done();
+    void warm_up(u_int n_cons);
+    void record_query(const char* text, size_t len, double exec_time);
+    void run_reporter(double interval);
+    void report_lag_window();
+    void run_ramp_monitor();
+    // false if s has to wait, it is woken up with the slot once one frees up
+    bool acquire_slot(Replay_session* s);
+    void release_slot();
+    u_int step_of(Time_Point start) const;
+    double step_target_qps(u_int step) const;
+    // one entry of steps or clones, over all the loops
+    Replay_exec_stats merged(std::vector<Replay_exec_stats> Replay_loop::*which, u_int i);
+    // connect times, and how many sessions did without connecting
+    void print_connect_stats(FILE* fp);
+    void stall_reader();
+
+public:
+    Replay_engine(Mysql_stream_manager* sm, u_int n_loops);
+    ~Replay_engine();
+
+    // t=0 of the schedule, call once the manager's replay_start_ts is set
+    void start(Time_Point start_ts);
+    // capture side, safe to call from several threads
+    Replay_session* open_session(u_int clone);
+    // when s should start the query, sm is the manager that captured it
+    Time_Point schedule(Mysql_stream_manager* sm, Mysql_packet* query_pkt, Replay_session* s);
+    // Replay_query::create() and release() that keep count of the memory
+    Replay_query* new_query(u_int len, u_int n_refs);
+    void release_query(Replay_query* q);
+    // the reader, blocks while over --max-buffered-mb
+    void throttle()
+    {
+        if (max_buffered && buffered.load(std::memory_order_relaxed) > max_buffered)
+            stall_reader();
+    }
+    // the ramp is over, further queries are dropped
+    bool stopped() const { return ramp_over; }
+    // open and ramp modes, where step times and latencies count from when a
+    // query was due rather than when it got to start
+    bool fixed_rate() const { return mode == REPLAY_OPEN || mode == REPLAY_RAMP; }
+    // waits for every session to be closed and drained, then stops the loops,
+    // safe to call more than once
+    void finish();
+    // the schedule lag over the whole replay, if any query had a schedule,
+    // the connect times, then the achieved QPS and latency of every step
+    // and clone group
+    void print_replay_stats(FILE* fp);
+};
+
+#endif
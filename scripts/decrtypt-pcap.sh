@@ -1,6 +1,10 @@
 #!/bin/bash
 # -----------------------------------------------------------------------------
 # MySQL TLS Traffic Decryption Script using TShark (Wireshark CLI)
+#
+# Only RSA key exchange can be decrypted with the server key. With an NSS key
+# log (SSLKEYLOGFILE) of the clients or the server, mysqlpcap --tls-keylog
+# reads the encrypted capture directly, no decrypted copy needed.
 # -----------------------------------------------------------------------------
 
 # --- CONFIGURATION (MUST EDIT) ---
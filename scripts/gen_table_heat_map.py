@@ -30,8 +30,9 @@ def parse_log_data(file_path):
                 # 2. Split the statistics string by comma
                 stat_fields = [f.strip() for f in stats_string.split(',')]
 
-                # Expected fields per record: 6 (table_name, query_type, number_of_queries, min_time, max_time, avg_time)
-                CHUNK_SIZE = 6
+                # Expected fields per record: 9 (table_name, query_type, number_of_queries, min_time, max_time, avg_time,
+                # no_index, no_good_index, slow)
+                CHUNK_SIZE = 9
 
                 if len(stat_fields) % CHUNK_SIZE != 0:
                      print(f"Warning: Line {i+1} has {len(stat_fields)} stats fields, which is not divisible by {CHUNK_SIZE}. Data may be truncated.", file=sys.stderr)
@@ -49,6 +50,9 @@ def parse_log_data(file_path):
                         'min_time': chunk[3],
                         'max_time': chunk[4],
                         'avg_time': chunk[5],
+                        'no_index': chunk[6],
+                        'no_good_index': chunk[7],
+                        'slow': chunk[8],
                     }
                     record['total_time'] = float(record['avg_time']) * int(record['num_queries']);
                     all_parsed_data.append(record)
@@ -94,6 +98,9 @@ def generate_html_content(template_content, parsed_data):
             <td class="px-3 py-3 whitespace-nowrap text-sm text-red-600">{item['max_time']}</td>
             <td class="px-3 py-3 whitespace-nowrap text-sm text-yellow-600">{item['avg_time']}</td>
             <td class="px-3 py-3 whitespace-nowrap text-sm text-purple-600">{item['total_time']}</td>
+            <td class="px-3 py-3 whitespace-nowrap text-sm text-gray-500">{item['no_index']}</td>
+            <td class="px-3 py-3 whitespace-nowrap text-sm text-gray-500">{item['no_good_index']}</td>
+            <td class="px-3 py-3 whitespace-nowrap text-sm text-gray-500">{item['slow']}</td>
         </tr>
         """
 
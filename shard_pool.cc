@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "shard_pool.h"
+
+#define BATCH_MAX_PACKETS 256
+#define BATCH_MAX_BYTES (256 * 1024)
+// per shard, caps the memory the reader can run ahead by
+#define MAX_QUEUED_BATCHES 64
+
+Mysql_shard::~Mysql_shard()
+{
+    for (size_t i = 0; i < free_batches.size(); i++)
+        delete free_batches[i];
+
+    for (size_t i = 0; i < queue.size(); i++)
+        delete queue[i];
+
+    delete cur;
+    delete sm;
+}
+
+void Mysql_shard::run()
+{
+    for (;;)
+    {
+        Packet_batch* batch;
+
+        {
+            std::unique_lock<std::mutex> lk(lock);
+
+            while (queue.empty() && !done)
+                not_empty.wait(lk);
+
+            if (queue.empty())
+                return;
+
+            batch = queue.front();
+            queue.pop_front();
+        }
+
+        not_full.notify_one();
+
+        for (size_t i = 0; i < batch->size(); i++)
+        {
+            try
+            {
+                sm->process_pkt(&batch->headers[i], &batch->data[batch->offsets[i]]);
+            }
+            catch (const std::exception& e)
+            {
+                fprintf(stderr, "Error: Exception: %s\n", e.what());
+                exit(1);
+            }
+        }
+
+        if (batch->has_tick)
+            sm->advance_clock(batch->tick);
+
+        batch->clear();
+        std::lock_guard<std::mutex> guard(lock);
+        free_batches.push_back(batch);
+    }
+}
+
+Mysql_shard_pool::Mysql_shard_pool(Mysql_stream_manager* primary, u_int n_shards): primary(primary),
+    frag_shard(1 << 16, 0), first_packet_seen(false), cur_window(0)
+{
+    for (u_int i = 0; i < n_shards; i++)
+    {
+        Mysql_shard* shard = new Mysql_shard;
+        shard->sm = new Mysql_stream_manager(primary->mysql_ip, primary->_mysql_port, primary->info, true);
+        shard->sm->replay_start_ts = primary->replay_start_ts;
+        shard->sm->replay_engine = primary->replay_engine;
+
+        if (primary->interval_stats)
+        {
+            shard->sm->interval_stats = primary->interval_stats;
+            shard->sm->interval_source = primary->interval_stats->add_source();
+        }
+
+        shard->cur = new Packet_batch;
+        shard->th = new std::thread(&Mysql_shard::run, shard);
+        shards.push_back(shard);
+    }
+}
+
+Mysql_shard_pool::~Mysql_shard_pool()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+        delete shards[i];
+}
+
+void Mysql_shard_pool::submit(Mysql_shard* shard)
+{
+    Packet_batch* next = 0;
+
+    {
+        std::unique_lock<std::mutex> lk(shard->lock);
+
+        while (shard->queue.size() >= MAX_QUEUED_BATCHES)
+            shard->not_full.wait(lk);
+
+        shard->queue.push_back(shard->cur);
+
+        if (!shard->free_batches.empty())
+        {
+            next = shard->free_batches.back();
+            shard->free_batches.pop_back();
+        }
+    }
+
+    shard->not_empty.notify_one();
+    shard->cur = next ? next : new Packet_batch;
+}
+
+void Mysql_shard_pool::dispatch(const struct pcap_pkthdr* header, const u_char* packet)
+{
+    Flow_info fi;
+
+    if (!primary->get_flow_info(header, packet, &fi))
+        return;
+
+    // replay is scheduled relative to the first packet, all shards must
+    // agree on what that is
+    if (!first_packet_seen)
+    {
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            shards[i]->sm->first_packet_ts = header->ts;
+            shards[i]->sm->first_packet_ts_inited = true;
+        }
+
+        first_packet_seen = true;
+    }
+
+    // a shard that gets no traffic must still let the windows close
+    if (primary->interval_stats)
+    {
+        long long window = primary->interval_stats->window_of(header->ts);
+
+        if (window != cur_window)
+        {
+            for (size_t i = 0; i < shards.size(); i++)
+            {
+                shards[i]->cur->tick = header->ts;
+                shards[i]->cur->has_tick = true;
+                submit(shards[i]);
+            }
+
+            cur_window = window;
+        }
+    }
+
+    u_int n;
+
+    if (fi.has_key)
+    {
+        n = flow_key_hash(fi.key) % shards.size();
+
+        // the first fragment pins the rest of its datagram; a whole packet
+        // leaves the pins alone, ip_id is reused freely outside fragments
+        if (fi.is_fragment)
+            frag_shard[fi.ip_id] = n + 1;
+    }
+    else
+    {
+        u_short& frag = frag_shard[fi.ip_id];
+
+        if (frag)
+        {
+            n = frag - 1;
+
+            if (!fi.is_fragment)
+                frag = 0; // last piece of the datagram
+        }
+        else
+        {
+            // a datagram whose first fragment arrives late is pinned by
+            // ip_id, the reassembled data may then miss its stream, as it
+            // would if the first fragment had been lost
+            n = fi.ip_id % shards.size();
+
+            if (fi.is_fragment)
+                frag = n + 1;
+        }
+    }
+
+    Mysql_shard* shard = shards[n];
+    shard->cur->add(header, packet);
+
+    if (shard->cur->size() >= BATCH_MAX_PACKETS || shard->cur->data.size() >= BATCH_MAX_BYTES)
+        submit(shard);
+}
+
+void Mysql_shard_pool::flush()
+{
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (shards[i]->cur->size())
+            submit(shards[i]);
+    }
+}
+
+void Mysql_shard_pool::finish()
+{
+    flush();
+
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        Mysql_shard* shard = shards[i];
+
+        {
+            std::lock_guard<std::mutex> guard(shard->lock);
+            shard->done = true;
+        }
+
+        shard->not_empty.notify_one();
+    }
+
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        Mysql_shard* shard = shards[i];
+        shard->th->join();
+        delete shard->th;
+        shard->th = 0;
+
+        if (primary->info->do_run)
+            shard->sm->finish_replay();
+
+        primary->merge_stats(*shard->sm);
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef SHARD_POOL_H
+#define SHARD_POOL_H
+
+#include <pcap.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "common.h"
+#include "mysql_stream_manager.h"
+
+// Packets copied out of the reader's buffer on their way to a shard. They are
+// handed over in batches so the queue lock is taken once per batch, not once
+// per packet.
+struct Packet_batch
+{
+    std::vector<struct pcap_pkthdr> headers;
+    std::vector<size_t> offsets;
+    std::vector<u_char> data;
+    // --interval: the reader got to a new window at this time, everything
+    // before it in the stream has been handed out
+    struct timeval tick;
+    bool has_tick;
+
+    Packet_batch(): has_tick(false) {}
+
+    void add(const struct pcap_pkthdr* header, const u_char* packet)
+    {
+        headers.push_back(*header);
+        offsets.push_back(data.size());
+        data.insert(data.end(), packet, packet + header->caplen);
+    }
+
+    void clear()
+    {
+        headers.clear();
+        offsets.clear();
+        data.clear();
+        has_tick = false;
+    }
+
+    size_t size() { return headers.size(); }
+};
+
+struct Mysql_shard
+{
+    Mysql_stream_manager* sm;
+    std::thread* th;
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<Packet_batch*> queue;
+    std::vector<Packet_batch*> free_batches;
+    Packet_batch* cur; // being filled by the reader, not shared
+    bool done;
+
+    Mysql_shard(): sm(0), th(0), cur(0), done(false) {}
+    ~Mysql_shard();
+    void run();
+};
+
+// --threads mode: the reader thread works out each packet's flow key (the
+// same key process_pkt() files streams under) and hands the packet to the
+// shard that owns that flow. Every shard is a complete Mysql_stream_manager
+// with its own streams, Query_stats and Table_stats running on its own
+// thread; their results are merged into the primary manager at the end.
+class Mysql_shard_pool
+{
+protected:
+    Mysql_stream_manager* primary;
+    std::vector<Mysql_shard*> shards;
+    // IP fragments of one datagram must land on the same shard, indexed by
+    // ip_id, 0 means unassigned, otherwise the shard number + 1
+    std::vector<u_short> frag_shard;
+    bool first_packet_seen;
+    long long cur_window; // --interval window of the last packet dispatched
+
+    void submit(Mysql_shard* shard);
+
+public:
+    Mysql_shard_pool(Mysql_stream_manager* primary, u_int n_shards);
+    ~Mysql_shard_pool();
+
+    void dispatch(const struct pcap_pkthdr* header, const u_char* packet);
+    // hands the batches filled so far to the shards, for --live, where a
+    // quiet link would otherwise hold the last packets back indefinitely
+    void flush();
+    // drains the queues, stops the workers, finishes their replay and merges
+    // their stats into the primary manager
+    void finish();
+};
+
+#endif
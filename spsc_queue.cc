@@ -0,0 +1,266 @@
+// Spsc_queue is a header-only template, this file holds its test and
+// benchmark drivers.
+
+#include "spsc_queue.h"
+
+#if defined(TEST_SPSC_QUEUE) || defined(BENCH_SPSC_QUEUE)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <chrono>
+#include <thread>
+
+// the consumer sleeps on an eventfd, like a replay loop does
+struct Waker
+{
+    int fd;
+    u_longlong n_wakeups;
+
+    Waker(): fd(eventfd(0, 0)), n_wakeups(0) {}
+    ~Waker() { close(fd); }
+
+    void wake()
+    {
+        u_longlong one = 1;
+        n_wakeups++;
+
+        if (write(fd, &one, sizeof(one)) != sizeof(one))
+            perror("eventfd write");
+    }
+
+    void wait()
+    {
+        u_longlong n;
+
+        if (read(fd, &n, sizeof(n)) != sizeof(n))
+            perror("eventfd read");
+    }
+};
+
+// pops until the queue is closed and drained, returns how many items it got
+// and sets *in_order if they were 0, 1, 2, ...
+template <class Queue>
+static u_longlong consume(Queue& q, Waker& w, bool* in_order, u_longlong* n_parked)
+{
+    u_longlong n = 0, v;
+    *in_order = true;
+    *n_parked = 0;
+
+    for (;;)
+    {
+        bool closed = q.closed();
+
+        if (q.pop(&v))
+        {
+            *in_order &= v == n;
+            n++;
+            continue;
+        }
+
+        if (closed)
+            return n;
+
+        if (q.park())
+        {
+            (*n_parked)++;
+            w.wait();
+        }
+    }
+}
+
+#endif
+
+#ifdef TEST_SPSC_QUEUE
+
+// xorshift, deterministic across runs
+static u_longlong rnd_state = 88172645463325252ULL;
+
+static u_longlong rnd()
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+int main()
+{
+    int n_failed = 0;
+
+    {
+        // chunk boundaries, the spare chunk and drop on destruction
+        Spsc_queue<u_longlong, 4> q;
+        u_longlong v;
+        bool ok = q.push(0); // the consumer starts out parked
+
+        for (u_longlong i = 1; i < 10; i++)
+            ok &= !q.push(i);
+
+        for (u_longlong i = 0; i < 10; i++)
+            ok &= q.pop(&v) && v == i;
+
+        ok &= !q.pop(&v) && !q.closed() && q.park() && q.push(10) && q.pop(&v) && v == 10;
+        ok &= !q.pop(&v) && q.park() && q.close() && q.closed() && !q.pop(&v);
+        printf("Test: single thread push, pop, park and close: %s\n", ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+    }
+
+    {
+        // a producer that comes and goes, so the consumer parks a lot, must
+        // get everything across in order and never leave it asleep
+        Spsc_queue<u_longlong, 16> q;
+        Waker w;
+        const u_longlong n_items = 2000000;
+        bool in_order;
+        u_longlong n_parked, n_got;
+
+        std::thread consumer([&]() { n_got = consume(q, w, &in_order, &n_parked); });
+
+        for (u_longlong i = 0; i < n_items; i++)
+        {
+            if (q.push(i))
+                w.wake();
+
+            if (!(rnd() % 50000))
+                usleep(100);
+        }
+
+        if (q.close())
+            w.wake();
+
+        consumer.join();
+        bool ok = in_order && n_got == n_items && n_parked == w.n_wakeups;
+        printf("Test: %llu items across threads, %llu parks, %llu wakeups: %s\n", n_got, n_parked, w.n_wakeups,
+               ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+    }
+
+    printf("%s\n", n_failed ? "FAILED" : "ALL PASSED");
+    return n_failed ? 1 : 0;
+}
+
+#endif
+
+#ifdef BENCH_SPSC_QUEUE
+
+#include <deque>
+#include <mutex>
+
+#define N_ITEMS 5000000
+
+// what Replay_session used before: a deque and a parked flag under a mutex
+class Locked_queue
+{
+protected:
+    std::mutex lock;
+    std::deque<u_longlong> items;
+    bool is_closed;
+    bool parked;
+
+public:
+    Locked_queue(): is_closed(false), parked(true) {}
+
+    bool push(u_longlong v)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        items.push_back(v);
+        bool wake = parked;
+        parked = false;
+        return wake;
+    }
+
+    bool close()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        is_closed = true;
+        bool wake = parked;
+        parked = false;
+        return wake;
+    }
+
+    bool pop(u_longlong* v)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (items.empty())
+            return false;
+
+        *v = items.front();
+        items.pop_front();
+        return true;
+    }
+
+    bool closed()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return is_closed;
+    }
+
+    bool park()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (!items.empty() || is_closed)
+            return false;
+
+        parked = true;
+        return true;
+    }
+};
+
+// the producer hands over burst items at a time, spinning a little in
+// between the way the capture side parses packets between queries
+template <class Queue>
+static void bench(const char* name, u_int burst, u_int gap_spins)
+{
+    Queue q;
+    Waker w;
+    bool in_order;
+    u_longlong n_parked, n_got;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::thread consumer([&]() { n_got = consume(q, w, &in_order, &n_parked); });
+
+    for (u_longlong i = 0; i < N_ITEMS; )
+    {
+        for (u_int j = 0; j < burst && i < N_ITEMS; j++, i++)
+        {
+            if (q.push(i))
+                w.wake();
+        }
+
+        for (volatile u_int j = 0; j < gap_spins; j++)
+            ;
+    }
+
+    if (q.close())
+        w.wake();
+
+    consumer.join();
+    double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    printf("%-12s burst %4u gap %5u: %6.1f ns/item  %8llu wakeups%s\n", name, burst, gap_spins,
+           secs * 1e9 / N_ITEMS, w.n_wakeups, in_order && n_got == N_ITEMS ? "" : "  LOST ITEMS");
+}
+
+int main()
+{
+    static const u_int bursts[] = {1, 64, 1024};
+    static const u_int gaps[] = {0, 200};
+
+    printf("%d queries handed from the capture thread to a replay consumer\n", N_ITEMS);
+
+    for (size_t i = 0; i < sizeof(bursts) / sizeof(bursts[0]); i++)
+    {
+        for (size_t j = 0; j < sizeof(gaps) / sizeof(gaps[0]); j++)
+        {
+            bench<Locked_queue>("mutex+deque", bursts[i], gaps[j]);
+            bench<Spsc_queue<u_longlong> >("Spsc_queue", bursts[i], gaps[j]);
+        }
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+
+#include "common.h"
+
+// Unbounded single producer, single consumer queue that lets the consumer go
+// to sleep when it runs dry. Items go into chunks of CHUNK_SIZE linked in a
+// list, the producer publishes them by bumping a counter and neither side
+// ever takes a lock; the consumer hands emptied chunks back through a one
+// chunk spare so a steady stream allocates nothing.
+//
+// Waking is left to the caller, the queue only decides who has to do it.
+// The consumer calls park() when pop() comes up empty, and the push() or
+// close() that finds it parked returns true, at which point the producer has
+// to wake it up by whatever means the consumer sleeps on. A consumer that is
+// not parked is never signalled, so a busy one costs the producer no more
+// than an atomic load per item.
+template <class T, u_int CHUNK_SIZE = 64>
+class Spsc_queue
+{
+protected:
+    static const u_int PARKED = 1;
+    static const u_int CLOSED = 2;
+
+    struct Chunk
+    {
+        T items[CHUNK_SIZE];
+        Chunk* next; // set by the producer before any item in it is published
+    };
+
+    // each side's hot fields on cache lines of their own
+    std::atomic<u_longlong> n_pushed;
+    char pad1[64];
+
+    // producer only
+    Chunk* tail;
+    u_int tail_pos;
+    u_longlong n_produced;
+    char pad2[64];
+
+    // consumer only
+    Chunk* head;
+    u_int head_pos;
+    u_longlong n_popped;
+    char pad3[64];
+
+    std::atomic<Chunk*> spare;
+    std::atomic<u_int> flags; // PARKED, CLOSED
+
+    // the producer's half of the handshake with park()
+    bool claim_wakeup()
+    {
+        if (!(flags.load() & PARKED))
+            return false;
+
+        return flags.fetch_and(~PARKED) & PARKED;
+    }
+
+public:
+    // the consumer starts out parked, the first push() wakes it
+    Spsc_queue(): n_pushed(0), n_produced(0), n_popped(0), spare(0), flags(PARKED)
+    {
+        head = tail = new Chunk;
+        head->next = 0;
+        head_pos = tail_pos = 0;
+    }
+
+    // whatever is still queued is dropped without a word
+    ~Spsc_queue()
+    {
+        while (head)
+        {
+            Chunk* next = head->next;
+            delete head;
+            head = next;
+        }
+
+        delete spare.load();
+    }
+
+    // producer, returns true if the consumer has to be woken up
+    bool push(const T& v)
+    {
+        if (tail_pos == CHUNK_SIZE)
+        {
+            Chunk* c = spare.exchange(0);
+
+            if (!c)
+                c = new Chunk;
+
+            c->next = 0;
+            tail->next = c;
+            tail = c;
+            tail_pos = 0;
+        }
+
+        tail->items[tail_pos++] = v;
+        n_pushed.store(++n_produced);
+        return claim_wakeup();
+    }
+
+    // producer, nothing more is coming; returns true if the consumer has to
+    // be woken up, if not, it may already be gone along with the queue
+    bool close()
+    {
+        u_int old = flags.load();
+
+        while (!flags.compare_exchange_weak(old, (old | CLOSED) & ~PARKED))
+            ;
+
+        return old & PARKED;
+    }
+
+    // consumer, false if there is nothing to pop right now
+    bool pop(T* v)
+    {
+        if (n_popped == n_pushed.load(std::memory_order_acquire))
+            return false;
+
+        if (head_pos == CHUNK_SIZE)
+        {
+            Chunk* old = head;
+            head = head->next;
+            head_pos = 0;
+            delete spare.exchange(old);
+        }
+
+        *v = head->items[head_pos++];
+        n_popped++;
+        return true;
+    }
+
+    // consumer, true once close() has been called; everything pushed before
+    // it can be popped after this returns true
+    bool closed() const { return flags.load() & CLOSED; }
+
+    // consumer, call when pop() came up empty and closed() was false. Returns
+    // true if the consumer is now parked and must not touch the queue again
+    // before it is woken up; false if something came in meanwhile and it
+    // should go on popping.
+    bool park()
+    {
+        flags.fetch_or(PARKED);
+
+        if (n_popped == n_pushed.load() && !(flags.load() & CLOSED))
+            return true;
+
+        // the producer may have claimed the wakeup in the meantime, in which
+        // case it is on its way and the consumer has to wait for it
+        return !(flags.fetch_and(~PARKED) & PARKED);
+    }
+};
+
+#endif
@@ -24,9 +24,9 @@ typedef struct MemoryChunk {
     struct MemoryChunk* next;
 } MemoryChunk;
 
-// Global head and current chunk pointers
-MemoryChunk* pool_head = nullptr;
-MemoryChunk* pool_current_chunk = nullptr;
+// Head and current chunk pointers, per thread so sharded workers can parse concurrently
+thread_local MemoryChunk* pool_head = nullptr;
+thread_local MemoryChunk* pool_current_chunk = nullptr;
 
 // Function to allocate a new chunk
 MemoryChunk* allocate_new_chunk(size_t min_size) {
@@ -156,12 +156,12 @@ void reset_pool() {
 // --- END MEMORY POOL IMPLEMENTATION ---
 
 // Global variable for line number 
-int yylineno = 1;
-int yycolno = 1;
+thread_local int yylineno = 1;
+thread_local int yycolno = 1;
 // --- Input Buffer Management Globals ---
-const char* yy_input_buffer = nullptr;
-const char* yy_current_ptr = nullptr;
-const char* yy_input_end = nullptr; // Pointer to 1 past the last valid character
+thread_local const char* yy_input_buffer = nullptr;
+thread_local const char* yy_current_ptr = nullptr;
+thread_local const char* yy_input_end = nullptr; // Pointer to 1 past the last valid character
 
 // Function to read the next character from the in-memory buffer, replacing getchar()
 int yygetc() {
@@ -1351,7 +1351,7 @@ int yyparse_string(SQL_Parser* parser, const char* query, size_t query_len) {
 int yylex (void *yylval_ptr, void *yyloc_ptr, SQL_Parser* parser) {
     YYSTYPE* yylval = (YYSTYPE*)yylval_ptr;
     // Use a static buffer with defined max size for token scanning
-    static char buffer[YY_BUF_SIZE];
+    static thread_local char buffer[YY_BUF_SIZE];
     int c;
     char *p = buffer;
 
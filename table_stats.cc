@@ -20,8 +20,10 @@ class Table_parser: public SQL_Parser
 protected:
     Table_stats* table_stats;
     double exec_time;
+    u_int status_flags;
 public:
-    Table_parser(Table_stats* table_stats, double exec_time):table_stats(table_stats),exec_time(exec_time)
+    Table_parser(Table_stats* table_stats, double exec_time, u_int status_flags):table_stats(table_stats),
+        exec_time(exec_time),status_flags(status_flags)
     {
     }
     
@@ -31,7 +33,7 @@ public:
     
     void handle_table(const char* query_type, const char* table_name)
     {
-        table_stats->update_table(table_name, query_type, exec_time);
+        table_stats->update_table(table_name, query_type, exec_time, status_flags);
     }
     
 };
@@ -62,7 +64,8 @@ static std::vector<std::string> tokenize_query(const std::string& query)
 
 void Table_query_entry::print(FILE* fp)
 {
-    fprintf(fp, ",%lu,%.5f,%.5f,%.5f", n, min_time, max_time, total_time / n);
+    fprintf(fp, ",%lu,%.5f,%.5f,%.5f,%zu,%zu,%zu", n, min_time, max_time, total_time / n, n_no_index, n_no_good_index,
+            n_slow);
 }
 
 void Table_query_info::print(FILE* fp, const char* table_name)
@@ -98,10 +101,17 @@ static bool table_char(char c)
     return isalnum(c) || c == '_' || c == '$';
 }
 
-void Table_query_entry::update(double exec_time)
+void Table_query_entry::update(double exec_time, u_int status_flags)
 {
     n++;
 
+    if (status_flags & SERVER_QUERY_NO_INDEX_USED)
+        n_no_index++;
+    if (status_flags & SERVER_QUERY_NO_GOOD_INDEX_USED)
+        n_no_good_index++;
+    if (status_flags & SERVER_QUERY_WAS_SLOW)
+        n_slow++;
+
     if (exec_time > max_time)
         max_time = exec_time;
     if (exec_time < min_time)
@@ -110,22 +120,59 @@ void Table_query_entry::update(double exec_time)
     total_time += exec_time;
 }
 
-void Table_query_info::register_query(const char* type, double exec_time)
+void Table_query_info::register_query(const char* type, double exec_time, u_int status_flags)
 {
     auto it = entries.find(type);
 
     if (it == entries.end())
     {
         Table_query_entry& e = entries[type] = Table_query_entry();
-        e.n = 1;
-        e.min_time = e.max_time = e.total_time = exec_time;
+        e.n = 0;
+        e.min_time = e.max_time = exec_time;
+        e.total_time = 0.0;
+        e.n_no_index = e.n_no_good_index = e.n_slow = 0;
+        e.update(exec_time, status_flags);
         return;
     }
 
-    it->second.update(exec_time);
+    it->second.update(exec_time, status_flags);
+}
+
+void Table_query_entry::merge(const Table_query_entry& other)
+{
+    n += other.n;
+
+    if (other.max_time > max_time)
+        max_time = other.max_time;
+    if (other.min_time < min_time)
+        min_time = other.min_time;
+
+    total_time += other.total_time;
+    n_no_index += other.n_no_index;
+    n_no_good_index += other.n_no_good_index;
+    n_slow += other.n_slow;
+}
+
+void Table_query_info::merge(const Table_query_info& other)
+{
+    for (auto it = other.entries.begin(); it != other.entries.end(); it++)
+    {
+        auto my_it = entries.find(it->first);
+
+        if (my_it == entries.end())
+            entries[it->first] = it->second;
+        else
+            my_it->second.merge(it->second);
+    }
+}
+
+void Table_stats::merge(const Table_stats& other)
+{
+    for (auto it = other.stats.begin(); it != other.stats.end(); it++)
+        stats[it->first].merge(it->second);
 }
 
-void Table_stats::update_table(const char* table_token, const char* type, double exec_time)
+void Table_stats::update_table(const char* table_token, const char* type, double exec_time, u_int status_flags)
 {
     std::string table_name;
     const char* p = table_token;
@@ -147,11 +194,11 @@ void Table_stats::update_table(const char* table_token, const char* type, double
     if (it == stats.end())
     {
         Table_query_info& e = stats[table_name] = Table_query_info();
-        e.register_query(type, exec_time);
+        e.register_query(type, exec_time, status_flags);
         return;
     }
 
-    it->second.register_query(type, exec_time);
+    it->second.register_query(type, exec_time, status_flags);
 }
 
 unsigned int str_sum(const char* s, size_t len)
@@ -162,7 +209,7 @@ unsigned int str_sum(const char* s, size_t len)
     return sum;
 }
 
-void Table_stats::update_from_query(const char* query, size_t query_len, double exec_time)
+void Table_stats::update_from_query(const char* query, size_t query_len, double exec_time, u_int status_flags)
 {
     if (!query_len)
         query_len = strlen(query);
@@ -181,19 +228,19 @@ void Table_stats::update_from_query(const char* query, size_t query_len, double
     // Logic to determine query type and extract tables
     if (first_token == "insert" && tokens.size() > 2 && tokens[1] == "into")
     {
-        update_table(tokens[2].c_str(), first_token.c_str(), exec_time);
+        update_table(tokens[2].c_str(), first_token.c_str(), exec_time, status_flags);
         return;
     }
     
     if (first_token == "update" && tokens.size() > 1)
     {
-        update_table(tokens[1].c_str(), first_token.c_str(), exec_time);
+        update_table(tokens[1].c_str(), first_token.c_str(), exec_time, status_flags);
         return;
     }
     
     if (first_token == "delete" && tokens.size() > 2 && tokens[1] == "from")
     {
-        update_table(tokens[2].c_str(), first_token.c_str(), exec_time);
+        update_table(tokens[2].c_str(), first_token.c_str(), exec_time, status_flags);
         return;
     }
 
@@ -216,7 +263,7 @@ void Table_stats::update_from_query(const char* query, size_t query_len, double
                         break;
                     }
                     
-                    update_table(table_name.c_str(), first_token.c_str(), exec_time);
+                    update_table(table_name.c_str(), first_token.c_str(), exec_time, status_flags);
                     j++;
                     
                     if (j < tokens.size() && tokens[j] == "as")
@@ -233,7 +280,7 @@ void Table_stats::update_from_query(const char* query, size_t query_len, double
         }
     }
 #else
-    Table_parser p(this, exec_time);
+    Table_parser p(this, exec_time, status_flags);
     if (yyparse_string(&p, query, query_len))
         fprintf(stderr, "Error parsing: %.*s\n", (int)query_len, query);
     else if (info.verbose)
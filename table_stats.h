@@ -16,15 +16,22 @@ struct Table_query_entry
     double min_time;
     double max_time;
     double total_time;
-
-    void update(double exec_time);
+    // SERVER_QUERY_NO_INDEX_USED, SERVER_QUERY_NO_GOOD_INDEX_USED and
+    // SERVER_QUERY_WAS_SLOW in the status the server answered with
+    size_t n_no_index;
+    size_t n_no_good_index;
+    size_t n_slow;
+
+    void update(double exec_time, u_int status_flags);
+    void merge(const Table_query_entry& other);
     void print(FILE* fp);
 };
 
 struct Table_query_info
 {
     std::map<std::string, Table_query_entry> entries;
-    void register_query(const char* type, double exec_time);
+    void register_query(const char* type, double exec_time, u_int status_flags);
+    void merge(const Table_query_info& other);
     void print(FILE* fp, const char* table_name);
 };
 
@@ -32,8 +39,9 @@ struct Table_stats
 {
     std::map<std::string, Table_query_info> stats;
     void print(FILE* fp);
-    void update_table(const char* table_name, const char* type, double exec_time);
-    void update_from_query(const char* query, size_t query_len=0, double exec_time=0.0);
+    void merge(const Table_stats& other);
+    void update_table(const char* table_name, const char* type, double exec_time, u_int status_flags=0);
+    void update_from_query(const char* query, size_t query_len=0, double exec_time=0.0, u_int status_flags=0);
 };
 
 
@@ -0,0 +1,12 @@
+#! /bin/bash
+
+# needs root (or CAP_NET_RAW) and a server listening on 127.0.0.1:3306
+set -e -x
+./mysqlpcap --live lo --ip 127.0.0.1 --port 3306 --csv live-out.csv &
+pid=$!
+sleep 1
+mysql -h 127.0.0.1 -P 3306 -u mysqlpcap -pmysqlpcap -e "select 1; select sleep(0.1)"
+sleep 1
+kill -INT $pid
+wait $pid
+test $(wc -l < live-out.csv) -gt 1
@@ -0,0 +1,10 @@
+#! /bin/bash
+
+set -e -x
+./mysqlpcap -i tests/multi-con.pcap --ip 127.0.0.1 --port 3306 --record-for-replay tests/multi-con.mcap
+./mysqlpcap-mcap stats tests/multi-con.mcap
+./mysqlpcap-mcap slice -o tests/before.mcap --end-time 1724359150 tests/multi-con.mcap
+./mysqlpcap-mcap slice -o tests/after.mcap --start-time "$(date -d @1724359150 '+%Y-%m-%d %H:%M:%S').000001" tests/multi-con.mcap
+./mysqlpcap-mcap merge -o tests/merged.mcap tests/before.mcap tests/after.mcap
+./mysqlpcap-mcap filter -o tests/filtered.mcap --command query --pattern '^select' tests/merged.mcap
+./mysqlpcap-mcap stats tests/filtered.mcap
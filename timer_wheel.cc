@@ -0,0 +1,128 @@
+// Timer_wheel is a header-only template, this file holds its test driver.
+
+#include "timer_wheel.h"
+
+#ifdef TEST_TIMER_WHEEL
+
+#include <stdio.h>
+#include <map>
+
+// xorshift, deterministic across runs
+static u_longlong rnd_state = 88172645463325252ULL;
+
+static u_longlong rnd()
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+int main()
+{
+    int n_failed = 0;
+
+    {
+        // every entry fires at the first advance() that reaches it, never
+        // before, with more added as time goes on, near and far
+        Timer_wheel<u_longlong> wheel(1000);
+        std::map<u_longlong, u_longlong> expires; // id -> tick
+        std::vector<u_longlong> fired;
+        u_longlong now = 1000;
+        u_longlong next_id = 0;
+        size_t n_early = 0, n_late = 0, n_fired = 0;
+
+        for (int round = 0; round < 20000; round++)
+        {
+            for (int i = rnd() % 4; i > 0; i--)
+            {
+                static const u_longlong spans[] = {1, 300, 70000, 20000000, 1ULL << 34};
+                u_longlong t = now + rnd() % spans[rnd() % 5];
+                wheel.add(t, next_id);
+                expires[next_id++] = t;
+            }
+
+            // mostly small steps, now and then a long idle stretch
+            now += rnd() % 8 ? rnd() % 500 : rnd() % 5000000;
+            fired.clear();
+            wheel.advance(now, &fired);
+
+            for (size_t i = 0; i < fired.size(); i++)
+            {
+                if (expires[fired[i]] > now)
+                    n_early++;
+                expires.erase(fired[i]);
+            }
+
+            n_fired += fired.size();
+        }
+
+        for (std::map<u_longlong, u_longlong>::iterator it = expires.begin(); it != expires.end(); it++)
+        {
+            if (it->second <= now)
+                n_late++;
+        }
+
+        bool ok = !n_early && !n_late && wheel.size() == expires.size();
+        printf("Test: %zu fired on time, %zu pending: %s\n", n_fired, expires.size(), ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+    }
+
+    {
+        // next_expiry() is exact on level 0 and never past a due entry
+        Timer_wheel<int> wheel;
+        u_longlong next = 0;
+        wheel.add(200, 1);
+        wheel.add(70000, 2);
+        bool exact = wheel.next_expiry(&next) && next == 200;
+        std::vector<int> fired;
+        wheel.advance(199, &fired);
+        bool held = fired.empty();
+        wheel.advance(200, &fired);
+        bool first = fired.size() == 1 && fired[0] == 1;
+        bool bound = wheel.next_expiry(&next) && next <= 70000;
+        fired.clear();
+        wheel.advance(next, &fired);
+
+        while (fired.empty() && wheel.next_expiry(&next))
+            wheel.advance(next, &fired);
+
+        bool second = fired.size() == 1 && fired[0] == 2 && next == 70000 && !wheel.next_expiry(&next);
+        bool ok = exact && held && first && bound && second;
+        printf("Test: next_expiry() leads to each entry: %s\n", ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+    }
+
+    {
+        // entries N_SLOTS^level ticks ahead, and ones at the block boundary
+        // that far out, which share a slot with the block cur is in
+        bool ok = true;
+
+        for (u_int level = 1; level < Timer_wheel<int>::N_LEVELS; level++)
+        {
+            u_longlong span = 1ULL << (Timer_wheel<int>::LEVEL_BITS * level);
+            u_longlong ts[2] = {1 + span, span * Timer_wheel<int>::N_SLOTS};
+
+            for (int i = 0; i < 2; i++)
+            {
+                Timer_wheel<int> wheel(1);
+                std::vector<int> fired;
+                u_longlong next = 0;
+                wheel.add(ts[i], 1);
+                ok = ok && wheel.next_expiry(&next) && next <= ts[i];
+                wheel.advance(ts[i] - 1, &fired);
+                ok = ok && fired.empty();
+                wheel.advance(ts[i], &fired);
+                ok = ok && fired.size() == 1 && !wheel.size();
+            }
+        }
+
+        printf("Test: entries a whole level ahead: %s\n", ok ? "PASS" : "FAIL");
+        n_failed += !ok;
+    }
+
+    printf("%s\n", n_failed ? "FAILED" : "ALL PASSED");
+    return n_failed ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <vector>
+
+#include "common.h"
+
+// Hierarchical timing wheel over integer ticks, the caller decides what a
+// tick is. Level 0 has a slot per tick for the next 256 ticks, each level
+// above covers 256 times the span of the one below with a slot per span of
+// the level below; an entry waits on the coarsest level that can tell it
+// apart and is moved down a level (cascaded) when the wheel reaches the start
+// of its slot. Adding is O(1), and advancing costs one slot visit per tick
+// plus the cascades, except that runs of empty ticks are skipped outright.
+//
+// Entries further out than the top level covers (2^32 ticks) are parked in
+// its farthest slot and re-placed every time they come round.
+template <class T>
+class Timer_wheel
+{
+public:
+    static const u_int LEVEL_BITS = 8;
+    static const u_int N_LEVELS = 4;
+    static const u_int N_SLOTS = 1 << LEVEL_BITS;
+    static const u_int SLOT_MASK = N_SLOTS - 1;
+
+protected:
+    struct Entry
+    {
+        u_longlong expires;
+        T value;
+    };
+
+    std::vector<Entry> slots[N_LEVELS][N_SLOTS];
+    size_t level_size[N_LEVELS];
+    size_t n_entries;
+    u_longlong cur; // the next tick to process, everything before it has fired
+
+    void place(const Entry& e)
+    {
+        u_longlong t = e.expires < cur ? cur : e.expires;
+        u_longlong delta = t - cur;
+        u_int level = 0;
+
+        while (level < N_LEVELS - 1 && (delta >> (LEVEL_BITS * (level + 1))))
+            level++;
+
+        if (delta >> (LEVEL_BITS * N_LEVELS))
+            t = cur + ((u_longlong)SLOT_MASK << (LEVEL_BITS * (N_LEVELS - 1)));
+
+        slots[level][(t >> (LEVEL_BITS * level)) & SLOT_MASK].push_back(e);
+        level_size[level]++;
+        n_entries++;
+    }
+
+    // called when cur reaches the start of a slot on this level
+    void cascade(u_int level)
+    {
+        u_longlong idx = (cur >> (LEVEL_BITS * level)) & SLOT_MASK;
+
+        // the level above turns over at the same tick, its entries may land here
+        if (!idx && level + 1 < N_LEVELS)
+            cascade(level + 1);
+
+        if (slots[level][idx].empty())
+            return;
+
+        std::vector<Entry> moving;
+        moving.swap(slots[level][idx]);
+        level_size[level] -= moving.size();
+        n_entries -= moving.size();
+
+        for (size_t i = 0; i < moving.size(); i++)
+            place(moving[i]);
+    }
+
+public:
+    Timer_wheel(u_longlong now = 0): n_entries(0), cur(now)
+    {
+        for (u_int i = 0; i < N_LEVELS; i++)
+            level_size[i] = 0;
+    }
+
+    size_t size() const { return n_entries; }
+
+    // fires at the first advance() to expires or later, right away if
+    // expires has already been passed
+    void add(u_longlong expires, const T& value)
+    {
+        Entry e;
+        e.expires = expires;
+        e.value = value;
+        place(e);
+    }
+
+    // the earliest tick advance() has work at, a lower bound for entries still
+    // on the upper levels; false if the wheel is empty
+    bool next_expiry(u_longlong* tick) const
+    {
+        if (!n_entries)
+            return false;
+
+        u_longlong best = ~0ULL;
+
+        if (level_size[0])
+        {
+            for (u_longlong i = 0; i < N_SLOTS; i++)
+            {
+                if (!slots[0][(cur + i) & SLOT_MASK].empty())
+                {
+                    best = cur + i;
+                    break;
+                }
+            }
+        }
+
+        for (u_int level = 1; level < N_LEVELS; level++)
+        {
+            if (!level_size[level])
+                continue;
+
+            u_longlong block = cur >> (LEVEL_BITS * level);
+
+            // up to N_SLOTS blocks ahead, the last of which shares its slot
+            // with the current block: from a tick past the start of the
+            // block, place() can put an entry that far out
+            for (u_longlong j = 1; j <= N_SLOTS; j++)
+            {
+                if (!slots[level][(block + j) & SLOT_MASK].empty())
+                {
+                    u_longlong start = (block + j) << (LEVEL_BITS * level);
+
+                    if (start < best)
+                        best = start;
+                    break;
+                }
+            }
+        }
+
+        *tick = best;
+        return true;
+    }
+
+    // fires everything due up to and including tick now, in expiry order
+    // give or take the order within one tick
+    void advance(u_longlong now, std::vector<T>* expired)
+    {
+        while (cur <= now)
+        {
+            if (!n_entries)
+            {
+                cur = now + 1;
+                return;
+            }
+
+            if (!(cur & SLOT_MASK))
+                cascade(1);
+
+            std::vector<Entry>& slot = slots[0][cur & SLOT_MASK];
+
+            for (size_t i = 0; i < slot.size(); i++)
+                expired->push_back(slot[i].value);
+
+            level_size[0] -= slot.size();
+            n_entries -= slot.size();
+            slot.clear();
+            cur++;
+
+            u_longlong next;
+
+            if (next_expiry(&next) && next > cur)
+                cur = next < now + 1 ? next : now + 1;
+        }
+    }
+};
+
+#endif
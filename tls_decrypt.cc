@@ -0,0 +1,904 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <openssl/hmac.h>
+
+#include "tls_decrypt.h"
+
+#define TLS_1_2 0x0303
+#define TLS_1_3 0x0304
+
+#define TLS_CHANGE_CIPHER_SPEC 20
+#define TLS_HANDSHAKE 22
+#define TLS_APPLICATION_DATA 23
+
+#define TLS_CLIENT_HELLO 1
+#define TLS_SERVER_HELLO 2
+#define TLS_FINISHED 20
+#define TLS_KEY_UPDATE 24
+
+#define RANDOM_LEN 32
+#define TAG_LEN 16
+#define RECORD_HEADER_LEN 5
+// 2^14 of plaintext plus what encryption may add to it
+#define MAX_RECORD_LEN (16384 + 2048)
+
+struct Tls_suite
+{
+    u_short id;
+    bool tls13;
+    const EVP_CIPHER* (*cipher)();
+    const EVP_MD* (*md)();
+    u_int key_len;
+    u_int iv_len; // TLS 1.2, the part of the nonce that comes from the key block
+    bool explicit_nonce; // TLS 1.2 GCM, the rest of the nonce starts every record
+};
+
+static const Tls_suite suites[] =
+{
+    {0x1301, true, EVP_aes_128_gcm, EVP_sha256, 16, 12, false}, // TLS_AES_128_GCM_SHA256
+    {0x1302, true, EVP_aes_256_gcm, EVP_sha384, 32, 12, false}, // TLS_AES_256_GCM_SHA384
+    {0x1303, true, EVP_chacha20_poly1305, EVP_sha256, 32, 12, false}, // TLS_CHACHA20_POLY1305_SHA256
+    {0x009c, false, EVP_aes_128_gcm, EVP_sha256, 16, 4, true}, // AES128-GCM-SHA256
+    {0x009d, false, EVP_aes_256_gcm, EVP_sha384, 32, 4, true}, // AES256-GCM-SHA384
+    {0x009e, false, EVP_aes_128_gcm, EVP_sha256, 16, 4, true}, // DHE-RSA-AES128-GCM-SHA256
+    {0x009f, false, EVP_aes_256_gcm, EVP_sha384, 32, 4, true}, // DHE-RSA-AES256-GCM-SHA384
+    {0xc02b, false, EVP_aes_128_gcm, EVP_sha256, 16, 4, true}, // ECDHE-ECDSA-AES128-GCM-SHA256
+    {0xc02c, false, EVP_aes_256_gcm, EVP_sha384, 32, 4, true}, // ECDHE-ECDSA-AES256-GCM-SHA384
+    {0xc02f, false, EVP_aes_128_gcm, EVP_sha256, 16, 4, true}, // ECDHE-RSA-AES128-GCM-SHA256
+    {0xc030, false, EVP_aes_256_gcm, EVP_sha384, 32, 4, true}, // ECDHE-RSA-AES256-GCM-SHA384
+    {0xcca8, false, EVP_chacha20_poly1305, EVP_sha256, 32, 12, false}, // ECDHE-RSA-CHACHA20-POLY1305
+    {0xcca9, false, EVP_chacha20_poly1305, EVP_sha256, 32, 12, false}, // ECDHE-ECDSA-CHACHA20-POLY1305
+    {0xccaa, false, EVP_chacha20_poly1305, EVP_sha256, 32, 12, false}, // DHE-RSA-CHACHA20-POLY1305
+};
+
+// the random of a ServerHello that is really a HelloRetryRequest
+static const u_char hello_retry_random[RANDOM_LEN] =
+{
+    0xcf, 0x21, 0xad, 0x74, 0xe5, 0x9a, 0x61, 0x11, 0xbe, 0x1d, 0x8c, 0x02, 0x1e, 0x65, 0xb8, 0x91,
+    0xc2, 0xa2, 0x11, 0x16, 0x7a, 0xbb, 0x8c, 0x5e, 0x07, 0x9e, 0x09, 0xe2, 0xc8, 0xa8, 0x33, 0x9c
+};
+
+static u_int get_be16(const u_char* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+static bool unhex(const char* s, size_t len, std::string* out)
+{
+    if (len % 2)
+        return false;
+
+    out->clear();
+
+    for (size_t i = 0; i < len; i += 2)
+    {
+        int hi = hex_digit(s[i]), lo = hex_digit(s[i + 1]);
+
+        if (hi < 0 || lo < 0)
+            return false;
+
+        out->push_back((char)(hi << 4 | lo));
+    }
+
+    return true;
+}
+
+// the TLS 1.2 PRF, P_hash of RFC 5246 section 5
+static std::string prf_12(const EVP_MD* md, const std::string& secret, const std::string& seed, size_t len)
+{
+    u_char a[EVP_MAX_MD_SIZE], block[EVP_MAX_MD_SIZE];
+    u_int a_len, block_len;
+    std::string out;
+
+    HMAC(md, secret.data(), secret.size(), (const u_char*)seed.data(), seed.size(), a, &a_len);
+
+    while (out.size() < len)
+    {
+        std::string in((const char*)a, a_len);
+        in += seed;
+        HMAC(md, secret.data(), secret.size(), (const u_char*)in.data(), in.size(), block, &block_len);
+        out.append((const char*)block, block_len);
+        HMAC(md, secret.data(), secret.size(), a, a_len, a, &a_len);
+    }
+
+    out.resize(len);
+    return out;
+}
+
+// HKDF-Expand-Label of RFC 8446 section 7.1, with no context
+static std::string expand_label_13(const EVP_MD* md, const std::string& secret, const char* label, size_t len)
+{
+    std::string info;
+    info.push_back((char)(len >> 8));
+    info.push_back((char)len);
+    info.push_back((char)(6 + strlen(label)));
+    info += "tls13 ";
+    info += label;
+    info.push_back(0);
+
+    u_char block[EVP_MAX_MD_SIZE];
+    u_int block_len = 0;
+    std::string out;
+
+    for (u_char i = 1; out.size() < len; i++)
+    {
+        std::string in((const char*)block, block_len);
+        in += info;
+        in.push_back((char)i);
+        HMAC(md, secret.data(), secret.size(), (const u_char*)in.data(), in.size(), block, &block_len);
+        out.append((const char*)block, block_len);
+    }
+
+    out.resize(len);
+    return out;
+}
+
+bool Tls_keylog::open(const char* fname)
+{
+    FILE* fp = fopen(fname, "r");
+
+    if (!fp)
+        return false;
+
+    fclose(fp);
+    this->fname = fname;
+    std::lock_guard<std::mutex> guard(lock);
+    load_new_lines();
+    return true;
+}
+
+void Tls_keylog::load_new_lines()
+{
+    struct stat st;
+
+    if (stat(fname.c_str(), &st) || st.st_size <= loaded_size)
+        return;
+
+    FILE* fp = fopen(fname.c_str(), "r");
+
+    if (!fp)
+        return;
+
+    char line[1024];
+    fseek(fp, loaded_size, SEEK_SET);
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        size_t len = strlen(line);
+
+        if (!len)
+            break; // a NUL, not a key log
+
+        if (line[len - 1] != '\n' && !feof(fp))
+        {
+            // longer than any line the format has, skip the rest of it
+            int c;
+
+            while ((c = fgetc(fp)) != EOF && c != '\n')
+                len++;
+
+            loaded_size += len + (c == '\n');
+            continue;
+        }
+
+        if (line[len - 1] != '\n')
+            break; // still being written, read again next time
+
+        loaded_size += len;
+
+        // LABEL <client random> <secret>, in hex
+        char* random = strchr(line, ' ');
+        char* secret = random ? strchr(random + 1, ' ') : 0;
+        std::string random_bin, secret_bin;
+
+        if (line[0] == '#' || !secret || !unhex(random + 1, secret - random - 1, &random_bin) ||
+            random_bin.size() != RANDOM_LEN || !unhex(secret + 1, strcspn(secret + 1, "\r\n"), &secret_bin))
+            continue;
+
+        secrets[std::string(line, random - line + 1) + random_bin] = secret_bin;
+    }
+
+    fclose(fp);
+}
+
+bool Tls_keylog::find(const char* label, const u_char* client_random, std::string* secret)
+{
+    std::string key(label);
+    key.push_back(' ');
+    key.append((const char*)client_random, RANDOM_LEN);
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<std::string, std::string>::iterator it = secrets.find(key);
+
+    if (it == secrets.end())
+    {
+        load_new_lines();
+
+        if ((it = secrets.find(key)) == secrets.end())
+            return false;
+    }
+
+    *secret = it->second;
+    return true;
+}
+
+Tls_session::Tls_session(Tls_keylog* keys): keys(keys), have_client_random(false), version(0), suite(0), err(0),
+    buf(0), buf_size(0), buf_len(0)
+{
+}
+
+Tls_session::~Tls_session()
+{
+    for (int i = 0; i < 2; i++)
+        EVP_CIPHER_CTX_free(dirs[i].ctx);
+
+    free(buf);
+}
+
+void Tls_session::reserve(size_t n)
+{
+    if (buf_len + n <= buf_size)
+        return;
+
+    size_t size = buf_size ? buf_size : 16384;
+
+    while (size < buf_len + n)
+        size *= 2;
+
+    u_char* p = (u_char*)realloc(buf, size);
+
+    if (!p)
+        throw Oom_exception();
+
+    buf = p;
+    buf_size = size;
+}
+
+bool Tls_session::set_cipher(Direction& d, const u_char* key)
+{
+    if (!d.ctx && !(d.ctx = EVP_CIPHER_CTX_new()))
+        throw Oom_exception();
+
+    d.seq = 0;
+
+    if (!EVP_DecryptInit_ex(d.ctx, suite->cipher(), NULL, key, NULL))
+        return fail("cannot set up the cipher");
+
+    return true;
+}
+
+bool Tls_session::start_12(Direction& d, bool in)
+{
+    if (!suite)
+        return fail("ChangeCipherSpec before the ServerHello");
+
+    u_int key_len = suite->key_len, iv_len = suite->iv_len;
+
+    if (key_block.empty())
+    {
+        std::string master;
+
+        if (!have_client_random || !keys->find("CLIENT_RANDOM", client_random, &master))
+            return fail("no CLIENT_RANDOM in the key log for the connection");
+
+        std::string seed("key expansion");
+        seed.append((const char*)server_random, RANDOM_LEN);
+        seed.append((const char*)client_random, RANDOM_LEN);
+        key_block = prf_12(suite->md(), master, seed, 2 * (key_len + iv_len));
+    }
+
+    // the client's key, the server's, then the same for the IVs; the AEAD
+    // suites have no MAC keys
+    const u_char* kb = (const u_char*)key_block.data();
+    memcpy(d.iv, kb + 2 * key_len + (in ? 0 : iv_len), iv_len);
+    return set_cipher(d, kb + (in ? 0 : key_len));
+}
+
+bool Tls_session::start_13(Direction& d)
+{
+    std::string key = expand_label_13(suite->md(), d.secret, "key", suite->key_len);
+    std::string iv = expand_label_13(suite->md(), d.secret, "iv", sizeof(d.iv));
+    memcpy(d.iv, iv.data(), sizeof(d.iv));
+    return set_cipher(d, (const u_char*)key.data());
+}
+
+bool Tls_session::set_secret(Direction& d, const char* label)
+{
+    if (!have_client_random || !keys->find(label, client_random, &d.secret))
+        return fail("no TLS 1.3 traffic secrets in the key log for the connection");
+
+    return start_13(d);
+}
+
+bool Tls_session::server_hello(const u_char* msg, u_int len)
+{
+    if (len < 2 + RANDOM_LEN + 1)
+        return fail("ServerHello cut short");
+
+    if (!memcmp(msg + 2, hello_retry_random, RANDOM_LEN))
+        return true; // another ClientHello and the real ServerHello follow
+
+    memcpy(server_random, msg + 2, RANDOM_LEN);
+    u_int off = 2 + RANDOM_LEN + 1 + msg[2 + RANDOM_LEN]; // past the session id
+
+    if (off + 3 > len)
+        return fail("ServerHello cut short");
+
+    u_int cipher = get_be16(msg + off);
+    version = get_be16(msg);
+    off += 3; // and the compression method
+
+    // TLS 1.3 says so in the supported_versions extension
+    if (off + 2 <= len)
+    {
+        u_int end = off + 2 + get_be16(msg + off);
+        off += 2;
+
+        while (off + 4 <= end && end <= len)
+        {
+            u_int ext_len = get_be16(msg + off + 2);
+
+            if (get_be16(msg + off) == 0x2b && ext_len == 2 && off + 6 <= end)
+                version = get_be16(msg + off + 4);
+
+            off += 4 + ext_len;
+        }
+    }
+
+    if (version != TLS_1_2 && version != TLS_1_3)
+        return fail("only TLS 1.2 and 1.3 are supported");
+
+    for (size_t i = 0; i < sizeof(suites) / sizeof(suites[0]); i++)
+    {
+        if (suites[i].id == cipher && suites[i].tls13 == (version == TLS_1_3))
+            suite = &suites[i];
+    }
+
+    if (!suite)
+        return fail("the cipher suite is not supported");
+
+    // TLS 1.3 encrypts the rest of the handshake
+    if (version == TLS_1_3)
+        return set_secret(dirs[1], "CLIENT_HANDSHAKE_TRAFFIC_SECRET") &&
+            set_secret(dirs[0], "SERVER_HANDSHAKE_TRAFFIC_SECRET");
+
+    return true;
+}
+
+bool Tls_session::handshake(Direction& d, bool in, const u_char* data, u_int len)
+{
+    d.hs.append((const char*)data, len);
+    size_t off = 0;
+
+    while (d.hs.size() - off >= 4)
+    {
+        const u_char* msg = (const u_char*)d.hs.data() + off;
+        u_int msg_len = (msg[1] << 16) | (msg[2] << 8) | msg[3];
+
+        if (d.hs.size() - off - 4 < msg_len)
+            break;
+
+        off += 4 + msg_len;
+
+        switch (msg[0])
+        {
+        case TLS_CLIENT_HELLO:
+            if (in && msg_len >= 2 + RANDOM_LEN)
+            {
+                memcpy(client_random, msg + 4 + 2, RANDOM_LEN);
+                have_client_random = true;
+            }
+            break;
+        case TLS_SERVER_HELLO:
+            if (!in && !server_hello(msg + 4, msg_len))
+                return false;
+            break;
+        case TLS_FINISHED:
+            // TLS 1.3, the application secrets take over
+            if (version == TLS_1_3 &&
+                !set_secret(d, in ? "CLIENT_TRAFFIC_SECRET_0" : "SERVER_TRAFFIC_SECRET_0"))
+                return false;
+            break;
+        case TLS_KEY_UPDATE:
+            if (version == TLS_1_3)
+            {
+                d.secret = expand_label_13(suite->md(), d.secret, "traffic upd", EVP_MD_size(suite->md()));
+
+                if (!start_13(d))
+                    return false;
+            }
+            break;
+        }
+    }
+
+    d.hs.erase(0, off);
+    return true;
+}
+
+bool Tls_session::decrypt(Direction& d, const u_char* body, u_int len, u_char* type, u_int* plain_len)
+{
+    u_char nonce[12];
+    u_char aad[13];
+    int aad_len;
+    u_int explicit_len = version == TLS_1_2 && suite->explicit_nonce ? 8 : 0;
+
+    if (len < explicit_len + TAG_LEN)
+        return fail("record too short to decrypt");
+
+    const u_char* ct = body + explicit_len;
+    u_int ct_len = len - explicit_len - TAG_LEN;
+
+    if (explicit_len)
+    {
+        memcpy(nonce, d.iv, 4);
+        memcpy(nonce + 4, body, 8);
+    }
+    else
+    {
+        // the IV with the sequence number xored into its last 8 bytes
+        memcpy(nonce, d.iv, sizeof(nonce));
+
+        for (int i = 0; i < 8; i++)
+            nonce[sizeof(nonce) - 1 - i] ^= (u_char)(d.seq >> (8 * i));
+    }
+
+    if (version == TLS_1_3)
+    {
+        // the record header
+        aad[0] = *type;
+        aad[1] = TLS_1_2 >> 8;
+        aad[2] = TLS_1_2 & 0xff;
+        aad[3] = len >> 8;
+        aad[4] = len & 0xff;
+        aad_len = 5;
+    }
+    else
+    {
+        for (int i = 0; i < 8; i++)
+            aad[i] = (u_char)(d.seq >> (56 - 8 * i));
+
+        aad[8] = *type;
+        aad[9] = TLS_1_2 >> 8;
+        aad[10] = TLS_1_2 & 0xff;
+        aad[11] = ct_len >> 8;
+        aad[12] = ct_len & 0xff;
+        aad_len = 13;
+    }
+
+    reserve(ct_len);
+    u_char* out = buf + buf_len;
+    int n;
+
+    if (!EVP_DecryptInit_ex(d.ctx, NULL, NULL, NULL, nonce) ||
+        !EVP_DecryptUpdate(d.ctx, NULL, &n, aad, aad_len) ||
+        !EVP_DecryptUpdate(d.ctx, out, &n, ct, ct_len) ||
+        !EVP_CIPHER_CTX_ctrl(d.ctx, EVP_CTRL_AEAD_SET_TAG, TAG_LEN, (void*)(ct + ct_len)) ||
+        EVP_DecryptFinal_ex(d.ctx, out + n, &n) <= 0)
+        return fail("a record does not authenticate, the secrets do not match");
+
+    d.seq++;
+    *plain_len = ct_len;
+
+    if (version == TLS_1_3)
+    {
+        // the real type follows the content, then zeros of padding
+        while (*plain_len && !out[*plain_len - 1])
+            (*plain_len)--;
+
+        if (!*plain_len)
+            return fail("record with no content type");
+
+        *type = out[--*plain_len];
+    }
+
+    return true;
+}
+
+bool Tls_session::record(Direction& d, bool in, const u_char* body, u_int len)
+{
+    u_char type = d.hdr[0];
+
+    // TLS 1.3 sends ChangeCipherSpec in the clear, for middleboxes only
+    if (d.ctx && !(version == TLS_1_3 && type == TLS_CHANGE_CIPHER_SPEC))
+    {
+        u_int plain_len;
+
+        if (!decrypt(d, body, len, &type, &plain_len))
+            return false;
+
+        body = buf + buf_len;
+        len = plain_len;
+
+        if (type == TLS_APPLICATION_DATA)
+        {
+            buf_len += plain_len; // stays where it was decrypted to
+            return true;
+        }
+    }
+
+    switch (type)
+    {
+    case TLS_CHANGE_CIPHER_SPEC:
+        return version == TLS_1_2 ? start_12(d, in) : true;
+    case TLS_HANDSHAKE:
+        return handshake(d, in, body, len);
+    case TLS_APPLICATION_DATA:
+        return fail("application data before the keys");
+    default:
+        return true; // alerts, heartbeats
+    }
+}
+
+bool Tls_session::feed(bool in, const u_char* data, u_int len)
+{
+    Direction& d = dirs[in];
+    buf_len = 0;
+
+    if (err)
+        return true;
+
+    while (len)
+    {
+        if (d.hdr_len < RECORD_HEADER_LEN)
+        {
+            u_int n = RECORD_HEADER_LEN - d.hdr_len < len ? RECORD_HEADER_LEN - d.hdr_len : len;
+            memcpy(d.hdr + d.hdr_len, data, n);
+            d.hdr_len += n;
+            data += n;
+            len -= n;
+
+            if (d.hdr_len < RECORD_HEADER_LEN)
+                break;
+
+            d.body_left = get_be16(d.hdr + 3);
+            d.body.clear();
+
+            if (d.body_left > MAX_RECORD_LEN)
+                goto err;
+
+            if (d.body_left)
+                continue;
+        }
+        else if (d.body.empty() && len >= d.body_left)
+        {
+            // the whole record is here, no need to copy it
+            const u_char* body = data;
+            data += d.body_left;
+            len -= d.body_left;
+            d.body_left = 0;
+
+            if (!record(d, in, body, data - body))
+                goto err;
+        }
+        else
+        {
+            u_int n = d.body_left < len ? d.body_left : len;
+            d.body.append((const char*)data, n);
+            d.body_left -= n;
+            data += n;
+            len -= n;
+
+            if (d.body_left)
+                break;
+
+            if (!record(d, in, (const u_char*)d.body.data(), d.body.size()))
+                goto err;
+        }
+
+        d.hdr_len = 0;
+    }
+
+    return true;
+
+err:
+    if (!this->err)
+        this->err = "not a TLS stream";
+
+    buf_len = 0;
+    return false;
+}
+
+#ifdef TEST_TLS_DECRYPT
+
+#include <unistd.h>
+#include <vector>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+static int n_failed = 0;
+static std::string keylog_lines;
+
+struct Wire_chunk
+{
+    bool in;
+    std::string data;
+};
+
+// a client and a server talking over memory BIOs, with every byte between
+// them kept in order
+struct Tls_pair
+{
+    SSL* client;
+    SSL* server;
+    BIO* to_client;
+    BIO* from_client;
+    BIO* to_server;
+    BIO* from_server;
+    std::vector<Wire_chunk> wire;
+    std::string client_sent, server_sent;
+};
+
+static void keylog_cb(const SSL*, const char* line)
+{
+    keylog_lines += line;
+    keylog_lines += '\n';
+}
+
+static bool move(BIO* from, BIO* to, bool in, std::vector<Wire_chunk>* wire)
+{
+    char b[4096];
+    int n;
+    bool moved = false;
+
+    while ((n = BIO_read(from, b, sizeof(b))) > 0)
+    {
+        BIO_write(to, b, n);
+        Wire_chunk c = {in, std::string(b, n)};
+        wire->push_back(c);
+        moved = true;
+    }
+
+    return moved;
+}
+
+static void pump(Tls_pair* p)
+{
+    while (move(p->from_client, p->to_server, true, &p->wire) | move(p->from_server, p->to_client, false, &p->wire))
+        ;
+}
+
+static void send(Tls_pair* p, bool from_client, const std::string& data)
+{
+    SSL* from = from_client ? p->client : p->server;
+    SSL* to = from_client ? p->server : p->client;
+    char b[65536];
+
+    SSL_write(from, data.data(), data.size());
+    pump(p);
+
+    while (SSL_read(to, b, sizeof(b)) > 0)
+        ;
+
+    pump(p);
+    (from_client ? p->client_sent : p->server_sent) += data;
+}
+
+static EVP_PKEY* make_key()
+{
+    EVP_PKEY* pkey = NULL;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY_keygen_init(ctx);
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1);
+    EVP_PKEY_keygen(ctx, &pkey);
+    EVP_PKEY_CTX_free(ctx);
+    return pkey;
+}
+
+static X509* make_cert(EVP_PKEY* pkey)
+{
+    X509* x = X509_new();
+    X509_set_version(x, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+    X509_set_pubkey(x, pkey);
+    X509_NAME* name = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const u_char*)"mysqlpcap", -1, -1, 0);
+    X509_set_issuer_name(x, name);
+    X509_sign(x, pkey, EVP_sha256());
+    return x;
+}
+
+// a connection over TLS 1.2 with cipher, or 1.3 with suite
+static bool run_connection(Tls_pair* p, EVP_PKEY* pkey, X509* cert, const char* cipher, const char* suite)
+{
+    int version = suite ? TLS1_3_VERSION : TLS1_2_VERSION;
+    SSL_CTX* sctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX* cctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_use_certificate(sctx, cert);
+    SSL_CTX_use_PrivateKey(sctx, pkey);
+
+    for (SSL_CTX* ctx = sctx; ctx; ctx = ctx == sctx ? cctx : NULL)
+    {
+        SSL_CTX_set_min_proto_version(ctx, version);
+        SSL_CTX_set_max_proto_version(ctx, version);
+        SSL_CTX_set_keylog_callback(ctx, keylog_cb);
+
+        if (suite)
+            SSL_CTX_set_ciphersuites(ctx, suite);
+        else
+            SSL_CTX_set_cipher_list(ctx, cipher);
+    }
+
+    p->client = SSL_new(cctx);
+    p->server = SSL_new(sctx);
+    p->to_client = BIO_new(BIO_s_mem());
+    p->from_client = BIO_new(BIO_s_mem());
+    p->to_server = BIO_new(BIO_s_mem());
+    p->from_server = BIO_new(BIO_s_mem());
+    SSL_set_bio(p->client, p->to_client, p->from_client);
+    SSL_set_bio(p->server, p->to_server, p->from_server);
+    SSL_set_connect_state(p->client);
+    SSL_set_accept_state(p->server);
+
+    for (int i = 0; i < 10 && !(SSL_is_init_finished(p->client) && SSL_is_init_finished(p->server)); i++)
+    {
+        SSL_do_handshake(p->client);
+        pump(p);
+        SSL_do_handshake(p->server);
+        pump(p);
+    }
+
+    bool ok = SSL_is_init_finished(p->client) && SSL_is_init_finished(p->server);
+
+    if (ok)
+    {
+        send(p, true, std::string("\x09\x00\x00\x00\x03select 1", 13));
+        send(p, false, std::string(40000, 'r')); // more than a record holds
+        send(p, true, "and some more");
+
+        if (suite)
+        {
+            SSL_key_update(p->client, SSL_KEY_UPDATE_REQUESTED);
+            send(p, true, "after the key update");
+            send(p, false, "the server's keys too");
+        }
+    }
+
+    SSL_free(p->client);
+    SSL_free(p->server);
+    SSL_CTX_free(sctx);
+    SSL_CTX_free(cctx);
+    return ok;
+}
+
+// feeds the wire step bytes at a time, returns false if the session fails
+static bool decrypt_wire(const Tls_pair& p, Tls_keylog* keys, size_t step, std::string* client, std::string* server)
+{
+    Tls_session s(keys);
+
+    for (size_t i = 0; i < p.wire.size(); i++)
+    {
+        const Wire_chunk& c = p.wire[i];
+
+        for (size_t off = 0; off < c.data.size(); off += step)
+        {
+            size_t n = c.data.size() - off < step ? c.data.size() - off : step;
+
+            if (!s.feed(c.in, (const u_char*)c.data.data() + off, n))
+                return false;
+
+            (c.in ? client : server)->append((const char*)s.data(), s.size());
+        }
+    }
+
+    return true;
+}
+
+static void check(const char* what, bool ok)
+{
+    printf("  %s: %s\n", what, ok ? "PASS" : "FAIL");
+
+    if (!ok)
+        n_failed++;
+}
+
+int main()
+{
+    printf("Test: TLS decryption\n");
+
+    static const char* configs[][2] =
+    {
+        {"ECDHE-ECDSA-AES128-GCM-SHA256", NULL},
+        {"ECDHE-ECDSA-AES256-GCM-SHA384", NULL},
+        {"ECDHE-ECDSA-CHACHA20-POLY1305", NULL},
+        {NULL, "TLS_AES_128_GCM_SHA256"},
+        {NULL, "TLS_AES_256_GCM_SHA384"},
+        {NULL, "TLS_CHACHA20_POLY1305_SHA256"},
+    };
+
+    char fname[] = "/tmp/test_tls_keylogXXXXXX";
+    int fd = mkstemp(fname);
+    close(fd);
+
+    // opened empty, the lines come after, as they would live
+    Tls_keylog keys;
+    check("open", keys.open(fname));
+
+    EVP_PKEY* pkey = make_key();
+    X509* cert = make_cert(pkey);
+    std::vector<Tls_pair> pairs(sizeof(configs) / sizeof(configs[0]));
+
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+        if (!run_connection(&pairs[i], pkey, cert, configs[i][0], configs[i][1]))
+        {
+            printf("  handshake %s: FAIL\n", configs[i][0] ? configs[i][0] : configs[i][1]);
+            n_failed++;
+        }
+    }
+
+    // decrypting without the secrets fails
+    {
+        std::string client, server;
+        Tls_keylog none;
+        check("no secrets", none.open(fname) && !decrypt_wire(pairs[0], &none, 1 << 20, &client, &server));
+    }
+
+    FILE* fp = fopen(fname, "w");
+    fputs("# a comment\nnot a line of the format\n", fp);
+    fputs(keylog_lines.c_str(), fp);
+    fclose(fp);
+
+    static const size_t steps[] = {1, 5, 7, 1460, 1 << 20};
+
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+        bool ok = true;
+
+        for (size_t j = 0; j < sizeof(steps) / sizeof(steps[0]); j++)
+        {
+            std::string client, server;
+            ok = ok && decrypt_wire(pairs[i], &keys, steps[j], &client, &server) &&
+                client == pairs[i].client_sent && server == pairs[i].server_sent;
+        }
+
+        check(configs[i][0] ? configs[i][0] : configs[i][1], ok);
+    }
+
+    // a bit flipped in the last record
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+        Tls_pair p = pairs[i];
+        std::string& last = p.wire.back().data;
+        last[last.size() - 1] ^= 1;
+        std::string client, server;
+
+        if (decrypt_wire(p, &keys, 1460, &client, &server))
+        {
+            printf("  tampered %s: FAIL\n", configs[i][0] ? configs[i][0] : configs[i][1]);
+            n_failed++;
+        }
+    }
+
+    unlink(fname);
+    X509_free(cert);
+    EVP_PKEY_free(pkey);
+
+    if (n_failed)
+    {
+        printf("%d FAILED\n", n_failed);
+        return 1;
+    }
+
+    printf("ALL PASSED\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef TLS_DECRYPT_H
+#define TLS_DECRYPT_H
+
+#include <sys/types.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <openssl/evp.h>
+
+#include "common.h"
+
+// The secrets of an NSS key log, what SSLKEYLOGFILE makes clients and
+// servers write: CLIENT_RANDOM lines for TLS 1.2 and the *_TRAFFIC_SECRET
+// ones for TLS 1.3, each under the client random of its connection. A
+// lookup that misses reads whatever was added to the file since, so a live
+// capture finds the connections logged after it started. The --threads
+// workers share one.
+class Tls_keylog
+{
+protected:
+    std::string fname;
+    off_t loaded_size; // whole lines read so far
+    std::mutex lock;
+    std::unordered_map<std::string, std::string> secrets; // label, space, binary client random
+
+    void load_new_lines();
+
+public:
+    Tls_keylog(): loaded_size(0) {}
+
+    // false if the file cannot be read
+    bool open(const char* fname);
+    bool find(const char* label, const u_char* client_random, std::string* secret);
+};
+
+struct Tls_suite;
+
+// TLS 1.2 and 1.3 of one connection, decrypted with the secrets of a
+// Tls_keylog. The bytes of each direction go in as TCP delivers them, the
+// records are put together and the handshake followed as far as the
+// randoms, the version and the cipher suite, and the application data of
+// each record that completes is decrypted into a buffer kept from one call
+// to the next. A record that arrives whole is decrypted from where it lies,
+// only the ones split over segments are copied first. The suites are the
+// AEAD ones, AES-GCM and ChaCha20-Poly1305: all TLS 1.3 has, and what
+// MySQL servers pick for 1.2 unless told otherwise.
+class Tls_session
+{
+protected:
+    struct Direction
+    {
+        u_char hdr[5]; // of the record being put together
+        u_int hdr_len;
+        std::string body; // of a record split across segments
+        u_int body_left;
+        std::string hs; // handshake messages, they may span records
+        EVP_CIPHER_CTX* ctx; // 0 until the keys are in
+        u_char iv[12];
+        u_longlong seq;
+        std::string secret; // TLS 1.3, the current traffic secret
+
+        Direction(): hdr_len(0), body_left(0), ctx(0), seq(0) {}
+    };
+
+    Tls_keylog* keys;
+    Direction dirs[2]; // by in, 1 for the client's
+    u_char client_random[32];
+    bool have_client_random;
+    u_char server_random[32];
+    u_short version; // 0x0303 or 0x0304 from the ServerHello on
+    const Tls_suite* suite;
+    std::string key_block; // TLS 1.2
+    const char* err;
+
+    u_char* buf;
+    size_t buf_size;
+    size_t buf_len;
+
+    void reserve(size_t n);
+    bool fail(const char* why) { err = why; return false; }
+    bool record(Direction& d, bool in, const u_char* body, u_int len);
+    // into buf after buf_len, which is left where it was
+    bool decrypt(Direction& d, const u_char* body, u_int len, u_char* type, u_int* plain_len);
+    bool handshake(Direction& d, bool in, const u_char* data, u_int len);
+    bool server_hello(const u_char* msg, u_int len);
+    bool set_cipher(Direction& d, const u_char* key);
+    // TLS 1.2, at the ChangeCipherSpec
+    bool start_12(Direction& d, bool in);
+    // TLS 1.3, the keys of d.secret
+    bool start_13(Direction& d);
+    bool set_secret(Direction& d, const char* label);
+
+public:
+    Tls_session(Tls_keylog* keys);
+    ~Tls_session();
+
+    // the next len bytes from the client if in, from the server otherwise;
+    // the application data they complete is then in data() and size().
+    // False on the call that finds the connection cannot be decrypted, no
+    // secrets for it, a suite not supported or a record that does not
+    // authenticate, error() says which; nothing comes out after that.
+    bool feed(bool in, const u_char* data, u_int len);
+    const u_char* data() const { return buf; }
+    size_t size() const { return buf_len; }
+    const char* error() const { return err; }
+};
+
+#endif